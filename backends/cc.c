@@ -24,6 +24,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <utime.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <glib/gstdio.h>
 
 #include "../compiler-internals.h"
 #include "../compiler_types.h"
@@ -94,6 +100,15 @@ output_value_name (FILE *out, value_t *value, int for_decl)
     }
 }
 
+static void
+output_local_tuple_storage_name (FILE *out, value_t *value)
+{
+    g_assert(value->local_tuple_length > 0);
+
+    output_value_name(out, value, 1);
+    fputs("_storage", out);
+}
+
 static void
 output_value_decl (FILE *out, value_t *value)
 {
@@ -102,6 +117,12 @@ output_value_decl (FILE *out, value_t *value)
 	fprintf(out, "%s ", type_c_type_name(value->compvar->type));
 	output_value_name(out, value, 1);
 	fputs(";\n", out);
+	if (value->local_tuple_length > 0)
+	{
+	    fputs("float ", out);
+	    output_local_tuple_storage_name(out, value);
+	    fprintf(out, "[%d];\n", value->local_tuple_length);
+	}
 	value->have_defined = 1;
     }
 }
@@ -207,6 +228,16 @@ output_rhs (FILE *out, rhs_t *rhs)
 	    {
 		int i;
 
+		if (compiler_op_index(rhs->v.op.op) == OP_OUTPUT_TUPLE
+		    && rhs->v.op.args[0].kind == PRIMARY_VALUE
+		    && rhs->v.op.args[0].v.value->local_tuple_length > 0)
+		{
+		    fputs("OUTPUT_LOCAL_TUPLE(", out);
+		    output_primary(out, &rhs->v.op.args[0]);
+		    fprintf(out, ",%d)", rhs->v.op.args[0].v.value->local_tuple_length);
+		    break;
+		}
+
 		fprintf(out, "%s(", rhs->v.op.op->name);
 		for (i = 0; i < rhs->v.op.op->num_args; ++i)
 		{
@@ -305,6 +336,51 @@ output_rhs (FILE *out, rhs_t *rhs)
     }
 }
 
+/* Tuples which don't escape are built in the storage declared along
+   with their value instead of being allocated from the pools. */
+static void
+output_assign_rhs (FILE *out, value_t *lhs, rhs_t *rhs)
+{
+    if (lhs->local_tuple_length == 0)
+    {
+	output_rhs(out, rhs);
+	return;
+    }
+
+    if (rhs->kind == RHS_TUPLE)
+    {
+	int i;
+
+	fputs("({ float *tuple = ", out);
+	output_local_tuple_storage_name(out, lhs);
+	fputs("; ", out);
+
+	for (i = 0; i < rhs->v.tuple.length; ++i)
+	{
+	    fprintf(out, "TUPLE_SET(tuple, %d, ", i);
+	    output_primary(out, &rhs->v.tuple.args[i]);
+	    fprintf(out, "); ");
+	}
+
+	fprintf(out, "tuple; })");
+    }
+    else
+    {
+	int i;
+
+	g_assert(rhs->kind == RHS_OP);
+
+	fprintf(out, "%s_INTO(", rhs->v.op.op->name);
+	for (i = 0; i < rhs->v.op.op->num_args; ++i)
+	{
+	    output_primary(out, &rhs->v.op.args[i]);
+	    fputs(",", out);
+	}
+	output_local_tuple_storage_name(out, lhs);
+	fputs(")", out);
+    }
+}
+
 static void
 output_phis (FILE *out, statement_t *phis, int branch, unsigned int slice_flag)
 {
@@ -358,7 +434,7 @@ output_stmts (FILE *out, statement_t *stmt, unsigned int slice_flag)
 		case STMT_ASSIGN :
 		    output_value_name(out, stmt->v.assign.lhs, 0);
 		    fputs(" = ", out);
-		    output_rhs(out, stmt->v.assign.rhs);
+		    output_assign_rhs(out, stmt->v.assign.lhs, stmt->v.assign.rhs);
 		    fputs(";\n", out);
 		    break;
 
@@ -447,6 +523,442 @@ output_all_code (filter_code_t *code, FILE *out)
     output_stmts(out, code->first_stmt, SLICE_IGNORE);
 }
 
+/*** lane code output ***/
+
+/* calc_lines() can evaluate a whole strip of PIXEL_STRIP_WIDTH pixels
+ * at once.  Each per-pixel value is then an array with one element
+ * per pixel, or lane, and each statement is a loop over all lanes,
+ * which the C compiler can vectorize.  Ops without a vector form just
+ * end up being called once per lane.
+ *
+ * Control flow doesn't depend on a single pixel anymore, so both
+ * branches of a conditional are executed for all lanes, and the phis
+ * select the value of each lane according to the condition.  Loops
+ * are executed as long as any lane is still looping, and only the
+ * lanes which are update their values.  A mask of the lanes which
+ * would actually execute the code is kept, so that loops which are
+ * only executed speculatively for some lanes don't run forever for
+ * them.
+ *
+ * Executing code speculatively is only safe if it has no side
+ * effects and can't crash, so filters which don't fulfill this
+ * (see lanes_stmts_possible()) only get the one pixel at a time
+ * code. */
+
+#ifndef NO_CONSTANTS_ANALYSIS
+static gboolean
+is_lane_value (value_t *value)
+{
+    return value->index >= 0 && compiler_is_value_needed_for_const(value, 0);
+}
+
+static gboolean
+lanes_primary_possible (primary_t *primary)
+{
+    if (primary->kind != PRIMARY_VALUE || primary->v.value->index >= 0)
+	return TRUE;
+
+    /* An uninitialized value is a null pointer for all types but
+       these, so we can't speculatively execute code using it. */
+    switch (primary->v.value->compvar->type)
+    {
+	case TYPE_INT :
+	case TYPE_FLOAT :
+	case TYPE_COMPLEX :
+	case TYPE_COLOR :
+	    return TRUE;
+
+	default :
+	    return FALSE;
+    }
+}
+
+static gboolean
+lanes_rhs_possible (rhs_t *rhs, gboolean is_top_level)
+{
+    int i;
+
+    switch (rhs->kind)
+    {
+	case RHS_PRIMARY :
+	    return lanes_primary_possible(&rhs->v.primary);
+
+	case RHS_INTERNAL :
+	    /* x is the only internal which is different for each
+	       pixel of a row, and we have it as an array. */
+	    return (rhs->v.internal->const_type & CONST_X)
+		|| strcmp(rhs->v.internal->name, "x") == 0;
+
+	case RHS_OP :
+	    if (compiler_op_index(rhs->v.op.op) == OP_OUTPUT_TUPLE)
+	    {
+		if (!is_top_level)
+		    return FALSE;
+	    }
+	    else if (!rhs->v.op.op->is_pure)
+		return FALSE;
+
+	    /* A speculatively executed tuple access with a variable
+	       index might be out of bounds. */
+	    if (compiler_op_index(rhs->v.op.op) == OP_TUPLE_NTH
+		&& rhs->v.op.args[1].kind != PRIMARY_CONST)
+		return FALSE;
+
+	    for (i = 0; i < rhs->v.op.op->num_args; ++i)
+		if (!lanes_primary_possible(&rhs->v.op.args[i]))
+		    return FALSE;
+	    return TRUE;
+
+	case RHS_TUPLE :
+	    for (i = 0; i < rhs->v.tuple.length; ++i)
+		if (!lanes_primary_possible(&rhs->v.tuple.args[i]))
+		    return FALSE;
+	    return TRUE;
+
+	default :
+	    return FALSE;
+    }
+}
+
+static gboolean
+lanes_stmts_possible (statement_t *stmt, gboolean is_top_level)
+{
+    for (; stmt != 0; stmt = stmt->next)
+    {
+	if ((stmt->slice_flags & SLICE_NO_CONST) == 0)
+	    continue;
+
+	switch (stmt->kind)
+	{
+	    case STMT_NIL :
+		break;
+
+	    case STMT_ASSIGN :
+		if (!lanes_rhs_possible(stmt->v.assign.rhs, is_top_level))
+		    return FALSE;
+		break;
+
+	    case STMT_PHI_ASSIGN :
+		if (!lanes_rhs_possible(stmt->v.assign.rhs, FALSE)
+		    || !lanes_rhs_possible(stmt->v.assign.rhs2, FALSE))
+		    return FALSE;
+		break;
+
+	    case STMT_IF_COND :
+		if (!lanes_rhs_possible(stmt->v.if_cond.condition, FALSE)
+		    || !lanes_stmts_possible(stmt->v.if_cond.consequent, FALSE)
+		    || !lanes_stmts_possible(stmt->v.if_cond.alternative, FALSE)
+		    || !lanes_stmts_possible(stmt->v.if_cond.exit, FALSE))
+		    return FALSE;
+		break;
+
+	    case STMT_WHILE_LOOP :
+		if (!lanes_stmts_possible(stmt->v.while_loop.entry, FALSE)
+		    || !lanes_rhs_possible(stmt->v.while_loop.invariant, FALSE)
+		    || !lanes_stmts_possible(stmt->v.while_loop.body, FALSE))
+		    return FALSE;
+		break;
+
+	    default :
+		g_assert_not_reached();
+	}
+    }
+
+    return TRUE;
+}
+
+static void
+output_lane_value_name (FILE *out, value_t *value)
+{
+    if (is_lane_value(value))
+    {
+	output_value_name(out, value, 1);
+	fputs("[lane]", out);
+    }
+    else if (value->index >= 0 && compiler_is_permanent_const_value(value)
+	     && (value->const_type | CONST_T) == (CONST_Y | CONST_T))
+    {
+	fputs("y_vars[lane].", out);
+	output_value_name(out, value, 1);
+    }
+    else
+	output_value_name(out, value, 0);
+}
+
+static void
+output_lane_primary (FILE *out, primary_t *primary)
+{
+    if (primary->kind == PRIMARY_VALUE)
+	output_lane_value_name(out, primary->v.value);
+    else
+	output_primary(out, primary);
+}
+
+static void
+output_lane_rhs (FILE *out, rhs_t *rhs)
+{
+    int i;
+
+    switch (rhs->kind)
+    {
+	case RHS_PRIMARY :
+	    output_lane_primary(out, &rhs->v.primary);
+	    break;
+
+	case RHS_INTERNAL :
+	    fputs(rhs->v.internal->name, out);
+	    if (!(rhs->v.internal->const_type & CONST_X))
+		fputs("[lane]", out);
+	    break;
+
+	case RHS_OP :
+	    if (compiler_op_index(rhs->v.op.op) == OP_OUTPUT_TUPLE)
+		fputs("OUTPUT_LANE_TUPLE(", out);
+	    else
+		fprintf(out, "%s(", rhs->v.op.op->name);
+	    for (i = 0; i < rhs->v.op.op->num_args; ++i)
+	    {
+		if (i > 0)
+		    fputs(",", out);
+		output_lane_primary(out, &rhs->v.op.args[i]);
+	    }
+	    fputs(")", out);
+	    break;
+
+	case RHS_TUPLE :
+	    fprintf(out, "({ float *tuple = ALLOC_TUPLE(%d); ", rhs->v.tuple.length);
+	    for (i = 0; i < rhs->v.tuple.length; ++i)
+	    {
+		fprintf(out, "TUPLE_SET(tuple, %d, ", i);
+		output_lane_primary(out, &rhs->v.tuple.args[i]);
+		fprintf(out, "); ");
+	    }
+	    fprintf(out, "tuple; })");
+	    break;
+
+	default :
+	    g_assert_not_reached();
+    }
+}
+
+static void
+output_lane_assign_rhs (FILE *out, value_t *lhs, rhs_t *rhs)
+{
+    int i;
+
+    if (lhs->local_tuple_length == 0)
+    {
+	output_lane_rhs(out, rhs);
+	return;
+    }
+
+    if (rhs->kind == RHS_TUPLE)
+    {
+	fputs("({ float *tuple = ", out);
+	output_local_tuple_storage_name(out, lhs);
+	fputs("[lane]; ", out);
+
+	for (i = 0; i < rhs->v.tuple.length; ++i)
+	{
+	    fprintf(out, "TUPLE_SET(tuple, %d, ", i);
+	    output_lane_primary(out, &rhs->v.tuple.args[i]);
+	    fprintf(out, "); ");
+	}
+
+	fprintf(out, "tuple; })");
+    }
+    else
+    {
+	g_assert(rhs->kind == RHS_OP);
+
+	fprintf(out, "%s_INTO(", rhs->v.op.op->name);
+	for (i = 0; i < rhs->v.op.op->num_args; ++i)
+	{
+	    output_lane_primary(out, &rhs->v.op.args[i]);
+	    fputs(",", out);
+	}
+	output_local_tuple_storage_name(out, lhs);
+	fputs("[lane])", out);
+    }
+}
+
+#define FOR_EACH_LANE	"for (lane = 0; lane < PIXEL_STRIP_WIDTH; ++lane)\n"
+
+static gboolean
+phi_is_nop (statement_t *phi, rhs_t *rhs)
+{
+    return rhs->kind == RHS_PRIMARY
+	&& rhs->v.primary.kind == PRIMARY_VALUE
+	&& rhs->v.primary.v.value == phi->v.assign.lhs;
+}
+
+/* For the exit of an if, mask is the mask of the consequent, and the
+ * phis select between the values of the two branches.  For the entry
+ * of a loop, branch 0 is the assignment before the loop, with a mask
+ * of -1, and branch 1 selects between the value of the body and the
+ * old one. */
+static void
+output_lane_phis (FILE *out, statement_t *phis, int branch, int mask)
+{
+    for (; phis != 0; phis = phis->next)
+    {
+	if (phis->kind == STMT_NIL || (phis->slice_flags & SLICE_NO_CONST) == 0)
+	    continue;
+
+	g_assert(phis->kind == STMT_PHI_ASSIGN);
+
+	if (branch == 0)
+	{
+	    if (mask < 0 && phi_is_nop(phis, phis->v.assign.rhs))
+		continue;
+
+	    fputs(FOR_EACH_LANE, out);
+	    output_lane_value_name(out, phis->v.assign.lhs);
+	    fputs(" = ", out);
+	    if (mask >= 0)
+	    {
+		fprintf(out, "mask_%d[lane] ? (", mask);
+		output_lane_rhs(out, phis->v.assign.rhs);
+		fputs(") : (", out);
+		output_lane_rhs(out, phis->v.assign.rhs2);
+		fputs(")", out);
+	    }
+	    else
+		output_lane_rhs(out, phis->v.assign.rhs);
+	    fputs(";\n", out);
+	}
+	else
+	{
+	    if (phi_is_nop(phis, phis->v.assign.rhs2))
+		continue;
+
+	    fputs(FOR_EACH_LANE, out);
+	    output_lane_value_name(out, phis->v.assign.lhs);
+	    fprintf(out, " = mask_%d[lane] ? (", mask);
+	    output_lane_rhs(out, phis->v.assign.rhs2);
+	    fputs(") : ", out);
+	    output_lane_value_name(out, phis->v.assign.lhs);
+	    fputs(";\n", out);
+	}
+    }
+}
+
+/* mask is the number of the mask of the lanes executing stmt, or -1
+ * if all lanes do. */
+static void
+output_lane_stmts (FILE *out, statement_t *stmt, int mask, int *num_masks)
+{
+    for (; stmt != 0; stmt = stmt->next)
+    {
+	if ((stmt->slice_flags & SLICE_NO_CONST) == 0)
+	    continue;
+
+	switch (stmt->kind)
+	{
+	    case STMT_NIL :
+		break;
+
+	    case STMT_ASSIGN :
+		fputs(FOR_EACH_LANE, out);
+		output_lane_value_name(out, stmt->v.assign.lhs);
+		fputs(" = ", out);
+		output_lane_assign_rhs(out, stmt->v.assign.lhs, stmt->v.assign.rhs);
+		fputs(";\n", out);
+		break;
+
+	    case STMT_IF_COND :
+		{
+		    int consequent_mask = (*num_masks)++;
+		    int alternative_mask = (*num_masks)++;
+
+		    fprintf(out, "{\nint mask_%d[PIXEL_STRIP_WIDTH], mask_%d[PIXEL_STRIP_WIDTH];\n",
+			    consequent_mask, alternative_mask);
+		    fputs(FOR_EACH_LANE, out);
+		    fprintf(out, "{\nmask_%d[lane] = (", consequent_mask);
+		    output_lane_rhs(out, stmt->v.if_cond.condition);
+		    fputs(") != 0;\n", out);
+		    if (mask >= 0)
+		    {
+			fprintf(out, "mask_%d[lane] = mask_%d[lane] & !mask_%d[lane];\n",
+				alternative_mask, mask, consequent_mask);
+			fprintf(out, "mask_%d[lane] &= mask_%d[lane];\n", consequent_mask, mask);
+		    }
+		    else
+			fprintf(out, "mask_%d[lane] = !mask_%d[lane];\n", alternative_mask, consequent_mask);
+		    fputs("}\n", out);
+
+		    output_lane_stmts(out, stmt->v.if_cond.consequent, consequent_mask, num_masks);
+		    output_lane_stmts(out, stmt->v.if_cond.alternative, alternative_mask, num_masks);
+		    output_lane_phis(out, stmt->v.if_cond.exit, 0, consequent_mask);
+		    fputs("}\n", out);
+		}
+		break;
+
+	    case STMT_WHILE_LOOP :
+		{
+		    int loop_mask = (*num_masks)++;
+
+		    output_lane_phis(out, stmt->v.while_loop.entry, 0, -1);
+		    fprintf(out, "{\nint mask_%d[PIXEL_STRIP_WIDTH];\n", loop_mask);
+		    fputs(FOR_EACH_LANE, out);
+		    if (mask >= 0)
+			fprintf(out, "mask_%d[lane] = mask_%d[lane];\n", loop_mask, mask);
+		    else
+			fprintf(out, "mask_%d[lane] = 1;\n", loop_mask);
+		    fputs("for (;;)\n{\n", out);
+		    fputs(FOR_EACH_LANE, out);
+		    fprintf(out, "mask_%d[lane] &= (", loop_mask);
+		    output_lane_rhs(out, stmt->v.while_loop.invariant);
+		    fputs(") != 0;\n", out);
+		    fprintf(out, "if (!any_lane_active(mask_%d))\nbreak;\n", loop_mask);
+		    output_lane_stmts(out, stmt->v.while_loop.body, loop_mask, num_masks);
+		    output_lane_phis(out, stmt->v.while_loop.entry, 1, loop_mask);
+		    fputs("}\n}\n", out);
+		}
+		break;
+
+	    default :
+		g_assert_not_reached();
+	}
+    }
+}
+
+static void
+_output_lane_value_if_needed_decl (value_t *value, statement_t *stmt, void *info)
+{
+    CLOSURE_VAR(FILE*, out, 0);
+
+    if (!value->have_defined && is_lane_value(value))
+    {
+	fprintf(out, "%s ", type_c_type_name(value->compvar->type));
+	output_value_name(out, value, 1);
+	fputs("[PIXEL_STRIP_WIDTH];\n", out);
+	if (value->local_tuple_length > 0)
+	{
+	    fputs("float ", out);
+	    output_local_tuple_storage_name(out, value);
+	    fprintf(out, "[PIXEL_STRIP_WIDTH][%d];\n", value->local_tuple_length);
+	}
+	value->have_defined = 1;
+    }
+}
+
+static void
+output_lane_code (filter_code_t *code, FILE *out)
+{
+    int num_masks = 0;
+
+    compiler_slice_code_for_const(code->first_stmt, 0);
+    if (!lanes_stmts_possible(code->first_stmt, TRUE))
+	return;
+
+    compiler_reset_have_defined(code->first_stmt);
+    COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(code->first_stmt, &_output_lane_value_if_needed_decl, out);
+
+    output_lane_stmts(out, code->first_stmt, -1, &num_masks);
+}
+#endif
+
 /*** template processing ***/
 
 static char *include_path = 0;
@@ -477,6 +989,23 @@ filter_template_processor (mathmap_t *mathmap, const char *directive, const char
 	fputs(code->filter->name, out);
     else if (strcmp(directive, "m") == 0)
 	output_permanent_const_code(code, out, 0);
+    else if (strcmp(directive, "lane_m") == 0)
+    {
+#ifndef NO_CONSTANTS_ANALYSIS
+	output_lane_code(code, out);
+#endif
+    }
+    else if (strcmp(directive, "can_use_lanes") == 0)
+    {
+#ifndef NO_CONSTANTS_ANALYSIS
+	compiler_slice_code_for_const(code->first_stmt, 0);
+	putc(lanes_stmts_possible(code->first_stmt, TRUE) ? '1' : '0', out);
+#else
+	putc('0', out);
+#endif
+    }
+    else if (strcmp(directive, "uses_pixel_pools") == 0)
+	putc(code->uses_pixel_pools ? '1' : '0', out);
     else if (strcmp(directive, "xy_decls") == 0)
     {
 #ifndef NO_CONSTANTS_ANALYSIS
@@ -595,31 +1124,71 @@ compiler_template_processor (mathmap_t *mathmap, const char *directive, const ch
 
 /*** compiling and loading/unloading ***/
 
+/* Runs the command directly, without a shell, and appends the command
+   line and its output to the log file. */
+/* Runs command, which is split into arguments like a shell command
+   line, with the NULL terminated list of file names appended.  The
+   file names are passed as they are, so they can contain spaces and
+   quotes. */
 static int
-exec_cmd (char *log_filename, char *format, ...)
+exec_cmd (const char *log_filename, const char *command, ...)
 {
     va_list ap;
-    char *cmdline, *full_cmdline;
+    char **command_argv;
+    char **argv;
+    const char *filename;
+    int command_argc, num_filenames, i;
+    char *output = NULL, *errors = NULL;
+    int exit_status;
     int result;
     FILE *log;
 
-    va_start(ap, format);
-    cmdline = g_strdup_vprintf(format, ap);
+    if (!g_shell_parse_argv(command, &command_argc, &command_argv, NULL))
+	return -1;
+
+    num_filenames = 0;
+    va_start(ap, command);
+    while (va_arg(ap, const char*) != NULL)
+	++num_filenames;
     va_end(ap);
 
+    argv = g_new(char*, command_argc + num_filenames + 1);
+    for (i = 0; i < command_argc; ++i)
+	argv[i] = command_argv[i];
+    va_start(ap, command);
+    while ((filename = va_arg(ap, const char*)) != NULL)
+	argv[i++] = (char*)filename;
+    va_end(ap);
+    argv[i] = NULL;
+
+    if (g_spawn_sync(NULL, argv, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, &output, &errors, &exit_status, NULL))
+	result = exit_status;
+    else
+	result = -1;
+
     log = fopen(log_filename, "a");
     if (log != 0)
     {
-	fprintf(log, "\n%s\n", cmdline);
+	fputs("\n", log);
+	for (i = 0; argv[i] != NULL; ++i)
+	{
+	    char *quoted = g_shell_quote(argv[i]);
+
+	    fprintf(log, i > 0 ? " %s" : "%s", quoted);
+	    g_free(quoted);
+	}
+	fputs("\n", log);
+	if (output != NULL)
+	    fputs(output, log);
+	if (errors != NULL)
+	    fputs(errors, log);
 	fclose(log);
     }
 
-    full_cmdline = g_strdup_printf("%s >>%s 2>&1", cmdline, log_filename);
-
-    result = system(full_cmdline);
-
-    g_free(full_cmdline);
-    g_free(cmdline);
+    g_free(output);
+    g_free(errors);
+    g_free(argv);
+    g_strfreev(command_argv);
 
     return result;
 }
@@ -631,6 +1200,263 @@ exec_cmd (char *log_filename, char *format, ...)
 
 #define TMP_PREFIX		"/tmp/mathfunc"
 
+/*** compiled code cache ***/
+
+/* Compiled modules are kept in a directory, named by a hash of their C
+   source, of the headers it includes from the include path and of the
+   commands used to compile them, so that compiling the same filter
+   again only means loading the module.  The headers must be part of
+   the hash because they define the calling conventions between the
+   module and MathMap.  The directory can be set with the environment
+   variable MATHMAP_CODE_CACHE_DIR, which disables the cache if it is
+   empty.  MATHMAP_CODE_CACHE_SIZE sets the maximum size of the cache
+   in megabytes.  If the cache gets larger, the modules which haven't
+   been used longest are removed. */
+
+#define CODE_CACHE_DEFAULT_SIZE		64
+
+/* Temporary modules older than this (in seconds) were left behind by
+   a process which died while compiling. */
+#define CODE_CACHE_TMP_MAX_AGE		3600
+
+static const char *code_cache_headers[] = { "opmacros.h", "pools.h", NULL };
+
+static const char*
+get_code_cache_dir (void)
+{
+    static gboolean initialized = FALSE;
+    static char *dir = NULL;
+
+    if (!initialized)
+    {
+	const char *env = g_getenv("MATHMAP_CODE_CACHE_DIR");
+
+	if (env == NULL)
+	    dir = g_build_filename(g_get_user_cache_dir(), "mathmap", "code", NULL);
+	else if (env[0] != '\0')
+	    dir = g_strdup(env);
+
+	if (dir != NULL && g_mkdir_with_parents(dir, 0700) != 0)
+	{
+	    g_free(dir);
+	    dir = NULL;
+	}
+
+	initialized = TRUE;
+    }
+
+    return dir;
+}
+
+static gboolean
+checksum_file (GChecksum *checksum, const char *filename)
+{
+    gchar *contents;
+    gsize length;
+
+    if (!g_file_get_contents(filename, &contents, &length, NULL))
+	return FALSE;
+
+    g_checksum_update(checksum, (const guchar*)contents, length);
+    g_free(contents);
+
+    return TRUE;
+}
+
+static char*
+get_code_cache_filename (const char *cache_dir, const char *c_filename, const char *include_path)
+{
+    GChecksum *checksum;
+    char *filename = NULL;
+    int i;
+
+    checksum = g_checksum_new(G_CHECKSUM_SHA1);
+    g_checksum_update(checksum, (const guchar*)MATHMAP_VERSION "\n" CGEN_CC "\n" CGEN_LD "\n", -1);
+#ifdef CGEN_CCLD
+    g_checksum_update(checksum, (const guchar*)CGEN_CCLD "\n", -1);
+#endif
+
+    if (!checksum_file(checksum, c_filename))
+	goto out;
+
+    for (i = 0; code_cache_headers[i] != NULL; ++i)
+    {
+	char *header_filename = g_build_filename(include_path, code_cache_headers[i], NULL);
+	gboolean success = checksum_file(checksum, header_filename);
+
+	g_free(header_filename);
+
+	/* If we can't hash it we can't tell whether a cached module
+	   matches it. */
+	if (!success)
+	    goto out;
+    }
+
+    filename = g_strdup_printf("%s/%s.so", cache_dir, g_checksum_get_string(checksum));
+
+ out:
+    g_checksum_free(checksum);
+
+    return filename;
+}
+
+typedef struct
+{
+    char *filename;
+    off_t size;
+    time_t mtime;
+} code_cache_file_t;
+
+static gint
+compare_code_cache_files (gconstpointer _a, gconstpointer _b)
+{
+    const code_cache_file_t *a = _a, *b = _b;
+
+    if (a->mtime < b->mtime)
+	return -1;
+    if (a->mtime > b->mtime)
+	return 1;
+    return 0;
+}
+
+/* Removes the modules which haven't been used longest until the cache
+   fits its size, but never keep_filename, as well as temporary modules
+   left behind by crashed processes. */
+static void
+trim_code_cache (const char *cache_dir, const char *keep_filename)
+{
+    const char *env = g_getenv("MATHMAP_CODE_CACHE_SIZE");
+    off_t max_size = (off_t)(env != NULL ? atoi(env) : CODE_CACHE_DEFAULT_SIZE) * 1024 * 1024;
+    off_t total_size = 0;
+    GSList *files = NULL, *l;
+    GDir *dir;
+    const char *name;
+    time_t now = time(NULL);
+
+    dir = g_dir_open(cache_dir, 0, NULL);
+    if (dir == NULL)
+	return;
+
+    while ((name = g_dir_read_name(dir)) != NULL)
+    {
+	code_cache_file_t *file;
+	struct stat buf;
+	char *filename;
+
+	if (!g_str_has_suffix(name, ".so") && !g_str_has_suffix(name, ".tmp"))
+	    continue;
+
+	filename = g_build_filename(cache_dir, name, NULL);
+	if (g_stat(filename, &buf) != 0 || strcmp(filename, keep_filename) == 0)
+	{
+	    g_free(filename);
+	    continue;
+	}
+
+	if (g_str_has_suffix(name, ".tmp"))
+	{
+	    if (now - buf.st_mtime > CODE_CACHE_TMP_MAX_AGE)
+		g_unlink(filename);
+	    g_free(filename);
+	    continue;
+	}
+
+	file = g_new(code_cache_file_t, 1);
+	file->filename = filename;
+	file->size = buf.st_size;
+	file->mtime = buf.st_mtime;
+
+	total_size += file->size;
+	files = g_slist_prepend(files, file);
+    }
+
+    g_dir_close(dir);
+
+    files = g_slist_sort(files, compare_code_cache_files);
+
+    for (l = files; l != NULL; l = l->next)
+    {
+	code_cache_file_t *file = l->data;
+
+	if (total_size > max_size)
+	{
+	    g_unlink(file->filename);
+	    total_size -= file->size;
+	}
+
+	g_free(file->filename);
+	g_free(file);
+    }
+
+    g_slist_free(files);
+}
+
+/* Compiles the module.  If *cached_so_filename is not NULL the module
+   is compiled under a temporary name in the cache directory and then
+   renamed, so that other processes never see an incomplete module.
+   If that fails, *cached_so_filename is set to NULL and the module is
+   used without caching it.  Returns the filename of the module, or
+   NULL if compilation failed. */
+static char*
+compile_module (const char *c_filename, const char *o_filename, const char *log_filename,
+		int pid, int num, char **cached_so_filename, gboolean *new_cached_module)
+{
+    char *so_filename;
+
+    if (*cached_so_filename != NULL)
+	so_filename = g_strdup_printf("%s.%d_%d.tmp", *cached_so_filename, pid, num);
+    else
+	so_filename = g_strdup_printf("%s%d_%d.so", TMP_PREFIX, pid, num);
+
+#ifdef CGEN_CCLD
+    /* The compiler driver can link as well, which saves us one
+       process and the object file. */
+    if (exec_cmd(log_filename, CGEN_CCLD, so_filename, c_filename, NULL) != 0)
+    {
+	sprintf(error_string, _("C compiler failed.  See logfile `%s'."), log_filename);
+	unlink(so_filename);
+	g_free(so_filename);
+	return NULL;
+    }
+#else
+    if (exec_cmd(log_filename, CGEN_CC, o_filename, c_filename, NULL) != 0)
+    {
+	sprintf(error_string, _("C compiler failed.  See logfile `%s'."), log_filename);
+	unlink(o_filename);
+	g_free(so_filename);
+	return NULL;
+    }
+
+    if (exec_cmd(log_filename, CGEN_LD, so_filename, o_filename, NULL) != 0)
+    {
+	sprintf(error_string, _("Linker failed.  See logfile `%s'."), log_filename);
+	unlink(o_filename);
+	unlink(so_filename);
+	g_free(so_filename);
+	return NULL;
+    }
+#endif
+
+    if (*cached_so_filename != NULL)
+    {
+	if (g_rename(so_filename, *cached_so_filename) == 0)
+	{
+	    g_free(so_filename);
+	    so_filename = g_strdup(*cached_so_filename);
+	    *new_cached_module = TRUE;
+	}
+	else
+	{
+	    /* Just use the module without caching it. */
+	    unlink(so_filename);
+	    g_free(*cached_so_filename);
+	    *cached_so_filename = NULL;
+	}
+    }
+
+    return so_filename;
+}
+
 initfunc_t
 gen_and_load_c_code (mathmap_t *mathmap, void **module_info, char *template_filename, char *include_path,
 		     filter_code_t **the_filter_codes)
@@ -639,6 +1465,9 @@ gen_and_load_c_code (mathmap_t *mathmap, void **module_info, char *template_file
 
     FILE *out;
     char *c_filename, *o_filename, *so_filename, *log_filename;
+    const char *cache_dir;
+    char *cached_so_filename = NULL;
+    gboolean new_cached_module = FALSE;
     int pid = getpid();
     initfunc_t initfunc;
 #ifndef OPENSTEP
@@ -670,22 +1499,41 @@ gen_and_load_c_code (mathmap_t *mathmap, void **module_info, char *template_file
     o_filename = g_strdup_printf("%s%d_%d.o", TMP_PREFIX, pid, last_mathfunc);
     log_filename = g_strdup_printf("%s%d_%d.log", TMP_PREFIX, pid, last_mathfunc);
 
-    if (exec_cmd(log_filename, "%s %s %s", CGEN_CC, o_filename, c_filename) != 0)
-    {
-	sprintf(error_string, _("C compiler failed.  See logfile `%s'."), log_filename);
-	return 0;
-    }
+    cache_dir = get_code_cache_dir();
+    if (cache_dir != NULL)
+	cached_so_filename = get_code_cache_filename(cache_dir, c_filename, include_path);
 
-    so_filename = g_strdup_printf("%s%d_%d.so", TMP_PREFIX, pid, last_mathfunc);
+    if (cached_so_filename != NULL && g_file_test(cached_so_filename, G_FILE_TEST_EXISTS))
+    {
+	/* Mark it as recently used. */
+	utime(cached_so_filename, NULL);
 
-    if (exec_cmd(log_filename, "%s %s %s", CGEN_LD, so_filename, o_filename) != 0)
+	so_filename = g_strdup(cached_so_filename);
+    }
+    else
     {
-	sprintf(error_string, _("Linker failed.  See logfile `%s'."), log_filename);
-	return 0;
+	so_filename = compile_module(c_filename, o_filename, log_filename, pid, last_mathfunc,
+				     &cached_so_filename, &new_cached_module);
+	if (so_filename == NULL)
+	    return 0;
     }
 
 #ifndef OPENSTEP
     module = g_module_open(so_filename, 0);
+    if (module == 0 && !new_cached_module && cached_so_filename != NULL)
+    {
+	/* The cached module is broken, for example because it was
+	   truncated, so we replace it instead of failing for good. */
+	unlink(cached_so_filename);
+	g_free(so_filename);
+
+	so_filename = compile_module(c_filename, o_filename, log_filename, pid, last_mathfunc,
+				     &cached_so_filename, &new_cached_module);
+	if (so_filename == NULL)
+	    return 0;
+
+	module = g_module_open(so_filename, 0);
+    }
     if (module == 0)
     {
 	sprintf(error_string, _("Could not load module `%s': %s."), so_filename, g_module_error());
@@ -738,10 +1586,17 @@ gen_and_load_c_code (mathmap_t *mathmap, void **module_info, char *template_file
     }
 #endif
 
+    /* Only trim once the new module is loaded, so that we can't remove
+       it before we get to use it. */
+    if (new_cached_module)
+	trim_code_cache(cache_dir, cached_so_filename);
+
 #ifndef DONT_UNLINK_SO
-    unlink(so_filename);
+    if (cached_so_filename == NULL)
+	unlink(so_filename);
 #endif
     g_free(so_filename);
+    g_free(cached_so_filename);
 
     unlink(o_filename);
     g_free(o_filename);
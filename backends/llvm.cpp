@@ -22,23 +22,26 @@
 
 #include <iostream>
 #include <map>
+#include <memory>
 #include <complex>
 
-#include <llvm/Module.h>
-#include <llvm/Function.h>
-#include <llvm/PassManager.h>
-#include <llvm/CallingConv.h>
-#include <llvm/Analysis/Verifier.h>
-#include <llvm/Assembly/PrintModulePass.h>
-#include <llvm/Support/IRBuilder.h>
-#include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Bitcode/BitcodeReader.h>
 #include <llvm/Support/MemoryBuffer.h>
-#include <llvm/Bitcode/ReaderWriter.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
 #include <llvm/Transforms/Scalar.h>
+#include <llvm/Transforms/Scalar/GVN.h>
+#include <llvm/Transforms/InstCombine/InstCombine.h>
 #include <llvm/Transforms/IPO.h>
-#include <llvm/Target/TargetData.h>
-#include <llvm/ModuleProvider.h>
-#include <llvm/TypeSymbolTable.h>
+#include <llvm/Transforms/Utils.h>
 
 #include "../compiler-internals.h"
 #include "../compiler_types.h"
@@ -67,6 +70,7 @@ private:
     filter_t *filter;
     filter_code_t *filter_code;
     Module *module;
+    LLVMContext &context;
 
     Function *init_frame_function;
     Function *current_function;
@@ -77,6 +81,7 @@ private:
     Value *frame_arg;
     Value *closure_arg;
     Value *pools_arg;
+    Value *rand_state_var;
 
     StructType *x_vars_type;
     StructType *y_vars_type;
@@ -87,8 +92,6 @@ private:
     Value *xy_vars_var;
     Value *ret_var;
 
-    Value *complex_copy_var;
-
     map<value_t*, Value*> value_map;
     map<string, Value*> internal_map;
     map<value_t*, PHINode*> phi_map;
@@ -106,13 +109,18 @@ private:
     Value* lookup_internal (internal_t *internal);
     Value* lookup_internal (const char *name);
 
+    Value* make_int_const (int x);
+    Value* make_float_const (float x);
+
     Value* promote (Value *val, int type);
 
-    void alloc_complex_copy_var ();
-    Value* convert_complex_return_value (Value *result);
+    Value* create_entry_alloca (Type *type);
+    Value* coerce_arg (Value *val, Type *type);
+    Value* emit_call (Function *func, vector<Value*> &args);
+    Value* emit_call (const char *name, vector<Value*> args);
 
     void build_const_value_info (value_t *value, statement_t *stmt, int const_type,
-				 vector<const Type*> *struct_elems);
+				 vector<Type*> *struct_elems);
     static void _build_const_value_info (value_t *value, statement_t *stmt, void *info);
     StructType* build_const_value_infos (int const_type);
 
@@ -129,6 +137,7 @@ private:
     Value* emit_rhs (rhs_t *rhs);
     Value* emit_primary (primary_t *primary, bool need_float = false);
     Value* emit_closure (filter_t *filter, primary_t *args);
+    Value* emit_condition (Value *number);
 
     void set_internals_from_invocation (Value *invocation_arg);
     void setup_xy_vars_from_closure ();
@@ -226,64 +235,105 @@ lookup_init_y_function (Module *module, filter_t *filter)
     return func;
 }
 
-static Value*
-make_int_const (int x)
+static Function*
+lookup_runtime_function (Module *module, const char *name)
+{
+    Function *func = module->getFunction(name);
+
+    if (func == NULL)
+	throw compiler_error(string("The LLVM template lacks the function `") + name + string("'."));
+
+    return func;
+}
+
+/* The template is compiled by clang, which names the struct types
+   as it likes and represents complex numbers according to the
+   platform ABI, so we take all the types we need from the
+   signatures of its functions. */
+static Type*
+get_runtime_param_type (Module *module, const char *function_name, unsigned int index)
 {
-    return ConstantInt::get(Type::Int32Ty, x, true);
+    return lookup_runtime_function(module, function_name)->getFunctionType()->getParamType(index);
 }
 
-static Value*
-make_float_const (float x)
+static Type*
+get_runtime_return_type (Module *module, const char *function_name)
 {
-    return ConstantFP::get(Type::FloatTy, x);
+    return lookup_runtime_function(module, function_name)->getReturnType();
 }
 
-static const Type*
-get_void_ptr_type ()
+static Type*
+get_void_ptr_type (Module *module)
 {
-    return PointerType::getUnqual(Type::Int8Ty);
+    return Type::getInt8PtrTy(module->getContext());
 }
 
-static const Type*
+static Type*
 get_invocation_ptr_type (Module *module)
 {
-    const Type *invocation_type = module->getTypeByName(string("struct.mathmap_invocation_t"));
-    g_assert(invocation_type);
-    return PointerType::getUnqual(invocation_type);
+    return get_runtime_param_type(module, "get_invocation_img_width", 0);
 }
 
-static const Type*
+static Type*
 get_frame_ptr_type (Module *module)
 {
-    const Type *frame_type = module->getTypeByName(string("struct.mathmap_frame_t"));
-    g_assert(frame_type);
-    return PointerType::getUnqual(frame_type);
+    return get_runtime_param_type(module, "get_frame_invocation", 0);
 }
 
-static const Type*
+static Type*
 get_slice_ptr_type (Module *module)
 {
-    const Type *slice_type = module->getTypeByName(string("struct._mathmap_slice_t"));
-    g_assert(slice_type);
-    return PointerType::getUnqual(slice_type);
+    return get_runtime_param_type(module, "get_slice_frame", 0);
 }
 
-static const Type*
+static Type*
 get_pools_ptr_type (Module *module)
 {
-    const Type *pools_type = module->getTypeByName(string("struct.mathmap_pools_t"));
-    g_assert(pools_type);
-    return PointerType::getUnqual(pools_type);
+    return get_runtime_param_type(module, "alloc_tuple", 0);
+}
+
+static Type*
+llvm_type_for_type (Module *module, type_t type)
+{
+    switch (type)
+    {
+	case TYPE_INT :
+	case TYPE_COLOR :
+	    return Type::getInt32Ty(module->getContext());
+	case TYPE_FLOAT :
+	    return Type::getFloatTy(module->getContext());
+	case TYPE_COMPLEX :
+	    /* Complex values are kept in the representation functions
+	       return them in.  See coerce_arg() for passing them. */
+	    return get_runtime_return_type(module, "make_complex");
+	case TYPE_IMAGE :
+	    return get_runtime_return_type(module, "get_uninited_image");
+	case TYPE_TUPLE :
+	    return PointerType::getUnqual(Type::getFloatTy(module->getContext()));
+	case TYPE_TREE_VECTOR :
+	    return get_runtime_return_type(module, "alloc_tree_vector");
+	case TYPE_CURVE :
+	    return get_runtime_param_type(module, "set_userval_curve", 2);
+	case TYPE_GRADIENT :
+	    return get_runtime_param_type(module, "set_userval_gradient", 2);
+	default :
+	    g_assert_not_reached();
+    }
 }
 
 code_emitter::code_emitter (Module *_module, filter_t *_filter, filter_code_t *code)
+    : context(_module->getContext())
 {
     module = _module;
     filter_code = code;
     filter = _filter;
 
+    builder = NULL;
+    current_function = NULL;
+
     x_vars_type = y_vars_type = xy_vars_type = NULL;
     x_vars_var = y_vars_var = xy_vars_var = NULL;
+    rand_state_var = NULL;
 
     init_frame_function = lookup_init_frame_function(module, filter);
     g_assert(init_frame_function);
@@ -291,6 +341,20 @@ code_emitter::code_emitter (Module *_module, filter_t *_filter, filter_code_t *c
 
 code_emitter::~code_emitter ()
 {
+    if (builder)
+	delete builder;
+}
+
+Value*
+code_emitter::make_int_const (int x)
+{
+    return ConstantInt::get(Type::getInt32Ty(context), x, true);
+}
+
+Value*
+code_emitter::make_float_const (float x)
+{
+    return ConstantFP::get(Type::getFloatTy(context), x);
 }
 
 Value*
@@ -299,23 +363,28 @@ code_emitter::emit_const_value_addr (value_t *value)
     g_assert(const_value_index_map.find(value) != const_value_index_map.end());
 
     int index = const_value_index_map[value];
-    vector<Value*> indices;
-
-    indices.push_back(make_int_const(0));
-    indices.push_back(make_int_const(index));
-
     Value *const_var = NULL;
+    StructType *const_var_type = NULL;
 
     if ((value->const_type | CONST_T) == (CONST_X | CONST_Y | CONST_T))
+    {
 	const_var = xy_vars_var;
+	const_var_type = xy_vars_type;
+    }
     else if ((value->const_type | CONST_T) == (CONST_X | CONST_T))
+    {
 	const_var = x_vars_var;
+	const_var_type = x_vars_type;
+    }
     else if ((value->const_type | CONST_T) == (CONST_Y | CONST_T))
+    {
 	const_var = y_vars_var;
+	const_var_type = y_vars_type;
+    }
     else
 	g_assert_not_reached();
 
-    return builder->CreateGEP(const_var, indices.begin(), indices.end());
+    return builder->CreateStructGEP(const_var_type, const_var, index);
 }
 
 static void
@@ -360,9 +429,10 @@ code_emitter::commit_set_const_value (value_t *value, Value *llvm_value)
     printf("storing value ");
     compiler_print_value(value);
     printf(" with llvm value ");
-    llvm_value->dump();
+    llvm_value->print(errs());
     printf(" at addr ");
-    addr->dump();
+    addr->print(errs());
+    errs() << "\n";
 #endif
 
     builder->CreateStore(llvm_value, addr);
@@ -389,7 +459,7 @@ code_emitter::lookup_value (value_t *value)
 	return value_map[value];
 
     g_assert(compiler_is_permanent_const_value(value));
-    return builder->CreateLoad(emit_const_value_addr(value));
+    return builder->CreateLoad(llvm_type_for_type(module, value->compvar->type), emit_const_value_addr(value));
 }
 
 void
@@ -424,42 +494,88 @@ code_emitter::promote (Value *val, int type)
     switch (type)
     {
 	case TYPE_FLOAT :
-	    if (val->getType() == Type::Int32Ty)
-		val = builder->CreateCall(module->getFunction(string("promote_int_to_float")), val);
+	    if (val->getType()->isIntegerTy(32))
+		val = emit_call("promote_int_to_float", { val });
 	    else
-		assert(val->getType() == Type::FloatTy);
+		assert(val->getType()->isFloatTy());
 	    break;
 
 	case TYPE_COMPLEX :
-	    if (val->getType() == Type::Int32Ty)
-		val = builder->CreateCall(module->getFunction(string("promote_int_to_complex")), val);
-	    else if (val->getType() == Type::FloatTy)
-		val = builder->CreateCall(module->getFunction(string("promote_float_to_complex")), val);
+	    if (val->getType()->isIntegerTy(32))
+		val = emit_call("promote_int_to_complex", { val });
+	    else if (val->getType()->isFloatTy())
+		val = emit_call("promote_float_to_complex", { val });
 	    break;
     }
     return val;
 }
 
+/* Allocas in the entry block are turned into registers by mem2reg,
+   and don't grow the stack in loops. */
 Value*
-code_emitter::convert_complex_return_value (Value *result)
+code_emitter::create_entry_alloca (Type *type)
 {
-    /* The result is complex, whose representation
-       differs between archs, and we need to transform
-       it into another arch-dependent
-       representation. */
-    if (sizeof(gpointer) == 4)
-    {
-	Value *local = complex_copy_var;
-	Value *local_ptr = builder->CreateBitCast(local, PointerType::getUnqual(Type::Int64Ty));
-	builder->CreateStore(result, local_ptr);
-	result = builder->CreateLoad(local);
-    }
-    else if (sizeof(gpointer) == 8)
-	result = builder->CreateExtractValue(result, 0);
-    else
-	g_assert_not_reached();
+    BasicBlock &entry = current_function->getEntryBlock();
+    IRBuilder<> entry_builder(&entry, entry.begin());
+
+    return entry_builder.CreateAlloca(type);
+}
+
+Value*
+code_emitter::coerce_arg (Value *val, Type *type)
+{
+    Type *val_type = val->getType();
 
-    return result;
+    if (val_type == type)
+	return val;
+
+    /* Function pointers and struct pointers whose types differ only
+       in name. */
+    if (val_type->isPointerTy() && type->isPointerTy())
+	return builder->CreateBitCast(val, type);
+
+    /* Complex numbers are returned in a different representation than
+       they are passed in on some platforms, e.g. as {float, float}
+       and as [2 x float] on AArch64, or they are passed by
+       reference, so we go through memory. */
+    Value *copy = create_entry_alloca(val_type);
+
+    builder->CreateStore(val, copy);
+
+    if (type->isPointerTy())
+	return builder->CreateBitCast(copy, type);
+
+    const DataLayout &data_layout = module->getDataLayout();
+
+    if (data_layout.getTypeAllocSize(val_type) != data_layout.getTypeAllocSize(type))
+	throw compiler_error(string("The LLVM backend cannot pass complex numbers on this platform."));
+
+    return builder->CreateLoad(type, builder->CreateBitCast(copy, PointerType::getUnqual(type)));
+}
+
+Value*
+code_emitter::emit_call (Function *func, vector<Value*> &args)
+{
+    FunctionType *func_type = func->getFunctionType();
+
+    if (func_type->getNumParams() != args.size())
+	throw compiler_error(string("The LLVM backend cannot call `") + func->getName().str()
+			     + string("' on this platform."));
+
+    for (unsigned int i = 0; i < args.size(); ++i)
+	args[i] = coerce_arg(args[i], func_type->getParamType(i));
+
+#ifdef DEBUG_OUTPUT
+    func->print(errs());
+#endif
+
+    return builder->CreateCall(func_type, func, args);
+}
+
+Value*
+code_emitter::emit_call (const char *name, vector<Value*> args)
+{
+    return emit_call(lookup_runtime_function(module, name), args);
 }
 
 Value*
@@ -477,7 +593,7 @@ code_emitter::emit_primary (primary_t *primary, bool need_float)
 		    case TYPE_FLOAT :
 			return make_float_const(0.0);
 		    case TYPE_IMAGE :
-			return builder->CreateCall(module->getFunction(string("get_uninited_image")));
+			return emit_call("get_uninited_image", {});
 		    default :
 			g_assert_not_reached();
 		}
@@ -501,20 +617,17 @@ code_emitter::emit_primary (primary_t *primary, bool need_float)
 		case TYPE_FLOAT :
 		    return make_float_const(primary->v.constant.float_value);
 		case TYPE_COMPLEX :
-		    {
-			assert(!need_float);
-			Value *val = builder->CreateCall2(module->getFunction(string("make_complex")),
-							  make_float_const(__real__ primary->v.constant.complex_value),
-							  make_float_const(__imag__ primary->v.constant.complex_value));
-			return convert_complex_return_value(val);
-		    }
+		    assert(!need_float);
+		    return emit_call("make_complex",
+				     { make_float_const(__real__ primary->v.constant.complex_value),
+				       make_float_const(__imag__ primary->v.constant.complex_value) });
 		case TYPE_COLOR :
 		    assert(!need_float);
-		    return builder->CreateCall4(module->getFunction(string("make_color")),
-						make_int_const(RED(primary->v.constant.color_value)),
-						make_int_const(GREEN(primary->v.constant.color_value)),
-						make_int_const(BLUE(primary->v.constant.color_value)),
-						make_int_const(ALPHA(primary->v.constant.color_value)));
+		    return emit_call("make_color",
+				     { make_int_const(RED(primary->v.constant.color_value)),
+				       make_int_const(GREEN(primary->v.constant.color_value)),
+				       make_int_const(BLUE(primary->v.constant.color_value)),
+				       make_int_const(ALPHA(primary->v.constant.color_value)) });
 		default :
 		    g_assert_not_reached();
 	    }
@@ -571,13 +684,12 @@ code_emitter::emit_closure (filter_t *closure_filter, primary_t *args)
 	args.push_back(lookup_init_x_function(module, closure_filter));
 	args.push_back(lookup_init_y_function(module, closure_filter));
 
-	closure = builder->CreateCall(module->getFunction(string("alloc_closure_image")), args.begin(), args.end());
-	uservals = builder->CreateCall(module->getFunction(string("get_closure_uservals")), closure);
+	closure = emit_call("alloc_closure_image", args);
+	uservals = emit_call("get_closure_uservals", { closure });
     }
     else
-	uservals = builder->CreateCall2(module->getFunction(string("alloc_uservals")),
-					pools_arg,
-					make_int_const(compiler_num_filter_args(closure_filter) - 3));
+	uservals = emit_call("alloc_uservals",
+			     { pools_arg, make_int_const(compiler_num_filter_args(closure_filter) - 3) });
 
     for (i = 0, info = closure_filter->userval_infos;
 	 info != 0;
@@ -590,104 +702,23 @@ code_emitter::emit_closure (filter_t *closure_filter, primary_t *args)
 	if (info->type == USERVAL_BOOL_CONST)
 	    arg = promote(arg, TYPE_FLOAT);
 
-	builder->CreateCall3(module->getFunction(string(set_func_name)), uservals, make_int_const(i), arg);
+	emit_call(set_func_name, { uservals, make_int_const(i), arg });
     }
     g_assert(i == num_args);
 
     if (closure_filter->kind == FILTER_MATHMAP)
     {
-	builder->CreateCall3(module->getFunction(string("set_closure_pixel_size")),
-			     closure, lookup_internal("__canvasPixelW"), lookup_internal("__canvasPixelH"));
+	emit_call("set_closure_pixel_size",
+		  { closure, lookup_internal("__canvasPixelW"), lookup_internal("__canvasPixelH") });
 	return closure;
     }
     else
     {
 	string filter_func_name = string("llvm_") + string(closure_filter->v.native.func_name);
-	return builder->CreateCall3(module->getFunction(filter_func_name),
-				    invocation_arg, uservals, pools_arg);
+	return emit_call(filter_func_name.c_str(), { invocation_arg, uservals, pools_arg });
     }
 }
 
-static bool
-is_complex_return_type (const Type *type)
-{
-    if (sizeof(gpointer) == 4)
-	return type == Type::Int64Ty;
-    else if (sizeof(gpointer) == 8)
-    {
-	static Type *ret_type;
-
-	if (!ret_type)
-	{
-	    vector<const Type*> elems;
-
-	    elems.push_back(Type::DoubleTy);
-
-	    ret_type = StructType::get(elems);
-	}
-
-	g_assert(ret_type);
-
-	return type == ret_type;
-    }
-    else
-	g_assert_not_reached();
-}
-
-static const Type*
-llvm_type_for_type (Module *module, type_t type)
-{
-    switch (type)
-    {
-	case TYPE_INT :
-	    return Type::Int32Ty;
-	case TYPE_FLOAT :
-	    return Type::FloatTy;
-	case TYPE_COMPLEX :
-	    if (sizeof(gpointer) == 4)
-	    {
-		static const Type *result;
-
-		vector<const Type*> elems;
-
-		if (result)
-		    return result;
-
-		elems.push_back(Type::FloatTy);
-		elems.push_back(Type::FloatTy);
-
-		result = StructType::get(elems);
-
-		g_assert(result != NULL);
-		return result;
-	    }
-	    else if (sizeof(gpointer) == 8)
-		return Type::DoubleTy;
-	    else
-		g_assert_not_reached();
-	case TYPE_IMAGE :
-	    return PointerType::getUnqual(module->getTypeByName(string("struct._image_t")));
-	case TYPE_TUPLE :
-	    return PointerType::getUnqual(Type::FloatTy);
-	case TYPE_TREE_VECTOR :
-	    return PointerType::getUnqual(module->getTypeByName(string("struct.tree_vector_t")));
-	case TYPE_COLOR :
-	    return Type::Int32Ty;
-	case TYPE_CURVE :
-	    return PointerType::getUnqual(module->getTypeByName(string("struct.curve_t")));
-	case TYPE_GRADIENT :
-	    return PointerType::getUnqual(module->getTypeByName(string("struct.gradient_t")));
-	default :
-	    g_assert_not_reached();
-    }
-}
-
-void
-code_emitter::alloc_complex_copy_var ()
-{
-    complex_copy_var = builder->CreateAlloca(llvm_type_for_type(module, TYPE_COMPLEX));
-}
-
 Value*
 code_emitter::emit_rhs (rhs_t *rhs)
 {
@@ -700,47 +731,40 @@ code_emitter::emit_rhs (rhs_t *rhs)
 	    {
 		operation_t *op = rhs->v.op.op;
 		type_t promotion_type = TYPE_NIL;
-		char *function_name = compiler_function_name_for_op_rhs(rhs, &promotion_type);
+		const char *function_name = compiler_function_name_for_op_rhs(rhs, &promotion_type);
 
 		if (promotion_type == TYPE_NIL)
 		    assert(op->type_prop == TYPE_PROP_CONST);
 		if (op->type_prop != TYPE_PROP_CONST)
 		    assert(promotion_type != TYPE_NIL);
 
-		Function *func = module->getFunction(string(function_name));
-		g_assert(func);
 		vector<Value*> args;
-		args.push_back(invocation_arg);
-		args.push_back(closure_arg);
-		args.push_back(pools_arg);
+		if (op->index == OP_RAND)
+		{
+		    /* RAND is impure, so it only occurs in the filter
+		       functions, which set up the generator state. */
+		    assert(rand_state_var != NULL);
+		    args.push_back(rand_state_var);
+		    function_name = "rand_with_state";
+		}
+		else
+		{
+		    args.push_back(invocation_arg);
+		    args.push_back(closure_arg);
+		    args.push_back(pools_arg);
+		}
 		for (int i = 0; i < rhs->v.op.op->num_args; ++i) {
 		    type_t type = promotion_type == TYPE_NIL ? op->arg_types[i] : promotion_type;
 		    Value *val = emit_primary(&rhs->v.op.args[i], type == TYPE_FLOAT);
 		    val = promote(val, type);
 
-#ifndef __MINGW32__
-		    if (sizeof(gpointer) == 4 && val->getType() == llvm_type_for_type(module, TYPE_COMPLEX))
-		    {
-			Value *copy = builder->CreateAlloca(llvm_type_for_type(module, TYPE_COMPLEX));
-			builder->CreateStore(val, copy);
-			val = copy;
-		    }
-#endif
-
 #ifdef DEBUG_OUTPUT
-		    val->dump();
+		    val->print(errs());
+		    errs() << "\n";
 #endif
 		    args.push_back(val);
 		}
-#ifdef DEBUG_OUTPUT
-		func->dump();
-#endif
-		Value *result = builder->CreateCall(func, args.begin(), args.end());
-		/* FIXME: this is ugly - we should check for the type
-		   of the operation or resulting value */
-		if (is_complex_return_type(result->getType()))
-		    result = convert_complex_return_value(result);
-		return result;
+		return emit_call(function_name, args);
 	    }
 
 	case RHS_FILTER :
@@ -757,7 +781,7 @@ code_emitter::emit_rhs (rhs_t *rhs)
 		args.push_back(emit_primary(&rhs->v.filter.args[num_args - 1]));
 		args.push_back(pools_arg);
 
-		return builder->CreateCall(func, args.begin(), args.end());
+		return emit_call(func, args);
 	    }
 
 	case RHS_CLOSURE :
@@ -766,25 +790,18 @@ code_emitter::emit_rhs (rhs_t *rhs)
 	case RHS_TUPLE :
 	case RHS_TREE_VECTOR :
 	    {
-		Function *set_func = module->getFunction(string("tuple_set"));
-		Value *tuple = builder->CreateCall2(module->getFunction(string("alloc_tuple")),
-						    pools_arg,
-						    make_int_const(rhs->v.tuple.length));
+		Value *tuple = emit_call("alloc_tuple", { pools_arg, make_int_const(rhs->v.tuple.length) });
 		int i;
 
 		for (i = 0; i < rhs->v.tuple.length; ++i)
 		{
 		    Value *val = emit_primary(&rhs->v.tuple.args[i], true);
-		    builder->CreateCall3(set_func, tuple, make_int_const(i), val);
+		    emit_call("tuple_set", { tuple, make_int_const(i), val });
 		}
 
 		if (rhs->kind == RHS_TREE_VECTOR)
-		{
-		    return builder->CreateCall3(module->getFunction(string("alloc_tree_vector")),
-						pools_arg,
-						make_int_const(rhs->v.tuple.length),
-						tuple);
-		}
+		    return emit_call("alloc_tree_vector",
+				     { pools_arg, make_int_const(rhs->v.tuple.length), tuple });
 		else
 		    return tuple;
 	    }
@@ -853,7 +870,7 @@ code_emitter::emit_phis (statement_t *stmt, BasicBlock *left_bb, BasicBlock *rig
 		    Value *left = NULL;
 		    Value *right = NULL;
 		    int compvar_type = stmt->v.assign.lhs->compvar->type;
-		    const Type *type = llvm_type_for_type(module, compvar_type);
+		    Type *type = llvm_type_for_type(module, compvar_type);
 
 #ifdef DEBUG_OUTPUT
 		    compiler_print_assign_statement(stmt);
@@ -866,7 +883,8 @@ code_emitter::emit_phis (statement_t *stmt, BasicBlock *left_bb, BasicBlock *rig
 			g_assert(left != NULL);
 #ifdef DEBUG_OUTPUT
 			printf("left:\n");
-			left->dump();
+			left->print(errs());
+			errs() << "\n";
 #endif
 		    }
 		    if (right_bb)
@@ -875,7 +893,8 @@ code_emitter::emit_phis (statement_t *stmt, BasicBlock *left_bb, BasicBlock *rig
 			g_assert(right != NULL);
 #ifdef DEBUG_OUTPUT
 			printf("right:\n");
-			right->dump();
+			right->print(errs());
+			errs() << "\n";
 #endif
 		    }
 
@@ -883,8 +902,8 @@ code_emitter::emit_phis (statement_t *stmt, BasicBlock *left_bb, BasicBlock *rig
 
 		    if (left_bb)
 		    {
-			phi = builder->CreatePHI(type);
-			phi->addIncoming(promote(left, compvar_type), left_bb);
+			phi = builder->CreatePHI(type, 2);
+			phi->addIncoming(left, left_bb);
 			set_value(stmt->v.assign.lhs, phi, false);
 			phi_map[stmt->v.assign.lhs] = phi;
 		    }
@@ -896,11 +915,12 @@ code_emitter::emit_phis (statement_t *stmt, BasicBlock *left_bb, BasicBlock *rig
 
 #ifdef DEBUG_OUTPUT
 		    printf("phi:\n");
-		    phi->dump();
+		    phi->print(errs());
+		    errs() << "\n";
 #endif
 
 		    if (right_bb)
-			phi->addIncoming(promote(right, compvar_type), right_bb);
+			phi->addIncoming(right, right_bb);
 		}
 		break;
 
@@ -912,6 +932,17 @@ code_emitter::emit_phis (statement_t *stmt, BasicBlock *left_bb, BasicBlock *rig
     commit_set_const_values();
 }
 
+Value*
+code_emitter::emit_condition (Value *number)
+{
+    if (number->getType()->isIntegerTy(32))
+	return builder->CreateICmpNE(number, make_int_const(0));
+    else if (number->getType()->isFloatTy())
+	return builder->CreateFCmpONE(number, make_float_const(0.0));
+    else
+	g_assert_not_reached();
+}
+
 void
 code_emitter::emit_stmts (statement_t *stmt, unsigned int slice_flag)
 {
@@ -940,20 +971,12 @@ code_emitter::emit_stmts (statement_t *stmt, unsigned int slice_flag)
 
 	    case STMT_IF_COND :
 		{
-		    Value *condition_number = emit_rhs(stmt->v.if_cond.condition);
-		    Value *condition;
+		    Value *condition = emit_condition(emit_rhs(stmt->v.if_cond.condition));
 		    map<rhs_t*, Value*> rhs_map;
 
-		    if (condition_number->getType() == Type::Int32Ty)
-			condition = builder->CreateICmpNE(condition_number, make_int_const(0));
-		    else if (condition_number->getType() == Type::FloatTy)
-			condition = builder->CreateFCmpONE(condition_number, make_float_const(0.0));
-		    else
-			g_assert_not_reached();
-
-		    BasicBlock *then_bb = BasicBlock::Create("then", current_function);
-		    BasicBlock *else_bb = BasicBlock::Create("else");
-		    BasicBlock *merge_bb = BasicBlock::Create("ifcont");
+		    BasicBlock *then_bb = BasicBlock::Create(context, "then", current_function);
+		    BasicBlock *else_bb = BasicBlock::Create(context, "else");
+		    BasicBlock *merge_bb = BasicBlock::Create(context, "ifcont");
 
 		    builder->CreateCondBr(condition, then_bb, else_bb);
 
@@ -963,14 +986,14 @@ code_emitter::emit_stmts (statement_t *stmt, unsigned int slice_flag)
 		    builder->CreateBr(merge_bb);
 		    then_bb = builder->GetInsertBlock();
 
-		    current_function->getBasicBlockList().push_back(else_bb);
+		    else_bb->insertInto(current_function);
 		    builder->SetInsertPoint(else_bb);
 		    emit_stmts(stmt->v.if_cond.alternative, slice_flag);
 		    emit_phi_rhss(stmt->v.if_cond.exit, false, &rhs_map, slice_flag);
 		    builder->CreateBr(merge_bb);
 		    else_bb = builder->GetInsertBlock();
 
-		    current_function->getBasicBlockList().push_back(merge_bb);
+		    merge_bb->insertInto(current_function);
 		    builder->SetInsertPoint(merge_bb);
 
 		    emit_phis(stmt->v.if_cond.exit, then_bb, else_bb, rhs_map, slice_flag);
@@ -980,12 +1003,13 @@ code_emitter::emit_stmts (statement_t *stmt, unsigned int slice_flag)
 	    case STMT_WHILE_LOOP:
 		{
 		    BasicBlock *start_bb = builder->GetInsertBlock();
-		    BasicBlock *entry_bb = BasicBlock::Create("entry", current_function);
-		    BasicBlock *body_bb = BasicBlock::Create("body");
-		    BasicBlock *exit_bb = BasicBlock::Create("exit");
+		    BasicBlock *entry_bb = BasicBlock::Create(context, "entry", current_function);
+		    BasicBlock *body_bb = BasicBlock::Create(context, "body");
+		    BasicBlock *exit_bb = BasicBlock::Create(context, "exit");
 		    map<rhs_t*, Value*> rhs_map;
 
 		    emit_phi_rhss(stmt->v.while_loop.entry, true, &rhs_map, slice_flag);
+		    start_bb = builder->GetInsertBlock();
 
 		    builder->CreateBr(entry_bb);
 
@@ -993,27 +1017,19 @@ code_emitter::emit_stmts (statement_t *stmt, unsigned int slice_flag)
 
 		    emit_phis(stmt->v.while_loop.entry, start_bb, NULL, rhs_map, slice_flag);
 
-		    Value *invariant_number = emit_rhs(stmt->v.while_loop.invariant);
-		    Value *invariant;
-
-		    if (invariant_number->getType() == Type::Int32Ty)
-			invariant = builder->CreateICmpNE(invariant_number, make_int_const(0));
-		    else if (invariant_number->getType() == Type::FloatTy)
-			invariant = builder->CreateFCmpONE(invariant_number, make_float_const(0.0));
-		    else
-			g_assert_not_reached();
+		    Value *invariant = emit_condition(emit_rhs(stmt->v.while_loop.invariant));
 
 		    builder->CreateCondBr(invariant, body_bb, exit_bb);
 
-		    current_function->getBasicBlockList().push_back(body_bb);
+		    body_bb->insertInto(current_function);
 		    builder->SetInsertPoint(body_bb);
 		    emit_stmts(stmt->v.while_loop.body, slice_flag);
-		    body_bb = builder->GetInsertBlock();
 		    emit_phi_rhss(stmt->v.while_loop.entry, false, &rhs_map, slice_flag);
+		    body_bb = builder->GetInsertBlock();
 		    emit_phis(stmt->v.while_loop.entry, NULL, body_bb, rhs_map, slice_flag);
 		    builder->CreateBr(entry_bb);
 
-		    current_function->getBasicBlockList().push_back(exit_bb);
+		    exit_bb->insertInto(current_function);
 		    builder->SetInsertPoint(exit_bb);
 		}
 		break;
@@ -1027,7 +1043,7 @@ code_emitter::emit_stmts (statement_t *stmt, unsigned int slice_flag)
 
 void
 code_emitter::build_const_value_info (value_t *value, statement_t *stmt, int const_type,
-				      vector<const Type*> *struct_elems)
+				      vector<Type*> *struct_elems)
 {
     if ((value->const_type | CONST_T) == (const_type | CONST_T)
 	&& compiler_is_permanent_const_value(value))
@@ -1049,7 +1065,7 @@ code_emitter::_build_const_value_info (value_t *value, statement_t *stmt, void *
 {
     CLOSURE_VAR(code_emitter*, emitter, 0);
     CLOSURE_VAR(int, const_type, 1);
-    CLOSURE_VAR(vector<const Type*>*, struct_elems, 2);
+    CLOSURE_VAR(vector<Type*>*, struct_elems, 2);
 
     emitter->build_const_value_info(value, stmt, const_type, struct_elems);
 }
@@ -1073,21 +1089,21 @@ void
 code_emitter::set_internals_from_invocation (Value *invocation_arg)
 {
     set_internal(::lookup_internal(filter->v.mathmap.internals, "__canvasPixelW", true),
-		 builder->CreateCall(module->getFunction(string("get_invocation_img_width")), invocation_arg));
+		 emit_call("get_invocation_img_width", { invocation_arg }));
     set_internal(::lookup_internal(filter->v.mathmap.internals, "__canvasPixelH", true),
-		 builder->CreateCall(module->getFunction(string("get_invocation_img_height")), invocation_arg));
+		 emit_call("get_invocation_img_height", { invocation_arg }));
     set_internal(::lookup_internal(filter->v.mathmap.internals, "__renderPixelW", true),
-		 builder->CreateCall(module->getFunction(string("get_invocation_render_width")), invocation_arg));
+		 emit_call("get_invocation_render_width", { invocation_arg }));
     set_internal(::lookup_internal(filter->v.mathmap.internals, "__renderPixelH", true),
-		 builder->CreateCall(module->getFunction(string("get_invocation_render_height")), invocation_arg));
+		 emit_call("get_invocation_render_height", { invocation_arg }));
     set_internal(::lookup_internal(filter->v.mathmap.internals, "R", true),
-		 builder->CreateCall(module->getFunction(string("get_invocation_image_R")), invocation_arg));
+		 emit_call("get_invocation_image_R", { invocation_arg }));
 }
 
 void
 code_emitter::set_xy_vars_from_frame ()
 {
-    Value *xy_vars_untyped = builder->CreateCall(module->getFunction(string("get_frame_xy_vars")), frame_arg);
+    Value *xy_vars_untyped = emit_call("get_frame_xy_vars", { frame_arg });
     xy_vars_var = builder->CreateBitCast(xy_vars_untyped, PointerType::getUnqual(xy_vars_type));
 }
 
@@ -1095,8 +1111,8 @@ void
 code_emitter::setup_xy_vars_from_closure ()
 {
     Value *t_var = lookup_internal(::lookup_internal(filter->v.mathmap.internals, "t", true));
-    Value *xy_vars_untyped = builder->CreateCall4(module->getFunction(string("calc_closure_xy_vars")),
-						  invocation_arg, closure_arg, t_var, init_frame_function);
+    Value *xy_vars_untyped = emit_call("calc_closure_xy_vars",
+				       { invocation_arg, closure_arg, t_var, init_frame_function });
     xy_vars_var = builder->CreateBitCast(xy_vars_untyped, PointerType::getUnqual(xy_vars_type));
 }
 
@@ -1111,30 +1127,32 @@ code_emitter::setup_filter_function (bool is_main_filter_function)
 
     if (is_main_filter_function)
     {
-	slice_arg = args++;
+	slice_arg = &*args++;
 	slice_arg->setName("slice");
     }
     else
     {
-	invocation_arg = args++;
+	invocation_arg = &*args++;
 	invocation_arg->setName("invocation");
     }
-    closure_arg = args++;
+    closure_arg = &*args++;
     closure_arg->setName("closure");
     if (is_main_filter_function)
     {
-	x_vars_var = args++;
+	x_vars_var = &*args++;
 	x_vars_var->setName("x_vars");
-	y_vars_var = args++;
+	y_vars_var = &*args++;
 	y_vars_var->setName("y_vars");
     }
-    set_internal(::lookup_internal(filter->v.mathmap.internals, "x", true), args++);
-    set_internal(::lookup_internal(filter->v.mathmap.internals, "y", true), args++);
-    set_internal(::lookup_internal(filter->v.mathmap.internals, "t", true), args++);
-    pools_arg = args++;
+    set_internal(::lookup_internal(filter->v.mathmap.internals, "x", true), &*args++);
+    set_internal(::lookup_internal(filter->v.mathmap.internals, "y", true), &*args++);
+    set_internal(::lookup_internal(filter->v.mathmap.internals, "t", true), &*args++);
+    pools_arg = &*args++;
     pools_arg->setName("pools");
 
-    BasicBlock *block = BasicBlock::Create("entry", filter_function);
+    current_function = filter_function;
+
+    BasicBlock *block = BasicBlock::Create(context, "entry", filter_function);
 
     builder = new IRBuilder<> (block);
 
@@ -1142,29 +1160,33 @@ code_emitter::setup_filter_function (bool is_main_filter_function)
     {
 	x_vars_var = builder->CreateBitCast(x_vars_var, PointerType::getUnqual(x_vars_type));
 	y_vars_var = builder->CreateBitCast(y_vars_var, PointerType::getUnqual(y_vars_type));
-	frame_arg = builder->CreateCall(module->getFunction(string("get_slice_frame")), slice_arg);
-	invocation_arg = builder->CreateCall(module->getFunction(string("get_frame_invocation")), frame_arg);
+	frame_arg = emit_call("get_slice_frame", { slice_arg });
+	invocation_arg = emit_call("get_frame_invocation", { frame_arg });
     }
 
     set_internals_from_invocation(invocation_arg);
 
+    /* Big and aligned enough for a mathmap_rand_state_t.  If the
+       filter doesn't use RAND the state is optimized away. */
+    rand_state_var = create_entry_alloca(ArrayType::get(Type::getInt64Ty(context), 2));
+    emit_call("init_rand_state", { invocation_arg, rand_state_var,
+				   lookup_internal(::lookup_internal(filter->v.mathmap.internals, "x", true)),
+				   lookup_internal(::lookup_internal(filter->v.mathmap.internals, "y", true)),
+				   lookup_internal(::lookup_internal(filter->v.mathmap.internals, "t", true)) });
+
     if (is_main_filter_function)
 	set_xy_vars_from_frame ();
     else
 	setup_xy_vars_from_closure ();
-
-    alloc_complex_copy_var();
-
-    current_function = filter_function;
 }
 
 Value*
 code_emitter::emit_sizeof (Type *type)
 {
-    Value *size = builder->CreateGEP(ConstantPointerNull::get(PointerType::getUnqual(type)),
+    Value *size = builder->CreateGEP(type, ConstantPointerNull::get(PointerType::getUnqual(type)),
 				     make_int_const(1));
 
-    return builder->CreatePtrToInt(size, sizeof(gpointer) == 4 ? Type::Int32Ty : Type::Int64Ty);
+    return builder->CreatePtrToInt(size, sizeof(gpointer) == 4 ? Type::getInt32Ty(context) : Type::getInt64Ty(context));
 }
 
 void
@@ -1173,35 +1195,32 @@ code_emitter::setup_init_frame_function ()
     Value *t_arg;
     Function::arg_iterator args = init_frame_function->arg_begin();
 
-    invocation_arg = args++;
+    invocation_arg = &*args++;
     invocation_arg->setName("invocation");
-    //frame_arg = args++;
+    //frame_arg = &*args++;
     //frame_arg->setName("frame");
-    closure_arg = args++;
+    closure_arg = &*args++;
     closure_arg->setName("closure");
-    t_arg = args++;
+    t_arg = &*args++;
     t_arg->setName("t");
-    pools_arg = args++;
+    pools_arg = &*args++;
     pools_arg->setName("pools");
 
-    BasicBlock *block = BasicBlock::Create("entry", init_frame_function);
+    current_function = init_frame_function;
+
+    BasicBlock *block = BasicBlock::Create(context, "entry", init_frame_function);
 
     builder = new IRBuilder<> (block);
 
-    //invocation_arg = builder->CreateCall(module->getFunction(string("get_frame_invocation")), frame_arg);
-    //pools_arg = builder->CreateCall(module->getFunction(string("get_frame_pools")), frame_arg);
+    //invocation_arg = emit_call("get_frame_invocation", { frame_arg });
+    //pools_arg = emit_call("get_frame_pools", { frame_arg });
 
     set_internal(::lookup_internal(filter->v.mathmap.internals, "t", true), t_arg);
 
     set_internals_from_invocation(invocation_arg);
 
-    ret_var = builder->CreateCall2(module->getFunction(string("_mathmap_pools_alloc")),
-				   pools_arg, emit_sizeof(xy_vars_type));
+    ret_var = emit_call("_mathmap_pools_alloc", { pools_arg, emit_sizeof(xy_vars_type) });
     xy_vars_var = builder->CreateBitCast(ret_var, PointerType::getUnqual(xy_vars_type));
-
-    alloc_complex_copy_var();
-
-    current_function = init_frame_function;
 }
 
 Value*
@@ -1213,32 +1232,29 @@ code_emitter::setup_init_x_or_y_function (string function_name, const char *inte
 
     Function::arg_iterator args = current_function->arg_begin();
 
-    slice_arg = args++;
+    slice_arg = &*args++;
     slice_arg->setName("slice");
-    closure_arg = args++;
+    closure_arg = &*args++;
     closure_arg->setName("closure");
-    set_internal(::lookup_internal(filter->v.mathmap.internals, internal_name, true), args++);
-    set_internal(::lookup_internal(filter->v.mathmap.internals, "t", true), args++);
+    set_internal(::lookup_internal(filter->v.mathmap.internals, internal_name, true), &*args++);
+    set_internal(::lookup_internal(filter->v.mathmap.internals, "t", true), &*args++);
 
-    BasicBlock *block = BasicBlock::Create("entry", current_function);
+    BasicBlock *block = BasicBlock::Create(context, "entry", current_function);
 
     builder = new IRBuilder<> (block);
 
-    frame_arg = builder->CreateCall(module->getFunction(string("get_slice_frame")), slice_arg);
-    invocation_arg = builder->CreateCall(module->getFunction(string("get_frame_invocation")), frame_arg);
-    pools_arg = builder->CreateCall(module->getFunction("get_slice_pools"), slice_arg);
+    frame_arg = emit_call("get_slice_frame", { slice_arg });
+    invocation_arg = emit_call("get_frame_invocation", { frame_arg });
+    pools_arg = emit_call("get_slice_pools", { slice_arg });
 
     set_internals_from_invocation(invocation_arg);
 
     set_xy_vars_from_frame();
 
-    ret_var = builder->CreateCall2(module->getFunction(string("_mathmap_pools_alloc")),
-				   pools_arg, emit_sizeof(vars_type));
+    ret_var = emit_call("_mathmap_pools_alloc", { pools_arg, emit_sizeof(vars_type) });
 
     Value *vars_var = builder->CreateBitCast(ret_var, PointerType::getUnqual(vars_type));
 
-    alloc_complex_copy_var();
-
     return vars_var;
 }
 
@@ -1251,14 +1267,13 @@ code_emitter::finish_function ()
     closure_arg = NULL;
     frame_arg = NULL;
     pools_arg = NULL;
+    rand_state_var = NULL;
 
     x_vars_var = NULL;
     y_vars_var = NULL;
     xy_vars_var = NULL;
     ret_var = NULL;
 
-    complex_copy_var = NULL;
-
     value_map.clear();
     internal_map.clear();
     phi_map.clear();
@@ -1273,14 +1288,14 @@ code_emitter::finish_function ()
 StructType*
 code_emitter::build_const_value_infos (int const_type)
 {
-    vector<const Type*> struct_elems;
+    vector<Type*> struct_elems;
 
     compiler_reset_have_defined(filter_code->first_stmt);
     next_const_value_index = 0;
     COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(filter_code->first_stmt, &_build_const_value_info,
-					  CLOSURE_ARG(this), CLOSURE_ARG((void*)const_type), CLOSURE_ARG(&struct_elems));
+					  CLOSURE_ARG(this), CLOSURE_ARG(const_type), CLOSURE_ARG(&struct_elems));
 
-    return StructType::get(struct_elems);
+    return StructType::get(context, struct_elems);
 }
 
 void
@@ -1360,139 +1375,277 @@ code_emitter::emit_main_filter_funcs ()
     finish_function();
 }
 
+static Function*
+make_function (Module *module, string name, Type *ret_type, vector<Type*> arg_types)
+{
+    FunctionType *type = FunctionType::get(ret_type, arg_types, false);
+
+    return Function::Create(type, Function::ExternalLinkage, name, module);
+}
+
 static Function*
 make_filter_function (Module *module, filter_t *filter)
 {
-    Constant *function_const = module->getOrInsertFunction(filter_function_name(filter),
-							   llvm_type_for_type(module, TYPE_TUPLE), // ret type
-							   get_invocation_ptr_type(module), // invocation
-							   llvm_type_for_type(module, TYPE_IMAGE), // closure
-							   Type::FloatTy, // x
-							   Type::FloatTy, // y
-							   Type::FloatTy, // t
-							   get_pools_ptr_type(module), // pools
-							   NULL);
-    return cast<Function>(function_const);
+    Type *float_type = Type::getFloatTy(module->getContext());
+
+    return make_function(module, filter_function_name(filter),
+			 llvm_type_for_type(module, TYPE_TUPLE), // ret type
+			 { get_invocation_ptr_type(module), // invocation
+			   llvm_type_for_type(module, TYPE_IMAGE), // closure
+			   float_type, // x
+			   float_type, // y
+			   float_type, // t
+			   get_pools_ptr_type(module) }); // pools
 }
 
 static Function*
 make_init_frame_function (Module *module, filter_t *filter)
 {
-    Constant *function_const = module->getOrInsertFunction(init_frame_function_name(filter),
-							   get_void_ptr_type(), // ret type
-							   get_invocation_ptr_type(module), // invocation
-							   llvm_type_for_type(module, TYPE_IMAGE), // closure
-							   Type::FloatTy, // t
-							   get_pools_ptr_type(module), // pools
-							   NULL);
-    return cast<Function>(function_const);
+    Type *float_type = Type::getFloatTy(module->getContext());
+
+    return make_function(module, init_frame_function_name(filter),
+			 get_void_ptr_type(module), // ret type
+			 { get_invocation_ptr_type(module), // invocation
+			   llvm_type_for_type(module, TYPE_IMAGE), // closure
+			   float_type, // t
+			   get_pools_ptr_type(module) }); // pools
 }
 
 static Function*
 make_init_x_or_y_function (Module *module, filter_t *filter, string function_name)
 {
-    Constant *function_const = module->getOrInsertFunction(function_name,
-							   get_void_ptr_type(),	// ret type
-							   get_slice_ptr_type(module), // slice
-							   llvm_type_for_type(module, TYPE_IMAGE), // closure
-							   Type::FloatTy, // x/y
-							   Type::FloatTy, // t
-							   NULL);
-    return cast<Function>(function_const);
+    Type *float_type = Type::getFloatTy(module->getContext());
+
+    return make_function(module, function_name,
+			 get_void_ptr_type(module), // ret type
+			 { get_slice_ptr_type(module), // slice
+			   llvm_type_for_type(module, TYPE_IMAGE), // closure
+			   float_type, // x/y
+			   float_type }); // t
 }
 
 static Function*
 make_main_filter_function (Module *module, filter_t *filter)
 {
-    Constant *function_const = module->getOrInsertFunction(main_filter_function_name(filter),
-							   llvm_type_for_type(module, TYPE_TUPLE), // ret type
-							   get_slice_ptr_type(module), // invocation
-							   llvm_type_for_type(module, TYPE_IMAGE), // closure
-							   get_void_ptr_type(), // x_vars
-							   get_void_ptr_type(), // y_vars
-							   Type::FloatTy, // x
-							   Type::FloatTy, // y
-							   Type::FloatTy, // t
-							   get_pools_ptr_type(module), // pools
-							   NULL);
-    return cast<Function>(function_const);
+    Type *float_type = Type::getFloatTy(module->getContext());
+
+    return make_function(module, main_filter_function_name(filter),
+			 llvm_type_for_type(module, TYPE_TUPLE), // ret type
+			 { get_slice_ptr_type(module), // slice
+			   llvm_type_for_type(module, TYPE_IMAGE), // closure
+			   get_void_ptr_type(module), // x_vars
+			   get_void_ptr_type(module), // y_vars
+			   float_type, // x
+			   float_type, // y
+			   float_type, // t
+			   get_pools_ptr_type(module) }); // pools
 }
 
 void* lazy_creator (const std::string &name);
 
+/* Resolves the functions the template only declares, like the
+   builtins, to the ones linked into MathMap.  Those from shared
+   libraries are found by a DynamicLibrarySearchGenerator before we
+   are asked. */
+class lazy_creator_generator : public orc::DefinitionGenerator
+{
+public:
+    lazy_creator_generator (char _global_prefix) { global_prefix = _global_prefix; }
+
+    Error tryToGenerate (orc::LookupState &state, orc::LookupKind kind, orc::JITDylib &dylib,
+			 orc::JITDylibLookupFlags flags, const orc::SymbolLookupSet &symbols) override
+    {
+	orc::SymbolMap new_symbols;
+
+	for (const pair<orc::SymbolStringPtr, orc::SymbolLookupFlags> &symbol : symbols)
+	{
+	    string name = (*symbol.first).str();
+
+	    if (global_prefix != '\0' && !name.empty() && name[0] == global_prefix)
+		name = name.substr(1);
+
+	    void *address = lazy_creator(name);
+
+	    if (address != NULL)
+		new_symbols[symbol.first] = JITEvaluatedSymbol(pointerToJITTargetAddress(address),
+							       JITSymbolFlags::Exported);
+	}
+
+	if (new_symbols.empty())
+	    return Error::success();
+	return dylib.define(orc::absoluteSymbols(std::move(new_symbols)));
+    }
+
+private:
+    char global_prefix;
+};
+
 typedef struct
 {
-    ExecutionEngine *ee;
+    orc::LLJIT *jit;
     mathfuncs_t mathfuncs;
 } module_info_t;
 
-extern "C"
-void
-gen_and_load_llvm_code (mathmap_t *mathmap, char *template_filename, filter_code_t **filter_codes)
+static void
+set_error_string (string message)
+{
+    g_strlcpy(error_string, message.c_str(), ERROR_STRING_LENGTH);
+}
+
+static void
+set_error_string_from_error (string message, Error error)
 {
-    MemoryBuffer *buffer = MemoryBuffer::getFile(template_filename, NULL);
+    set_error_string(message + string(": ") + toString(std::move(error)));
+}
 
-    g_assert(buffer != NULL);
+static orc::LLJIT*
+make_jit (void)
+{
+    static bool initialized_native_target = false;
 
-    Module *module = ParseBitcodeFile (buffer, NULL);
-    int i;
-    filter_t *filter;
+    if (!initialized_native_target)
+    {
+	InitializeNativeTarget();
+	InitializeNativeTargetAsmPrinter();
+	initialized_native_target = true;
+    }
 
-    assert(module != NULL);
-    delete buffer;
+    Expected<unique_ptr<orc::LLJIT> > jit = orc::LLJITBuilder().create();
 
-    for (i = 0, filter = mathmap->filters;
-	 filter != 0;
-	 ++i, filter = filter->next)
+    if (!jit)
     {
-	if (filter->kind != FILTER_MATHMAP)
-	    continue;
+	set_error_string_from_error("Cannot create the JIT", jit.takeError());
+	return NULL;
+    }
 
-	make_init_frame_function(module, filter);
-	make_init_x_or_y_function(module, filter, init_x_function_name(filter));
-	make_init_x_or_y_function(module, filter, init_y_function_name(filter));
-	make_main_filter_function(module, filter);
-	make_filter_function(module, filter);
+    orc::JITDylib &dylib = (*jit)->getMainJITDylib();
+    char global_prefix = (*jit)->getDataLayout().getGlobalPrefix();
+    Expected<unique_ptr<orc::DynamicLibrarySearchGenerator> > process_symbols
+	= orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(global_prefix);
+
+    if (!process_symbols)
+    {
+	set_error_string_from_error("Cannot look up symbols in MathMap", process_symbols.takeError());
+	return NULL;
     }
 
-    for (i = 0, filter = mathmap->filters;
-	 filter != 0;
-	 ++i, filter = filter->next)
+    dylib.addGenerator(std::move(*process_symbols));
+    dylib.addGenerator(unique_ptr<orc::DefinitionGenerator>(new lazy_creator_generator(global_prefix)));
+
+    return jit->release();
+}
+
+static void*
+lookup_jitted_function (orc::LLJIT *jit, string name)
+{
+    Expected<JITEvaluatedSymbol> symbol = jit->lookup(name);
+
+    if (!symbol)
     {
-	filter_code_t *code = filter_codes[i];
-	code_emitter *emitter;
+	set_error_string_from_error(string("Cannot compile `") + name + string("'"), symbol.takeError());
+	return NULL;
+    }
 
-	if (filter->kind != FILTER_MATHMAP)
-	    continue;
+    return jitTargetAddressToPointer<void*>(symbol->getAddress());
+}
 
-	g_assert(code->filter == filter);
+/* The code is compiled in memory by LLVM's ORC JIT, so no compiler
+   process is started.  The template is bitcode made by clang.  Its
+   functions are internalized so that after inlining only the ones
+   the filter still calls are compiled. */
+extern "C"
+void
+gen_and_load_llvm_code (mathmap_t *mathmap, char *template_filename, filter_code_t **filter_codes)
+{
+    ErrorOr<unique_ptr<MemoryBuffer> > buffer = MemoryBuffer::getFile(template_filename);
 
-	emitter = new code_emitter (module, filter, code);
-	try
+    if (!buffer)
+    {
+	set_error_string(string("Cannot read `") + string(template_filename) + string("': ")
+			 + buffer.getError().message());
+	return;
+    }
+
+    unique_ptr<LLVMContext> context(new LLVMContext());
+    Expected<unique_ptr<Module> > parsed_module = parseBitcodeFile((*buffer)->getMemBufferRef(), *context);
+
+    if (!parsed_module)
+    {
+	set_error_string_from_error(string("Cannot load `") + string(template_filename) + string("'"),
+				    parsed_module.takeError());
+	return;
+    }
+
+    unique_ptr<Module> module = std::move(*parsed_module);
+    orc::LLJIT *jit = make_jit();
+    int i;
+    filter_t *filter;
+
+    if (jit == NULL)
+	return;
+
+    module->setDataLayout(jit->getDataLayout());
+    module->setTargetTriple(jit->getTargetTriple().str());
+
+    for (Module::iterator iter = module->begin(); iter != module->end(); ++iter)
+	if (!iter->isDeclaration())
+	    iter->setLinkage(GlobalValue::InternalLinkage);
+
+    try
+    {
+	for (i = 0, filter = mathmap->filters;
+	     filter != 0;
+	     ++i, filter = filter->next)
 	{
-	    emitter->emit_init_frame_function();
-	    emitter->emit_filter_function();
-	    emitter->emit_main_filter_funcs();
+	    if (filter->kind != FILTER_MATHMAP)
+		continue;
+
+	    make_init_frame_function(module.get(), filter);
+	    make_init_x_or_y_function(module.get(), filter, init_x_function_name(filter));
+	    make_init_x_or_y_function(module.get(), filter, init_y_function_name(filter));
+	    make_main_filter_function(module.get(), filter);
+	    make_filter_function(module.get(), filter);
 	}
-	catch (compiler_error error)
+
+	for (i = 0, filter = mathmap->filters;
+	     filter != 0;
+	     ++i, filter = filter->next)
 	{
-	    delete emitter;
-	    delete module;
+	    filter_code_t *code = filter_codes[i];
+
+	    if (filter->kind != FILTER_MATHMAP)
+		continue;
+
+	    g_assert(code->filter == filter);
+
+	    code_emitter emitter(module.get(), filter, code);
 
-	    strcpy(error_string, error.info.c_str());
-	    return;
+	    emitter.emit_init_frame_function();
+	    emitter.emit_filter_function();
+	    emitter.emit_main_filter_funcs();
 	}
-	delete emitter;
+    }
+    catch (compiler_error error)
+    {
+	delete jit;
+
+	set_error_string(error.info);
+	return;
+    }
+
+    if (verifyModule(*module, &errs()))
+    {
+	delete jit;
+
+	set_error_string("The LLVM backend generated invalid code.");
+	return;
     }
 
-    PassManager pm;
+    legacy::PassManager pm;
 
-    pm.add(new TargetData(module));
     pm.add(createFunctionInliningPass());
     pm.add(createInstructionCombiningPass());
     pm.add(createReassociatePass());
-    pm.add(createLowerSetJmpPass());
-    pm.add(createRaiseAllocationsPass());
     pm.add(createGVNPass());
     pm.add(createCFGSimplificationPass());
     pm.add(createPromoteMemoryToRegisterPass());
@@ -1502,25 +1655,34 @@ gen_and_load_llvm_code (mathmap_t *mathmap, char *template_filename, filter_code
     pm.run(*module);
 
 #ifdef DEBUG_OUTPUT
-    module->dump();
-
-    verifyModule(*module, PrintMessageAction);
+    module->print(errs(), NULL);
 #endif
 
-    ExecutionEngine *ee = ExecutionEngine::create (module);
+    Error error = jit->addIRModule(orc::ThreadSafeModule(std::move(module), std::move(context)));
 
-    ee->InstallLazyFunctionCreator(lazy_creator);
+    if (error)
+    {
+	set_error_string_from_error("Cannot add the code to the JIT", std::move(error));
+	delete jit;
+	return;
+    }
 
-    module_info_t *module_info = g_new0(module_info_t, 1);
+    void *init_frame_fptr = lookup_jitted_function(jit, init_frame_function_name(mathmap->main_filter));
+    void *main_filter_fptr = lookup_jitted_function(jit, main_filter_function_name(mathmap->main_filter));
+    void *init_x_fptr = lookup_jitted_function(jit, init_x_function_name(mathmap->main_filter));
+    void *init_y_fptr = lookup_jitted_function(jit, init_y_function_name(mathmap->main_filter));
 
-    module_info->ee = ee;
+    if (!init_frame_fptr || !main_filter_fptr || !init_x_fptr || !init_y_fptr)
+    {
+	delete jit;
+	return;
+    }
+
+    module_info_t *module_info = g_new0(module_info_t, 1);
 
-    void *init_frame_fptr = ee->getPointerToFunction(lookup_init_frame_function(module, mathmap->main_filter));
-    void *main_filter_fptr = ee->getPointerToFunction(lookup_main_filter_function(module, mathmap->main_filter));
-    void *init_x_fptr = ee->getPointerToFunction(lookup_init_x_function(module, mathmap->main_filter));
-    void *init_y_fptr = ee->getPointerToFunction(lookup_init_y_function(module, mathmap->main_filter));
-    g_assert(main_filter_fptr && init_x_fptr && init_y_fptr);
+    module_info->jit = jit;
 
+    module_info->mathfuncs.filter_name = mathmap->main_filter->name;
     module_info->mathfuncs.llvm_init_frame_func = (llvm_init_frame_func_t)init_frame_fptr;
     module_info->mathfuncs.main_filter_func = (llvm_filter_func_t)main_filter_fptr;
     module_info->mathfuncs.init_x_func = (init_x_or_y_func_t)init_x_fptr;
@@ -1539,6 +1701,6 @@ unload_llvm_code (mathmap_t *mathmap)
 
     mathmap->module_info = NULL;
 
-    delete info->ee;
+    delete info->jit;
     g_free(info);
 }
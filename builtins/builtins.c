@@ -36,95 +36,98 @@
 #include "overload.h"
 #include "mathmap.h"
 #include "opmacros.h"
+#include "thread_pool.h"
 
-static void
-apply_edge_behaviour (mathmap_invocation_t *invocation, int *_x, int *_y, int width, int height)
+/* Returns the coordinate c, which is outside of [0,size), mapped into
+   it according to the edge behaviour mode.  The rotate behaviour also
+   mirrors the other coordinate. */
+static inline int
+apply_edge_behaviour_to_coord (int mode, int c, int size, int *other, int other_size)
 {
-    int x = *_x, y = *_y;
-
-    switch (invocation->edge_behaviour_x)
+    switch (mode)
     {
 	case EDGE_BEHAVIOUR_WRAP :
-	    if (x < 0)
-		x = x % width + width;
-	    else if (x >= width)
-		x %= width;
-	    break;
-
-	case EDGE_BEHAVIOUR_REFLECT :
-	    if (x < 0)
-		x = -x % width;
-	    else if (x >= width)
-		x = (width - 1) - (x % width);
-	    break;
+	    c %= size;
+	    return c < 0 ? c + size : c;
 
 	case EDGE_BEHAVIOUR_ROTATE :
-	    if (x < 0)
-	    {
-		x = -x % width;
-		y = (height - 1) - y;
-	    }
-	    else if (x >= width)
-	    {
-		x = (width - 1) - (x % width);
-		y = (height - 1) - y;
-	    }
-	    break;
-
-	case EDGE_BEHAVIOUR_COLOR :
-	    break;
-
-	default :
-	    assert(0);
-    }
-
-    switch (invocation->edge_behaviour_y)
-    {
-	case EDGE_BEHAVIOUR_WRAP :
-	    if (y < 0)
-		y = y % height + height;
-	    else if (y >= height)
-		y %= height;
-	    break;
+	    *other = (other_size - 1) - *other;
+	    /* fall through */
 
 	case EDGE_BEHAVIOUR_REFLECT :
-	    if (y < 0)
-		y = -y % height;
-	    else if (y >= height)
-		y = (height - 1) - (y % height);
-	    break;
-
-	case EDGE_BEHAVIOUR_ROTATE :
-	    if (y < 0)
-	    {
-		x = (width - 1) - x;
-		y = -y % height;
-	    }
-	    else if (y >= height)
-	    {
-		x = (width - 1) - x;
-		y = (height - 1) - (y % height);
-	    }
-	    break;
+	    if (c < 0)
+		return -c % size;
+	    return (size - 1) - (c % size);
 
 	case EDGE_BEHAVIOUR_COLOR :
-	    break;
+	    return c;
 
 	default :
 	    assert(0);
+	    return c;
+    }
+}
+
+/* There's one edge behaviour function for each combination of x and y
+   modes, in which the modes are constants, so that the compiler can
+   get rid of the switches.  Coordinates inside the image only cost
+   a comparison each. */
+#define DEFINE_EDGE_BEHAVIOUR_FUNC(name,mode_x,mode_y) \
+    static void \
+    name (int *x, int *y, int width, int height) \
+    { \
+	if ((mode_x) != EDGE_BEHAVIOUR_COLOR && (unsigned int)*x >= (unsigned int)width) \
+	    *x = apply_edge_behaviour_to_coord((mode_x), *x, width, y, height); \
+	if ((mode_y) != EDGE_BEHAVIOUR_COLOR && (unsigned int)*y >= (unsigned int)height) \
+	    *y = apply_edge_behaviour_to_coord((mode_y), *y, height, x, width); \
     }
 
-    *_x = x;
-    *_y = y;
+#define DEFINE_EDGE_BEHAVIOUR_FUNCS(name,mode_x) \
+    DEFINE_EDGE_BEHAVIOUR_FUNC(name##_color, (mode_x), EDGE_BEHAVIOUR_COLOR) \
+    DEFINE_EDGE_BEHAVIOUR_FUNC(name##_wrap, (mode_x), EDGE_BEHAVIOUR_WRAP) \
+    DEFINE_EDGE_BEHAVIOUR_FUNC(name##_reflect, (mode_x), EDGE_BEHAVIOUR_REFLECT) \
+    DEFINE_EDGE_BEHAVIOUR_FUNC(name##_rotate, (mode_x), EDGE_BEHAVIOUR_ROTATE)
+
+DEFINE_EDGE_BEHAVIOUR_FUNCS(edge_behaviour_color, EDGE_BEHAVIOUR_COLOR)
+DEFINE_EDGE_BEHAVIOUR_FUNCS(edge_behaviour_wrap, EDGE_BEHAVIOUR_WRAP)
+DEFINE_EDGE_BEHAVIOUR_FUNCS(edge_behaviour_reflect, EDGE_BEHAVIOUR_REFLECT)
+DEFINE_EDGE_BEHAVIOUR_FUNCS(edge_behaviour_rotate, EDGE_BEHAVIOUR_ROTATE)
+
+#define EDGE_BEHAVIOUR_FUNCS(name)	{ name##_color, name##_wrap, name##_reflect, name##_rotate }
+
+/* Indexed by x mode and y mode, minus EDGE_BEHAVIOUR_COLOR. */
+static edge_behaviour_func_t edge_behaviour_funcs[4][4] = {
+    EDGE_BEHAVIOUR_FUNCS(edge_behaviour_color),
+    EDGE_BEHAVIOUR_FUNCS(edge_behaviour_wrap),
+    EDGE_BEHAVIOUR_FUNCS(edge_behaviour_reflect),
+    EDGE_BEHAVIOUR_FUNCS(edge_behaviour_rotate)
+};
+
+edge_behaviour_func_t
+get_edge_behaviour_func (int edge_behaviour_x, int edge_behaviour_y)
+{
+    g_assert(edge_behaviour_x >= EDGE_BEHAVIOUR_COLOR && edge_behaviour_x <= EDGE_BEHAVIOUR_ROTATE);
+    g_assert(edge_behaviour_y >= EDGE_BEHAVIOUR_COLOR && edge_behaviour_y <= EDGE_BEHAVIOUR_ROTATE);
+
+    return edge_behaviour_funcs[edge_behaviour_x - EDGE_BEHAVIOUR_COLOR][edge_behaviour_y - EDGE_BEHAVIOUR_COLOR];
 }
 
+#define PREFETCHED_PIXEL_IS_AVAILABLE(d,x,y,f)	((d)->prefetched != NULL \
+						 && ((d)->prefetched_frame < 0 || (d)->prefetched_frame == (f)) \
+						 && (x) >= -PREFETCH_BORDER && (x) < (d)->image.pixel_width + PREFETCH_BORDER \
+						 && (y) >= -PREFETCH_BORDER && (y) < (d)->image.pixel_height + PREFETCH_BORDER)
+#define PREFETCHED_PIXEL(d,x,y)			((d)->prefetched[(y) * (d)->prefetched_row_stride + (x)])
+
 static color_t
 get_pixel (mathmap_invocation_t *invocation, int x, int y, input_drawable_t *drawable, int frame)
 {
     if (drawable == NULL)
 	return MAKE_RGBA_COLOR(255, 255, 255, 255);
 
-    apply_edge_behaviour(invocation, &x, &y, drawable->image.pixel_width, drawable->image.pixel_height);
+    if (PREFETCHED_PIXEL_IS_AVAILABLE(drawable, x, y, frame))
+	return PREFETCHED_PIXEL(drawable, x, y);
+
+    invocation->edge_behaviour_func(&x, &y, drawable->image.pixel_width, drawable->image.pixel_height);
 
     return mathmap_get_pixel(invocation, drawable, frame, x, y);
 }
@@ -146,10 +149,11 @@ get_image_drawable (mathmap_invocation_t *invocation, image_t *image, float *x,
 }
 
 CALLBACK_SYMBOL
-color_t
-get_orig_val_pixel (mathmap_invocation_t *invocation, float x, float y, image_t *image, int frame)
+float*
+get_orig_val_pixel (mathmap_invocation_t *invocation, float x, float y, image_t *image, int frame, float *result)
 {
     input_drawable_t *drawable = get_image_drawable(invocation, image, &x, &y);
+    color_t color;
 
     if (!invocation->supersampling)
     {
@@ -157,123 +161,664 @@ get_orig_val_pixel (mathmap_invocation_t *invocation, float x, float y, image_t
 	y += 0.5;
     }
 
-    return get_pixel(invocation, floor(x), floor(y), drawable, frame);
+    color = get_pixel(invocation, floor(x), floor(y), drawable, frame);
+
+    return TUPLE_FROM_COLOR_INTO(color, result);
 }
 
-CALLBACK_SYMBOL
-color_t
-get_orig_val_intersample_pixel (mathmap_invocation_t *invocation, float x, float y, image_t *image, int frame)
+/* The interpolating sampling modes are separable kernels.  For the
+   position g, in pixels, the kernel weights the pixels first to
+   first + SAMPLING_TAPS(mode) - 1, where first is returned by
+   calc_sampling_weights().  Pixel centers are at integer
+   positions. */
+#define SAMPLING_MAX_TAPS		6
+#define SAMPLING_TAPS(mode)		((mode) == SAMPLING_BILINEAR ? 2 : (mode) == SAMPLING_BICUBIC ? 4 : 6)
+
+static inline float
+lanczos3 (float d)
 {
-    int x1,
-	x2,
-	y1,
-	y2;
-    float x2fact,
-	y2fact,
-	x1fact,
-	y1fact,
-	p1fact,
-	p2fact,
-	p3fact,
-	p4fact;
-    color_t pixel1, pixel2, pixel3, pixel4, result;
-    float_color_t fpixel1, fpixel2, fpixel3, fpixel4, fresult;
-    input_drawable_t *drawable = get_image_drawable(invocation, image, &x, &y);
-    int pixel_inc_x, pixel_inc_y;
+    if (d == 0.0)
+	return 1.0;
+    if (d <= -3.0 || d >= 3.0)
+	return 0.0;
+    return 3.0 * sin(M_PI * d) * sin(M_PI * d / 3.0) / (M_PI * M_PI * d * d);
+}
 
-    drawable_get_pixel_inc(invocation, drawable, &pixel_inc_x, &pixel_inc_y);
+static inline int
+calc_sampling_weights (int mode, float g, float *weights)
+{
+    int i = floor(g);
+    float t = g - i;
 
-    if (pixel_inc_x > 1)
+    switch (mode)
     {
-	x -= pixel_inc_x / 2.0;
-
-	x1 = floor(x / pixel_inc_x) * pixel_inc_x;
-	x2 = x1 + pixel_inc_x;
+	case SAMPLING_BILINEAR :
+	    weights[0] = 1.0 - t;
+	    weights[1] = t;
+	    return i;
+
+	case SAMPLING_BICUBIC :
+	    /* Catmull-Rom */
+	    weights[0] = ((-0.5 * t + 1.0) * t - 0.5) * t;
+	    weights[1] = (1.5 * t - 2.5) * t * t + 1.0;
+	    weights[2] = ((-1.5 * t + 2.0) * t + 0.5) * t;
+	    weights[3] = (0.5 * t - 0.5) * t * t;
+	    return i - 1;
+
+	case SAMPLING_LANCZOS :
+	{
+	    float sum = 0.0;
+	    int k;
+
+	    for (k = 0; k < 6; ++k)
+		sum += weights[k] = lanczos3(t - (k - 2));
+	    for (k = 0; k < 6; ++k)
+		weights[k] /= sum;
+	    return i - 2;
+	}
 
-	x2fact = (x - x1) / pixel_inc_x;
+	default :
+	    g_assert_not_reached();
+	    return i;
     }
-    else
-    {
-	x1 = floor(x);
-	x2 = x1 + 1;
+}
+
+/* Adds the color, weighted, to the four float channels in sum, which
+   are in the range 0 to 255. */
+static inline void
+add_weighted_color (float *sum, color_t color, float weight)
+{
+    sum[0] += RED(color) * weight;
+    sum[1] += GREEN(color) * weight;
+    sum[2] += BLUE(color) * weight;
+    sum[3] += ALPHA(color) * weight;
+}
 
-	x2fact = x - x1;
+static inline float*
+sample_drawable (mathmap_invocation_t *invocation, float x, float y, image_t *image, int frame,
+		 float *result, int mode)
+{
+    input_drawable_t *drawable = get_image_drawable(invocation, image, &x, &y);
+    int taps = SAMPLING_TAPS(mode);
+    float weights_x[SAMPLING_MAX_TAPS], weights_y[SAMPLING_MAX_TAPS];
+    float sum[4] = { 0.0, 0.0, 0.0, 0.0 };
+    int pixel_inc_x, pixel_inc_y;
+    int first_x, first_y;
+    int i, j, c;
+
+    if (drawable == NULL)
+    {
+	result[0] = result[1] = result[2] = result[3] = 1.0;
+	return result;
     }
 
+    /* The fast preview only has every pixel_inc-th pixel, so we
+       sample on that grid. */
+    drawable_get_pixel_inc(invocation, drawable, &pixel_inc_x, &pixel_inc_y);
+    if (pixel_inc_x > 1)
+	x = (x - pixel_inc_x / 2.0) / pixel_inc_x;
     if (pixel_inc_y > 1)
+	y = (y - pixel_inc_y / 2.0) / pixel_inc_y;
+
+    first_x = calc_sampling_weights(mode, x, weights_x);
+    first_y = calc_sampling_weights(mode, y, weights_y);
+
+    /* All the pixels are available if the top left one and the bottom
+       right one are. */
+    if (pixel_inc_x == 1 && pixel_inc_y == 1
+	&& PREFETCHED_PIXEL_IS_AVAILABLE(drawable, first_x, first_y, frame)
+	&& PREFETCHED_PIXEL_IS_AVAILABLE(drawable, first_x + taps - 1, first_y + taps - 1, frame))
     {
-	y -= pixel_inc_y / 2.0;
+	color_t *p = &PREFETCHED_PIXEL(drawable, first_x, first_y);
+	int stride = drawable->prefetched_row_stride;
 
-	y1 = floor(y / pixel_inc_y) * pixel_inc_y;
-	y2 = y1 + pixel_inc_y;
+	for (j = 0; j < taps; ++j)
+	{
+	    float row[4] = { 0.0, 0.0, 0.0, 0.0 };
 
-	y2fact = (y - y1) / pixel_inc_y;
+	    for (i = 0; i < taps; ++i)
+		add_weighted_color(row, p[j * stride + i], weights_x[i]);
+	    for (c = 0; c < 4; ++c)
+		sum[c] += row[c] * weights_y[j];
+	}
     }
     else
     {
-	y1 = floor(y);
-	y2 = y1 + 1;
-
-	y2fact = y - y1;
+	for (j = 0; j < taps; ++j)
+	{
+	    float row[4] = { 0.0, 0.0, 0.0, 0.0 };
+
+	    for (i = 0; i < taps; ++i)
+		add_weighted_color(row, get_pixel(invocation, (first_x + i) * pixel_inc_x, (first_y + j) * pixel_inc_y,
+						  drawable, frame),
+				   weights_x[i]);
+	    for (c = 0; c < 4; ++c)
+		sum[c] += row[c] * weights_y[j];
+	}
     }
 
-    x1fact = 1.0 - x2fact;
-    y1fact = 1.0 - y2fact;
+    /* Bicubic and Lanczos overshoot, but drawables have always
+       produced values between 0 and 1. */
+    for (c = 0; c < 4; ++c)
+	result[c] = CLAMP(sum[c] * (1.0 / 255.0), 0.0, 1.0);
+
+    return result;
+}
+
+CALLBACK_SYMBOL
+float*
+get_orig_val_intersample_pixel (mathmap_invocation_t *invocation, float x, float y, image_t *image, int frame, float *result)
+{
+    return sample_drawable(invocation, x, y, image, frame, result, SAMPLING_BILINEAR);
+}
+
+CALLBACK_SYMBOL
+float*
+get_orig_val_bicubic_pixel (mathmap_invocation_t *invocation, float x, float y, image_t *image, int frame, float *result)
+{
+    return sample_drawable(invocation, x, y, image, frame, result, SAMPLING_BICUBIC);
+}
+
+CALLBACK_SYMBOL
+float*
+get_orig_val_lanczos_pixel (mathmap_invocation_t *invocation, float x, float y, image_t *image, int frame, float *result)
+{
+    return sample_drawable(invocation, x, y, image, frame, result, SAMPLING_LANCZOS);
+}
 
-    p1fact = x1fact * y1fact;
-    p2fact = x1fact * y2fact;
-    p3fact = x2fact * y1fact;
-    p4fact = x2fact * y2fact;
+/* Samples pixels stored like those of floatmaps, with the strides
+   given in floats.  Pixels outside are clamped to the edges. */
+static inline float*
+sample_float_pixels (float *pixels, int width, int height, int pixel_stride, int row_stride, int channel_stride,
+		     float x, float y, float *result, int mode)
+{
+    int taps = SAMPLING_TAPS(mode);
+    float weights_x[SAMPLING_MAX_TAPS], weights_y[SAMPLING_MAX_TAPS];
+    int columns[SAMPLING_MAX_TAPS];
+    int first_x, first_y;
+    int i, j, c;
 
-    pixel1 = get_pixel(invocation, x1, y1, drawable, frame);
-    pixel2 = get_pixel(invocation, x1, y2, drawable, frame);
-    pixel3 = get_pixel(invocation, x2, y1, drawable, frame);
-    pixel4 = get_pixel(invocation, x2, y2, drawable, frame);
+    first_x = calc_sampling_weights(mode, x, weights_x);
+    first_y = calc_sampling_weights(mode, y, weights_y);
 
-    fpixel1 = COLOR_MUL_FLOAT(pixel1, p1fact);
-    fpixel2 = COLOR_MUL_FLOAT(pixel2, p2fact);
-    fpixel3 = COLOR_MUL_FLOAT(pixel3, p3fact);
-    fpixel4 = COLOR_MUL_FLOAT(pixel4, p4fact);
+    for (i = 0; i < taps; ++i)
+	columns[i] = CLAMP(first_x + i, 0, width - 1) * pixel_stride;
 
-    fresult = FLOAT_COLOR_ADD(fpixel1, fpixel2);
-    fresult = FLOAT_COLOR_ADD(fresult, fpixel3);
-    fresult = FLOAT_COLOR_ADD(fresult, fpixel4);
+    result[0] = result[1] = result[2] = result[3] = 0.0;
 
-    result = FLOAT_COLOR_TO_COLOR(fresult);
+    for (j = 0; j < taps; ++j)
+    {
+	float *line = pixels + CLAMP(first_y + j, 0, height - 1) * row_stride;
+	float row[4] = { 0.0, 0.0, 0.0, 0.0 };
+
+	for (i = 0; i < taps; ++i)
+	    for (c = 0; c < 4; ++c)
+		row[c] += line[columns[i] + c * channel_stride] * weights_x[i];
+	for (c = 0; c < 4; ++c)
+	    result[c] += row[c] * weights_y[j];
+    }
 
     return result;
 }
 
+static inline float*
+sample_floatmap (image_t *image, float x, float y, float *result, int mode)
+{
+    return sample_float_pixels(image->v.floatmap.data, image->pixel_width, image->pixel_height,
+			       image->v.floatmap.pixel_stride, image->v.floatmap.row_stride,
+			       image->v.floatmap.channel_stride, x, y, result, mode);
+}
+
+/* With nearest sampling of an interleaved floatmap the result points
+   into the floatmap, otherwise it's stored in result. */
 CALLBACK_SYMBOL
 float*
-get_floatmap_pixel (mathmap_invocation_t *invocation, image_t *image, float x, float y, float frame)
+get_floatmap_pixel (mathmap_invocation_t *invocation, image_t *image, float x, float y, float frame, float *result)
 {
     static float black[] = { 0.0, 0.0, 0.0, 0.0 };
 
-    int ix, iy;
-
     g_assert(image->type == IMAGE_FLOATMAP);
 
-    ix = (int)lrintf(image->v.floatmap.ax * x + image->v.floatmap.bx);
-    iy = (int)lrintf(image->v.floatmap.ay * y + image->v.floatmap.by);
+    x = image->v.floatmap.ax * x + image->v.floatmap.bx;
+    y = image->v.floatmap.ay * y + image->v.floatmap.by;
 
-    if (ix < 0 || ix >= image->pixel_width
-	|| iy < 0 || iy >= image->pixel_height)
+    if (x < -0.5 || x >= image->pixel_width - 0.5
+	|| y < -0.5 || y >= image->pixel_height - 0.5)
 	return black;
 
-    return image->v.floatmap.data + (iy * image->pixel_width + ix) * 4;
+    switch (invocation->sampling)
+    {
+	case SAMPLING_BILINEAR :
+	    return sample_floatmap(image, x, y, result, SAMPLING_BILINEAR);
+	case SAMPLING_BICUBIC :
+	    return sample_floatmap(image, x, y, result, SAMPLING_BICUBIC);
+	case SAMPLING_LANCZOS :
+	    return sample_floatmap(image, x, y, result, SAMPLING_LANCZOS);
+	default :
+	{
+	    int ix = MIN((int)floor(x + 0.5), image->pixel_width - 1);
+	    int iy = MIN((int)floor(y + 0.5), image->pixel_height - 1);
+	    int c;
+
+	    if (image->v.floatmap.layout == FLOATMAP_LAYOUT_INTERLEAVED)
+		return &FLOATMAP_VALUE_XY(image, ix, iy, 0);
+
+	    for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+		result[c] = FLOATMAP_VALUE_XY(image, ix, iy, c);
+	    return result;
+	}
+    }
 }
 
+static inline float*
+sample_mipmap_level (mipmap_t *mipmap, int level, float x, float y, float *result)
+{
+    float scale = 1.0 / (float)(2 << level);
+
+    return sample_float_pixels(mipmap->levels[level], mipmap->widths[level], mipmap->heights[level],
+			       NUM_FLOATMAP_CHANNELS, mipmap->widths[level] * NUM_FLOATMAP_CHANNELS, 1,
+			       (x + 0.5) * scale - 0.5, (y + 0.5) * scale - 0.5, result, SAMPLING_BILINEAR);
+}
+
+/* Like ORIG_VAL, but footprint is the distance between the lookups
+   of neighbouring pixels, in image coordinates.  If that's more
+   than one pixel of the image the result is interpolated between the
+   two mipmap levels whose pixel sizes are closest to it.  Images
+   without a mipmap are sampled as usual. */
 CALLBACK_SYMBOL
+float*
+get_orig_val_lod_pixel (mathmap_invocation_t *invocation, float x, float y, image_t *image, float frame,
+			float footprint, float *result)
+{
+    mipmap_t *mipmap = NULL;
+    float px = x, py = y;
+    float lod, t;
+    float *base;
+    int level, c;
+
+    if (image->type == IMAGE_FLOATMAP)
+    {
+	mipmap = image->v.floatmap.mipmap;
+	px = image->v.floatmap.ax * x + image->v.floatmap.bx;
+	py = image->v.floatmap.ay * y + image->v.floatmap.by;
+	footprint *= MAX(fabs(image->v.floatmap.ax), fabs(image->v.floatmap.ay));
+    }
+    else if (image->v.drawable != NULL)
+    {
+	input_drawable_t *drawable = get_image_drawable(invocation, image, &px, &py);
+	int pixel_inc_x, pixel_inc_y;
+
+	/* The fast preview doesn't have all the pixels the mipmap
+	   was built from. */
+	drawable_get_pixel_inc(invocation, drawable, &pixel_inc_x, &pixel_inc_y);
+	if (pixel_inc_x == 1 && pixel_inc_y == 1
+	    && drawable->mipmap != NULL
+	    && (drawable->mipmap->frame < 0 || drawable->mipmap->frame == (int)frame))
+	    mipmap = drawable->mipmap;
+	footprint *= MAX(fabs(drawable->scale_x), fabs(drawable->scale_y));
+    }
+
+    if (mipmap == NULL || mipmap->num_levels == 0 || footprint <= 1.0
+	|| px < -0.5 || px >= image->pixel_width - 0.5
+	|| py < -0.5 || py >= image->pixel_height - 0.5)
+    {
+	if (image->type == IMAGE_FLOATMAP)
+	    return get_floatmap_pixel(invocation, image, x, y, frame, result);
+	return invocation->orig_val_func(invocation, x, y, image, frame, result);
+    }
+
+    lod = log2(footprint);
+    level = floor(lod);
+    t = lod - level;
+    if (level >= mipmap->num_levels)
+    {
+	level = mipmap->num_levels;
+	t = 0.0;
+    }
+
+    /* Level 0 is the image itself, level n is mipmap->levels[n-1]. */
+    if (level == 0)
+    {
+	if (image->type == IMAGE_FLOATMAP)
+	    base = get_floatmap_pixel(invocation, image, x, y, frame, result);
+	else
+	    base = invocation->orig_val_func(invocation, x, y, image, frame, result);
+    }
+    else
+	base = sample_mipmap_level(mipmap, level - 1, px, py, result);
+
+    if (t > 0.0)
+    {
+	float next[NUM_FLOATMAP_CHANNELS];
+
+	sample_mipmap_level(mipmap, level, px, py, next);
+	for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+	    result[c] = base[c] + (next[c] - base[c]) * t;
+	return result;
+    }
+
+    return base;
+}
+
+typedef struct
+{
+    mathmap_invocation_t *invocation;
+    /* The source of the first level is the drawable, if it's not
+       NULL, otherwise src. */
+    input_drawable_t *drawable;
+    int frame;
+    float *src;
+    int src_width, src_height;
+    int src_pixel_stride, src_row_stride, src_channel_stride;
+    float *dst;
+    int dst_width;
+} mipmap_level_data_t;
+
+static void
+mipmap_row_task_func (gpointer _data, int task_index)
+{
+    mipmap_level_data_t *data = (mipmap_level_data_t*)_data;
+    int y0 = task_index * 2;
+    int y1 = MIN(y0 + 1, data->src_height - 1);
+    float *p = data->dst + task_index * data->dst_width * NUM_FLOATMAP_CHANNELS;
+    int x, c;
+
+    for (x = 0; x < data->dst_width; ++x)
+    {
+	int x0 = x * 2;
+	int x1 = MIN(x0 + 1, data->src_width - 1);
+
+	if (data->drawable != NULL)
+	{
+	    float sum[4] = { 0.0, 0.0, 0.0, 0.0 };
+
+	    add_weighted_color(sum, get_pixel(data->invocation, x0, y0, data->drawable, data->frame), 0.25);
+	    add_weighted_color(sum, get_pixel(data->invocation, x1, y0, data->drawable, data->frame), 0.25);
+	    add_weighted_color(sum, get_pixel(data->invocation, x0, y1, data->drawable, data->frame), 0.25);
+	    add_weighted_color(sum, get_pixel(data->invocation, x1, y1, data->drawable, data->frame), 0.25);
+
+	    for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+		p[c] = sum[c] * (1.0 / 255.0);
+	}
+	else
+	{
+	    float *row0 = data->src + y0 * data->src_row_stride;
+	    float *row1 = data->src + y1 * data->src_row_stride;
+	    int i0 = x0 * data->src_pixel_stride;
+	    int i1 = x1 * data->src_pixel_stride;
+
+	    for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+	    {
+		int o = c * data->src_channel_stride;
+
+		p[c] = (row0[i0 + o] + row0[i1 + o] + row1[i0 + o] + row1[i1 + o]) * 0.25;
+	    }
+	}
+
+	p += NUM_FLOATMAP_CHANNELS;
+    }
+}
+
+/* Builds the mipmap of a width x height image whose pixels come from
+   the drawable, if it's not NULL, or otherwise from the floatmap.
+   Each level is built in parallel from the previous one.  The mipmap
+   is allocated from pools, or with g_malloc() if pools is NULL. */
+static mipmap_t*
+build_mipmap (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame, image_t *floatmap,
+	      int width, int height, mathmap_pools_t *pools)
+{
+    mipmap_t *mipmap;
+    mipmap_level_data_t data;
+    gsize num_pixels = 0;
+    float *level;
+    int w = width, h = height;
+    int i;
+
+    if (pools != NULL)
+	mipmap = mathmap_pools_alloc(pools, sizeof(mipmap_t));
+    else
+	mipmap = g_new(mipmap_t, 1);
+
+    mipmap->frame = frame;
+    mipmap->num_levels = 0;
+    while (w > 1 || h > 1)
+    {
+	g_assert(mipmap->num_levels < MAX_MIPMAP_LEVELS);
+
+	w = (w + 1) / 2;
+	h = (h + 1) / 2;
+
+	mipmap->widths[mipmap->num_levels] = w;
+	mipmap->heights[mipmap->num_levels] = h;
+	num_pixels += w * h;
+	++mipmap->num_levels;
+    }
+
+    if (pools != NULL)
+    {
+	mipmap->block = NULL;
+	level = mathmap_pools_alloc(pools, sizeof(float) * num_pixels * NUM_FLOATMAP_CHANNELS);
+    }
+    else
+	mipmap->block = level = g_malloc(sizeof(float) * num_pixels * NUM_FLOATMAP_CHANNELS);
+
+    data.invocation = invocation;
+    data.drawable = drawable;
+    data.frame = MAX(frame, 0);
+    data.src_width = width;
+    data.src_height = height;
+    if (floatmap != NULL)
+    {
+	data.src = floatmap->v.floatmap.data;
+	data.src_pixel_stride = floatmap->v.floatmap.pixel_stride;
+	data.src_row_stride = floatmap->v.floatmap.row_stride;
+	data.src_channel_stride = floatmap->v.floatmap.channel_stride;
+    }
+
+    for (i = 0; i < mipmap->num_levels; ++i)
+    {
+	mipmap->levels[i] = level;
+
+	data.dst = level;
+	data.dst_width = mipmap->widths[i];
+
+	thread_pool_run(mipmap_row_task_func, &data, mipmap->heights[i]);
+
+	data.drawable = NULL;
+	data.src = level;
+	data.src_width = mipmap->widths[i];
+	data.src_height = mipmap->heights[i];
+	data.src_pixel_stride = NUM_FLOATMAP_CHANNELS;
+	data.src_row_stride = mipmap->widths[i] * NUM_FLOATMAP_CHANNELS;
+	data.src_channel_stride = 1;
+
+	level += mipmap->widths[i] * mipmap->heights[i] * NUM_FLOATMAP_CHANNELS;
+    }
+
+    return mipmap;
+}
+
+typedef struct
+{
+    mathmap_invocation_t *invocation;
+    input_drawable_t *drawable;
+    int frame;
+    color_t *pixels;		/* pixel (0,0) */
+} prefetch_data_t;
+
+static void
+prefetch_row_task_func (gpointer _data, int task_index)
+{
+    prefetch_data_t *data = (prefetch_data_t*)_data;
+    input_drawable_t *drawable = data->drawable;
+    int y = task_index - PREFETCH_BORDER;
+    color_t *p = data->pixels + y * drawable->prefetched_row_stride - PREFETCH_BORDER;
+    int x;
+
+    for (x = -PREFETCH_BORDER; x < drawable->image.pixel_width + PREFETCH_BORDER; ++x)
+	*p++ = get_pixel(data->invocation, x, y, drawable, data->frame);
+}
+
+/* Decodes the whole drawable, including a border according to the
+   invocation's edge behaviour, into a buffer, from which get_pixel()
+   can then fetch pixels without going through mathmap_get_pixel().
+   The prefetched pixels must be freed, or fetched again, when the
+   drawable or the edge behaviour changes.  If frame is negative the
+   drawable is assumed to be the same for all frames.  If the
+   invocation uses mipmapping the drawable's mipmap is built, too. */
+void
+prefetch_input_drawable (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame)
+{
+    int width = drawable->image.pixel_width;
+    int height = drawable->image.pixel_height;
+    int row_stride;
+    color_t *block;
+    prefetch_data_t data;
+
+    free_prefetched_input_drawable(drawable);
+
+    row_stride = width + 2 * PREFETCH_BORDER;
+    row_stride = (row_stride + PREFETCH_BORDER - 1) / PREFETCH_BORDER * PREFETCH_BORDER;
+
+    drawable->prefetched_block = g_malloc(sizeof(color_t) * row_stride * (height + 2 * PREFETCH_BORDER)
+					  + PREFETCH_ALIGNMENT);
+    block = (color_t*)(((gsize)drawable->prefetched_block + PREFETCH_ALIGNMENT - 1)
+		       & ~(gsize)(PREFETCH_ALIGNMENT - 1));
+
+    data.invocation = invocation;
+    data.drawable = drawable;
+    data.frame = MAX(frame, 0);
+    data.pixels = block + PREFETCH_BORDER * row_stride + PREFETCH_BORDER;
+
+    /* Fetch one pixel before going parallel, so that the drawable's
+       source is loaded. */
+    get_pixel(invocation, 0, 0, drawable, data.frame);
+
+    drawable->prefetched_row_stride = row_stride;
+    drawable->prefetched_frame = frame;
+    /* get_pixel() must not use the buffer until it's filled in. */
+    drawable->prefetched = NULL;
+
+    thread_pool_run(prefetch_row_task_func, &data, height + 2 * PREFETCH_BORDER);
+
+    drawable->prefetched = data.pixels;
+
+    if (invocation->mipmapping)
+	drawable->mipmap = build_mipmap(invocation, drawable, frame, NULL, width, height, NULL);
+}
+
+#define RENDER_TASKS_PER_WORKER	8
+
+typedef struct
+{
+    mathmap_frame_t *frame;
+    image_t *closure;
+    int width, height;
+    int rows_per_task;
+    image_t *floatmap;
+} render_closure_data_t;
+
+static void
+render_closure_task_func (gpointer _data, int task_index)
+{
+    render_closure_data_t *data = (render_closure_data_t*)_data;
+    int first_row = task_index * data->rows_per_task;
+    int num_rows = MIN(data->rows_per_task, data->height - first_row);
+    image_t *floatmap = data->floatmap;
+    mathmap_slice_t slice;
+
+    invocation_init_slice(&slice, data->closure, data->frame, 0, first_row, data->width, num_rows, 0.0, 0.0);
+
+    /* The filter code produces interleaved lines, so for planar
+       floatmaps we render into a buffer and distribute the channels
+       from there. */
+    if (floatmap->v.floatmap.layout == FLOATMAP_LAYOUT_INTERLEAVED)
+	data->closure->v.closure.funcs->calc_lines(&slice, data->closure, first_row, first_row + num_rows,
+						   &FLOATMAP_VALUE_XY(floatmap, 0, first_row, 0), 1);
+    else
+    {
+	float *lines = g_new(float, num_rows * data->width * NUM_FLOATMAP_CHANNELS);
+	int x, y, c;
+
+	data->closure->v.closure.funcs->calc_lines(&slice, data->closure, first_row, first_row + num_rows, lines, 1);
+
+	for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+	    for (y = 0; y < num_rows; ++y)
+	    {
+		float *src = lines + y * data->width * NUM_FLOATMAP_CHANNELS + c;
+		float *dst = &FLOATMAP_VALUE_XY(floatmap, 0, first_row + y, c);
+
+		for (x = 0; x < data->width; ++x)
+		    dst[x] = src[x * NUM_FLOATMAP_CHANNELS];
+	    }
+
+	g_free(lines);
+    }
+
+    invocation_deinit_slice(&slice);
+}
+
+typedef struct
+{
+    mathmap_invocation_t *invocation;
+    image_t *image;
+    int width, height;
+    int rows_per_task;
+    image_t *floatmap;
+} render_orig_val_data_t;
+
+static void
+render_orig_val_task_func (gpointer _data, int task_index)
+{
+    render_orig_val_data_t *data = (render_orig_val_data_t*)_data;
+    mathmap_invocation_t *invocation = data->invocation;
+    orig_val_pixel_func_t get_orig_val_pixel_func = get_orig_val_pixel;
+    int first_row = task_index * data->rows_per_task;
+    int last_row = MIN(first_row + data->rows_per_task, data->height);
+    image_t *floatmap = data->floatmap;
+    mathmap_pools_t filter_pools;
+    mathmap_pools_t *pools = &filter_pools;
+    int x, y, c;
+
+    mathmap_pools_init_local(&filter_pools);
+
+    for (y = first_row; y < last_row; ++y)
+    {
+	float fy = ((float)y - floatmap->v.floatmap.by) / floatmap->v.floatmap.ay;
+
+	for (x = 0; x < data->width; ++x)
+	{
+	    float fx = ((float)x - floatmap->v.floatmap.bx) / floatmap->v.floatmap.ax;
+	    float storage[NUM_FLOATMAP_CHANNELS];
+	    float *tuple;
+
+	    mathmap_pools_reset(&filter_pools);
+	    tuple = ORIG_VAL_INTO(fx, fy, data->image, 0.0, storage);
+
+	    for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+		FLOATMAP_VALUE_XY(floatmap, x, y, c) = tuple[c];
+	}
+    }
+
+    mathmap_pools_free(&filter_pools);
+}
+
+/* Renders the image into a floatmap with the given layout, unless
+   it's a floatmap already and force is not set, in which case it's
+   only converted to the layout if necessary.  The image is rendered
+   in bands of rows which are distributed over the thread pool.
+   Every pixel only depends on its coordinates, so the result doesn't
+   depend on the number of threads. */
 image_t*
-render_image (mathmap_invocation_t *invocation, image_t *image, int width, int height, mathmap_pools_t *pools, int force)
+render_image_with_layout (mathmap_invocation_t *invocation, image_t *image, int width, int height, int layout,
+			  mathmap_pools_t *pools, int force)
 {
     image_t *new_image;
 
     if (!force && image->type == IMAGE_FLOATMAP)
-	return image;
+	return floatmap_with_layout(image, layout, pools);
 
-    new_image = floatmap_alloc(width, height, pools);
+    new_image = floatmap_alloc_with_layout(width, height, layout, pools);
 
 #ifdef DEBUG_OUTPUT
     g_print("rendering %dx%d\n", width, height);
@@ -281,66 +826,56 @@ render_image (mathmap_invocation_t *invocation, image_t *image, int width, int h
 
     if (image->type == IMAGE_CLOSURE)
     {
-	mathmap_frame_t *frame;
-	mathmap_slice_t slice;
+	render_closure_data_t data;
 
 #ifdef DEBUG_OUTPUT
 	g_print("image is closure\n");
 #endif
 
-	frame = invocation_new_frame(invocation, image, 0, 0.0);
-	frame->frame_render_width = width;
-	frame->frame_render_height = height;
-
-	invocation_init_slice(&slice, image, frame, 0, 0, width, height, 0.0, 0.0);
-
-	image->v.closure.funcs->calc_lines(&slice, image, 0, height, new_image->v.floatmap.data, 1);
+	data.frame = invocation_new_frame(invocation, image, 0, 0.0);
+	data.frame->frame_render_width = width;
+	data.frame->frame_render_height = height;
+	data.closure = image;
+	data.width = width;
+	data.height = height;
+	data.rows_per_task = MAX(height / (thread_pool_num_workers() * RENDER_TASKS_PER_WORKER), 1);
+	data.floatmap = new_image;
 
-	invocation_deinit_slice(&slice);
+	thread_pool_run(render_closure_task_func, &data, (height + data.rows_per_task - 1) / data.rows_per_task);
 
-	invocation_free_frame(frame);
+	invocation_free_frame(data.frame);
     }
     else
     {
-	float ax, bx, ay, by;
-	color_t (*get_orig_val_pixel_func) (mathmap_invocation_t*, float, float, image_t*, int) = get_orig_val_pixel;
-	int x, y;
-	float *p;
-	mathmap_pools_t filter_pools;
+	render_orig_val_data_t data;
 
 #ifdef DEBUG_OUTPUT
 	g_print("image is not closure: %d\n", image->type);
 #endif
 
-	ax = new_image->v.floatmap.ax;
-	bx = new_image->v.floatmap.bx;
-	ay = new_image->v.floatmap.ay;
-	by = new_image->v.floatmap.by;
-
-	mathmap_pools_init_local(&filter_pools);
-	pools = &filter_pools;
-
-	p = new_image->v.floatmap.data;
-	for (y = 0; y < height; ++y)
-	{
-	    float fy = ((float)y - by) / ay;
-
-	    for (x = 0; x < width; ++x)
-	    {
-		float fx = ((float)x - bx) / ax;
-		float *tuple;
+	data.invocation = invocation;
+	data.image = image;
+	data.width = width;
+	data.height = height;
+	data.rows_per_task = MAX(height / (thread_pool_num_workers() * RENDER_TASKS_PER_WORKER), 1);
+	data.floatmap = new_image;
 
-		mathmap_pools_reset(&filter_pools);
-		tuple = ORIG_VAL(fx, fy, image, 0.0);
+	thread_pool_run(render_orig_val_task_func, &data, (height + data.rows_per_task - 1) / data.rows_per_task);
+    }
 
-		memcpy(p, tuple, sizeof(float) * 4);
+    if (invocation->mipmapping)
+	new_image->v.floatmap.mipmap = build_mipmap(invocation, NULL, -1, new_image, width, height, pools);
 
-		p += 4;
-	    }
-	}
+    return new_image;
+}
 
-	mathmap_pools_free(&filter_pools);
-    }
+/* The code of filters doesn't care about the layout of floatmaps. */
+CALLBACK_SYMBOL
+image_t*
+render_image (mathmap_invocation_t *invocation, image_t *image, int width, int height, mathmap_pools_t *pools, int force)
+{
+    if (!force && image->type == IMAGE_FLOATMAP)
+	return image;
 
-    return new_image;
+    return render_image_with_layout(invocation, image, width, height, FLOATMAP_LAYOUT_INTERLEAVED, pools, force);
 }
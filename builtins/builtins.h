@@ -32,22 +32,43 @@
 #include "color.h"
 
 struct _mathmap_invocation_t;
+struct _input_drawable_t;
 struct _compvar_t;
 struct _image_t;
 struct _filter_t;
 
+typedef void (*edge_behaviour_func_t) (int *x, int *y, int width, int height);
+
 typedef void (*generator_function_t) (struct _filter_t*, struct _compvar_t***, int*, int*, struct _compvar_t**);
 
 /* TEMPLATE builtins */
-color_t get_orig_val_pixel (struct _mathmap_invocation_t *invocation, float x, float y, struct _image_t *image, int frame);
-color_t get_orig_val_intersample_pixel (struct _mathmap_invocation_t *invocation, float x, float y, struct _image_t *image, int frame);
+float* get_orig_val_pixel (struct _mathmap_invocation_t *invocation, float x, float y, struct _image_t *image, int frame,
+			   float *result);
+float* get_orig_val_intersample_pixel (struct _mathmap_invocation_t *invocation, float x, float y, struct _image_t *image,
+				       int frame, float *result);
+float* get_orig_val_bicubic_pixel (struct _mathmap_invocation_t *invocation, float x, float y, struct _image_t *image,
+				   int frame, float *result);
+float* get_orig_val_lanczos_pixel (struct _mathmap_invocation_t *invocation, float x, float y, struct _image_t *image,
+				   int frame, float *result);
 
-float* get_floatmap_pixel (struct _mathmap_invocation_t *invocation, struct _image_t *image, float x, float y, float frame);
+float* get_floatmap_pixel (struct _mathmap_invocation_t *invocation, struct _image_t *image, float x, float y, float frame,
+			   float *result);
+float* get_orig_val_lod_pixel (struct _mathmap_invocation_t *invocation, float x, float y, struct _image_t *image,
+			       float frame, float footprint, float *result);
 
 struct _image_t* render_image (struct _mathmap_invocation_t *invocation, struct _image_t *image,
 			       int width, int height, mathmap_pools_t *pools, int force);
 /* END */
 
+/* Returns a function which maps pixel coordinates outside of the image
+   into it according to the edge behaviour modes. */
+edge_behaviour_func_t get_edge_behaviour_func (int edge_behaviour_x, int edge_behaviour_y);
+
+void prefetch_input_drawable (struct _mathmap_invocation_t *invocation, struct _input_drawable_t *drawable, int frame);
+
+struct _image_t* render_image_with_layout (struct _mathmap_invocation_t *invocation, struct _image_t *image,
+					   int width, int height, int layout, mathmap_pools_t *pools, int force);
+
 void init_builtins (void);
 
 #endif
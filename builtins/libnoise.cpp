@@ -28,18 +28,61 @@
 
 using namespace noise;
 
+/* Constructing and configuring a module for every sample is
+   expensive - RidgedMulti, for example, calculates its spectral
+   weights whenever the lacunarity is set - so every thread keeps one
+   module of each kind and only reconfigures it when the parameters
+   differ from the ones of its last sample, which is rare since they
+   are usually constant over the whole image. */
+struct noise_modules_t
+{
+    module::Perlin perlin;
+    module::Billow billow;
+    module::RidgedMulti ridged_multi;
+    module::Voronoi voronoi;
+};
+
+static GStaticPrivate noise_modules_key = G_STATIC_PRIVATE_INIT;
+
+static void
+free_noise_modules (gpointer data)
+{
+    delete (noise_modules_t*)data;
+}
+
+static noise_modules_t*
+get_noise_modules (void)
+{
+    noise_modules_t *modules = (noise_modules_t*)g_static_private_get(&noise_modules_key);
+
+    if (modules == NULL)
+    {
+	modules = new noise_modules_t;
+
+	modules->perlin.SetNoiseQuality (QUALITY_BESTEST);
+	modules->billow.SetNoiseQuality (QUALITY_BESTEST);
+	modules->ridged_multi.SetNoiseQuality (QUALITY_BESTEST);
+
+	g_static_private_set(&noise_modules_key, modules, free_noise_modules);
+    }
+
+    return modules;
+}
+
 extern "C"
 CALLBACK_SYMBOL
 float
 libnoise_perlin (int num_octaves, float persistence, float lacunarity,
 		 float x, float y, float z)
 {
-    module::Perlin p;
+    module::Perlin &p = get_noise_modules()->perlin;
 
-    p.SetNoiseQuality (QUALITY_BESTEST);
-    p.SetOctaveCount (num_octaves);
-    p.SetLacunarity (lacunarity);
-    p.SetPersistence (persistence);
+    if (p.GetOctaveCount () != num_octaves)
+	p.SetOctaveCount (num_octaves);
+    if (p.GetLacunarity () != lacunarity)
+	p.SetLacunarity (lacunarity);
+    if (p.GetPersistence () != persistence)
+	p.SetPersistence (persistence);
 
     return p.GetValue (x, y, z);
 }
@@ -50,12 +93,14 @@ float
 libnoise_billow (int num_octaves, float persistence, float lacunarity,
 		 float x, float y, float z)
 {
-    module::Billow p;
+    module::Billow &p = get_noise_modules()->billow;
 
-    p.SetNoiseQuality (QUALITY_BESTEST);
-    p.SetOctaveCount (num_octaves);
-    p.SetLacunarity (lacunarity);
-    p.SetPersistence (persistence);
+    if (p.GetOctaveCount () != num_octaves)
+	p.SetOctaveCount (num_octaves);
+    if (p.GetLacunarity () != lacunarity)
+	p.SetLacunarity (lacunarity);
+    if (p.GetPersistence () != persistence)
+	p.SetPersistence (persistence);
 
     return p.GetValue (x, y, z);
 }
@@ -66,11 +111,12 @@ float
 libnoise_ridged_multi (int num_octaves, float lacunarity,
 		       float x, float y, float z)
 {
-    module::RidgedMulti p;
+    module::RidgedMulti &p = get_noise_modules()->ridged_multi;
 
-    p.SetNoiseQuality (QUALITY_BESTEST);
-    p.SetOctaveCount (num_octaves);
-    p.SetLacunarity (lacunarity);
+    if (p.GetOctaveCount () != num_octaves)
+	p.SetOctaveCount (num_octaves);
+    if (p.GetLacunarity () != lacunarity)
+	p.SetLacunarity (lacunarity);
 
     return p.GetValue (x, y, z);
 }
@@ -80,9 +126,10 @@ CALLBACK_SYMBOL
 float
 libnoise_voronoi (float displacement, float x, float y, float z)
 {
-    module::Voronoi p;
+    module::Voronoi &p = get_noise_modules()->voronoi;
 
-    p.SetDisplacement (displacement);
+    if (p.GetDisplacement () != displacement)
+	p.SetDisplacement (displacement);
 
     return p.GetValue (x, y, z);
 }
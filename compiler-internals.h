@@ -30,7 +30,6 @@ extern "C" {
 #include "mathmap.h"
 #include "vars.h"
 #include "compiler.h"
-#include "bitvector.h"
 
 #include "opdefs.h"
 
@@ -64,7 +63,7 @@ typedef struct _compvar_t
     struct _value_t *values;
 } compvar_t;
 
-struct _statement_list_t;
+struct _value_use_t;
 struct _statement_t;
 
 typedef struct _value_t
@@ -73,11 +72,12 @@ typedef struct _value_t
     int global_index;
     int index;			/* SSA index */
     struct _statement_t *def;
-    struct _statement_list_t *uses;
+    struct _value_use_t *uses;
     unsigned int const_type : 3; /* defined in internals.h */
     unsigned int least_const_type_directly_used_in : 3;
     unsigned int least_const_type_multiply_used_in : 3;
     unsigned int have_defined : 1; /* used in c code output */
+    int local_tuple_length;	/* > 0 if the tuple doesn't escape */
     struct _value_t *next;	/* next value for same compvar */
 } value_t;
 
@@ -219,6 +219,7 @@ typedef struct _statement_t
     } v;
     struct _statement_t *parent;
     unsigned int slice_flags;
+    struct _value_use_t *uses;	/* uses of values in this statement */
     struct _statement_t *next;
 } statement_t;
 
@@ -228,10 +229,23 @@ typedef struct _statement_list_t
     struct _statement_list_t *next;
 } statement_list_t;
 
+/* Each use of a value is in the list of uses of the value and in the
+   list of uses in the statement.  Removing a use only has to search
+   the latter, which is short, even if the value is used a lot. */
+typedef struct _value_use_t
+{
+    statement_t *stmt;
+    value_t *value;
+    struct _value_use_t *next;	/* next use of the same value */
+    struct _value_use_t *prev;
+    struct _value_use_t *next_in_stmt;
+} value_use_t;
+
 typedef struct _filter_code_t
 {
     filter_t *filter;
     statement_t *first_stmt;
+    gboolean uses_pixel_pools;	/* FALSE if the code never allocates */
 } filter_code_t;
 
 typedef struct
@@ -253,7 +267,18 @@ typedef struct _binding_values_t
     value_t *values[];
 } binding_values_t;
 
-typedef bit_vector_t value_set_t;
+typedef struct
+{
+    unsigned int index;		/* global value index / 64 */
+    guint64 bits;
+} value_set_word_t;
+
+typedef struct
+{
+    int length;
+    int allocated;
+    value_set_word_t *words;
+} value_set_t;
 
 extern int compiler_op_index (operation_t *op);
 
@@ -265,6 +290,16 @@ extern value_t* make_lhs (compvar_t *compvar);
 #define compiler_make_lhs make_lhs
 extern rhs_t* make_op_rhs (int op_index, ...);
 #define compiler_make_op_rhs make_op_rhs
+extern rhs_t* make_op_rhs_from_array (int op_index, primary_t *args);
+#define compiler_make_op_rhs_from_array make_op_rhs_from_array
+extern rhs_t* make_tuple_rhs_from_array (int length, primary_t *args);
+#define compiler_make_tuple_rhs_from_array make_tuple_rhs_from_array
+extern primary_t make_value_primary (value_t *value);
+#define compiler_make_value_primary make_value_primary
+extern primary_t make_int_const_primary (int int_const);
+#define compiler_make_int_const_primary make_int_const_primary
+extern primary_t make_float_const_primary (float float_const);
+#define compiler_make_float_const_primary make_float_const_primary
 extern primary_t make_compvar_primary (compvar_t *compvar);
 #define compiler_make_compvar_primary make_compvar_primary
 extern rhs_t* make_primary_rhs (primary_t primary);
@@ -326,7 +361,7 @@ extern int compiler_slice_code (statement_t *stmt, unsigned int slice_flag,
 extern filter_code_t* compiler_generate_ir_code (filter_t *filter, int constant_analysis,
 						 int convert_types, int timeout, gboolean debug_output);
 
-extern filter_code_t** compiler_compile_filters (mathmap_t *mathmap, int timeout);
+extern filter_code_t** compiler_compile_filters (mathmap_t *mathmap, int timeout, userval_t *uservals);
 
 extern void compiler_free_pools (mathmap_t *mathmap);
 
@@ -335,6 +370,7 @@ extern void compiler_slice_code_for_const (statement_t *stmt, int const_type);
 
 extern gboolean compiler_opt_remove_dead_assignments (statement_t *first_stmt);
 extern gboolean compiler_opt_orig_val_resize (statement_t **first_stmt);
+extern gboolean compiler_opt_orig_val_lod (filter_t *filter, statement_t **first_stmt);
 extern gboolean compiler_opt_strip_resize (statement_t **first_stmt);
 extern gboolean compiler_opt_loop_invariant_code_motion (statement_t **first_stmt);
 extern gboolean compiler_opt_simplify (filter_t *filter, statement_t *first_stmt);
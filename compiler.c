@@ -87,12 +87,10 @@ static type_t primary_type (primary_t *primary);
 				      RHS_ARG((i)).const_type == TYPE_COMPLEX ? RHS_ARG((i)).v.constant.complex_value : \
 				      ({ g_assert_not_reached(); 0.0; })); })
 
-#define ORIG_VAL_INTERPRETER(x,y,i,f)     ({ color_t c; \
-                                 	     if (invocation->antialiasing) \
-                                     	         c = get_orig_val_intersample_pixel(invocation, (x), (y), (i), (f)); \
-                                 	     else \
-                                     		 c = get_orig_val_pixel(invocation, (x), (y), (i), (f)); \
-                                 	     /*TUPLE_FROM_COLOR(c);*/ NULL; })
+#define ORIG_VAL_INTERPRETER(x,y,i,f)     ({ float storage[NUM_FLOATMAP_CHANNELS]; \
+                                 	     invocation->orig_val_func(invocation, (x), (y), (i), (f), storage); \
+                                 	     NULL; })
+#define ORIG_VAL_LOD_INTERPRETER(x,y,i,f,fp)	ORIG_VAL_INTERPRETER((x),(y),(i),(f))
 
 #define APPLY_GRADIENT_INTERPRETER(g,p)	NULL
 
@@ -124,6 +122,13 @@ static binding_values_t *binding_values = NULL;
 
 static GHashTable *vector_variables = NULL;
 
+/* If set, the int, float and bool user values of this filter are
+   compiled as constants. */
+static filter_t *constant_uservals_filter = NULL;
+static userval_t *constant_uservals = NULL;
+
+static filter_t *main_filter = NULL;
+
 #define STMT_STACK_SIZE            64
 
 static statement_t *stmt_stack[STMT_STACK_SIZE];
@@ -157,44 +162,124 @@ direct_hash_table_copy (GHashTable *table)
 
 /*** value sets ***/
 
-/* This is updated by new_value.  We assume that no new values are generated
- * at the time value sets are used.  */
+/* This is updated by new_value. */
 static int next_value_global_index = 0;
 
+/* A value set is a sparse bit vector indexed by the global indexes of
+   the values.  We only keep the words which have bits set, sorted by
+   their index.  Most sets only contain a small part of all the values
+   ever generated, and values are mostly added in the order they were
+   generated in, which appends to the array. */
+
+#define VALUE_SET_WORD_BITS	64
+
+static int
+value_set_word_position (value_set_t *set, unsigned int index)
+{
+    int lo = 0, hi = set->length;
+
+    while (lo < hi)
+    {
+	int mid = (lo + hi) / 2;
+
+	if (set->words[mid].index < index)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    return lo;
+}
+
 value_set_t*
 compiler_new_value_set (void)
 {
-    return new_bit_vector(next_value_global_index, 0);
+    return g_new0(value_set_t, 1);
 }
 
 void
 compiler_value_set_add (value_set_t *set, value_t *val)
 {
-    bit_vector_set(set, val->global_index);
+    unsigned int index = val->global_index / VALUE_SET_WORD_BITS;
+    guint64 bit = (guint64)1 << (val->global_index % VALUE_SET_WORD_BITS);
+    int pos = value_set_word_position(set, index);
+
+    if (pos < set->length && set->words[pos].index == index)
+    {
+	set->words[pos].bits |= bit;
+	return;
+    }
+
+    if (set->length == set->allocated)
+    {
+	set->allocated = set->allocated == 0 ? 8 : set->allocated * 2;
+	set->words = g_renew(value_set_word_t, set->words, set->allocated);
+    }
+
+    memmove(&set->words[pos + 1], &set->words[pos], sizeof(value_set_word_t) * (set->length - pos));
+    set->words[pos].index = index;
+    set->words[pos].bits = bit;
+    ++set->length;
 }
 
 void
 compiler_value_set_add_set (value_set_t *set, value_set_t *addee)
 {
-    bit_vector_add(set, addee);
+    int allocated = set->length + addee->length;
+    value_set_word_t *words;
+    int i = 0, j = 0, k = 0;
+
+    if (addee->length == 0)
+	return;
+
+    words = g_new(value_set_word_t, allocated);
+
+    while (i < set->length || j < addee->length)
+    {
+	if (j == addee->length
+	    || (i < set->length && set->words[i].index < addee->words[j].index))
+	    words[k++] = set->words[i++];
+	else if (i == set->length || addee->words[j].index < set->words[i].index)
+	    words[k++] = addee->words[j++];
+	else
+	{
+	    words[k].index = set->words[i].index;
+	    words[k++].bits = set->words[i++].bits | addee->words[j++].bits;
+	}
+    }
+
+    g_free(set->words);
+    set->words = words;
+    set->length = k;
+    set->allocated = allocated;
 }
 
 gboolean
 compiler_value_set_contains (value_set_t *set, value_t *val)
 {
-    return bit_vector_bit(set, val->global_index);
+    unsigned int index = val->global_index / VALUE_SET_WORD_BITS;
+    int pos = value_set_word_position(set, index);
+
+    return pos < set->length && set->words[pos].index == index
+	&& (set->words[pos].bits & ((guint64)1 << (val->global_index % VALUE_SET_WORD_BITS))) != 0;
 }
 
 value_set_t*
 compiler_value_set_copy (value_set_t *set)
 {
-    return copy_bit_vector(set);
+    value_set_t *copy = g_new(value_set_t, 1);
+
+    copy->length = copy->allocated = set->length;
+    copy->words = g_memdup(set->words, sizeof(value_set_word_t) * set->length);
+
+    return copy;
 }
 
 void
 compiler_free_value_set (value_set_t *set)
 {
-    free_bit_vector(set);
+    g_free(set->words);
+    g_free(set);
 }
 
 statement_t*
@@ -229,12 +314,22 @@ compiler_op_index (operation_t *op)
     return op - ops;
 }
 
-#define alloc_stmt()               ((statement_t*)pools_alloc(&compiler_pools, sizeof(statement_t)))
+#define alloc_stmt()               new_stmt_memory()
 #define alloc_value()              ((value_t*)pools_alloc(&compiler_pools, sizeof(value_t)))
 #define alloc_rhs()                ((rhs_t*)pools_alloc(&compiler_pools, sizeof(rhs_t)))
 #define alloc_compvar()            (compvar_t*)pools_alloc(&compiler_pools, sizeof(compvar_t))
 #define alloc_primary()            (primary_t*)pools_alloc(&compiler_pools, sizeof(primary_t))
 
+static statement_t*
+new_stmt_memory (void)
+{
+    statement_t *stmt = (statement_t*)pools_alloc(&compiler_pools, sizeof(statement_t));
+
+    stmt->uses = NULL;
+
+    return stmt;
+}
+
 static value_t*
 new_value (compvar_t *compvar)
 {
@@ -249,6 +344,7 @@ new_value (compvar_t *compvar)
     val->least_const_type_directly_used_in = CONST_MAX;
     val->least_const_type_multiply_used_in = CONST_MAX;
     val->have_defined = 0;
+    val->local_tuple_length = 0;
     val->next = 0;
 
     return val;
@@ -341,26 +437,54 @@ prepend_statement (statement_t *stmt, statement_list_t *rest)
 void
 add_use (value_t *val, statement_t *stmt)
 {
-    val->uses = prepend_statement(stmt, val->uses);
+    value_use_t *use = (value_use_t*)pools_alloc(&compiler_pools, sizeof(value_use_t));
+
+    use->stmt = stmt;
+    use->value = val;
+
+    use->prev = NULL;
+    use->next = val->uses;
+    if (use->next != NULL)
+	use->next->prev = use;
+    val->uses = use;
+
+    use->next_in_stmt = stmt->uses;
+    stmt->uses = use;
+}
+
+static gboolean
+stmt_uses_value (statement_t *stmt, value_t *val)
+{
+    value_use_t *use;
+
+    for (use = stmt->uses; use != NULL; use = use->next_in_stmt)
+	if (use->value == val)
+	    return TRUE;
+    return FALSE;
 }
 
 void
 remove_use (value_t *val, statement_t *stmt)
 {
-    statement_list_t **lst = &val->uses;
+    value_use_t **usep;
 
-    while (*lst != 0)
+    for (usep = &stmt->uses; *usep != NULL; usep = &(*usep)->next_in_stmt)
     {
-	statement_list_t *elem = *lst;
+	value_use_t *use = *usep;
 
-	if (elem->stmt == stmt)
-	{
-	    *lst = elem->next;
+	if (use->value != val)
+	    continue;
 
-	    return;
-	}
+	*usep = use->next_in_stmt;
+
+	if (use->prev != NULL)
+	    use->prev->next = use->next;
+	else
+	    val->uses = use->next;
+	if (use->next != NULL)
+	    use->next->prev = use->prev;
 
-	lst = &(*lst)->next;
+	return;
     }
 
     g_assert_not_reached();
@@ -492,7 +616,7 @@ compiler_make_internal_rhs (internal_t *internal)
     return rhs;
 }
 
-static rhs_t*
+rhs_t*
 make_op_rhs_from_array (int op_index, primary_t *args)
 {
     rhs_t *rhs = alloc_rhs();
@@ -520,7 +644,7 @@ make_op_rhs (int op_index, ...)
     return make_op_rhs_from_array(op_index, args);
 }
 
-static rhs_t*
+rhs_t*
 make_tuple_rhs_from_array (int length, primary_t *args)
 {
     rhs_t *rhs = alloc_rhs();
@@ -899,37 +1023,23 @@ static void
 rewrite_use (statement_t *stmt, value_t *old, primary_t new)
 {
     primary_t *primary;
-    statement_list_t **lst;
     int found_one = 0;
 
     if (new.kind == PRIMARY_VALUE)
 	assert(old != new.v.value);
 
  restart:
-    /* remove stmt from the uses list of old */
-    lst = &old->uses;
-    for (;;)
+    if (!stmt_uses_value(stmt, old))
     {
-	statement_list_t *elem = *lst;
-
-	if (elem == 0)
-	{
-	    /* if we don't find it now we must have done at least one
-	       iteration before */
-	    assert(found_one);
-	    return;
-	}
-
-	if (elem->stmt == stmt)
-	{
-	    *lst = elem->next;
-	    found_one = 1;
-	    break;
-	}
-
-	lst = &elem->next;
+	/* if we don't find it now we must have done at least one
+	   iteration before */
+	assert(found_one);
+	return;
     }
 
+    remove_use(old, stmt);
+    found_one = 1;
+
     /* now find out where the use is */
     switch (stmt->kind)
     {
@@ -971,28 +1081,35 @@ rewrite_use (statement_t *stmt, value_t *old, primary_t new)
 static void
 rewrite_uses (value_t *old, primary_t new, statement_t *limit)
 {
-    statement_list_t *lst;
+    value_use_t *use;
+    GSList *stmts = NULL, *l;
 
     if (new.kind == PRIMARY_VALUE)
 	assert(old != new.v.value);
 
-    lst = old->uses;
-    while (lst != 0)
+    /* rewrite_use changes the list, so we collect the statements
+       first */
+    for (use = old->uses; use != NULL; use = use->next)
     {
-	statement_t *stmt = lst->stmt;
+	statement_t *stmt = use->stmt;
 
 	/* we do not rewrite phis in the loop we're currently working on */
 	if (stmt_is_within_limit(stmt, limit)
 	    && !(stmt->kind == STMT_PHI_ASSIGN && stmt->parent == limit))
-	{
+	    stmts = g_slist_prepend(stmts, stmt);
+    }
+
+    /* a statement is in the list once for every use, but
+       rewrite_use rewrites all of them */
+    for (l = stmts; l != NULL; l = l->next)
+    {
+	statement_t *stmt = (statement_t*)l->data;
+
+	if (stmt_uses_value(stmt, old))
 	    rewrite_use(stmt, old, new);
-	    /* rewrite_use changes the list, so we have to restart -
-	       very inefficient */
-	    lst = old->uses;
-	}
-	else
-	    lst = lst->next;
     }
+
+    g_slist_free(stmts);
 }
 
 static void
@@ -1608,10 +1725,10 @@ output_const_type (FILE *out, unsigned int const_type)
 static int
 count_uses (value_t *val)
 {
-    statement_list_t *lst;
+    value_use_t *use;
     int num_uses = 0;
 
-    for (lst = val->uses; lst != 0; lst = lst->next)
+    for (use = val->uses; use != 0; use = use->next)
 	++num_uses;
 
     return num_uses;
@@ -2244,9 +2361,37 @@ new_binding_values (int kind, gpointer key, binding_values_t *next, int num_valu
     return bv;
 }
 
+static rhs_t*
+make_userval_rhs (filter_t *filter, userval_info_t *info, userval_representation_t *rep)
+{
+    if (filter == constant_uservals_filter)
+    {
+	userval_t *userval = &constant_uservals[info->index];
+
+	switch (info->type)
+	{
+	    case USERVAL_INT_CONST :
+		return make_int_const_rhs(userval->v.int_const);
+
+	    case USERVAL_FLOAT_CONST :
+		return make_float_const_rhs(userval->v.float_const);
+
+	    case USERVAL_BOOL_CONST :
+		return make_int_const_rhs((int)userval->v.bool_const);
+
+	    default :
+		break;
+	}
+    }
+
+    return make_op_rhs(rep->getter_op, make_int_const_primary(info->index));
+}
+
 static binding_values_t*
-gen_binding_values_from_userval_infos (userval_info_t *info, binding_values_t *bvs)
+gen_binding_values_from_userval_infos (filter_t *filter, binding_values_t *bvs)
 {
+    userval_info_t *info = filter->userval_infos;
+
     while (info != NULL)
     {
 	userval_representation_t *rep = lookup_userval_representation(info->type);
@@ -2267,7 +2412,7 @@ gen_binding_values_from_userval_infos (userval_info_t *info, binding_values_t *b
 	    else
 	    {
 		bvs = new_binding_values(BINDING_USERVAL, info, bvs, rep->num_vars, rep->var_type);
-		emit_assign(bvs->values[0], make_op_rhs(rep->getter_op, make_int_const_primary(info->index)));
+		emit_assign(bvs->values[0], make_userval_rhs(filter, info, rep));
 	    }
 	}
 
@@ -2628,7 +2773,7 @@ gen_filter_code (filter_t *filter, compvar_t *tuple, primary_t *args, rhs_t **tu
 	binding_values = gen_binding_values_from_filter_args(filter, args, binding_values);
     else
     {
-	binding_values = gen_binding_values_from_userval_infos(filter->userval_infos, binding_values);
+	binding_values = gen_binding_values_from_userval_infos(filter, binding_values);
 	if (needs_xy_scaling(filter_flags(filter)))
 	    binding_values = gen_binding_values_for_xy(filter,
 						       get_internal_value(filter, "x", FALSE),
@@ -2675,10 +2820,10 @@ gen_filter_code (filter_t *filter, compvar_t *tuple, primary_t *args, rhs_t **tu
 static statement_list_t*
 prepend_value_statements (value_t *value, statement_list_t *rest)
 {
-    statement_list_t *lst;
+    value_use_t *use;
 
-    for (lst = value->uses; lst != 0; lst = lst->next)
-	rest = prepend_statement(lst->stmt, rest);
+    for (use = value->uses; use != 0; use = use->next)
+	rest = prepend_statement(use->stmt, rest);
 
     return rest;
 }
@@ -3248,7 +3393,8 @@ optimize_closure_application (statement_t *stmt)
 
 	    case STMT_ASSIGN :
 		if (stmt->v.assign.rhs->kind == RHS_OP
-		    && compiler_op_index(stmt->v.assign.rhs->v.op.op) == OP_ORIG_VAL
+		    && (compiler_op_index(stmt->v.assign.rhs->v.op.op) == OP_ORIG_VAL
+			|| compiler_op_index(stmt->v.assign.rhs->v.op.op) == OP_ORIG_VAL_LOD)
 		    && stmt->v.assign.rhs->v.op.args[2].kind == PRIMARY_VALUE)
 		{
 		    statement_t *def = stmt->v.assign.rhs->v.op.args[2].v.value->def;
@@ -3270,6 +3416,10 @@ optimize_closure_application (statement_t *stmt)
 			args[num_args - 1] = stmt->v.assign.rhs->v.op.args[3]; /* t */
 
 			remove_use(stmt->v.assign.rhs->v.op.args[2].v.value, stmt); /* image */
+			/* a closure's result doesn't depend on the footprint */
+			if (compiler_op_index(stmt->v.assign.rhs->v.op.op) == OP_ORIG_VAL_LOD
+			    && stmt->v.assign.rhs->v.op.args[4].kind == PRIMARY_VALUE)
+			    remove_use(stmt->v.assign.rhs->v.op.args[4].v.value, stmt);
 
 			stmt->v.assign.rhs = make_filter_rhs(filter, args);
 			stmt->v.assign.rhs->v.filter.history = def->v.assign.rhs->v.closure.history;
@@ -3662,10 +3812,10 @@ remove_dead_branches_recursively (statement_t *stmt, int *changed)
 
 			if (branch->kind == STMT_ASSIGN)
 			{
-			    statement_list_t *lst;
+			    value_use_t *use;
 
-			    for (lst = branch->v.assign.lhs->uses; lst != 0; lst = lst->next)
-				assert(has_indirect_parent(lst->stmt, stmt));
+			    for (use = branch->v.assign.lhs->uses; use != 0; use = use->next)
+				assert(has_indirect_parent(use->stmt, stmt));
 			}
 
 			if (branch->kind != STMT_NIL)
@@ -3964,62 +4114,101 @@ replace_rhs_with_value (rhs_t **rhs, value_t *val, statement_t *stmt)
     compiler_replace_rhs(rhs, make_value_rhs(val), stmt);
 }
 
-static void
-replace_rhs_recursively (statement_t *stmt, rhs_t *rhs, value_t *val, int *changed)
+/* Must agree with primaries_equal(). */
+static guint
+primary_hash (primary_t *primary)
 {
-    while (stmt != 0)
+    switch (primary->kind)
     {
-	switch (stmt->kind)
-	{
-	    case STMT_NIL :
-		break;
+	case PRIMARY_VALUE :
+	    return g_direct_hash(primary->v.value);
 
-	    case STMT_PHI_ASSIGN :
-		if (rhss_equal(rhs, stmt->v.assign.rhs2))
-		{
-		    replace_rhs_with_value(&stmt->v.assign.rhs2, val, stmt);
-		    *changed = 1;
-		}
-	    case STMT_ASSIGN :
-		if (rhss_equal(rhs, stmt->v.assign.rhs))
-		{
-		    replace_rhs_with_value(&stmt->v.assign.rhs, val, stmt);
-		    *changed = 1;
-		}
-		break;
+	case PRIMARY_CONST :
+	    switch (primary->const_type)
+	    {
+		case TYPE_INT :
+		    return primary->v.constant.int_value * 31 + TYPE_INT;
 
-	    case STMT_IF_COND :
-		if (rhss_equal(rhs, stmt->v.if_cond.condition))
-		{
-		    replace_rhs_with_value(&stmt->v.if_cond.condition, val, stmt);
-		    *changed = 1;
-		}
-		replace_rhs_recursively(stmt->v.if_cond.consequent, rhs, val, changed);
-		replace_rhs_recursively(stmt->v.if_cond.alternative, rhs, val, changed);
-		replace_rhs_recursively(stmt->v.if_cond.exit, rhs, val, changed);
-		break;
+		case TYPE_FLOAT :
+		    {
+			float f = primary->v.constant.float_value;
+			guint32 bits;
 
-	    case STMT_WHILE_LOOP :
-		if (rhss_equal(rhs, stmt->v.while_loop.invariant))
-		{
-		    replace_rhs_with_value(&stmt->v.while_loop.invariant, val, stmt);
-		    *changed = 1;
-		}
-		replace_rhs_recursively(stmt->v.while_loop.entry, rhs, val, changed);
-		replace_rhs_recursively(stmt->v.while_loop.body, rhs, val, changed);
-		break;
+			/* 0.0 and -0.0 are equal */
+			if (f == 0.0)
+			    return TYPE_FLOAT;
 
-	    default :
-		g_assert_not_reached();
+			memcpy(&bits, &f, sizeof(bits));
+			return bits * 31 + TYPE_FLOAT;
+		    }
+
+		default :
+		    return primary->const_type;
+	    }
+
+	default :
+	    g_assert_not_reached();
+    }
+
+    return 0;
+}
+
+/* We only hash the rhss CSE works on. */
+static guint
+cse_rhs_hash (gconstpointer key)
+{
+    rhs_t *rhs = (rhs_t*)key;
+
+    switch (rhs->kind)
+    {
+	case RHS_INTERNAL :
+	    return g_direct_hash(rhs->v.internal);
+
+	case RHS_OP :
+	{
+	    guint hash = g_direct_hash(rhs->v.op.op);
+	    int i;
+
+	    for (i = 0; i < rhs->v.op.op->num_args; ++i)
+		hash = hash * 33 + primary_hash(&rhs->v.op.args[i]);
+	    return hash;
 	}
 
-	stmt = stmt->next;
+	default :
+	    return rhs->kind;
+    }
+}
+
+static gboolean
+cse_rhss_equal (gconstpointer a, gconstpointer b)
+{
+    return rhss_equal((rhs_t*)a, (rhs_t*)b);
+}
+
+static void
+cse_replace_rhs (rhs_t **rhs, statement_t *stmt, GHashTable *available, int *changed)
+{
+    value_t *val;
+
+    if ((*rhs)->kind != RHS_INTERNAL && (*rhs)->kind != RHS_OP)
+	return;
+
+    val = (value_t*)g_hash_table_lookup(available, *rhs);
+    if (val != NULL)
+    {
+	replace_rhs_with_value(rhs, val, stmt);
+	*changed = 1;
     }
 }
 
+/* available maps the rhss of the assignments dominating stmt to their
+   lhss.  The ones we add here are only available within the block,
+   so we remove them when we're done with it. */
 static void
-cse_recursively (statement_t *stmt, int *changed)
+cse_block (statement_t *stmt, GHashTable *available, int *changed)
 {
+    GSList *added = NULL, *l;
+
     while (stmt != 0)
     {
 	switch (stmt->kind)
@@ -4027,23 +4216,34 @@ cse_recursively (statement_t *stmt, int *changed)
 	    case STMT_NIL :
 		break;
 
-	    case STMT_ASSIGN :
-		if (stmt->v.assign.rhs->kind == RHS_INTERNAL
-		    || (stmt->v.assign.rhs->kind == RHS_OP
-			&& stmt->v.assign.rhs->v.op.op->is_pure))
-		    replace_rhs_recursively(stmt->next, stmt->v.assign.rhs, stmt->v.assign.lhs, changed);
+	    case STMT_PHI_ASSIGN :
+		cse_replace_rhs(&stmt->v.assign.rhs2, stmt, available, changed);
+		cse_replace_rhs(&stmt->v.assign.rhs, stmt, available, changed);
 		break;
 
-	    case STMT_PHI_ASSIGN :
+	    case STMT_ASSIGN :
+		cse_replace_rhs(&stmt->v.assign.rhs, stmt, available, changed);
+		if ((stmt->v.assign.rhs->kind == RHS_INTERNAL
+		     || (stmt->v.assign.rhs->kind == RHS_OP
+			 && stmt->v.assign.rhs->v.op.op->is_pure))
+		    && g_hash_table_lookup(available, stmt->v.assign.rhs) == NULL)
+		{
+		    g_hash_table_insert(available, stmt->v.assign.rhs, stmt->v.assign.lhs);
+		    added = g_slist_prepend(added, stmt->v.assign.rhs);
+		}
 		break;
 
 	    case STMT_IF_COND :
-		cse_recursively(stmt->v.if_cond.consequent, changed);
-		cse_recursively(stmt->v.if_cond.alternative, changed);
+		cse_replace_rhs(&stmt->v.if_cond.condition, stmt, available, changed);
+		cse_block(stmt->v.if_cond.consequent, available, changed);
+		cse_block(stmt->v.if_cond.alternative, available, changed);
+		cse_block(stmt->v.if_cond.exit, available, changed);
 		break;
 
 	    case STMT_WHILE_LOOP :
-		cse_recursively(stmt->v.while_loop.body, changed);
+		cse_replace_rhs(&stmt->v.while_loop.invariant, stmt, available, changed);
+		cse_block(stmt->v.while_loop.entry, available, changed);
+		cse_block(stmt->v.while_loop.body, available, changed);
 		break;
 
 	    default :
@@ -4052,14 +4252,21 @@ cse_recursively (statement_t *stmt, int *changed)
 
 	stmt = stmt->next;
     }
+
+    for (l = added; l != NULL; l = l->next)
+	g_hash_table_remove(available, l->data);
+    g_slist_free(added);
 }
 
 static int
 common_subexpression_elimination (void)
 {
+    GHashTable *available = g_hash_table_new(cse_rhs_hash, cse_rhss_equal);
     int changed = 0;
 
-    cse_recursively(first_stmt, &changed);
+    cse_block(first_stmt, available, &changed);
+
+    g_hash_table_destroy(available);
 
     return changed;
 }
@@ -4214,75 +4421,257 @@ optimize_make_tuple (void)
     return changed;
 }
 
-/*** inlining ***/
+/*** tuple escape analysis ***/
 
-static gboolean
-can_inline (filter_t *filter, inlining_history_t *history)
+/* Returns the length of the tuple produced by rhs if the C backend
+ * can build it in storage provided by the caller, 0 otherwise. */
+static int
+local_tuple_length_for_rhs (rhs_t *rhs)
 {
-    userval_info_t *info;
+    if (rhs->kind == RHS_TUPLE)
+	return rhs->v.tuple.length;
 
-    if (filter->kind != FILTER_MATHMAP)
-	return FALSE;
+    if (rhs->kind != RHS_OP)
+	return 0;
 
-    while (history != NULL)
+    switch (compiler_op_index(rhs->v.op.op))
     {
-	if (history->filter == filter)
-	{
-#ifdef DEBUG_OUTPUT
-	    printf("cannot inline filter %s due to recursion\n", filter->name);
-#endif
-	    return FALSE;
-	}
-	history = history->next;
+	case OP_ORIG_VAL :
+	case OP_ORIG_VAL_LOD :
+	case OP_APPLY_GRADIENT :
+	    return NUM_FLOATMAP_CHANNELS;
+
+	case OP_ELL_JAC :
+	case OP_SOLVE_LINEAR_3 :
+	case OP_SOLVE_POLY_3 :
+	    return 3;
+
+	case OP_SOLVE_LINEAR_2 :
+	case OP_SOLVE_POLY_2 :
+	    return 2;
+
+	default :
+	    return 0;
     }
+}
 
-    for (info = filter->userval_infos; info != NULL; info = info->next) 
+/* A tuple escapes the pixel if a pointer to it can survive the
+ * statement using it.  Reading elements, feeding it to a solver and
+ * outputting it are the only uses which don't let it escape. */
+static gboolean
+tuple_use_is_local (statement_t *stmt, value_t *value)
+{
+    rhs_t *rhs;
+    int i;
+
+    if (stmt->kind != STMT_ASSIGN)
+	return FALSE;
+
+    rhs = stmt->v.assign.rhs;
+    if (rhs->kind != RHS_OP)
+	return FALSE;
+
+    switch (compiler_op_index(rhs->v.op.op))
     {
-	userval_representation_t *rep = lookup_userval_representation(info->type);
+	case OP_TUPLE_NTH :
+	case OP_SOLVE_LINEAR_2 :
+	case OP_SOLVE_LINEAR_3 :
+	case OP_OUTPUT_TUPLE :
+	    break;
 
-	if (!rep)
-	{
-#ifdef DEBUG_OUTPUT
-	    printf("cannot inline filter %s because userval %s cannot be represented\n",
-		   filter->name, info->name);
-#endif
+	default :
 	    return FALSE;
-	}
     }
 
+    for (i = 0; i < rhs->v.op.op->num_args; ++i)
+	if (rhs->v.op.args[i].kind == PRIMARY_VALUE
+	    && rhs->v.op.args[i].v.value == value
+	    && rhs->v.op.op->arg_types[i] != TYPE_TUPLE)
+	    return FALSE;
+
     return TRUE;
 }
 
 static void
-insert_stmts_before (statement_t *stmts, statement_t **stmt, statement_t *new_parent)
+_analyze_tuple_escape (value_t *value, statement_t *stmt, void *info)
 {
-    statement_t *iter;
-    statement_t *last = last_stmt_of_block(stmts);
+    value_use_t *use;
+    int length;
 
-    for (iter = stmts; iter != NULL; iter = iter->next)
-    {
-	g_assert(iter->parent == NULL);
-	iter->parent = new_parent;
-    }
+    if (value->def != stmt
+	|| value->compvar->type != TYPE_TUPLE
+	|| stmt->kind != STMT_ASSIGN
+	|| compiler_is_permanent_const_value(value))
+	return;
 
-    g_assert(last->next == NULL);
+    length = local_tuple_length_for_rhs(stmt->v.assign.rhs);
+    if (length == 0)
+	return;
 
-    last->next = *stmt;
-    *stmt = stmts;
+    for (use = value->uses; use != 0; use = use->next)
+	if (!tuple_use_is_local(use->stmt, value))
+	    return;
+
+    value->local_tuple_length = length;
 }
 
-static void
-do_inlining_recursively (statement_t **stmt, gboolean *changed)
+static gboolean
+rhs_may_allocate (rhs_t *rhs, value_t *lhs)
 {
-    while (*stmt != NULL)
+    switch (rhs->kind)
     {
-	switch ((*stmt)->kind)
-	{
-	    case STMT_NIL :
-	    case STMT_PHI_ASSIGN :
-		break;
-
-	    case STMT_ASSIGN :
+	case RHS_PRIMARY :
+	case RHS_INTERNAL :
+	    return FALSE;
+
+	case RHS_TUPLE :
+	    return lhs == NULL || lhs->local_tuple_length == 0;
+
+	case RHS_OP :
+	    switch (compiler_op_index(rhs->v.op.op))
+	    {
+		/* the image might be a closure, which allocates its
+		   result */
+		case OP_ORIG_VAL :
+		case OP_ORIG_VAL_LOD :
+		case OP_RESIZE_IMAGE :
+		case OP_RENDER :
+		case OP_SET_TREE_VECTOR_NTH :
+		    return TRUE;
+
+		default :
+		    return local_tuple_length_for_rhs(rhs) > 0
+			&& (lhs == NULL || lhs->local_tuple_length == 0);
+	    }
+
+	default :
+	    return TRUE;
+    }
+}
+
+static gboolean
+stmts_may_allocate (statement_t *stmt)
+{
+    for (; stmt != 0; stmt = stmt->next)
+    {
+	switch (stmt->kind)
+	{
+	    case STMT_NIL :
+		break;
+
+	    case STMT_ASSIGN :
+	    case STMT_PHI_ASSIGN :
+		if (rhs_may_allocate(stmt->v.assign.rhs, stmt->v.assign.lhs))
+		    return TRUE;
+		if (stmt->kind == STMT_PHI_ASSIGN
+		    && rhs_may_allocate(stmt->v.assign.rhs2, stmt->v.assign.lhs))
+		    return TRUE;
+		break;
+
+	    case STMT_IF_COND :
+		if (rhs_may_allocate(stmt->v.if_cond.condition, NULL)
+		    || stmts_may_allocate(stmt->v.if_cond.consequent)
+		    || stmts_may_allocate(stmt->v.if_cond.alternative)
+		    || stmts_may_allocate(stmt->v.if_cond.exit))
+		    return TRUE;
+		break;
+
+	    case STMT_WHILE_LOOP :
+		if (rhs_may_allocate(stmt->v.while_loop.invariant, NULL)
+		    || stmts_may_allocate(stmt->v.while_loop.entry)
+		    || stmts_may_allocate(stmt->v.while_loop.body))
+		    return TRUE;
+		break;
+
+	    default :
+		g_assert_not_reached();
+	}
+    }
+
+    return FALSE;
+}
+
+/* Marks all tuples which don't escape the pixel they are computed
+ * for, so that the backend can keep them in local storage instead of
+ * allocating them from the pixel pools.  Returns whether the code
+ * might still allocate from the pools. */
+static gboolean
+analyze_tuple_escapes (void)
+{
+    COMPILER_FOR_EACH_VALUE_IN_STATEMENTS(first_stmt, &_analyze_tuple_escape);
+
+    return stmts_may_allocate(first_stmt);
+}
+
+/*** inlining ***/
+
+static gboolean
+can_inline (filter_t *filter, inlining_history_t *history)
+{
+    userval_info_t *info;
+
+    if (filter->kind != FILTER_MATHMAP)
+	return FALSE;
+
+    while (history != NULL)
+    {
+	if (history->filter == filter)
+	{
+#ifdef DEBUG_OUTPUT
+	    printf("cannot inline filter %s due to recursion\n", filter->name);
+#endif
+	    return FALSE;
+	}
+	history = history->next;
+    }
+
+    for (info = filter->userval_infos; info != NULL; info = info->next) 
+    {
+	userval_representation_t *rep = lookup_userval_representation(info->type);
+
+	if (!rep)
+	{
+#ifdef DEBUG_OUTPUT
+	    printf("cannot inline filter %s because userval %s cannot be represented\n",
+		   filter->name, info->name);
+#endif
+	    return FALSE;
+	}
+    }
+
+    return TRUE;
+}
+
+static void
+insert_stmts_before (statement_t *stmts, statement_t **stmt, statement_t *new_parent)
+{
+    statement_t *iter;
+    statement_t *last = last_stmt_of_block(stmts);
+
+    for (iter = stmts; iter != NULL; iter = iter->next)
+    {
+	g_assert(iter->parent == NULL);
+	iter->parent = new_parent;
+    }
+
+    g_assert(last->next == NULL);
+
+    last->next = *stmt;
+    *stmt = stmts;
+}
+
+static void
+do_inlining_recursively (statement_t **stmt, gboolean *changed)
+{
+    while (*stmt != NULL)
+    {
+	switch ((*stmt)->kind)
+	{
+	    case STMT_NIL :
+	    case STMT_PHI_ASSIGN :
+		break;
+
+	    case STMT_ASSIGN :
 		if ((*stmt)->v.assign.rhs->kind == RHS_FILTER
 		    && can_inline((*stmt)->v.assign.rhs->v.filter.filter, (*stmt)->v.assign.rhs->v.filter.history))
 		{
@@ -4672,36 +5061,350 @@ optimization_time_out (struct timeval *start, int timeout)
     return FALSE;
 }
 
-filter_code_t*
-compiler_generate_ir_code (filter_t *filter, int constant_analysis, int convert_types, int timeout, gboolean debug_output)
+/*** pass manager ***/
+
+/* The optimization passes run in the order of the pipeline, which is
+   repeated until none of them changes anything or the time limit is
+   reached.  The pipeline can be changed and passes disabled (by
+   name) before compiling, and we keep statistics about every pass
+   run, for every filter compiled, until they are reset. */
+
+typedef struct
 {
-    gboolean changed;
-    filter_code_t *code;
-    compvar_t *tuple_tmp, *dummy;
-    struct timeval tv;
+    const char *name;
+    gboolean (*run) (filter_t *filter);
+} compiler_pass_t;
 
-    g_assert(filter->kind == FILTER_MATHMAP);
+static gboolean
+pass_closure_application (filter_t *filter)
+{
+    optimize_closure_application(first_stmt);
+    return FALSE;
+}
 
-    gettimeofday(&tv, NULL);
+static gboolean
+pass_inlining (filter_t *filter)
+{
+    return do_inlining();
+}
 
-    next_temp_number = 1;
-    next_compvar_number = 1;
-    next_value_global_index = 0;
-    inlining_history = NULL;
+static gboolean
+pass_copy_propagation (filter_t *filter)
+{
+    return copy_propagation();
+}
 
-    tuple_tmp = make_temporary(TYPE_TUPLE);
-    first_stmt = gen_filter_code(filter, tuple_tmp, NULL, NULL, inlining_history);
+static gboolean
+pass_tuple_nth (filter_t *filter)
+{
+    return optimize_tuple_nth();
+}
 
-    emit_loc = &(last_stmt_of_block(first_stmt)->next);
+static gboolean
+pass_make_tuple (filter_t *filter)
+{
+    return optimize_make_tuple();
+}
 
-    dummy = make_temporary(TYPE_INT);
-    emit_assign(make_lhs(dummy), make_op_rhs(OP_OUTPUT_TUPLE, make_compvar_primary(tuple_tmp)));
+static gboolean
+pass_licm (filter_t *filter)
+{
+    return compiler_opt_loop_invariant_code_motion(&first_stmt);
+}
 
-    emit_loc = NULL;
+static gboolean
+pass_cse (filter_t *filter)
+{
+    return common_subexpression_elimination();
+}
+
+static gboolean
+pass_constant_folding (filter_t *filter)
+{
+    return constant_folding();
+}
+
+static gboolean
+pass_simplify_ops (filter_t *filter)
+{
+    return simplify_ops();
+}
+
+static gboolean
+pass_orig_val_resize (filter_t *filter)
+{
+    return compiler_opt_orig_val_resize(&first_stmt);
+}
+
+static gboolean
+pass_orig_val_lod (filter_t *filter)
+{
+    /* The internals x and y are only the pixel coordinates in the
+       main filter. */
+    if (filter != main_filter)
+	return FALSE;
+    return compiler_opt_orig_val_lod(filter, &first_stmt);
+}
+
+static gboolean
+pass_strip_resize (filter_t *filter)
+{
+    return compiler_opt_strip_resize(&first_stmt);
+}
+
+static gboolean
+pass_simplify (filter_t *filter)
+{
+    return compiler_opt_simplify(filter, first_stmt);
+}
+
+static gboolean
+pass_dead_assignments (filter_t *filter)
+{
+    return compiler_opt_remove_dead_assignments(first_stmt);
+}
+
+static gboolean
+pass_dead_branches (filter_t *filter)
+{
+    return remove_dead_branches();
+}
+
+static gboolean
+pass_dead_controls (filter_t *filter)
+{
+    return remove_dead_controls();
+}
+
+static compiler_pass_t passes[] = {
+    { "closure-application", pass_closure_application },
+    { "inlining", pass_inlining },
+    { "copy-propagation", pass_copy_propagation },
+    { "tuple-nth", pass_tuple_nth },
+    { "make-tuple", pass_make_tuple },
+    { "licm", pass_licm },
+    { "cse", pass_cse },
+    { "constant-folding", pass_constant_folding },
+    { "simplify-ops", pass_simplify_ops },
+    { "orig-val-resize", pass_orig_val_resize },
+    { "orig-val-lod", pass_orig_val_lod },
+    { "strip-resize", pass_strip_resize },
+    { "simplify", pass_simplify },
+    { "dead-assignments", pass_dead_assignments },
+    { "dead-branches", pass_dead_branches },
+    { "dead-controls", pass_dead_controls }
+};
+
+#define NUM_PASSES		(sizeof(passes) / sizeof(passes[0]))
+#define MAX_PIPELINE_LENGTH	64
+
+static const char *default_pipeline =
+    "closure-application,inlining,copy-propagation,tuple-nth,make-tuple,licm,cse,"
+    "copy-propagation,constant-folding,simplify-ops,orig-val-resize,strip-resize,"
+    "simplify,dead-assignments,dead-branches,dead-controls";
+
+static int pipeline[MAX_PIPELINE_LENGTH];
+static int pipeline_length = -1;
+static gboolean pass_disabled[NUM_PASSES];
+
+typedef struct
+{
+    int num_runs;
+    int num_changes;
+    gint64 usecs;
+} pass_stats_t;
+
+typedef struct
+{
+    char *filter_name;
+    int num_iterations;
+    gint64 usecs;
+    gboolean timed_out;
+    pass_stats_t passes[NUM_PASSES];
+} filter_pass_stats_t;
+
+static gboolean collect_pass_stats = FALSE;
+static GPtrArray *filter_pass_stats = NULL;
+
+static int
+lookup_pass (const char *name)
+{
+    int i;
+
+    for (i = 0; i < NUM_PASSES; ++i)
+	if (strcmp(passes[i].name, name) == 0)
+	    return i;
+    return -1;
+}
+
+static void
+set_unknown_pass_error (const char *name)
+{
+    GString *names = g_string_new("");
+    int i;
+
+    for (i = 0; i < NUM_PASSES; ++i)
+    {
+	if (i > 0)
+	    g_string_append(names, ", ");
+	g_string_append(names, passes[i].name);
+    }
+
+    sprintf(error_string, _("Unknown optimization pass `%.100s'.  Passes are: %s."), name, names->str);
+
+    g_string_free(names, TRUE);
+}
+
+/* Sets the passes to run, as a comma-separated list of pass names.
+   Passes can occur more than once.  If spec is NULL the default
+   pipeline is used.  Returns FALSE and sets error_string if a pass
+   is unknown. */
+gboolean
+compiler_set_pass_pipeline (const char *spec)
+{
+    int new_pipeline[MAX_PIPELINE_LENGTH];
+    int new_length = 0;
+    char **names;
+    int i;
+
+    if (spec == NULL)
+	spec = default_pipeline;
+
+    names = g_strsplit(spec, ",", 0);
+
+    for (i = 0; names[i] != NULL; ++i)
+    {
+	char *name = g_strstrip(names[i]);
+	int pass;
+
+	if (name[0] == '\0')
+	    continue;
+
+	pass = lookup_pass(name);
+	if (pass < 0)
+	{
+	    set_unknown_pass_error(name);
+	    g_strfreev(names);
+	    return FALSE;
+	}
+
+	if (new_length == MAX_PIPELINE_LENGTH)
+	{
+	    sprintf(error_string, _("The optimization pipeline can have at most %d passes."), MAX_PIPELINE_LENGTH);
+	    g_strfreev(names);
+	    return FALSE;
+	}
+
+	new_pipeline[new_length++] = pass;
+    }
+
+    g_strfreev(names);
+
+    memcpy(pipeline, new_pipeline, sizeof(int) * new_length);
+    pipeline_length = new_length;
+
+    return TRUE;
+}
+
+gboolean
+compiler_disable_pass (const char *name)
+{
+    int pass = lookup_pass(name);
+
+    if (pass < 0)
+    {
+	set_unknown_pass_error(name);
+	return FALSE;
+    }
+
+    pass_disabled[pass] = TRUE;
+    return TRUE;
+}
+
+/* Appends a pass to the pipeline, which is the default pipeline if
+   none has been set.  Used for passes which aren't run by default. */
+gboolean
+compiler_enable_pass (const char *name)
+{
+    int pass = lookup_pass(name);
+
+    if (pass < 0)
+    {
+	set_unknown_pass_error(name);
+	return FALSE;
+    }
+
+    if (pipeline_length < 0)
+    {
+	gboolean result = compiler_set_pass_pipeline(NULL);
+	g_assert(result);
+    }
+
+    if (pipeline_length == MAX_PIPELINE_LENGTH)
+    {
+	sprintf(error_string, _("The optimization pipeline can have at most %d passes."), MAX_PIPELINE_LENGTH);
+	return FALSE;
+    }
+
+    pipeline[pipeline_length++] = pass;
+    pass_disabled[pass] = FALSE;
+    return TRUE;
+}
+
+void
+compiler_collect_pass_stats (gboolean collect)
+{
+    collect_pass_stats = collect;
+}
+
+void
+compiler_reset_pass_stats (void)
+{
+    int i;
+
+    if (filter_pass_stats == NULL)
+	return;
+
+    for (i = 0; i < filter_pass_stats->len; ++i)
+    {
+	filter_pass_stats_t *stats = g_ptr_array_index(filter_pass_stats, i);
+
+	g_free(stats->filter_name);
+	g_free(stats);
+    }
+    g_ptr_array_set_size(filter_pass_stats, 0);
+}
+
+static gint64
+usecs_since (struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+
+    return (gint64)(now.tv_sec - start->tv_sec) * 1000000 + (now.tv_usec - start->tv_usec);
+}
+
+static void
+run_passes (filter_t *filter, struct timeval *start, int timeout, gboolean debug_output)
+{
+    filter_pass_stats_t filter_stats;
+    filter_pass_stats_t *stats = &filter_stats;
+    gboolean changed;
+
+    if (pipeline_length < 0)
+    {
+	gboolean result = compiler_set_pass_pipeline(NULL);
+	g_assert(result);
+    }
+
+    memset(stats, 0, sizeof(filter_pass_stats_t));
 
     changed = TRUE;
-    while (changed && !optimization_time_out(&tv, timeout))
+    while (changed && !optimization_time_out(start, timeout))
     {
+	int i;
+
 #ifdef DEBUG_OUTPUT
 	check_ssa(first_stmt);
 #endif
@@ -4712,56 +5415,181 @@ compiler_generate_ir_code (filter_t *filter, int constant_analysis, int convert_
 	    dump_code(first_stmt, 0);
 	}
 
-	optimize_closure_application(first_stmt);
-	CHECK_SSA;
-
 	changed = FALSE;
 
-	changed = do_inlining() || changed;
-	CHECK_SSA;
-	changed = copy_propagation() || changed;
-	CHECK_SSA;
-	changed = optimize_tuple_nth() || changed;
-	CHECK_SSA;
-	changed = optimize_make_tuple() || changed;
-	CHECK_SSA;
-	/*
-	changed = compiler_opt_loop_invariant_code_motion(&first_stmt) || changed;
-	CHECK_SSA;
-	*/
-	changed = common_subexpression_elimination() || changed;
-	CHECK_SSA;
-	changed = copy_propagation() || changed;
-	CHECK_SSA;
-	changed = constant_folding() || changed;
-	CHECK_SSA;
-	changed = simplify_ops() || changed;
-	CHECK_SSA;
-
-	if (debug_output)
+	for (i = 0; i < pipeline_length; ++i)
 	{
-	    printf("-------------------------------- before resize\n");
-	    dump_code(first_stmt, 0);
+	    int pass = pipeline[i];
+	    pass_stats_t *pass_stats = &stats->passes[pass];
+	    struct timeval pass_start;
+
+	    if (pass_disabled[pass])
+		continue;
+
+	    gettimeofday(&pass_start, NULL);
+
+	    ++pass_stats->num_runs;
+	    if (passes[pass].run(filter))
+	    {
+		++pass_stats->num_changes;
+		changed = TRUE;
+
+		if (debug_output)
+		{
+		    printf("-------------------------------- after %s\n", passes[pass].name);
+		    dump_code(first_stmt, 0);
+		}
+	    }
+	    CHECK_SSA;
+
+	    pass_stats->usecs += usecs_since(&pass_start);
 	}
-	changed = compiler_opt_orig_val_resize(&first_stmt) || changed;
-	CHECK_SSA;
-	if (debug_output)
+
+	++stats->num_iterations;
+    }
+
+    stats->timed_out = changed;
+    stats->usecs = usecs_since(start);
+
+#ifdef DEBUG_OUTPUT
+    if (stats->timed_out)
+	g_print("optimization of filter %s timed out after %d iterations\n", filter->name, stats->num_iterations);
+#endif
+
+    /* Only keep the statistics if someone is going to write them
+       out - otherwise every compile would add a record. */
+    if (collect_pass_stats)
+    {
+	if (filter_pass_stats == NULL)
+	    filter_pass_stats = g_ptr_array_new();
+	stats = g_memdup(&filter_stats, sizeof(filter_pass_stats_t));
+	stats->filter_name = g_strdup(filter->name);
+	g_ptr_array_add(filter_pass_stats, stats);
+    }
+}
+
+static void
+write_json_string (FILE *out, const char *str)
+{
+    putc('"', out);
+    for (; *str != '\0'; ++str)
+    {
+	if (*str == '"' || *str == '\\')
+	    fprintf(out, "\\%c", *str);
+	else if ((unsigned char)*str < 0x20)
+	    fprintf(out, "\\u%04x", (unsigned char)*str);
+	else
+	    putc(*str, out);
+    }
+    putc('"', out);
+}
+
+static void
+write_pass_stats_json (FILE *out, const char *name, pass_stats_t *stats)
+{
+    fprintf(out, "{ \"name\": ");
+    write_json_string(out, name);
+    fprintf(out, ", \"runs\": %d, \"changes\": %d, \"ms\": %.3f }",
+	    stats->num_runs, stats->num_changes, stats->usecs / 1000.0);
+}
+
+/* Writes the pipeline and the statistics of all compilations since
+   the last reset as a JSON object. */
+void
+compiler_write_pass_stats_json (FILE *out)
+{
+    pass_stats_t totals[NUM_PASSES];
+    int num_filters = filter_pass_stats == NULL ? 0 : filter_pass_stats->len;
+    int i, j;
+    gboolean first;
+
+    if (pipeline_length < 0)
+    {
+	gboolean result = compiler_set_pass_pipeline(NULL);
+	g_assert(result);
+    }
+
+    memset(totals, 0, sizeof(totals));
+
+    fprintf(out, "{\n  \"pipeline\": [");
+    first = TRUE;
+    for (i = 0; i < pipeline_length; ++i)
+    {
+	if (pass_disabled[pipeline[i]])
+	    continue;
+	fprintf(out, first ? " " : ", ");
+	write_json_string(out, passes[pipeline[i]].name);
+	first = FALSE;
+    }
+    fprintf(out, " ],\n  \"filters\": [");
+
+    for (i = 0; i < num_filters; ++i)
+    {
+	filter_pass_stats_t *stats = g_ptr_array_index(filter_pass_stats, i);
+
+	fprintf(out, "%s\n    { \"name\": ", i > 0 ? "," : "");
+	write_json_string(out, stats->filter_name);
+	fprintf(out, ", \"iterations\": %d, \"ms\": %.3f, \"timed_out\": %s,\n      \"passes\": [",
+		stats->num_iterations, stats->usecs / 1000.0, stats->timed_out ? "true" : "false");
+
+	first = TRUE;
+	for (j = 0; j < NUM_PASSES; ++j)
 	{
-	    printf("-------------------------------- after resize\n");
-	    dump_code(first_stmt, 0);
+	    if (stats->passes[j].num_runs == 0)
+		continue;
+
+	    fprintf(out, "%s\n        ", first ? "" : ",");
+	    write_pass_stats_json(out, passes[j].name, &stats->passes[j]);
+	    first = FALSE;
+
+	    totals[j].num_runs += stats->passes[j].num_runs;
+	    totals[j].num_changes += stats->passes[j].num_changes;
+	    totals[j].usecs += stats->passes[j].usecs;
 	}
+	fprintf(out, " ] }");
+    }
 
-	changed = compiler_opt_strip_resize(&first_stmt) || changed;
-	CHECK_SSA;
-	changed = compiler_opt_simplify(filter, first_stmt) || changed;
-	CHECK_SSA;
+    fprintf(out, " ],\n  \"passes\": [");
+    first = TRUE;
+    for (j = 0; j < NUM_PASSES; ++j)
+    {
+	if (totals[j].num_runs == 0)
+	    continue;
 
-	changed = compiler_opt_remove_dead_assignments(first_stmt) || changed;
-	CHECK_SSA;
-	changed = remove_dead_branches() || changed;
-	CHECK_SSA;
-	changed = remove_dead_controls() || changed;
+	fprintf(out, "%s\n    ", first ? "" : ",");
+	write_pass_stats_json(out, passes[j].name, &totals[j]);
+	first = FALSE;
     }
+    fprintf(out, " ]\n}\n");
+}
+
+filter_code_t*
+compiler_generate_ir_code (filter_t *filter, int constant_analysis, int convert_types, int timeout, gboolean debug_output)
+{
+    filter_code_t *code;
+    compvar_t *tuple_tmp, *dummy;
+    struct timeval tv;
+
+    g_assert(filter->kind == FILTER_MATHMAP);
+
+    gettimeofday(&tv, NULL);
+
+    next_temp_number = 1;
+    next_compvar_number = 1;
+    next_value_global_index = 0;
+    inlining_history = NULL;
+
+    tuple_tmp = make_temporary(TYPE_TUPLE);
+    first_stmt = gen_filter_code(filter, tuple_tmp, NULL, NULL, inlining_history);
+
+    emit_loc = &(last_stmt_of_block(first_stmt)->next);
+
+    dummy = make_temporary(TYPE_INT);
+    emit_assign(make_lhs(dummy), make_op_rhs(OP_OUTPUT_TUPLE, make_compvar_primary(tuple_tmp)));
+
+    emit_loc = NULL;
+
+    run_passes(filter, &tv, timeout, debug_output);
 
     CHECK_SSA;
     propagate_types();
@@ -4788,14 +5616,71 @@ compiler_generate_ir_code (filter_t *filter, int constant_analysis, int convert_
 
     code->filter = filter;
     code->first_stmt = first_stmt;
+    code->uses_pixel_pools = analyze_tuple_escapes();
 
     first_stmt = 0;
 
     return code;
 }
 
+static gboolean
+rhs_references_filter (rhs_t *rhs, filter_t *filter)
+{
+    return (rhs->kind == RHS_FILTER && rhs->v.filter.filter == filter)
+	|| (rhs->kind == RHS_CLOSURE && rhs->v.closure.filter == filter);
+}
+
+static gboolean
+stmts_reference_filter (statement_t *stmt, filter_t *filter)
+{
+    for (; stmt != NULL; stmt = stmt->next)
+    {
+	switch (stmt->kind)
+	{
+	    case STMT_NIL :
+		break;
+
+	    case STMT_ASSIGN :
+		if (rhs_references_filter(stmt->v.assign.rhs, filter))
+		    return TRUE;
+		break;
+
+	    case STMT_PHI_ASSIGN :
+		if (rhs_references_filter(stmt->v.assign.rhs, filter)
+		    || rhs_references_filter(stmt->v.assign.rhs2, filter))
+		    return TRUE;
+		break;
+
+	    case STMT_IF_COND :
+		if (rhs_references_filter(stmt->v.if_cond.condition, filter)
+		    || stmts_reference_filter(stmt->v.if_cond.consequent, filter)
+		    || stmts_reference_filter(stmt->v.if_cond.alternative, filter)
+		    || stmts_reference_filter(stmt->v.if_cond.exit, filter))
+		    return TRUE;
+		break;
+
+	    case STMT_WHILE_LOOP :
+		if (stmts_reference_filter(stmt->v.while_loop.entry, filter)
+		    || rhs_references_filter(stmt->v.while_loop.invariant, filter)
+		    || stmts_reference_filter(stmt->v.while_loop.body, filter))
+		    return TRUE;
+		break;
+
+	    default :
+		g_assert_not_reached();
+	}
+    }
+
+    return FALSE;
+}
+
+/* If uservals is not NULL, the main filter is specialized for the
+   values of its int, float and bool user values.  That is only
+   possible if no filter references the main filter, because those
+   references would pass other values.  Returns NULL if it's not
+   possible, in which case the compiler pools are already freed. */
 filter_code_t**
-compiler_compile_filters (mathmap_t *mathmap, int timeout)
+compiler_compile_filters (mathmap_t *mathmap, int timeout, userval_t *uservals)
 {
     filter_code_t **filter_codes;
     int num_filters, i;
@@ -4809,6 +5694,10 @@ compiler_compile_filters (mathmap_t *mathmap, int timeout)
     init_pools(&compiler_pools);
     vector_variables = g_hash_table_new(g_direct_hash, g_direct_equal);
 
+    constant_uservals_filter = uservals != NULL ? mathmap->main_filter : NULL;
+    constant_uservals = uservals;
+    main_filter = mathmap->main_filter;
+
     num_filters = 0;
     for (filter = mathmap->filters; filter != 0; filter = filter->next)
 	++num_filters;
@@ -4828,6 +5717,27 @@ compiler_compile_filters (mathmap_t *mathmap, int timeout)
 	filter_codes[i] = compiler_generate_ir_code(filter, 1, 0, timeout, debug_output && filter == mathmap->main_filter);
     }
 
+    constant_uservals_filter = NULL;
+    constant_uservals = NULL;
+    main_filter = NULL;
+
+    if (uservals != NULL)
+    {
+	for (i = 0, filter = mathmap->filters;
+	     filter != 0;
+	     ++i, filter = filter->next)
+	{
+	    if (filter->kind != FILTER_MATHMAP)
+		continue;
+
+	    if (stmts_reference_filter(filter_codes[i]->first_stmt, mathmap->main_filter))
+	    {
+		compiler_free_pools(mathmap);
+		return NULL;
+	    }
+	}
+    }
+
     return filter_codes;
 }
 
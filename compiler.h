@@ -51,6 +51,8 @@ typedef union
 /* All the functions required to render an image efficiently */
 typedef struct _mathfuncs_t
 {
+    const char *filter_name;
+
     init_frame_func_t init_frame;
     init_slice_func_t init_slice;
     calc_lines_func_t calc_lines;
@@ -73,6 +75,13 @@ struct _filter_code_t;
 
 void init_compiler (void);
 
+gboolean compiler_set_pass_pipeline (const char *spec);
+gboolean compiler_disable_pass (const char *name);
+gboolean compiler_enable_pass (const char *name);
+void compiler_collect_pass_stats (gboolean collect);
+void compiler_reset_pass_stats (void);
+void compiler_write_pass_stats_json (FILE *out);
+
 void set_opmacros_filename (const char *filename);
 int compiler_template_processor (struct _mathmap_t *mathmap, const char *directive, const char *arg, FILE *out, void *data);
 
@@ -138,7 +138,7 @@ stmt_only_contains_values_in_set (statement_t *stmt, value_set_t *values)
 
 		values_copy = compiler_value_set_copy(values);
 		add_values_from_phis(stmt->v.while_loop.entry, values_copy);
-		COMPILER_FOR_EACH_VALUE_IN_RHS(stmt->v.while_loop.invariant, &_check_value_in_set, values, &all_values_in_set);
+		COMPILER_FOR_EACH_VALUE_IN_RHS(stmt->v.while_loop.invariant, &_check_value_in_set, values_copy, &all_values_in_set);
 		if (all_values_in_set)
 		    all_values_in_set = stmts_only_contain_values_in_set(stmt->v.while_loop.body, values_copy);
 		if (all_values_in_set)
@@ -181,6 +181,141 @@ stmts_only_contain_values_in_set (statement_t *stmts, value_set_t *values)
     return TRUE;
 }
 
+static gboolean
+rhs_is_pure (rhs_t *rhs)
+{
+    if (rhs->kind == RHS_CLOSURE
+	&& rhs->v.closure.filter->kind == FILTER_NATIVE
+	&& !rhs->v.closure.filter->v.native.is_pure)
+	return FALSE;
+    return compiler_rhs_is_pure(rhs);
+}
+
+static gboolean stmts_are_pure (statement_t *stmts);
+
+/* Moving a statement out of a loop changes how often, and possibly
+   whether at all, it is executed, so only statements without side
+   effects may be moved. */
+static gboolean
+stmt_is_pure (statement_t *stmt)
+{
+    switch (stmt->kind)
+    {
+	case STMT_NIL :
+	    return TRUE;
+
+	case STMT_ASSIGN :
+	    return rhs_is_pure(stmt->v.assign.rhs);
+
+	case STMT_PHI_ASSIGN :
+	    return rhs_is_pure(stmt->v.assign.rhs) && rhs_is_pure(stmt->v.assign.rhs2);
+
+	case STMT_IF_COND :
+	    return rhs_is_pure(stmt->v.if_cond.condition)
+		&& stmts_are_pure(stmt->v.if_cond.consequent)
+		&& stmts_are_pure(stmt->v.if_cond.alternative)
+		&& stmts_are_pure(stmt->v.if_cond.exit);
+
+	case STMT_WHILE_LOOP :
+	    return rhs_is_pure(stmt->v.while_loop.invariant)
+		&& stmts_are_pure(stmt->v.while_loop.entry)
+		&& stmts_are_pure(stmt->v.while_loop.body);
+
+	default :
+	    g_assert_not_reached();
+    }
+}
+
+static gboolean
+stmts_are_pure (statement_t *stmts)
+{
+    for (; stmts != NULL; stmts = stmts->next)
+	if (!stmt_is_pure(stmts))
+	    return FALSE;
+    return TRUE;
+}
+
+/* Cheap ops are the ones that compile to a few instructions and
+   can't fault, so they can be executed even if their result is not
+   needed.  Being foldable is not enough: noise, the elliptic
+   integrals and gamma are foldable, too. */
+static gboolean
+rhs_is_cheap (rhs_t *rhs)
+{
+    switch (rhs->kind)
+    {
+	case RHS_PRIMARY :
+	case RHS_INTERNAL :
+	    return TRUE;
+
+	case RHS_OP :
+	    switch (compiler_op_index(rhs->v.op.op))
+	    {
+		case OP_INT_TO_FLOAT :
+		case OP_FLOAT_TO_INT :
+		case OP_INT_TO_COMPLEX :
+		case OP_FLOAT_TO_COMPLEX :
+		case OP_ADD :
+		case OP_SUB :
+		case OP_NEG :
+		case OP_MUL :
+		case OP_DIV :
+		case OP_ABS :
+		case OP_MIN :
+		case OP_MAX :
+		case OP_FLOOR :
+		case OP_CEIL :
+		case OP_EQ :
+		case OP_LESS :
+		case OP_LEQ :
+		case OP_NOT :
+		case OP_COMPLEX :
+		case OP_C_REAL :
+		case OP_C_IMAG :
+		    g_assert(rhs->v.op.op->is_pure);
+		    return TRUE;
+
+		default :
+		    return FALSE;
+	    }
+
+	default :
+	    return FALSE;
+    }
+}
+
+/* Moves cheap, pure, loop-invariant assignments out of the
+   conditionals in a loop body and in front of the loop, so that they
+   are computed once instead of in every iteration in which the
+   condition holds. */
+static void
+hoist_from_conditionals (statement_t **stmtp, value_set_t *set_values, statement_t ***loop, gboolean *did_change)
+{
+    while (*stmtp != NULL)
+    {
+	statement_t *stmt = *stmtp;
+
+	if (stmt->kind == STMT_ASSIGN
+	    && rhs_is_cheap(stmt->v.assign.rhs)
+	    && stmt_only_contains_values_in_set(stmt, set_values))
+	{
+	    compiler_stmt_unlink(stmtp);
+	    *loop = compiler_stmt_insert_before(stmt, *loop);
+	    add_values_from_stmt(stmt, set_values);
+	    *did_change = TRUE;
+	    continue;
+	}
+
+	if (stmt->kind == STMT_IF_COND)
+	{
+	    hoist_from_conditionals(&stmt->v.if_cond.consequent, set_values, loop, did_change);
+	    hoist_from_conditionals(&stmt->v.if_cond.alternative, set_values, loop, did_change);
+	}
+
+	stmtp = &stmt->next;
+    }
+}
+
 static gboolean
 process_loop (statement_t **loop, value_set_t *set_values)
 {
@@ -194,7 +329,7 @@ process_loop (statement_t **loop, value_set_t *set_values)
     iter = &(*loop)->v.while_loop.body;
     while (*iter != NULL)
     {
-	if (stmt_only_contains_values_in_set(*iter, set_values))
+	if (stmt_is_pure(*iter) && stmt_only_contains_values_in_set(*iter, set_values))
 	{
 	    statement_t *stmt = compiler_stmt_unlink(iter);
 
@@ -203,7 +338,15 @@ process_loop (statement_t **loop, value_set_t *set_values)
 	    did_change = TRUE;
 	}
 	else
+	{
+	    if ((*iter)->kind == STMT_IF_COND)
+	    {
+		hoist_from_conditionals(&(*iter)->v.if_cond.consequent, set_values, &loop, &did_change);
+		hoist_from_conditionals(&(*iter)->v.if_cond.alternative, set_values, &loop, &did_change);
+	    }
+
 	    iter = &(*iter)->next;
+	}
     }
 
     compiler_free_value_set(set_values);
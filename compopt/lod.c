@@ -0,0 +1,323 @@
+/*
+ * lod.c
+ *
+ * MathMap
+ *
+ * Copyright (C) 2009 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <glib.h>
+
+#include "../compiler-internals.h"
+
+/*** ORIG_VAL level of detail ***/
+
+/* To pick a mipmap level for an ORIG_VAL we need to know how far
+   apart the lookups of neighbouring pixels are.  We compute the
+   lookup coordinates a second time with x moved by one pixel and a
+   third time with y moved by one pixel, by cloning the statements
+   they depend on, and turn the ORIG_VAL into an ORIG_VAL_LOD whose
+   footprint is the larger of the two distances.
+
+   Only assignments of pure operations can be cloned, so lookups
+   whose coordinates depend on the pixel through a conditional or a
+   loop are left alone. */
+
+#define MAX_CLONED_STMTS	64
+
+#define SHIFT_FAILED		0
+#define SHIFT_UNCHANGED		1
+#define SHIFT_CHANGED		2
+
+typedef struct
+{
+    int status;
+    primary_t primary;		/* if status is SHIFT_CHANGED */
+} shifted_value_t;
+
+typedef struct
+{
+    internal_t *internal;	/* the pixel coordinate we move */
+    primary_t step;		/* one pixel in that coordinate */
+    GHashTable *shifted_values;	/* value_t* -> shifted_value_t* */
+    int num_cloned;
+    statement_t **loc;		/* where new statements go */
+    statement_t *parent;
+} shift_t;
+
+static primary_t
+emit_before (shift_t *shift, rhs_t *rhs)
+{
+    compvar_t *temp = compiler_make_temporary(TYPE_INT);
+
+    shift->loc = compiler_emit_stmt_before(compiler_make_assign(compiler_make_lhs(temp), rhs),
+					   shift->loc, shift->parent);
+    ++shift->num_cloned;
+
+    return compiler_make_compvar_primary(temp);
+}
+
+static int shift_value (shift_t *shift, value_t *value, primary_t *result);
+
+static int
+shift_primaries (shift_t *shift, primary_t *primaries, int num_primaries, primary_t *results)
+{
+    int status = SHIFT_UNCHANGED;
+    int i;
+
+    for (i = 0; i < num_primaries; ++i)
+    {
+	int arg_status = SHIFT_UNCHANGED;
+
+	results[i] = primaries[i];
+	if (primaries[i].kind == PRIMARY_VALUE)
+	    arg_status = shift_value(shift, primaries[i].v.value, &results[i]);
+
+	if (arg_status == SHIFT_FAILED)
+	    return SHIFT_FAILED;
+	if (arg_status == SHIFT_CHANGED)
+	    status = SHIFT_CHANGED;
+    }
+
+    return status;
+}
+
+/* Makes *result the value of value computed for the moved pixel,
+   cloning the statements necessary. */
+static int
+shift_value (shift_t *shift, value_t *value, primary_t *result)
+{
+    shifted_value_t *shifted = g_hash_table_lookup(shift->shifted_values, value);
+    statement_t *def = value->def;
+    int status = SHIFT_FAILED;
+
+    if (shifted != NULL)
+    {
+	if (shifted->status == SHIFT_CHANGED)
+	    *result = shifted->primary;
+	return shifted->status;
+    }
+
+    if (shift->num_cloned < MAX_CLONED_STMTS
+	&& def != NULL && def->kind == STMT_ASSIGN)
+    {
+	rhs_t *rhs = def->v.assign.rhs;
+
+	switch (rhs->kind)
+	{
+	    case RHS_PRIMARY :
+		status = shift_primaries(shift, &rhs->v.primary, 1, result);
+		break;
+
+	    case RHS_INTERNAL :
+		if (rhs->v.internal == shift->internal)
+		{
+		    *result = emit_before(shift, compiler_make_op_rhs(OP_ADD,
+								      compiler_make_value_primary(value),
+								      shift->step));
+		    status = SHIFT_CHANGED;
+		}
+		else
+		    status = SHIFT_UNCHANGED;
+		break;
+
+	    case RHS_OP :
+		{
+		    int op_index = compiler_op_index(rhs->v.op.op);
+		    primary_t args[MAX_OP_ARGS];
+
+		    /* We don't want to look up pixels twice more. */
+		    if (!compiler_rhs_is_pure(rhs) || op_index == OP_ORIG_VAL || op_index == OP_ORIG_VAL_LOD)
+			break;
+
+		    status = shift_primaries(shift, rhs->v.op.args, rhs->v.op.op->num_args, args);
+		    if (status == SHIFT_CHANGED)
+			*result = emit_before(shift, compiler_make_op_rhs_from_array(op_index, args));
+		}
+		break;
+
+	    case RHS_TUPLE :
+		{
+		    primary_t args[rhs->v.tuple.length];
+
+		    status = shift_primaries(shift, rhs->v.tuple.args, rhs->v.tuple.length, args);
+		    if (status == SHIFT_CHANGED)
+			*result = emit_before(shift, compiler_make_tuple_rhs_from_array(rhs->v.tuple.length, args));
+		}
+		break;
+
+	    default :
+		break;
+	}
+    }
+
+    shifted = g_new(shifted_value_t, 1);
+    shifted->status = status;
+    if (status == SHIFT_CHANGED)
+	shifted->primary = *result;
+    g_hash_table_insert(shift->shifted_values, value, shifted);
+
+    return status;
+}
+
+/* Emits the distance between the lookup at (x,y) and the one for the
+   pixel moved in the coordinate internal, before *stmt.  Returns
+   FALSE if the moved lookup cannot be computed. */
+static gboolean
+emit_lookup_distance (filter_t *filter, statement_t ***stmt, const char *internal_name, const char *size_name,
+		      primary_t x, primary_t y, primary_t *distance, gboolean *is_zero)
+{
+    shift_t shift;
+    primary_t moved[2], coords[2], deltas[2], size;
+    int status;
+    int i;
+
+    shift.internal = lookup_internal(filter->v.mathmap.internals, internal_name, TRUE);
+    g_assert(shift.internal != NULL);
+    shift.shifted_values = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+    shift.num_cloned = 0;
+    shift.loc = *stmt;
+    shift.parent = (**stmt)->parent;
+
+    /* The pixel coordinates go from -1 to 1 over the rendered image,
+       see CALC_VIRTUAL_X and CALC_VIRTUAL_Y. */
+    size = emit_before(&shift, compiler_make_internal_rhs(lookup_internal(filter->v.mathmap.internals, size_name, TRUE)));
+    size = emit_before(&shift, compiler_make_op_rhs(OP_SUB, size, compiler_make_int_const_primary(1)));
+    shift.step = emit_before(&shift, compiler_make_op_rhs(OP_DIV, compiler_make_float_const_primary(2.0), size));
+
+    coords[0] = x;
+    coords[1] = y;
+    status = shift_primaries(&shift, coords, 2, moved);
+
+    if (status == SHIFT_CHANGED)
+    {
+	for (i = 0; i < 2; ++i)
+	    deltas[i] = emit_before(&shift, compiler_make_op_rhs(OP_SUB, moved[i], coords[i]));
+	*distance = emit_before(&shift, compiler_make_op_rhs(OP_HYPOT, deltas[0], deltas[1]));
+    }
+
+    g_hash_table_destroy(shift.shifted_values);
+
+    *stmt = shift.loc;
+    *is_zero = status == SHIFT_UNCHANGED;
+
+    return status != SHIFT_FAILED;
+}
+
+/* Removes the statements from *first up to, but not including,
+   last. */
+static void
+remove_stmts_before (statement_t **first, statement_t *last)
+{
+    while (*first != last)
+    {
+	g_assert((*first)->kind == STMT_ASSIGN);
+	compiler_remove_uses_in_rhs((*first)->v.assign.rhs, *first);
+	compiler_stmt_unlink(first);
+    }
+}
+
+static gboolean
+add_lookup_footprint (filter_t *filter, statement_t ***stmt)
+{
+    statement_t **first = *stmt;
+    statement_t *lookup = **stmt;
+    primary_t x = compiler_stmt_op_assign_arg(lookup, 0);
+    primary_t y = compiler_stmt_op_assign_arg(lookup, 1);
+    primary_t image = compiler_stmt_op_assign_arg(lookup, 2);
+    primary_t distance_x, distance_y, footprint;
+    gboolean x_is_zero, y_is_zero;
+
+    /* Closures are applied, not sampled. */
+    if (image.kind == PRIMARY_VALUE
+	&& compiler_stmt_is_assign_with_rhs(image.v.value->def, RHS_CLOSURE))
+	return FALSE;
+
+    if (!emit_lookup_distance(filter, stmt, "x", "__renderPixelW", x, y, &distance_x, &x_is_zero)
+	|| !emit_lookup_distance(filter, stmt, "y", "__renderPixelH", x, y, &distance_y, &y_is_zero)
+	|| (x_is_zero && y_is_zero))
+    {
+	remove_stmts_before(first, lookup);
+	*stmt = first;
+	return FALSE;
+    }
+
+    if (x_is_zero)
+	footprint = distance_y;
+    else if (y_is_zero)
+	footprint = distance_x;
+    else
+    {
+	compvar_t *max = compiler_make_temporary(TYPE_INT);
+
+	*stmt = compiler_emit_stmt_before(compiler_make_assign(compiler_make_lhs(max),
+							       compiler_make_op_rhs(OP_MAX, distance_x, distance_y)),
+					  *stmt, lookup->parent);
+	footprint = compiler_make_compvar_primary(max);
+    }
+
+    compiler_replace_rhs(&lookup->v.assign.rhs,
+			 compiler_make_op_rhs(OP_ORIG_VAL_LOD, x, y, image,
+					      compiler_stmt_op_assign_arg(lookup, 3), footprint),
+			 lookup);
+
+    return TRUE;
+}
+
+static void
+optimize_orig_val_lod (filter_t *filter, statement_t **stmt, gboolean *changed)
+{
+    while ((*stmt) != NULL)
+    {
+	switch ((*stmt)->kind)
+	{
+	    case STMT_NIL :
+	    case STMT_PHI_ASSIGN :
+		break;
+
+	    case STMT_ASSIGN :
+		if (compiler_stmt_is_assign_with_op(*stmt, OP_ORIG_VAL)
+		    && add_lookup_footprint(filter, &stmt))
+		    *changed = TRUE;
+		break;
+
+	    case STMT_IF_COND :
+		optimize_orig_val_lod(filter, &(*stmt)->v.if_cond.consequent, changed);
+		optimize_orig_val_lod(filter, &(*stmt)->v.if_cond.alternative, changed);
+		break;
+
+	    case STMT_WHILE_LOOP :
+		optimize_orig_val_lod(filter, &(*stmt)->v.while_loop.body, changed);
+		break;
+
+	    default :
+		g_assert_not_reached();
+	}
+
+	stmt = &(*stmt)->next;
+    }
+}
+
+gboolean
+compiler_opt_orig_val_lod (filter_t *filter, statement_t **first_stmt)
+{
+    gboolean changed = FALSE;
+
+    optimize_orig_val_lod(filter, first_stmt, &changed);
+
+    return changed;
+}
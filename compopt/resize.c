@@ -24,7 +24,7 @@
 
 #include "../compiler-internals.h"
 
-/*** RESIZE_IMAGE/ORIG_VAL simplification ***/
+/*** RESIZE_IMAGE/ORIG_VAL(_LOD) simplification ***/
 
 static void
 optimize_orig_val_resize (statement_t **stmt, gboolean *changed)
@@ -38,7 +38,8 @@ optimize_orig_val_resize (statement_t **stmt, gboolean *changed)
 		break;
 
 	    case STMT_ASSIGN :
-		if (compiler_stmt_is_assign_with_op(*stmt, OP_ORIG_VAL)
+		if ((compiler_stmt_is_assign_with_op(*stmt, OP_ORIG_VAL)
+		     || compiler_stmt_is_assign_with_op(*stmt, OP_ORIG_VAL_LOD))
 		    && compiler_stmt_op_assign_arg(*stmt, 2).kind == PRIMARY_VALUE)
 		{
 		    statement_t *def = compiler_stmt_op_assign_arg(*stmt, 2).v.value->def;
@@ -62,7 +63,37 @@ optimize_orig_val_resize (statement_t **stmt, gboolean *changed)
 												   orig_y, y_factor)),
 							 stmt, (*stmt)->parent);
 
-			g_assert(compiler_op_index((*stmt)->v.assign.rhs->v.op.op) == OP_ORIG_VAL);
+			/* The footprint is scaled like the distances it
+			   measures, by the larger factor. */
+			if (compiler_stmt_is_assign_with_op(*stmt, OP_ORIG_VAL_LOD))
+			{
+			    compvar_t *abs_x_factor = compiler_make_temporary(TYPE_INT);
+			    compvar_t *abs_y_factor = compiler_make_temporary(TYPE_INT);
+			    compvar_t *factor = compiler_make_temporary(TYPE_INT);
+			    compvar_t *new_footprint = compiler_make_temporary(TYPE_INT);
+
+			    stmt = compiler_emit_stmt_before(compiler_make_assign(compiler_make_lhs(abs_x_factor),
+										  compiler_make_op_rhs(OP_ABS, x_factor)),
+							     stmt, (*stmt)->parent);
+			    stmt = compiler_emit_stmt_before(compiler_make_assign(compiler_make_lhs(abs_y_factor),
+										  compiler_make_op_rhs(OP_ABS, y_factor)),
+							     stmt, (*stmt)->parent);
+			    stmt = compiler_emit_stmt_before(compiler_make_assign(compiler_make_lhs(factor),
+										  compiler_make_op_rhs(OP_MAX,
+												       compiler_make_compvar_primary(abs_x_factor),
+												       compiler_make_compvar_primary(abs_y_factor))),
+							     stmt, (*stmt)->parent);
+			    stmt = compiler_emit_stmt_before(compiler_make_assign(compiler_make_lhs(new_footprint),
+										  compiler_make_op_rhs(OP_MUL,
+												       compiler_stmt_op_assign_arg(*stmt, 4),
+												       compiler_make_compvar_primary(factor))),
+							     stmt, (*stmt)->parent);
+
+			    compiler_replace_op_rhs_arg(*stmt, 4, compiler_make_compvar_primary(new_footprint));
+			}
+			else
+			    g_assert(compiler_op_index((*stmt)->v.assign.rhs->v.op.op) == OP_ORIG_VAL);
+
 			compiler_replace_op_rhs_arg(*stmt, 0, compiler_make_compvar_primary(new_x));
 			compiler_replace_op_rhs_arg(*stmt, 1, compiler_make_compvar_primary(new_y));
 			compiler_replace_op_rhs_arg(*stmt, 2, image);
@@ -67,23 +67,68 @@ alloc_input_drawable (int kind, int width, int height)
     drawable->image.pixel_height = height;
     drawable->image.v.drawable = drawable;
 
+    drawable->prefetched = NULL;
+    drawable->prefetched_block = NULL;
+    drawable->mipmap = NULL;
+    drawable->content_stamp = CONTENT_STAMP_INIT;
+    drawable->have_content_stamp = FALSE;
+
     return drawable;
 }
 
+#define CONTENT_STAMP_PRIME	G_GUINT64_CONSTANT(0x100000001b3)
+
+/* FNV-1a, but on 64 bit words where possible, because it has to get
+   through whole images. */
+guint64
+content_stamp_update (guint64 stamp, gconstpointer data, gsize length)
+{
+    const guchar *p = data;
+
+    for (; length >= sizeof(guint64); p += sizeof(guint64), length -= sizeof(guint64))
+    {
+	guint64 word;
+
+	memcpy(&word, p, sizeof(guint64));
+	stamp = (stamp ^ word) * CONTENT_STAMP_PRIME;
+    }
+
+    for (; length > 0; ++p, --length)
+	stamp = (stamp ^ *p) * CONTENT_STAMP_PRIME;
+
+    return stamp;
+}
+
+void
+free_prefetched_input_drawable (input_drawable_t *drawable)
+{
+    if (drawable->prefetched_block != NULL)
+    {
+	g_free(drawable->prefetched_block);
+	drawable->prefetched_block = NULL;
+    }
+    drawable->prefetched = NULL;
+
+    if (drawable->mipmap != NULL)
+    {
+	g_free(drawable->mipmap->block);
+	g_free(drawable->mipmap);
+	drawable->mipmap = NULL;
+    }
+}
+
 void
 free_input_drawable (input_drawable_t *drawable)
 {
     g_assert(drawable->used);
 
+    free_prefetched_input_drawable(drawable);
+
     switch (drawable->kind)
     {
 #ifndef OPENSTEP
 	case INPUT_DRAWABLE_GIMP :
-	    if (drawable->v.gimp.tile != 0)
-	    {
-		gimp_tile_unref(drawable->v.gimp.tile, FALSE);
-		drawable->v.gimp.tile = 0;
-	    }
+	    unref_gimp_input_drawable_tiles(drawable);
 	    if (drawable->v.gimp.fast_image_source != 0)
 	    {
 		g_free(drawable->v.gimp.fast_image_source);
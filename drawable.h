@@ -105,14 +105,26 @@ typedef struct _image_t
 	    mathmap_pools_t *pools;
 	    void *xy_vars;
 	    int num_args;
+#ifdef __cplusplus
+	    /* C++ doesn't allow flexible array members in structs that
+	       are embedded in other structs, like input_drawable_t. */
+	    userval_t args[0];
+#else
 	    userval_t args[];
+#endif
 	} closure;
 	struct {
 	    float ax;
 	    float bx;
 	    float ay;
 	    float by;
+	    int layout;
+	    /* in floats, see FLOATMAP_VALUE_XY() */
+	    int pixel_stride;
+	    int row_stride;
+	    int channel_stride;
 	    float *data;
+	    struct _mipmap_t *mipmap;
 	} floatmap;
 	struct {
 	    struct _image_t *original;
@@ -123,8 +135,44 @@ typedef struct _image_t
 } image_t;
 /* END */
 
-#define FLOATMAP_VALUE_I(img,i,c)          ((img)->v.floatmap.data[(i)*NUM_FLOATMAP_CHANNELS + (c)])
-#define FLOATMAP_VALUE_XY(img,x,y,c)	   FLOATMAP_VALUE_I((img), ((y)*(img)->pixel_width + (x)), (c))
+/* Number of pixels of edge behaviour around a prefetched drawable.
+   It's one cache line, so that every row of the image proper starts
+   aligned. */
+#define PREFETCH_BORDER		16
+#define PREFETCH_ALIGNMENT	(PREFETCH_BORDER * sizeof(color_t))
+
+/* The levels of a mipmap are the image halved in size again and
+   again, rounded up, down to 1x1 pixels, each pixel being the
+   average of up to 2x2 pixels of the previous level.  levels[0] is
+   half the size of the image.  The pixels are stored like those of
+   floatmaps. */
+#define MAX_MIPMAP_LEVELS	32
+
+typedef struct _mipmap_t
+{
+    int frame;			/* -1 if it's the same for all frames */
+    int num_levels;
+    int widths[MAX_MIPMAP_LEVELS];
+    int heights[MAX_MIPMAP_LEVELS];
+    float *levels[MAX_MIPMAP_LEVELS];
+    gpointer block;		/* NULL if allocated from pools */
+} mipmap_t;
+
+/* Interleaved floatmaps store the channels of each pixel next to
+   each other, without any padding.  Planar floatmaps store each
+   channel as a plane of its own, with rows padded to a multiple of
+   FLOATMAP_ROW_ALIGNMENT bytes and the data aligned to it, so that
+   code working on one channel at a time reads whole cache lines.
+   Producers of floatmaps use the layout their consumer asks for, see
+   render_image_with_layout(). */
+#define FLOATMAP_LAYOUT_INTERLEAVED	0
+#define FLOATMAP_LAYOUT_PLANAR		1
+
+#define FLOATMAP_ROW_ALIGNMENT		64
+
+#define FLOATMAP_VALUE_XY(img,x,y,c)	   ((img)->v.floatmap.data[(y) * (img)->v.floatmap.row_stride \
+							   + (x) * (img)->v.floatmap.pixel_stride \
+							   + (c) * (img)->v.floatmap.channel_stride])
 
 typedef struct _input_drawable_t {
     gboolean used;
@@ -138,6 +186,26 @@ typedef struct _input_drawable_t {
     float middle_x;
     float middle_y;
 
+    /* Set by prefetch_input_drawable().  prefetched points to pixel
+       (0,0) of the decoded image and is surrounded by PREFETCH_BORDER
+       pixels on all sides.  prefetched_frame is -1 if the pixels don't
+       depend on the frame. */
+    color_t *prefetched;
+    int prefetched_row_stride;	/* in pixels */
+    int prefetched_frame;
+    gpointer prefetched_block;
+
+    /* Built from the prefetched pixels if the invocation uses
+       mipmapping. */
+    mipmap_t *mipmap;
+
+    /* Identifies the pixels the drawable delivers, so that the native
+       filter cache can tell when they have changed.  Only maintained
+       for GIMP drawables, by get_gimp_input_drawable_content_stamp(),
+       and invalidated by the plug-in before each render. */
+    guint64 content_stamp;
+    gboolean have_content_stamp;
+
     union
     {
 #ifdef OPENSTEP
@@ -153,9 +221,10 @@ typedef struct _input_drawable_t {
 	    gboolean has_selection; /* only used for copying the drawable */
 	    gint x0, y0;	    /* is honored whatever the value of has_selection */
 	    gint bpp;
-	    gint row;
-	    gint col;
-	    GimpTile *tile;
+	    /* shared tiles, see get_pixel() in mathmap.c */
+	    gint num_tile_rows;
+	    gint num_tile_cols;
+	    struct _gimp_tile_entry_t **tiles;
 	    int fast_image_source_width;
 	    int fast_image_source_height;
 	    color_t *fast_image_source;
@@ -179,8 +248,14 @@ int image_new_id (void);
 
 input_drawable_t* alloc_input_drawable (int kind, int width, int height);
 
+#define CONTENT_STAMP_INIT	G_GUINT64_CONSTANT(0xcbf29ce484222325)
+
+guint64 content_stamp_update (guint64 stamp, gconstpointer data, gsize length);
+
 void free_input_drawable (input_drawable_t *drawable);
 
+void free_prefetched_input_drawable (input_drawable_t *drawable);
+
 input_drawable_t* copy_input_drawable (input_drawable_t *drawable);
 
 void for_each_input_drawable (void (*) (input_drawable_t *drawable));
@@ -191,6 +266,8 @@ input_drawable_t* get_nth_input_drawable (int n);
 #ifndef OPENSTEP
 input_drawable_t* alloc_gimp_input_drawable (GimpDrawable *drawable, gboolean honor_selection);
 GimpDrawable* get_gimp_input_drawable (input_drawable_t *drawable);
+void unref_gimp_input_drawable_tiles (input_drawable_t *drawable);
+guint64 get_gimp_input_drawable_content_stamp (input_drawable_t *drawable);
 
 input_drawable_t* get_default_input_drawable (void);
 #endif
@@ -201,7 +278,11 @@ input_drawable_t* alloc_cmdline_movie_input_drawable (const char *filename);
 #endif
 
 image_t* floatmap_alloc (int width, int height, mathmap_pools_t *pools);
+image_t* floatmap_alloc_with_layout (int width, int height, int layout, mathmap_pools_t *pools);
 image_t* floatmap_copy (image_t *floatmap, mathmap_pools_t *pools);
+image_t* floatmap_copy_with_layout (image_t *floatmap, int layout, mathmap_pools_t *pools);
+image_t* floatmap_with_layout (image_t *floatmap, int layout, mathmap_pools_t *pools);
+gsize floatmap_data_size (image_t *floatmap);
 
 /* TEMPLATE make_resize_image */
 image_t* make_resize_image (image_t *image, float x_factor, float y_factor, mathmap_pools_t *pools);
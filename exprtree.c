@@ -37,7 +37,7 @@
 
 #define MAX_GENSYM_LEN	64
 
-char error_string[1024];
+char error_string[ERROR_STRING_LENGTH];
 scanner_region_t error_region;
 
 static char*
@@ -29,7 +29,9 @@
 #include "macros.h"
 #include "scanner.h"
 
-extern char error_string[];
+#define ERROR_STRING_LENGTH    1024
+
+extern char error_string[ERROR_STRING_LENGTH];
 extern scanner_region_t error_region;
 
 #define LIMITS_INT             1
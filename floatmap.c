@@ -28,7 +28,7 @@
 #include "rwimg/writeimage.h"
 
 image_t*
-floatmap_alloc (int width, int height, mathmap_pools_t *pools)
+floatmap_alloc_with_layout (int width, int height, int layout, mathmap_pools_t *pools)
 {
     image_t *img = mathmap_pools_alloc(pools, sizeof(image_t));
 
@@ -40,31 +40,113 @@ floatmap_alloc (int width, int height, mathmap_pools_t *pools)
     img->v.floatmap.ay = img->v.floatmap.by = (float)(height - 1) / 2.0;
     img->v.floatmap.ay *= -1.0;
 
-    img->v.floatmap.data = mathmap_pools_alloc(pools, sizeof(float) * width * height * NUM_FLOATMAP_CHANNELS);
+    img->v.floatmap.layout = layout;
+    if (layout == FLOATMAP_LAYOUT_PLANAR)
+    {
+	int row_alignment = FLOATMAP_ROW_ALIGNMENT / sizeof(float);
+	gsize data;
+
+	img->v.floatmap.pixel_stride = 1;
+	img->v.floatmap.row_stride = (width + row_alignment - 1) / row_alignment * row_alignment;
+	img->v.floatmap.channel_stride = img->v.floatmap.row_stride * height;
+
+	data = (gsize)mathmap_pools_alloc(pools, sizeof(float) * img->v.floatmap.channel_stride * NUM_FLOATMAP_CHANNELS
+					  + FLOATMAP_ROW_ALIGNMENT - 1);
+	img->v.floatmap.data = (float*)((data + FLOATMAP_ROW_ALIGNMENT - 1) & ~(gsize)(FLOATMAP_ROW_ALIGNMENT - 1));
+    }
+    else
+    {
+	g_assert(layout == FLOATMAP_LAYOUT_INTERLEAVED);
+
+	img->v.floatmap.pixel_stride = NUM_FLOATMAP_CHANNELS;
+	img->v.floatmap.row_stride = width * NUM_FLOATMAP_CHANNELS;
+	img->v.floatmap.channel_stride = 1;
+
+	img->v.floatmap.data = mathmap_pools_alloc(pools, sizeof(float) * width * height * NUM_FLOATMAP_CHANNELS);
+    }
+
+    img->v.floatmap.mipmap = NULL;
 
     return img;
 }
 
 image_t*
-floatmap_copy (image_t *floatmap, mathmap_pools_t *pools)
+floatmap_alloc (int width, int height, mathmap_pools_t *pools)
+{
+    return floatmap_alloc_with_layout(width, height, FLOATMAP_LAYOUT_INTERLEAVED, pools);
+}
+
+/* Returns the number of floats of the floatmap's data, including the
+   padding. */
+gsize
+floatmap_data_size (image_t *floatmap)
+{
+    g_assert(floatmap->type == IMAGE_FLOATMAP);
+
+    if (floatmap->v.floatmap.layout == FLOATMAP_LAYOUT_PLANAR)
+	return (gsize)floatmap->v.floatmap.channel_stride * NUM_FLOATMAP_CHANNELS;
+    return (gsize)floatmap->pixel_width * floatmap->pixel_height * NUM_FLOATMAP_CHANNELS;
+}
+
+image_t*
+floatmap_copy_with_layout (image_t *floatmap, int layout, mathmap_pools_t *pools)
 {
     image_t *copy;
 
     g_assert(floatmap->type == IMAGE_FLOATMAP);
 
-    copy = floatmap_alloc(floatmap->pixel_width, floatmap->pixel_height, pools);
+    copy = floatmap_alloc_with_layout(floatmap->pixel_width, floatmap->pixel_height, layout, pools);
 
     copy->v.floatmap.ax = floatmap->v.floatmap.ax;
     copy->v.floatmap.bx = floatmap->v.floatmap.bx;
     copy->v.floatmap.ay = floatmap->v.floatmap.ay;
     copy->v.floatmap.by = floatmap->v.floatmap.by;
 
-    memcpy(copy->v.floatmap.data, floatmap->v.floatmap.data,
-	   sizeof(float) * floatmap->pixel_width * floatmap->pixel_height * NUM_FLOATMAP_CHANNELS);
+    if (layout == floatmap->v.floatmap.layout)
+	memcpy(copy->v.floatmap.data, floatmap->v.floatmap.data, sizeof(float) * floatmap_data_size(floatmap));
+    else
+    {
+	int x, y, c;
+
+	/* Going through the destination in order is the cheaper way
+	   round for both directions. */
+	if (layout == FLOATMAP_LAYOUT_PLANAR)
+	{
+	    for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+		for (y = 0; y < floatmap->pixel_height; ++y)
+		    for (x = 0; x < floatmap->pixel_width; ++x)
+			FLOATMAP_VALUE_XY(copy, x, y, c) = FLOATMAP_VALUE_XY(floatmap, x, y, c);
+	}
+	else
+	{
+	    for (y = 0; y < floatmap->pixel_height; ++y)
+		for (x = 0; x < floatmap->pixel_width; ++x)
+		    for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+			FLOATMAP_VALUE_XY(copy, x, y, c) = FLOATMAP_VALUE_XY(floatmap, x, y, c);
+	}
+    }
 
     return copy;
 }
 
+image_t*
+floatmap_copy (image_t *floatmap, mathmap_pools_t *pools)
+{
+    return floatmap_copy_with_layout(floatmap, floatmap->v.floatmap.layout, pools);
+}
+
+/* Returns the floatmap itself if it has the layout, otherwise a copy
+   with the layout. */
+image_t*
+floatmap_with_layout (image_t *floatmap, int layout, mathmap_pools_t *pools)
+{
+    g_assert(floatmap->type == IMAGE_FLOATMAP);
+
+    if (floatmap->v.floatmap.layout == layout)
+	return floatmap;
+    return floatmap_copy_with_layout(floatmap, layout, pools);
+}
+
 void
 floatmap_get_channel_column (float *dst, image_t *img, int col, int channel)
 {
@@ -117,52 +199,73 @@ floatmap_set_channel_row (image_t *img, int row, int channel, float *src)
 	FLOATMAP_VALUE_XY(img, i, row, channel) = src[i];
 }
 
+/* The functions getting and setting whole pixels use interleaved
+   pixels in dst and src, whatever the layout of the floatmap. */
+
 void
 floatmap_get_column (float *dst, image_t *img, int col)
 {
-    int i;
+    int i, c;
 
     g_assert(img->type == IMAGE_FLOATMAP);
     g_assert(col >= 0 && col < img->pixel_width);
 
     for (i = 0; i < img->pixel_height; ++i)
-	memcpy(dst + i * NUM_FLOATMAP_CHANNELS,
-	       &FLOATMAP_VALUE_XY(img, col, i, 0),
-	       sizeof(float) * NUM_FLOATMAP_CHANNELS);
+	for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+	    dst[i * NUM_FLOATMAP_CHANNELS + c] = FLOATMAP_VALUE_XY(img, col, i, c);
 }
 
 void
 floatmap_get_row (float *dst, image_t *img, int row)
 {
+    int i, c;
+
     g_assert(img->type == IMAGE_FLOATMAP);
     g_assert(row >= 0 && row < img->pixel_height);
 
-    memcpy(dst, &FLOATMAP_VALUE_XY(img, 0, row, 0),
-	   sizeof(float) * img->pixel_width * NUM_FLOATMAP_CHANNELS);
+    if (img->v.floatmap.layout == FLOATMAP_LAYOUT_INTERLEAVED)
+    {
+	memcpy(dst, &FLOATMAP_VALUE_XY(img, 0, row, 0),
+	       sizeof(float) * img->pixel_width * NUM_FLOATMAP_CHANNELS);
+	return;
+    }
+
+    for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+	for (i = 0; i < img->pixel_width; ++i)
+	    dst[i * NUM_FLOATMAP_CHANNELS + c] = FLOATMAP_VALUE_XY(img, i, row, c);
 }
 
 void
 floatmap_set_column (image_t *img, int col, float *src)
 {
-    int i;
+    int i, c;
 
     g_assert(img->type == IMAGE_FLOATMAP);
     g_assert(col >= 0 && col < img->pixel_width);
 
     for (i = 0; i < img->pixel_height; ++i)
-	memcpy(&FLOATMAP_VALUE_XY(img, col, i, 0),
-	       src + i * NUM_FLOATMAP_CHANNELS,
-	       sizeof(float) * NUM_FLOATMAP_CHANNELS);
+	for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+	    FLOATMAP_VALUE_XY(img, col, i, c) = src[i * NUM_FLOATMAP_CHANNELS + c];
 }
 
 void
 floatmap_set_row (image_t *img, int row, float *src)
 {
+    int i, c;
+
     g_assert(img->type == IMAGE_FLOATMAP);
     g_assert(row >= 0 && row < img->pixel_height);
 
-    memcpy(&FLOATMAP_VALUE_XY(img, 0, row, 0), src,
-	   sizeof(float) * img->pixel_width * NUM_FLOATMAP_CHANNELS);
+    if (img->v.floatmap.layout == FLOATMAP_LAYOUT_INTERLEAVED)
+    {
+	memcpy(&FLOATMAP_VALUE_XY(img, 0, row, 0), src,
+	       sizeof(float) * img->pixel_width * NUM_FLOATMAP_CHANNELS);
+	return;
+    }
+
+    for (c = 0; c < NUM_FLOATMAP_CHANNELS; ++c)
+	for (i = 0; i < img->pixel_width; ++i)
+	    FLOATMAP_VALUE_XY(img, i, row, c) = src[i * NUM_FLOATMAP_CHANNELS + c];
 }
 
 /* This is for debugging purposes only. */
@@ -170,17 +273,15 @@ void
 floatmap_write (image_t *img, const char *filename)
 {
     unsigned char *data;
-    int i;
+    int x, y, c;
 
     g_assert(img->type == IMAGE_FLOATMAP);
 
     data = g_malloc(3 * img->pixel_width * img->pixel_height);
-    for (i = 0; i < img->pixel_width * img->pixel_height; ++i)
-    {
-	data[i * 3 + 0] = FLOATMAP_VALUE_I(img, i, 0) * 255.0;
-	data[i * 3 + 1] = FLOATMAP_VALUE_I(img, i, 1) * 255.0;
-	data[i * 3 + 2] = FLOATMAP_VALUE_I(img, i, 2) * 255.0;
-    }
+    for (y = 0; y < img->pixel_height; ++y)
+	for (x = 0; x < img->pixel_width; ++x)
+	    for (c = 0; c < 3; ++c)
+		data[(y * img->pixel_width + x) * 3 + c] = FLOATMAP_VALUE_XY(img, x, y, c) * 255.0;
 
     write_image(filename, img->pixel_width, img->pixel_height, data, 3, 3 * img->pixel_width, IMAGE_FORMAT_PNG);
 
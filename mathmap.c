@@ -41,9 +41,6 @@
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
-#ifdef THREADED_FINAL_RENDER
-#include <pthread.h>
-#endif
 
 #include <glib.h>
 #include <glib/gstdio.h>
@@ -170,6 +167,9 @@ static void expression_copy (gchar *dest, const gchar *src);
 static gboolean generate_code (void);
 
 static void do_mathmap (int frame_num, float t);
+#ifdef DEBUG_OUTPUT
+static long get_num_pixels_requested (void);
+#endif
 static gint32 mathmap_layer_copy (gint32 layerID);
 
 static void update_userval_table (void);
@@ -244,8 +244,6 @@ static gint tile_width, tile_height;
 gint sel_x1, sel_y1, sel_x2, sel_y2;
 gint sel_width, sel_height;
 
-static long num_pixels_requested = 0;
-
 static gboolean ignore_dialog_tree_changes = FALSE;
 static gboolean ignore_designer_tree_changes = FALSE;
 
@@ -268,7 +266,6 @@ GtkWidget *mathmap_dialog_window,
     *notebook;
 
 #ifdef THREADED_FINAL_RENDER
-pthread_mutex_t get_gimp_pixel_mutex;
 #define NUM_FINAL_RENDER_CPUS		(get_num_cpus())
 #else
 #define NUM_FINAL_RENDER_CPUS		1
@@ -297,6 +294,34 @@ static expression_db_t *designer_edb = NULL;
 static designer_design_type_t *the_design_type = NULL;
 static designer_design_t *the_current_design = NULL;
 
+static char *support_paths[3];
+/* The expression mathmap was compiled from. */
+static char *compiled_expression = NULL;
+
+#ifndef USE_LLVM
+/* Once the int, float and bool user values of the main filter stop
+   changing for SPECIALIZATION_DELAY milliseconds we compile, in a
+   background thread, a variant of the filter in which they are
+   constants.  It is swapped in between two renders and used for as
+   long as the user values keep those values. */
+#define SPECIALIZATION_DELAY		1000
+
+typedef struct
+{
+    char *expression;
+    userval_t *uservals;
+    mathmap_t *mathmap;		/* NULL if the filter cannot be specialized */
+    thread_handle_t thread;
+} specialization_t;
+
+static guint specialization_timeout_id = 0;
+static specialization_t *pending_specialization = NULL;
+static specialization_t *current_specialization = NULL;
+static mathfuncs_t specialized_mathfuncs;
+
+static void free_specializations (void);
+#endif
+
 /***** Functions *****/
 
 /*****/
@@ -680,10 +705,6 @@ run (const gchar *name, gint nparams, const GimpParam *param, gint *nreturn_vals
     init_macros();
     init_compiler();
 
-#ifdef THREADED_FINAL_RENDER
-    pthread_mutex_init(&get_gimp_pixel_mutex, NULL);
-#endif
-
     /* See how we will run */
 
     switch (run_mode) {
@@ -748,7 +769,10 @@ run (const gchar *name, gint nparams, const GimpParam *param, gint *nreturn_vals
 	gimp_tile_cache_ntiles((gimp_drawable->width + gimp_tile_width() - 1)
 			       / gimp_tile_width());
 
-	/* Run! */
+	/* Run!  The frames of an animation all see the same input
+	   pixels, so they can share the content stamps. */
+
+	for_each_input_drawable(invalidate_content_stamp);
 
 	if (animation_enabled)
 	{
@@ -794,12 +818,16 @@ run (const gchar *name, gint nparams, const GimpParam *param, gint *nreturn_vals
     } else if (status == GIMP_PDB_SUCCESS)
 	status = GIMP_PDB_EXECUTION_ERROR;
 
+#ifndef USE_LLVM
+    free_specializations();
+#endif
+
     values[0].data.d_status = status;
 
     gimp_drawable_detach(gimp_drawable);
 
 #ifdef DEBUG_OUTPUT
-    g_print("%ld pixels requested\n", num_pixels_requested);
+    g_print("%ld pixels requested\n", get_num_pixels_requested());
 #endif
 } /* run */
 
@@ -967,17 +995,235 @@ update_gradient (void)
 
 /*****/
 
+#ifndef USE_LLVM
+static gboolean
+is_specializable_userval (userval_info_t *info)
+{
+    return info->type == USERVAL_INT_CONST
+	|| info->type == USERVAL_FLOAT_CONST
+	|| info->type == USERVAL_BOOL_CONST;
+}
+
+static gboolean
+specialization_matches_uservals (specialization_t *spec, userval_t *uservals)
+{
+    userval_info_t *info;
+
+    for (info = mathmap->main_filter->userval_infos; info != NULL; info = info->next)
+    {
+	userval_t *a = &spec->uservals[info->index];
+	userval_t *b = &uservals[info->index];
+
+	switch (info->type)
+	{
+	    case USERVAL_INT_CONST :
+		if (a->v.int_const != b->v.int_const)
+		    return FALSE;
+		break;
+
+	    case USERVAL_FLOAT_CONST :
+		if (a->v.float_const != b->v.float_const)
+		    return FALSE;
+		break;
+
+	    case USERVAL_BOOL_CONST :
+		if (a->v.bool_const != b->v.bool_const)
+		    return FALSE;
+		break;
+
+	    default :
+		break;
+	}
+    }
+
+    return TRUE;
+}
+
+static void
+free_specialization (specialization_t *spec)
+{
+    if (spec->mathmap != NULL)
+    {
+	unload_mathmap(spec->mathmap);
+	free_mathmap(spec->mathmap);
+    }
+    g_free(spec->uservals);
+    g_free(spec->expression);
+    g_free(spec);
+}
+
+static void
+discard_specialization (void)
+{
+    if (specialization_timeout_id != 0)
+    {
+	g_source_remove(specialization_timeout_id);
+	specialization_timeout_id = 0;
+    }
+
+    /* A pending specialization is discarded when it finishes because
+       its expression doesn't match anymore. */
+    if (current_specialization != NULL)
+    {
+	free_specialization(current_specialization);
+	current_specialization = NULL;
+    }
+}
+
+/* Waits for the pending specialization, if there is one, and frees it
+   together with the current one. */
+static void
+free_specializations (void)
+{
+    discard_specialization();
+
+    if (pending_specialization != NULL)
+    {
+	mathmap_thread_join(pending_specialization->thread);
+	g_idle_remove_by_data(pending_specialization);
+	free_specialization(pending_specialization);
+	pending_specialization = NULL;
+    }
+}
+
+static void schedule_specialization (void);
+
+/* Runs in the main loop after the compiler thread has finished. */
+static gboolean
+install_specialization (gpointer data)
+{
+    specialization_t *spec = (specialization_t*)data;
+
+    g_assert(spec == pending_specialization);
+
+    mathmap_thread_join(spec->thread);
+    pending_specialization = NULL;
+
+    if (invocation == NULL || strcmp(spec->expression, compiled_expression) != 0)
+    {
+	free_specialization(spec);
+	return FALSE;
+    }
+
+    if (current_specialization != NULL)
+	free_specialization(current_specialization);
+    current_specialization = spec;
+
+    if (spec->mathmap != NULL)
+    {
+	specialized_mathfuncs = spec->mathmap->initfunc(invocation);
+
+	/* The user values might have changed while we were
+	   compiling. */
+	schedule_specialization();
+    }
+
+    return FALSE;
+}
+
+static void
+compile_specialization (gpointer data)
+{
+    specialization_t *spec = (specialization_t*)data;
+
+    spec->mathmap = compile_mathmap(spec->expression, support_paths, DEFAULT_OPTIMIZATION_TIMEOUT, FALSE,
+				    spec->uservals);
+
+    g_idle_add(install_specialization, spec);
+}
+
+static gboolean
+specialization_timeout (gpointer data)
+{
+    specialization_t *spec;
+    userval_info_t *info;
+
+    specialization_timeout_id = 0;
+
+    /* We only compile one specialization at a time.  When it's
+       installed we check whether we need another one. */
+    if (pending_specialization != NULL || invocation == NULL)
+	return FALSE;
+
+    spec = g_new0(specialization_t, 1);
+    spec->expression = g_strdup(compiled_expression);
+    spec->uservals = g_new0(userval_t, mathmap->main_filter->num_uservals);
+    for (info = mathmap->main_filter->userval_infos; info != NULL; info = info->next)
+	if (is_specializable_userval(info))
+	    copy_userval(&spec->uservals[info->index], &invocation->uservals[info->index], info->type);
+
+    pending_specialization = spec;
+    spec->thread = mathmap_thread_start(compile_specialization, spec);
+
+    return FALSE;
+}
+
+static void
+schedule_specialization (void)
+{
+    userval_info_t *info;
+
+    if (specialization_timeout_id != 0)
+    {
+	g_source_remove(specialization_timeout_id);
+	specialization_timeout_id = 0;
+    }
+
+    if (run_mode != GIMP_RUN_INTERACTIVE || invocation == NULL)
+	return;
+
+    if (current_specialization != NULL
+	&& (current_specialization->mathmap == NULL
+	    || specialization_matches_uservals(current_specialization, invocation->uservals)))
+	return;
+
+    for (info = mathmap->main_filter->userval_infos; info != NULL; info = info->next)
+	if (is_specializable_userval(info))
+	    break;
+    if (info == NULL)
+	return;
+
+    specialization_timeout_id = g_timeout_add(SPECIALIZATION_DELAY, specialization_timeout, NULL);
+}
+#endif
+
+/* The functions to render the main filter with, which are those of the
+   specialized filter if it matches the current user values. */
+static mathfuncs_t*
+render_mathfuncs (void)
+{
+#ifndef USE_LLVM
+    if (current_specialization != NULL && current_specialization->mathmap != NULL
+	&& specialization_matches_uservals(current_specialization, invocation->uservals))
+	return &specialized_mathfuncs;
+#endif
+
+    return &invocation->mathfuncs;
+}
+
 static gboolean
 generate_code (void)
 {
     if (expression_changed)
     {
-	static char *support_paths[3];
+	if (run_mode == GIMP_RUN_INTERACTIVE && expression_entry != 0)
+	    dialog_text_update();
+
+	/* User values are passed to the filter at run-time, so we only
+	   have to recompile if the text of the expression has changed,
+	   which it doesn't for every edit. */
+	if (mathmap != 0 && compiled_expression != NULL
+	    && strcmp(compiled_expression, mmvals.expression) == 0)
+	    expression_changed = 0;
+    }
 
+    if (expression_changed)
+    {
 	mathmap_t *new_mathmap;
 
-	if (run_mode == GIMP_RUN_INTERACTIVE && expression_entry != 0)
-	    dialog_text_update();
+#ifndef USE_LLVM
+	discard_specialization();
+#endif
 
 	if (mathmap != 0)
 	    unload_mathmap(mathmap);
@@ -989,7 +1235,7 @@ generate_code (void)
 	    support_paths[2] = NULL;
 	}
 
-	new_mathmap = compile_mathmap(mmvals.expression, support_paths, DEFAULT_OPTIMIZATION_TIMEOUT, FALSE);
+	new_mathmap = compile_mathmap(mmvals.expression, support_paths, DEFAULT_OPTIMIZATION_TIMEOUT, FALSE, NULL);
 
 	if (new_mathmap == 0)
 	{
@@ -1027,6 +1273,9 @@ generate_code (void)
 	    mathmap = new_mathmap;
 	    invocation = new_invocation;
 
+	    g_free(compiled_expression);
+	    compiled_expression = g_strdup(mmvals.expression);
+
 	    expression_changed = 0;
 
 	    update_userval_table();
@@ -1041,8 +1290,7 @@ generate_code (void)
 	invocation_set_antialiasing(invocation, mmvals.flags & FLAG_ANTIALIASING);
 	invocation->supersampling = mmvals.flags & FLAG_SUPERSAMPLING;
 
-	invocation->edge_behaviour_x = edge_behaviour_x_mode;
-	invocation->edge_behaviour_y = edge_behaviour_y_mode;
+	invocation_set_edge_behaviour(invocation, edge_behaviour_x_mode, edge_behaviour_y_mode);
 	invocation->edge_color_x = MAKE_RGBA_COLOR_FLOAT(edge_color_x.r, edge_color_x.g, edge_color_x.b, edge_color_x.a);
 	invocation->edge_color_y = MAKE_RGBA_COLOR_FLOAT(edge_color_y.r, edge_color_y.g, edge_color_y.b, edge_color_y.a);
     }
@@ -1052,23 +1300,267 @@ generate_code (void)
 
 /*****/
 
+/* Tiles we get from GIMP are shared between all rendering threads.
+   Each thread keeps the few tiles it used most recently in its own
+   cache, which get_pixel() looks up without locking.  GIMP is only
+   asked for a tile, and the shared tiles are only touched, if there is
+   a miss, and that happens with gimp_tile_mutex held, because libgimp
+   is not thread-safe. */
+
+typedef struct _gimp_tile_entry_t
+{
+    GimpTile *tile;
+    int ref_count;		/* number of tile cache lines referring to it */
+} gimp_tile_entry_t;
+
+#define TILE_CACHE_SIZE		8
+
+typedef struct
+{
+    input_drawable_t *drawable;
+    gint row;
+    gint col;
+    gimp_tile_entry_t *entry;
+} tile_cache_line_t;
+
+typedef struct _tile_cache_t
+{
+    /* Most recently used line first. */
+    tile_cache_line_t lines[TILE_CACHE_SIZE];
+    long num_pixels_requested;
+    struct _tile_cache_t *next;
+} tile_cache_t;
+
+static GStaticMutex gimp_tile_mutex = G_STATIC_MUTEX_INIT;
+static GStaticPrivate tile_cache_key = G_STATIC_PRIVATE_INIT;
+/* All the threads' tile caches.  Protected by gimp_tile_mutex. */
+static tile_cache_t *tile_caches = NULL;
+
+static tile_cache_t*
+get_tile_cache (void)
+{
+    tile_cache_t *cache = g_static_private_get(&tile_cache_key);
+
+    if (cache == NULL)
+    {
+	cache = g_new0(tile_cache_t, 1);
+
+	g_static_mutex_lock(&gimp_tile_mutex);
+	cache->next = tile_caches;
+	tile_caches = cache;
+	g_static_mutex_unlock(&gimp_tile_mutex);
+
+	g_static_private_set(&tile_cache_key, cache, NULL);
+    }
+
+    return cache;
+}
+
+/* Must be called with gimp_tile_mutex held. */
+static gimp_tile_entry_t*
+acquire_tile_entry (input_drawable_t *drawable, gint row, gint col)
+{
+    gimp_tile_entry_t **slot;
+
+    if (drawable->v.gimp.tiles == NULL)
+    {
+	drawable->v.gimp.num_tile_rows = drawable->v.gimp.drawable->ntile_rows;
+	drawable->v.gimp.num_tile_cols = drawable->v.gimp.drawable->ntile_cols;
+	drawable->v.gimp.tiles = g_new0(gimp_tile_entry_t*,
+					drawable->v.gimp.num_tile_rows * drawable->v.gimp.num_tile_cols);
+    }
+
+    g_assert(row >= 0 && row < drawable->v.gimp.num_tile_rows
+	     && col >= 0 && col < drawable->v.gimp.num_tile_cols);
+
+    slot = &drawable->v.gimp.tiles[row * drawable->v.gimp.num_tile_cols + col];
+
+    if (*slot == NULL)
+    {
+	gimp_tile_entry_t *entry = g_new(gimp_tile_entry_t, 1);
+
+	entry->tile = gimp_drawable_get_tile(drawable->v.gimp.drawable, FALSE, row, col);
+	assert(entry->tile != 0);
+	gimp_tile_ref(entry->tile);
+	entry->ref_count = 0;
+
+	*slot = entry;
+    }
+
+    ++(*slot)->ref_count;
+
+    return *slot;
+}
+
+/* Must be called with gimp_tile_mutex held. */
 static void
-unref_drawable_tiles (input_drawable_t *drawable)
+release_tile_cache_line (tile_cache_line_t *line)
+{
+    input_drawable_t *drawable = line->drawable;
+    gimp_tile_entry_t *entry = line->entry;
+
+    if (drawable == NULL)
+	return;
+
+    g_assert(entry->ref_count > 0);
+
+    if (--entry->ref_count == 0)
+    {
+	gimp_tile_unref(entry->tile, FALSE);
+	drawable->v.gimp.tiles[line->row * drawable->v.gimp.num_tile_cols + line->col] = NULL;
+	g_free(entry);
+    }
+
+    line->drawable = NULL;
+    line->entry = NULL;
+}
+
+static GimpTile*
+get_cached_tile (tile_cache_t *cache, input_drawable_t *drawable, gint row, gint col)
+{
+    tile_cache_line_t *lines = cache->lines;
+    tile_cache_line_t line;
+    int i;
+
+    if (lines[0].drawable == drawable && lines[0].row == row && lines[0].col == col)
+	return lines[0].entry->tile;
+
+    for (i = 1; i < TILE_CACHE_SIZE; ++i)
+	if (lines[i].drawable == drawable && lines[i].row == row && lines[i].col == col)
+	    break;
+
+    if (i < TILE_CACHE_SIZE)
+	line = lines[i];
+    else
+    {
+	i = TILE_CACHE_SIZE - 1;
+
+	g_static_mutex_lock(&gimp_tile_mutex);
+	release_tile_cache_line(&lines[i]);
+	line.drawable = drawable;
+	line.row = row;
+	line.col = col;
+	line.entry = acquire_tile_entry(drawable, row, col);
+	g_static_mutex_unlock(&gimp_tile_mutex);
+    }
+
+    memmove(&lines[1], &lines[0], sizeof(tile_cache_line_t) * i);
+    lines[0] = line;
+
+    return line.entry->tile;
+}
+
+#ifdef DEBUG_OUTPUT
+static long
+get_num_pixels_requested (void)
 {
+    tile_cache_t *cache;
+    long num = 0;
+
+    g_static_mutex_lock(&gimp_tile_mutex);
+    for (cache = tile_caches; cache != NULL; cache = cache->next)
+	num += cache->num_pixels_requested;
+    g_static_mutex_unlock(&gimp_tile_mutex);
+
+    return num;
+}
+#endif
+
+/* Must not be called while rendering. */
+void
+unref_gimp_input_drawable_tiles (input_drawable_t *drawable)
+{
+    tile_cache_t *cache;
+
     g_assert(drawable->kind == INPUT_DRAWABLE_GIMP);
 
-    if (drawable->v.gimp.tile != 0)
+    g_static_mutex_lock(&gimp_tile_mutex);
+
+    for (cache = tile_caches; cache != NULL; cache = cache->next)
+    {
+	int i;
+
+	for (i = 0; i < TILE_CACHE_SIZE; ++i)
+	    if (cache->lines[i].drawable == drawable)
+		release_tile_cache_line(&cache->lines[i]);
+    }
+
+    if (drawable->v.gimp.tiles != NULL)
     {
-	gimp_tile_unref(drawable->v.gimp.tile, FALSE);
-	drawable->v.gimp.tile = 0;
+#ifndef G_DISABLE_ASSERT
+	int i;
+
+	for (i = 0; i < drawable->v.gimp.num_tile_rows * drawable->v.gimp.num_tile_cols; ++i)
+	    g_assert(drawable->v.gimp.tiles[i] == NULL);
+#endif
+
+	g_free(drawable->v.gimp.tiles);
+	drawable->v.gimp.tiles = NULL;
     }
+
+    g_static_mutex_unlock(&gimp_tile_mutex);
 }
 
 static void
 unref_tiles (void)
 {
-    for_each_input_drawable(unref_drawable_tiles);
+    for_each_input_drawable(unref_gimp_input_drawable_tiles);
+}
+
+/* Must be called before rendering from the drawable itself, not from
+   its fast image source, so that the native filter cache doesn't
+   return results for older pixels.  The stamp is only computed again
+   if the cache asks for it. */
+static void
+invalidate_content_stamp (input_drawable_t *drawable)
+{
+    drawable->have_content_stamp = FALSE;
+}
+
+/* Hashing the whole drawable is expensive, so we only do it for
+   drawables which are actually passed to a native filter. */
+guint64
+get_gimp_input_drawable_content_stamp (input_drawable_t *drawable)
+{
+    g_assert(drawable->kind == INPUT_DRAWABLE_GIMP);
+
+    g_static_mutex_lock(&gimp_tile_mutex);
+
+    if (!drawable->have_content_stamp)
+    {
+	GimpPixelRgn region;
+	gpointer pr;
+	guint64 stamp = CONTENT_STAMP_INIT;
+
+	gimp_pixel_rgn_init(&region, drawable->v.gimp.drawable,
+			    drawable->v.gimp.x0, drawable->v.gimp.y0,
+			    drawable->image.pixel_width, drawable->image.pixel_height,
+			    FALSE, FALSE);
+
+	for (pr = gimp_pixel_rgns_register(1, &region); pr != NULL; pr = gimp_pixel_rgns_process(pr))
+	{
+	    int y;
+
+	    for (y = 0; y < region.h; ++y)
+		stamp = content_stamp_update(stamp, region.data + y * region.rowstride, region.w * region.bpp);
+	}
+
+	drawable->content_stamp = stamp;
+	drawable->have_content_stamp = TRUE;
+    }
+
+    g_static_mutex_unlock(&gimp_tile_mutex);
+
+    return drawable->content_stamp;
+}
+
+#ifdef THREADED_FINAL_RENDER
+static void
+prefetch_drawable (input_drawable_t *drawable)
+{
+    prefetch_input_drawable(invocation, drawable, drawable->kind == INPUT_DRAWABLE_GIMP ? -1 : 0);
 }
+#endif
 
 input_drawable_t*
 alloc_gimp_input_drawable (GimpDrawable *gimp_drawable, gboolean honor_selection)
@@ -1101,9 +1593,9 @@ alloc_gimp_input_drawable (GimpDrawable *gimp_drawable, gboolean honor_selection
     drawable->v.gimp.x0 = x;
     drawable->v.gimp.y0 = y;
     drawable->v.gimp.bpp = gimp_drawable_bpp(GIMP_DRAWABLE_ID(gimp_drawable));
-    drawable->v.gimp.row = -1;
-    drawable->v.gimp.col = -1;
-    drawable->v.gimp.tile = 0;
+    drawable->v.gimp.num_tile_rows = 0;
+    drawable->v.gimp.num_tile_cols = 0;
+    drawable->v.gimp.tiles = NULL;
     drawable->v.gimp.fast_image_source = 0;
 
     drawable->v.gimp.fast_image_source_width =
@@ -1139,7 +1631,7 @@ do_mathmap (int frame_num, float current_t)
     if (generate_code())
     {
 	mathmap_frame_t *frame;
-	image_t *closure = closure_image_alloc(&invocation->mathfuncs, NULL,
+	image_t *closure = closure_image_alloc(render_mathfuncs(), NULL,
 					       invocation->mathmap->main_filter->num_uservals, invocation->uservals,
 					       sel_width, sel_height);
 
@@ -1156,6 +1648,12 @@ do_mathmap (int frame_num, float current_t)
 	    strcpy(progress_info, _("Mathmapping..."));
 	gimp_progress_init(progress_info);
 
+#ifdef THREADED_FINAL_RENDER
+	/* With several threads the renderer is faster than GIMP's tile
+	   access, so we decode all inputs beforehand. */
+	for_each_input_drawable(prefetch_drawable);
+#endif
+
 	frame = invocation_new_frame(invocation, closure,
 				     frame_num, current_t);
 
@@ -1180,6 +1678,9 @@ do_mathmap (int frame_num, float current_t)
 
 	invocation_free_frame(frame);
 
+#ifdef THREADED_FINAL_RENDER
+	for_each_input_drawable(free_prefetched_input_drawable);
+#endif
 	unref_tiles();
 
 	gimp_drawable_flush(output_drawable);
@@ -1197,11 +1698,13 @@ get_pixel (mathmap_invocation_t *invocation, input_drawable_t *drawable, int fra
 {
     gint newcol, newrow;
     gint newcoloff, newrowoff;
+    tile_cache_t *cache = get_tile_cache();
+    GimpTile *tile;
     guchar *p;
     guchar r, g, b, a;
     int bpp;
 
-    ++num_pixels_requested;
+    ++cache->num_pixels_requested;
 
     if (x < 0 || x >= drawable->image.pixel_width)
 	return invocation->edge_color_x;
@@ -1221,24 +1724,9 @@ get_pixel (mathmap_invocation_t *invocation, input_drawable_t *drawable, int fra
     newrow = y / tile_height;
     newrowoff = y % tile_height;
 
-#ifdef THREADED_FINAL_RENDER
-    pthread_mutex_lock(&get_gimp_pixel_mutex);
-#endif
-
-    if (drawable->v.gimp.col != newcol || drawable->v.gimp.row != newrow || drawable->v.gimp.tile == NULL)
-    {
-	if (drawable->v.gimp.tile != NULL)
-	    gimp_tile_unref(drawable->v.gimp.tile, FALSE);
-
-	drawable->v.gimp.tile = gimp_drawable_get_tile(drawable->v.gimp.drawable, FALSE, newrow, newcol);
-	assert(drawable->v.gimp.tile != 0);
-	gimp_tile_ref(drawable->v.gimp.tile);
-
-	drawable->v.gimp.col = newcol;
-	drawable->v.gimp.row = newrow;
-    }
+    tile = get_cached_tile(cache, drawable, newrow, newcol);
 
-    p = drawable->v.gimp.tile->data + drawable->v.gimp.tile->bpp * (drawable->v.gimp.tile->ewidth * newrowoff + newcoloff);
+    p = tile->data + tile->bpp * (tile->ewidth * newrowoff + newcoloff);
 
     bpp = drawable->v.gimp.bpp;
 
@@ -1258,10 +1746,6 @@ get_pixel (mathmap_invocation_t *invocation, input_drawable_t *drawable, int fra
     else
 	a = p[bpp - 1];
 
-#ifdef THREADED_FINAL_RENDER
-    pthread_mutex_unlock(&get_gimp_pixel_mutex);
-#endif
-
     return MAKE_RGBA_COLOR(r, g, b, a);
 }
 
@@ -1273,21 +1757,26 @@ build_fast_image_source (input_drawable_t *drawable)
     int x, y;
     int img_width, img_height;
 
-    if (drawable->v.gimp.fast_image_source != 0)
-	return;
-
     width = drawable->v.gimp.fast_image_source_width;
     height = drawable->v.gimp.fast_image_source_height;
 
-    p = drawable->v.gimp.fast_image_source = g_malloc(width * height * sizeof(color_t));
+    if (drawable->v.gimp.fast_image_source == 0)
+    {
+	p = drawable->v.gimp.fast_image_source = g_malloc(width * height * sizeof(color_t));
+
+	img_width = drawable->image.pixel_width;
+	img_height = drawable->image.pixel_height;
 
-    img_width = drawable->image.pixel_width;
-    img_height = drawable->image.pixel_height;
+	for (y = 0; y < height; ++y)
+	    for (x = 0; x < width; ++x)
+		drawable->v.gimp.fast_image_source[x + y * width] =
+		    get_pixel(invocation, drawable, 0, x * img_width / width, y * img_height / height);
+    }
 
-    for (y = 0; y < height; ++y)
-	for (x = 0; x < width; ++x)
-	    drawable->v.gimp.fast_image_source[x + y * width] =
-		get_pixel(invocation, drawable, 0, x * img_width / width, y * img_height / height);
+    /* The preview only sees these pixels. */
+    drawable->content_stamp = content_stamp_update(CONTENT_STAMP_INIT, drawable->v.gimp.fast_image_source,
+						   width * height * sizeof(color_t));
+    drawable->have_content_stamp = TRUE;
 }
 
 static color_t
@@ -2163,7 +2652,7 @@ recalculate_preview (void)
 	guchar *buf = (guchar*)malloc(4 * preview_width * preview_height);
 	int old_render_width, old_render_height;
 	mathmap_frame_t *frame;
-	image_t *closure = closure_image_alloc(&invocation->mathfuncs, NULL,
+	image_t *closure = closure_image_alloc(render_mathfuncs(), NULL,
 					       invocation->mathmap->main_filter->num_uservals, invocation->uservals,
 					       preview_width, preview_height);
 	assert(buf != 0);
@@ -2204,6 +2693,8 @@ recalculate_preview (void)
 
 	if (previewing)
 	    for_each_input_drawable(build_fast_image_source);
+	else
+	    for_each_input_drawable(invalidate_content_stamp);
 
 	frame = invocation_new_frame(invocation, closure, 0, mmvals.param_t);
 
@@ -2222,6 +2713,10 @@ recalculate_preview (void)
 	invocation->render_width = old_render_width;
 	invocation->render_height = old_render_height;
 
+#ifndef USE_LLVM
+	schedule_specialization();
+#endif
+
 	p = buf;
 	p_ul = wint.wimage;
 
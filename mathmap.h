@@ -110,6 +110,8 @@ typedef struct _mathmap_t
 
     void *module_info;
 
+    int id;			/* unique for every compiled mathmap */
+
     struct _mathmap_t *next;
 } mathmap_t;
 /* END */
@@ -142,22 +144,41 @@ extern int fast_image_source_scale;
 #define EDGE_BEHAVIOUR_X_FLAG	      0x0100
 #define EDGE_BEHAVIOUR_Y_FLAG	      0x0200
 
+#define SAMPLING_NEAREST	      0
+#define SAMPLING_BILINEAR	      1
+#define SAMPLING_BICUBIC	      2
+#define SAMPLING_LANCZOS	      3
+
 /* TEMPLATE max_debug_tuples */
 #define MAX_DEBUG_TUPLES              8
 /* END */
 
 /* TEMPLATE orig_val_pixel_func */
-typedef color_t (*orig_val_pixel_func_t) (struct _mathmap_invocation_t*, float, float, image_t*, int);
+typedef float* (*orig_val_pixel_func_t) (struct _mathmap_invocation_t*, float, float, image_t*, int, float*);
 /* END */
 
 typedef struct _native_filter_cache_entry_t
 {
-    filter_t *filter;
-    userval_t *args;
+    char *key;
     image_t *image;		/* NULL if not done */
+    mathmap_pools_t pools;	/* the image must be allocated here */
+    gsize size;
+    int ref_count;		/* number of invocations using it */
+    gpointer producer_old_owner; /* see thread_pool_set_owner() */
+    gboolean abandoned;		/* the producer was cancelled */
+    struct _native_filter_cache_entry_t *prev; /* LRU list */
     struct _native_filter_cache_entry_t *next;
 } native_filter_cache_entry_t;
 
+typedef struct
+{
+    unsigned long num_hits;
+    unsigned long num_misses;
+    unsigned long num_evictions;
+    int num_entries;
+    gsize size;
+} native_filter_cache_stats_t;
+
 /* TEMPLATE invocation_frame_slice */
 typedef struct _mathmap_invocation_t
 {
@@ -166,14 +187,21 @@ typedef struct _mathmap_invocation_t
     userval_t *uservals;
 
     /* FIXME: These should eventually go into image_t */
+    /* Set with invocation_set_sampling(). */
     int antialiasing;
+    int sampling;
     orig_val_pixel_func_t orig_val_func;
 
     int supersampling;
 
+    /* If set, input images get mipmaps for ORIG_VAL_LOD. */
+    int mipmapping;
+
     int output_bpp;
 
+    /* Set with invocation_set_edge_behaviour(). */
     int edge_behaviour_x, edge_behaviour_y;
+    void (*edge_behaviour_func) (int *x, int *y, int width, int height);
     color_t edge_color_x, edge_color_y;
 
     /* These are in pixel coordinates: */
@@ -188,10 +216,13 @@ typedef struct _mathmap_invocation_t
 
     unsigned char * volatile rows_finished;
 
-    mathmap_pools_t pools;	/* used exclusively for the native filter cache */
-    GMutex *native_filter_cache_mutex;
-    GCond *native_filter_cache_cond;
-    native_filter_cache_entry_t *native_filter_cache;
+    /* Set with invocation_set_rand_seed(). */
+    unsigned int rand_seed;
+
+    /* the native filter cache entries this invocation holds while it
+       has frames */
+    GHashTable *native_filter_cache_refs;
+    volatile gint num_frames;
 
     /* FIXME: remove - it's in the closure */
     mathfuncs_t mathfuncs;
@@ -271,9 +302,21 @@ unsigned int filter_flags (filter_t *filter);
 void start_parsing_filter (mathmap_t *mathmap, top_level_decl_t *decl);
 void finish_parsing_filter (mathmap_t *mathmap);
 
+/* The time the phases of the last call to compile_mathmap took, in
+   seconds.  Phases that weren't reached are 0. */
+typedef struct
+{
+    double parse;
+    double optimize;
+    double backend;
+} compile_timings_t;
+
+extern compile_timings_t last_compile_timings;
+
 int check_mathmap (char *expression);
 mathmap_t* parse_mathmap (char *expression);
-mathmap_t* compile_mathmap (char *expression, char **support_paths, int timeout, gboolean no_backend);
+mathmap_t* compile_mathmap (char *expression, char **support_paths, int timeout, gboolean no_backend,
+			    userval_t *constant_uservals);
 mathmap_invocation_t* invoke_mathmap (mathmap_t *mathmap, mathmap_invocation_t *template_invocation,
 				      int img_width, int img_height, gboolean copy_first_image);
 
@@ -286,6 +329,9 @@ void invocation_init_slice (mathmap_slice_t *slice, image_t *image, mathmap_fram
 void invocation_deinit_slice (mathmap_slice_t *slice);
 
 void invocation_set_antialiasing (mathmap_invocation_t *invocation, gboolean antialising);
+void invocation_set_sampling (mathmap_invocation_t *invocation, int sampling);
+void invocation_set_edge_behaviour (mathmap_invocation_t *invocation, int edge_behaviour_x, int edge_behaviour_y);
+void invocation_set_rand_seed (mathmap_invocation_t *invocation, unsigned int rand_seed);
 
 gpointer call_invocation_parallel (mathmap_frame_t *frame, image_t *closure,
 				   int region_x, int region_y, int region_width, int region_height,
@@ -303,6 +349,8 @@ native_filter_cache_entry_t* invocation_lookup_native_filter_invocation (mathmap
 void native_filter_cache_entry_set_image (mathmap_invocation_t *invocation,
 					  native_filter_cache_entry_t *cache_entry,
 					  image_t *image);
+void invocation_release_native_filter_cache_entries (mathmap_invocation_t *invocation);
+void native_filter_cache_get_stats (native_filter_cache_stats_t *stats);
 
 void carry_over_uservals_from_template (mathmap_invocation_t *invocation, mathmap_invocation_t *template_invocation,
 					gboolean copy_first_image);
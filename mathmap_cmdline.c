@@ -44,6 +44,7 @@
 #include "jump.h"
 #include "mathmap.h"
 #include "drawable.h"
+#include "thread_pool.h"
 #include "rwimg/readimage.h"
 #include "rwimg/writeimage.h"
 
@@ -64,10 +65,22 @@ typedef struct _cache_entry_t
     int timestamp;
 } cache_entry_t;
 
+/* The cache is shared by all render threads.  cache_mutex protects
+   the cache itself as well as binding entries to drawables and setting
+   their timestamps.  Once an entry's timestamp is the current time it
+   can't be evicted, so it can be read without taking the mutex until
+   the time advances, which only happens between renders.  The
+   timestamp is set last, so a reader which sees the current time
+   also sees the drawable and frame the entry was bound to.  It has to
+   check those, though, because the entry it got from the drawable
+   might have been rebound in the meantime. */
+static GStaticMutex cache_mutex = G_STATIC_MUTEX_INIT;
 static int cache_size = 16;
-static cache_entry_t *cache = 0;
-static int current_time = 0;
+static int cache_capacity = 0;
+static cache_entry_t **cache = 0;
+static volatile int current_time = 0;
 
+/* Must be called with cache_mutex held. */
 static cache_entry_t*
 get_free_cache_entry (void)
 {
@@ -75,31 +88,49 @@ get_free_cache_entry (void)
     int i;
 
     if (cache == 0)
-	cache = g_new0(cache_entry_t, cache_size);
+    {
+	cache_capacity = cache_size;
+	cache = g_new0(cache_entry_t*, cache_capacity);
+	for (i = 0; i < cache_capacity; ++i)
+	    cache[i] = g_new0(cache_entry_t, 1);
+    }
     g_assert(cache != 0);
 
-    for (i = 0; i < cache_size; ++i)
-	if (cache[i].drawable == 0)
+    for (i = 0; i < cache_capacity; ++i)
+	if (cache[i]->drawable == 0)
 	{
 	    lru_index = i;
 	    break;
 	}
-	else
-	    if (lru_index < 0 || cache[i].timestamp < cache[lru_index].timestamp)
+	else if (cache[i]->timestamp < current_time)
+	{
+	    if (lru_index < 0 || cache[i]->timestamp < cache[lru_index]->timestamp)
 		lru_index = i;
+	}
 
-    if (cache[lru_index].drawable != 0)
-	cache[lru_index].drawable->v.cmdline.cache_entries[cache[lru_index].frame] = 0;
+    /* All entries are in use by the current render, so we can't evict
+       any of them. */
+    if (lru_index < 0)
+    {
+	lru_index = cache_capacity;
+	cache = g_renew(cache_entry_t*, cache, cache_capacity + 1);
+	cache[cache_capacity++] = g_new0(cache_entry_t, 1);
+    }
 
-    if (cache[lru_index].data != 0)
+    if (cache[lru_index]->drawable != 0)
+	g_atomic_pointer_set((gpointer*)&cache[lru_index]->drawable->v.cmdline.cache_entries[cache[lru_index]->frame], 0);
+    cache[lru_index]->drawable = 0;
+
+    if (cache[lru_index]->data != 0)
     {
-	free(cache[lru_index].data);
-	cache[lru_index].data = 0;
+	free(cache[lru_index]->data);
+	cache[lru_index]->data = 0;
     }
 
-    return &cache[lru_index];
+    return cache[lru_index];
 }
 
+/* Must be called with cache_mutex held. */
 static cache_entry_t*
 get_cache_entry_for_image (const char *filename, int *width, int *height)
 {
@@ -115,6 +146,7 @@ get_cache_entry_for_image (const char *filename, int *width, int *height)
     return cache_entry;
 }
 
+/* Must be called with cache_mutex held. */
 static void
 bind_cache_entry_to_drawable (cache_entry_t *cache_entry, input_drawable_t *drawable, int frame)
 {
@@ -123,30 +155,24 @@ bind_cache_entry_to_drawable (cache_entry_t *cache_entry, input_drawable_t *draw
 
     cache_entry->drawable = drawable;
     cache_entry->frame = frame;
-    cache_entry->timestamp = current_time;
+    g_atomic_int_set(&cache_entry->timestamp, current_time);
 
-    drawable->v.cmdline.cache_entries[frame] = cache_entry;
+    /* The entry must be complete before other threads can see it. */
+    g_atomic_pointer_set((gpointer*)&drawable->v.cmdline.cache_entries[frame], cache_entry);
 }
 
-color_t
-cmdline_mathmap_get_pixel (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame, int x, int y)
+static cache_entry_t*
+load_cache_entry (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame)
 {
-    guchar *p;
-    int num_frames;
-    cache_entry_t **cache_entries;
+    cache_entry_t *cache_entry;
 
-    g_assert(drawable->kind == INPUT_DRAWABLE_CMDLINE_IMAGE || drawable->kind == INPUT_DRAWABLE_CMDLINE_MOVIE);
+    g_static_mutex_lock(&cache_mutex);
 
-    num_frames = drawable->v.cmdline.num_frames;
-    cache_entries = drawable->v.cmdline.cache_entries;
-
-    if (frame < 0 || frame >= num_frames)
-	return MAKE_RGBA_COLOR(255, 255, 255, 255);
-
-    if (cache_entries[frame] == 0)
+    cache_entry = drawable->v.cmdline.cache_entries[frame];
+    if (cache_entry != 0)
+	g_atomic_int_set(&cache_entry->timestamp, current_time);
+    else
     {
-	cache_entry_t *cache_entry;
-
 	if (drawable->kind == INPUT_DRAWABLE_CMDLINE_IMAGE)
 	{
 	    int width, height;
@@ -175,10 +201,34 @@ cmdline_mathmap_get_pixel (mathmap_invocation_t *invocation, input_drawable_t *d
 
 	bind_cache_entry_to_drawable(cache_entry, drawable, frame);
     }
-    else
-	cache_entries[frame]->timestamp = current_time;
 
-    p = cache_entries[frame]->data + 3 * (drawable->image.pixel_width * y + x);
+    g_static_mutex_unlock(&cache_mutex);
+
+    return cache_entry;
+}
+
+color_t
+cmdline_mathmap_get_pixel (mathmap_invocation_t *invocation, input_drawable_t *drawable, int frame, int x, int y)
+{
+    guchar *p;
+    int num_frames;
+    cache_entry_t *cache_entry;
+
+    g_assert(drawable->kind == INPUT_DRAWABLE_CMDLINE_IMAGE || drawable->kind == INPUT_DRAWABLE_CMDLINE_MOVIE);
+
+    num_frames = drawable->v.cmdline.num_frames;
+
+    if (frame < 0 || frame >= num_frames)
+	return MAKE_RGBA_COLOR(255, 255, 255, 255);
+
+    cache_entry = g_atomic_pointer_get((gpointer*)&drawable->v.cmdline.cache_entries[frame]);
+    if (cache_entry == 0
+	|| g_atomic_int_get(&cache_entry->timestamp) != current_time
+	|| cache_entry->drawable != drawable
+	|| cache_entry->frame != frame)
+	cache_entry = load_cache_entry(invocation, drawable, frame);
+
+    p = cache_entry->data + 3 * (drawable->image.pixel_width * y + x);
 
     return MAKE_RGBA_COLOR(p[0], p[1], p[2], 255);
 }
@@ -187,8 +237,13 @@ input_drawable_t*
 alloc_cmdline_image_input_drawable (const char *filename)
 {
     int width, height;
-    cache_entry_t *cache_entry = get_cache_entry_for_image(filename, &width, &height);
-    input_drawable_t *drawable = alloc_input_drawable(INPUT_DRAWABLE_CMDLINE_IMAGE, width, height);
+    cache_entry_t *cache_entry;
+    input_drawable_t *drawable;
+
+    g_static_mutex_lock(&cache_mutex);
+
+    cache_entry = get_cache_entry_for_image(filename, &width, &height);
+    drawable = alloc_input_drawable(INPUT_DRAWABLE_CMDLINE_IMAGE, width, height);
 
     drawable->v.cmdline.cache_entries = g_new0(cache_entry_t*, 1);
     drawable->v.cmdline.num_frames = 1;
@@ -196,6 +251,8 @@ alloc_cmdline_image_input_drawable (const char *filename)
 
     bind_cache_entry_to_drawable(cache_entry, drawable, 0);
 
+    g_static_mutex_unlock(&cache_mutex);
+
     return drawable;
 }
 
@@ -420,6 +477,53 @@ lookup_define (define_t *defines, const char *name)
     return NULL;
 }
 
+typedef struct
+{
+    const char *script_name;
+    int width;
+    int height;
+    int num_threads;
+    int num_frames;		/* number of frames rendered */
+    double frame_init;		/* in seconds, for all frames */
+    double render;
+} bench_results_t;
+
+/* Appends the results as one line of JSON to filename, so that the
+   file collects the results of a whole benchmark run. */
+static gboolean
+write_bench_results (const char *filename, bench_results_t *results)
+{
+    FILE *out = fopen(filename, "a");
+    const char *p;
+    int n = MAX(results->num_frames, 1);
+
+    if (out == NULL)
+    {
+	fprintf(stderr, _("Error: Cannot open file `%s' for writing: %s\n"), filename, strerror(errno));
+	return FALSE;
+    }
+
+    fprintf(out, "{\"script\": \"");
+    for (p = results->script_name; *p != '\0'; ++p)
+    {
+	if (*p == '"' || *p == '\\')
+	    putc('\\', out);
+	putc(*p, out);
+    }
+    fprintf(out, "\", \"width\": %d, \"height\": %d, \"threads\": %d, \"frames\": %d",
+	    results->width, results->height, results->num_threads, results->num_frames);
+    fprintf(out, ", \"parse_ms\": %.3f, \"optimize_ms\": %.3f, \"backend_ms\": %.3f",
+	    last_compile_timings.parse * 1000.0, last_compile_timings.optimize * 1000.0,
+	    last_compile_timings.backend * 1000.0);
+    fprintf(out, ", \"frame_init_ms\": %.3f, \"render_ms\": %.3f, \"ns_per_pixel\": %.3f}\n",
+	    results->frame_init * 1000.0 / n, results->render * 1000.0 / n,
+	    results->render * 1e9 / ((double)n * MAX(results->width * results->height, 1)));
+
+    fclose(out);
+
+    return TRUE;
+}
+
 static void
 usage (void)
 {
@@ -442,13 +546,30 @@ usage (void)
 	   "  -F, --frames=NUM            output movie has NUM frames\n"
 #endif
 	   "  -i, --intersampling         use intersampling\n"
+	   "  --sampling=MODE             sample input images with MODE, which is\n"
+	   "                              nearest, bilinear (same as -i), bicubic\n"
+	   "                              or lanczos\n"
+	   "  --mipmap                    sample minified input images from\n"
+	   "                              mipmaps (implies --prefetch)\n"
+	   "  --rand-seed=NUM             seed the random number generator with\n"
+	   "                              NUM (default 0)\n"
 	   "  -o, --oversampling          use oversampling\n"
 	   "  -s, --size=WIDTHxHEIGHT     sets the output image size\n"
 	   "  -c, --cache=NUM             cache NUM input images (default %d)\n"
+	   "  --threads=NUM               render with NUM threads (default %d)\n"
 	   "  -g, --generator=GEN         generate plug-in code with GEN\n"
+	   "  --prefetch                  decode input images completely before\n"
+	   "                              rendering\n"
+	   "  --passes=PASS,...           run the given optimization passes in\n"
+	   "                              that order\n"
+	   "  --disable-pass=PASS         don't run optimization pass PASS\n"
+	   "  --pass-stats=FILENAME       write optimization pass statistics\n"
+	   "                              as JSON to FILENAME (- for stdout)\n"
+	   "  --bench-results=FILENAME    append compile and render timings as\n"
+	   "                              a line of JSON to FILENAME\n"
 	   "\n"
 	   "Report bugs and suggestions to schani@complang.tuwien.ac.at\n",
-	   cache_size);
+	   cache_size, get_num_cpus());
 }
 
 #define OPTION_VERSION				256
@@ -459,6 +580,15 @@ usage (void)
 #define OPTION_BENCH_NO_COMPILE_TIME_LIMIT	261
 #define OPTION_BENCH_NO_BACKEND			262
 #define OPTION_BENCH_RENDER_COUNT		263
+#define OPTION_PREFETCH				264
+#define OPTION_THREADS				265
+#define OPTION_PASSES				266
+#define OPTION_DISABLE_PASS			267
+#define OPTION_PASS_STATS			268
+#define OPTION_BENCH_RESULTS			269
+#define OPTION_SAMPLING				270
+#define OPTION_MIPMAP				271
+#define OPTION_RAND_SEED			272
 
 int
 cmdline_main (int argc, char *argv[])
@@ -470,7 +600,7 @@ cmdline_main (int argc, char *argv[])
     quicktime_t *output_movie;
     guchar **rows;
 #endif
-    int antialiasing = 0, supersampling = 0;
+    int sampling = SAMPLING_NEAREST, supersampling = 0;
     int img_width, img_height;
     char *generator = 0;
     userval_info_t *userval_info;
@@ -485,6 +615,16 @@ cmdline_main (int argc, char *argv[])
     gboolean bench_no_output = FALSE;
     gboolean bench_no_backend = FALSE;
     int compile_time_limit = DEFAULT_OPTIMIZATION_TIMEOUT;
+    gboolean prefetch = FALSE;
+    gboolean mipmap = FALSE;
+    unsigned int rand_seed = 0;
+    int num_threads = get_num_cpus();
+    char *pass_stats_filename = NULL;
+    char *bench_results_filename = NULL;
+    bench_results_t bench_results;
+
+    memset(&bench_results, 0, sizeof(bench_results_t));
+    bench_results.script_name = "";
 
     for (;;)
     {
@@ -504,6 +644,15 @@ cmdline_main (int argc, char *argv[])
 		{ "bench-no-compile-time-limit", no_argument, 0, OPTION_BENCH_NO_COMPILE_TIME_LIMIT },
 		{ "bench-no-backend", no_argument, 0, OPTION_BENCH_NO_BACKEND },
 		{ "bench-render-count", required_argument, 0, OPTION_BENCH_RENDER_COUNT },
+		{ "prefetch", no_argument, 0, OPTION_PREFETCH },
+		{ "threads", required_argument, 0, OPTION_THREADS },
+		{ "passes", required_argument, 0, OPTION_PASSES },
+		{ "disable-pass", required_argument, 0, OPTION_DISABLE_PASS },
+		{ "pass-stats", required_argument, 0, OPTION_PASS_STATS },
+		{ "bench-results", required_argument, 0, OPTION_BENCH_RESULTS },
+		{ "sampling", required_argument, 0, OPTION_SAMPLING },
+		{ "mipmap", no_argument, 0, OPTION_MIPMAP },
+		{ "rand-seed", required_argument, 0, OPTION_RAND_SEED },
 #ifdef MOVIES
 		{ "frames", required_argument, 0, 'F' },
 		{ "movie", required_argument, 0, 'M' },
@@ -555,6 +704,7 @@ cmdline_main (int argc, char *argv[])
 		break;
 
 	    case 'f' :
+		bench_results.script_name = optarg;
 		if (!g_file_get_contents(optarg, &script, NULL, NULL))
 		{
 		    fprintf(stderr, _("Error: The script file `%s' could not be read.\n"), optarg);
@@ -563,7 +713,23 @@ cmdline_main (int argc, char *argv[])
 		break;
 
 	    case 'i' :
-		antialiasing = 1;
+		sampling = SAMPLING_BILINEAR;
+		break;
+
+	    case OPTION_SAMPLING :
+		if (strcmp(optarg, "nearest") == 0)
+		    sampling = SAMPLING_NEAREST;
+		else if (strcmp(optarg, "bilinear") == 0)
+		    sampling = SAMPLING_BILINEAR;
+		else if (strcmp(optarg, "bicubic") == 0)
+		    sampling = SAMPLING_BICUBIC;
+		else if (strcmp(optarg, "lanczos") == 0)
+		    sampling = SAMPLING_LANCZOS;
+		else
+		{
+		    fprintf(stderr, _("Error: Unknown sampling mode `%s'.\n"), optarg);
+		    return 1;
+		}
 		break;
 
 	    case 'o' :
@@ -616,6 +782,60 @@ cmdline_main (int argc, char *argv[])
 		bench_no_backend = TRUE;
 		break;
 
+	    case OPTION_PREFETCH :
+		prefetch = TRUE;
+		break;
+
+	    case OPTION_MIPMAP :
+		/* The mipmaps of drawables are built when they're
+		   prefetched. */
+		mipmap = TRUE;
+		prefetch = TRUE;
+		if (!compiler_enable_pass("orig-val-lod"))
+		{
+		    fprintf(stderr, _("Error: %s\n"), error_string);
+		    return 1;
+		}
+		break;
+
+	    case OPTION_RAND_SEED :
+		rand_seed = strtoul(optarg, NULL, 0);
+		break;
+
+	    case OPTION_THREADS :
+		num_threads = atoi(optarg);
+		if (num_threads < 1)
+		{
+		    fprintf(stderr, _("Error: Number of threads must be at least 1.\n"));
+		    return 1;
+		}
+		break;
+
+	    case OPTION_PASSES :
+		if (!compiler_set_pass_pipeline(optarg))
+		{
+		    fprintf(stderr, _("Error: %s\n"), error_string);
+		    return 1;
+		}
+		break;
+
+	    case OPTION_DISABLE_PASS :
+		if (!compiler_disable_pass(optarg))
+		{
+		    fprintf(stderr, _("Error: %s\n"), error_string);
+		    return 1;
+		}
+		break;
+
+	    case OPTION_PASS_STATS :
+		pass_stats_filename = optarg;
+		compiler_collect_pass_stats(TRUE);
+		break;
+
+	    case OPTION_BENCH_RESULTS :
+		bench_results_filename = optarg;
+		break;
+
 #ifdef MOVIES
 	    case 'F' :
 		generate_movie = 1;
@@ -652,6 +872,8 @@ cmdline_main (int argc, char *argv[])
 	output_filename = argv[optind + 1];
     }
 
+    thread_pool_set_num_workers(num_threads);
+
     init_tags();
     init_builtins();
     init_macros();
@@ -700,10 +922,43 @@ cmdline_main (int argc, char *argv[])
 	support_paths[2] = g_strdup_printf("%s/.gimp-2.4/mathmap", getenv("HOME"));
 	support_paths[3] = NULL;
 
-	mathmap = compile_mathmap(script, support_paths, compile_time_limit, bench_no_backend);
+	mathmap = compile_mathmap(script, support_paths, compile_time_limit, bench_no_backend, NULL);
+
+	if (pass_stats_filename != NULL)
+	{
+	    if (strcmp(pass_stats_filename, "-") == 0)
+		compiler_write_pass_stats_json(stdout);
+	    else
+	    {
+		FILE *out = fopen(pass_stats_filename, "w");
+
+		if (out == NULL)
+		{
+		    fprintf(stderr, _("Error: Cannot open file `%s' for writing: %s\n"),
+			    pass_stats_filename, strerror(errno));
+		    return 1;
+		}
+		compiler_write_pass_stats_json(out);
+		fclose(out);
+	    }
+	}
+
+	if (bench_results_filename != NULL)
+	{
+	    bench_results.num_threads = num_threads;
+	    if (size_is_set)
+	    {
+		bench_results.width = img_width;
+		bench_results.height = img_height;
+	    }
+	}
 
 	if (bench_no_backend)
+	{
+	    if (bench_results_filename != NULL && !write_bench_results(bench_results_filename, &bench_results))
+		return 1;
 	    return 0;
+	}
 
 	if (mathmap == 0)
 	{
@@ -712,7 +967,11 @@ cmdline_main (int argc, char *argv[])
 	}
 
 	if (bench_render_count == 0)
+	{
+	    if (bench_results_filename != NULL && !write_bench_results(bench_results_filename, &bench_results))
+		return 1;
 	    return 0;
+	}
 
 	if (!size_is_set)
 	    for (userval_info = mathmap->main_filter->userval_infos;
@@ -795,6 +1054,18 @@ cmdline_main (int argc, char *argv[])
 		}
 	}
 
+	invocation->mipmapping = mipmap;
+	invocation_set_rand_seed(invocation, rand_seed);
+
+	if (prefetch)
+	{
+	    int num_drawables = get_num_input_drawables();
+	    int j;
+
+	    for (j = 0; j < num_drawables; ++j)
+		prefetch_input_drawable(invocation, get_nth_input_drawable(j), 0);
+	}
+
 	for (render_num = 0; render_num < bench_render_count; ++render_num)
 	{
 #ifdef MOVIES
@@ -806,7 +1077,7 @@ cmdline_main (int argc, char *argv[])
 		}
 #endif
 
-	    invocation_set_antialiasing(invocation, antialiasing);
+	    invocation_set_sampling(invocation, sampling);
 	    invocation->supersampling = supersampling;
 
 	    invocation->output_bpp = 4;
@@ -838,10 +1109,21 @@ cmdline_main (int argc, char *argv[])
 						       invocation->mathmap->main_filter->num_uservals,
 						       invocation->uservals,
 						       img_width, img_height);
+		GTimer *timer = g_timer_new();
 		mathmap_frame_t *frame = invocation_new_frame(invocation, closure,
 							      current_frame, current_t);
 
-		call_invocation_parallel_and_join(frame, closure, 0, 0, img_width, img_height, output, 1);
+		bench_results.frame_init += g_timer_elapsed(timer, NULL);
+
+		/* Entries used for the previous frame may be evicted now. */
+		++current_time;
+
+		g_timer_start(timer);
+		call_invocation_parallel_and_join(frame, closure, 0, 0, img_width, img_height, output, num_threads);
+		bench_results.render += g_timer_elapsed(timer, NULL);
+		++bench_results.num_frames;
+
+		g_timer_destroy(timer);
 
 		invocation_free_frame(frame);
 
@@ -869,6 +1151,32 @@ cmdline_main (int argc, char *argv[])
 
 	    free(output);
 	}
+
+	if (bench_results_filename != NULL)
+	{
+	    bench_results.width = img_width;
+	    bench_results.height = img_height;
+	    if (!write_bench_results(bench_results_filename, &bench_results))
+		return 1;
+	}
+
+#ifdef DEBUG_OUTPUT
+	{
+	    native_filter_cache_stats_t stats;
+
+	    native_filter_cache_get_stats(&stats);
+	    fprintf(stderr, "native filter cache: %lu hits, %lu misses, %lu evictions, %d entries, %lu bytes\n",
+		    stats.num_hits, stats.num_misses, stats.num_evictions,
+		    stats.num_entries, (unsigned long)stats.size);
+	}
+	{
+	    size_t num_bytes, peak_num_bytes;
+
+	    mathmap_pools_get_stats(&num_bytes, &peak_num_bytes);
+	    fprintf(stderr, "global pools: %lu bytes, %lu bytes peak\n",
+		    (unsigned long)num_bytes, (unsigned long)peak_num_bytes);
+	}
+#endif
     }
     else
     {
@@ -48,6 +48,7 @@
 #include "mathmap.h"
 #include "compiler-internals.h"
 #include "native-filters/native-filters.h"
+#include "thread_pool.h"
 
 int cmd_line_mode = 0;
 
@@ -311,9 +312,7 @@ free_invocation (mathmap_invocation_t *invocation)
 
     free(invocation->rows_finished);
 
-    g_mutex_free(invocation->native_filter_cache_mutex);
-    g_cond_free(invocation->native_filter_cache_cond);
-    mathmap_pools_free(&invocation->pools);
+    invocation_release_native_filter_cache_entries(invocation);
 
     free(invocation);
 }
@@ -408,13 +407,19 @@ does_filter_use_t (filter_t *filter)
     return t_internal->is_used;
 }
 
-mathmap_t*
-parse_mathmap (char *expression)
+/* The scanner, parser and compiler are not reentrant, but the
+   plug-in compiles specialized filters in the background. */
+static GStaticRecMutex compiler_mutex = G_STATIC_REC_MUTEX_INIT;
+
+static mathmap_t*
+parse_mathmap_unlocked (char *expression)
 {
     static mathmap_t *mathmap;	/* this is static to avoid problems with longjmp.  */
+    static int last_id = 0;
     volatile gboolean need_end_scan = FALSE;
 
     mathmap = g_new0(mathmap_t, 1);
+    mathmap->id = ++last_id;
 
     the_mathmap = mathmap;
 
@@ -486,6 +491,18 @@ parse_mathmap (char *expression)
     return mathmap;
 }
 
+mathmap_t*
+parse_mathmap (char *expression)
+{
+    mathmap_t *mathmap;
+
+    g_static_rec_mutex_lock(&compiler_mutex);
+    mathmap = parse_mathmap_unlocked(expression);
+    g_static_rec_mutex_unlock(&compiler_mutex);
+
+    return mathmap;
+}
+
 int
 check_mathmap (char *expression)
 {
@@ -500,13 +517,19 @@ check_mathmap (char *expression)
 	return 0;
 }
 
-mathmap_t*
-compile_mathmap (char *expression, char **support_paths, int timeout, gboolean no_backend)
+compile_timings_t last_compile_timings;
+
+static mathmap_t*
+compile_mathmap_unlocked (char *expression, char **support_paths, int timeout, gboolean no_backend,
+			  userval_t *constant_uservals)
 {
     volatile mathmap_t *mathmap = NULL;
     char *template_filename, *include_path;
+    GTimer *timer;
     int i;
 
+    memset(&last_compile_timings, 0, sizeof(compile_timings_t));
+
     for (i = 0; support_paths[i] != NULL; ++i)
     {
 	template_filename = g_strdup_printf("%s/%s", support_paths[i], MAIN_TEMPLATE_FILENAME);
@@ -530,30 +553,46 @@ compile_mathmap (char *expression, char **support_paths, int timeout, gboolean n
     }
     include_path = support_paths[i];
 
+    timer = g_timer_new();
+
     DO_JUMP_CODE {
 	filter_code_t **filter_codes;
 
 	mathmap = parse_mathmap(expression);
+	last_compile_timings.parse = g_timer_elapsed(timer, NULL);
 
 	if (mathmap == 0)
 	{
 	    JUMP(1);
 	}
 
-	filter_codes = compiler_compile_filters((mathmap_t*)mathmap, timeout);
+	g_timer_start(timer);
+	filter_codes = compiler_compile_filters((mathmap_t*)mathmap, timeout, constant_uservals);
+	last_compile_timings.optimize = g_timer_elapsed(timer, NULL);
+
+	if (filter_codes == NULL)
+	{
+	    sprintf(error_string, _("The filter cannot be specialized."));
+	    error_region = scanner_null_region;
+
+	    JUMP(1);
+	}
 
 	if (no_backend)
 	{
 	    compiler_free_pools((mathmap_t*)mathmap);
+	    g_timer_destroy(timer);
 	    return NULL;
 	}
 
+	g_timer_start(timer);
 #ifdef USE_LLVM
 	gen_and_load_llvm_code((mathmap_t*)mathmap, template_filename, filter_codes);
 #else
 	mathmap->initfunc = gen_and_load_c_code(mathmap, &mathmap->module_info,
 						template_filename, include_path, filter_codes);
 #endif
+	last_compile_timings.backend = g_timer_elapsed(timer, NULL);
 
 	compiler_free_pools((mathmap_t*)mathmap);
 
@@ -578,9 +617,45 @@ compile_mathmap (char *expression, char **support_paths, int timeout, gboolean n
 	}
     } END_JUMP_HANDLER;
 
+    g_timer_destroy(timer);
+
     return (mathmap_t*)mathmap;
 }
 
+/* If constant_uservals is not NULL, the main filter is specialized
+   for the values of its int, float and bool user values, which it
+   will then ignore.  Other user values are still read at run time, so
+   the code can be used with an invocation of the unspecialized
+   mathmap as long as those values don't change.
+
+   Specializations are compiled in the background and their errors
+   are not reported, so they must not clobber the error of a compile
+   the user is waiting for, which is read after we unlock. */
+mathmap_t*
+compile_mathmap (char *expression, char **support_paths, int timeout, gboolean no_backend,
+		 userval_t *constant_uservals)
+{
+    mathmap_t *mathmap;
+    char saved_error_string[ERROR_STRING_LENGTH];
+    scanner_region_t saved_error_region;
+
+    g_static_rec_mutex_lock(&compiler_mutex);
+    if (constant_uservals != NULL)
+    {
+	memcpy(saved_error_string, error_string, ERROR_STRING_LENGTH);
+	saved_error_region = error_region;
+    }
+    mathmap = compile_mathmap_unlocked(expression, support_paths, timeout, no_backend, constant_uservals);
+    if (constant_uservals != NULL)
+    {
+	memcpy(error_string, saved_error_string, ERROR_STRING_LENGTH);
+	error_region = saved_error_region;
+    }
+    g_static_rec_mutex_unlock(&compiler_mutex);
+
+    return mathmap;
+}
+
 void
 llvm_filter_init_frame (mathmap_frame_t *mmframe, image_t *closure)
 {
@@ -733,14 +808,49 @@ init_invocation (mathmap_invocation_t *invocation)
     }
 }
 
+void
+invocation_set_sampling (mathmap_invocation_t *invocation, int sampling)
+{
+    invocation->sampling = sampling;
+    invocation->antialiasing = sampling != SAMPLING_NEAREST;
+
+    switch (sampling)
+    {
+	case SAMPLING_NEAREST :
+	    invocation->orig_val_func = get_orig_val_pixel;
+	    break;
+	case SAMPLING_BILINEAR :
+	    invocation->orig_val_func = get_orig_val_intersample_pixel;
+	    break;
+	case SAMPLING_BICUBIC :
+	    invocation->orig_val_func = get_orig_val_bicubic_pixel;
+	    break;
+	case SAMPLING_LANCZOS :
+	    invocation->orig_val_func = get_orig_val_lanczos_pixel;
+	    break;
+	default :
+	    g_assert_not_reached();
+    }
+}
+
 void
 invocation_set_antialiasing (mathmap_invocation_t *invocation, gboolean antialiasing)
 {
-    invocation->antialiasing = antialiasing;
-    if (antialiasing)
-	invocation->orig_val_func = get_orig_val_intersample_pixel;
-    else
-	invocation->orig_val_func = get_orig_val_pixel;
+    invocation_set_sampling(invocation, antialiasing ? SAMPLING_BILINEAR : SAMPLING_NEAREST);
+}
+
+void
+invocation_set_edge_behaviour (mathmap_invocation_t *invocation, int edge_behaviour_x, int edge_behaviour_y)
+{
+    invocation->edge_behaviour_x = edge_behaviour_x;
+    invocation->edge_behaviour_y = edge_behaviour_y;
+    invocation->edge_behaviour_func = get_edge_behaviour_func(edge_behaviour_x, edge_behaviour_y);
+}
+
+void
+invocation_set_rand_seed (mathmap_invocation_t *invocation, unsigned int rand_seed)
+{
+    invocation->rand_seed = rand_seed;
 }
 
 mathmap_invocation_t*
@@ -762,7 +872,7 @@ invoke_mathmap (mathmap_t *mathmap, mathmap_invocation_t *template, int img_widt
 
     invocation->output_bpp = 4;
 
-    invocation->edge_behaviour_x = invocation->edge_behaviour_y = EDGE_BEHAVIOUR_COLOR;
+    invocation_set_edge_behaviour(invocation, EDGE_BEHAVIOUR_COLOR, EDGE_BEHAVIOUR_COLOR);
 
     invocation->img_width = invocation->render_width = img_width;
     invocation->img_height = invocation->render_height = img_height;
@@ -776,6 +886,8 @@ invoke_mathmap (mathmap_t *mathmap, mathmap_invocation_t *template, int img_widt
 
     invocation->do_debug = 0;
 
+    invocation_set_rand_seed(invocation, 0);
+
     invocation->uservals = instantiate_uservals(mathmap->main_filter->userval_infos, invocation);
 
     if (template != NULL)
@@ -786,10 +898,8 @@ invoke_mathmap (mathmap_t *mathmap, mathmap_invocation_t *template, int img_widt
     if (!g_thread_supported())
 	g_thread_init (NULL);
 
-    mathmap_pools_init_global(&invocation->pools);
-    invocation->native_filter_cache_mutex = g_mutex_new();
-    invocation->native_filter_cache_cond = g_cond_new();
-    invocation->native_filter_cache = NULL;
+    invocation->native_filter_cache_refs = NULL;
+    invocation->num_frames = 0;
 
     return invocation;
 }
@@ -810,6 +920,8 @@ invocation_new_frame (mathmap_invocation_t *invocation, image_t *closure,
 
     mathmap_pools_init_global(&frame->pools);
 
+    g_atomic_int_inc(&invocation->num_frames);
+
     closure->v.closure.funcs->init_frame(frame, closure);
 
     return frame;
@@ -818,8 +930,15 @@ invocation_new_frame (mathmap_invocation_t *invocation, image_t *closure,
 void
 invocation_free_frame (mathmap_frame_t *frame)
 {
+    mathmap_invocation_t *invocation = frame->invocation;
+
     mathmap_pools_free(&frame->pools);
     g_free(frame);
+
+    /* Nothing refers to the native filter results anymore, so they
+       can be evicted if the cache gets too big. */
+    if (g_atomic_int_dec_and_test(&invocation->num_frames))
+	invocation_release_native_filter_cache_entries(invocation);
 }
 
 void
@@ -870,61 +989,220 @@ invocation_deinit_slice (mathmap_slice_t *slice)
     mathmap_pools_free(&slice->pools);
 }
 
+/* With supersampling we first render every pixel once, at its
+   center.  Pixels whose color differs from one of their neighbours by
+   more than SUPERSAMPLING_THRESHOLD in any channel are then rendered
+   again with SUPERSAMPLING_GRID x SUPERSAMPLING_GRID jittered samples,
+   one in each cell of a grid over the pixel, which are averaged in
+   float.  The pixels in flat regions are only rendered once. */
+#define SUPERSAMPLING_GRID		4
+#define SUPERSAMPLING_THRESHOLD		(1.0 / 32.0)
+
 static void
-call_invocation (mathmap_frame_t *frame, image_t *closure,
-		 int region_x, int region_y, int region_width, int region_height,
-		 unsigned char *q)
+calc_float_line (mathmap_slice_t *slice, image_t *closure, int row, float *line)
 {
-    mathmap_invocation_t *invocation = frame->invocation;
+    closure->v.closure.funcs->calc_lines(slice, closure, row, row + 1, line, 1);
+}
 
-    if (invocation->supersampling)
+static gboolean
+pixels_differ (float *a, float *b)
+{
+    int i;
+
+    for (i = 0; i < NUM_FLOATMAP_CHANNELS; ++i)
+	if (fabsf(CLAMP(a[i], 0.0, 1.0) - CLAMP(b[i], 0.0, 1.0)) > SUPERSAMPLING_THRESHOLD)
+	    return TRUE;
+    return FALSE;
+}
+
+/* Whether the pixel at x in line differs from any of its neighbours. */
+static gboolean
+needs_samples (float *line, float *above, float *below, int x, int width)
+{
+    float *pixel = &line[x * NUM_FLOATMAP_CHANNELS];
+
+    return (x > 0 && pixels_differ(pixel, pixel - NUM_FLOATMAP_CHANNELS))
+	|| (x + 1 < width && pixels_differ(pixel, pixel + NUM_FLOATMAP_CHANNELS))
+	|| pixels_differ(pixel, &above[x * NUM_FLOATMAP_CHANNELS])
+	|| pixels_differ(pixel, &below[x * NUM_FLOATMAP_CHANNELS]);
+}
+
+/* A number in [0,1) which only depends on the arguments, so that
+   renders are reproducible. */
+static float
+sample_jitter (unsigned int a, unsigned int b, unsigned int c)
+{
+    guint32 h = a * 0x9e3779b1U ^ b * 0x85ebca77U ^ c * 0xc2b2ae3dU;
+
+    h ^= h >> 15;
+    h *= 0x2c1b3c6dU;
+    h ^= h >> 12;
+
+    return (h >> 8) * (1.0 / 16777216.0);
+}
+
+static void
+store_pixel (mathmap_invocation_t *invocation, unsigned char *p, float *pixel)
+{
+    int output_bpp = invocation->output_bpp;
+    float r = CLAMP(pixel[0], 0.0, 1.0);
+    float g = CLAMP(pixel[1], 0.0, 1.0);
+    float b = CLAMP(pixel[2], 0.0, 1.0);
+
+    if (output_bpp == 1 || output_bpp == 2)
+	p[0] = (r * 0.299 + g * 0.587 + b * 0.114) * 255.0;
+    else
     {
-	guchar *line1, *line2, *line3;
-	int row, col;
-	mathmap_slice_t short_slice, long_slice;
+	p[0] = r * 255.0;
+	p[1] = g * 255.0;
+	p[2] = b * 255.0;
+    }
+    if (output_bpp == 2 || output_bpp == 4)
+	p[output_bpp - 1] = CLAMP(pixel[3], 0.0, 1.0) * 255.0;
+}
+
+/* Renders the samples for the pixels from x to x + width - 1 in row
+   and adds them to sums. */
+static void
+supersample_run (mathmap_frame_t *frame, image_t *closure, int x, int row, int width,
+		 float *samples, float *sums)
+{
+    int i, j, k;
+
+    memset(sums, 0, sizeof(float) * NUM_FLOATMAP_CHANNELS * width);
+
+    for (i = 0; i < SUPERSAMPLING_GRID; ++i)
+	for (j = 0; j < SUPERSAMPLING_GRID; ++j)
+	{
+	    int cell = i * SUPERSAMPLING_GRID + j;
+	    float offset_x = (j + sample_jitter(x, row, cell * 2)) / SUPERSAMPLING_GRID - 0.5;
+	    float offset_y = (i + sample_jitter(x, row, cell * 2 + 1)) / SUPERSAMPLING_GRID - 0.5;
+	    mathmap_slice_t slice;
+
+	    invocation_init_slice(&slice, closure, frame, x, row, width, 1, offset_x, offset_y);
+	    calc_float_line(&slice, closure, row, samples);
+	    invocation_deinit_slice(&slice);
 
-	line1 = (guchar*)malloc((region_width + 1) * invocation->output_bpp);
-	line2 = (guchar*)malloc(region_width * invocation->output_bpp);
-	line3 = (guchar*)malloc((region_width + 1) * invocation->output_bpp);
+	    for (k = 0; k < width * NUM_FLOATMAP_CHANNELS; ++k)
+		sums[k] += CLAMP(samples[k], 0.0, 1.0);
+	}
 
-	invocation_init_slice(&short_slice, closure, frame, region_x, region_y, region_width, region_height, 0.0, 0.0);
-	invocation_init_slice(&long_slice, closure, frame, region_x, region_y, region_width + 1, region_height, -0.5, -0.5);
+    for (k = 0; k < width * NUM_FLOATMAP_CHANNELS; ++k)
+	sums[k] /= SUPERSAMPLING_GRID * SUPERSAMPLING_GRID;
+}
 
-	calc_lines(&long_slice, closure, region_y, region_y + 1, line1);
+static void
+call_invocation_supersampled (mathmap_frame_t *frame, image_t *closure,
+			      int region_x, int region_y, int region_width, int region_height,
+			      unsigned char *q)
+{
+    mathmap_invocation_t *invocation = frame->invocation;
+    /* The pixels we render once, which include the neighbours of the
+       region if they're in the frame. */
+    int base_x = MAX(region_x - 1, 0);
+    int base_y = MAX(region_y - 1, 0);
+    int base_width = MIN(region_x + region_width + 1, frame->frame_render_width) - base_x;
+    int base_height = MIN(region_y + region_height + 1, frame->frame_render_height) - base_y;
+    mathmap_slice_t base_slice;
+    /* The rows above, at and below the current row. */
+    float *lines[3];
+    float *samples, *sums;
+    int row, i;
+
+    for (i = 0; i < 3; ++i)
+	lines[i] = g_new(float, base_width * NUM_FLOATMAP_CHANNELS);
+    samples = g_new(float, region_width * NUM_FLOATMAP_CHANNELS);
+    sums = g_new(float, region_width * NUM_FLOATMAP_CHANNELS);
+
+    invocation_init_slice(&base_slice, closure, frame, base_x, base_y, base_width, base_height, 0.0, 0.0);
+
+    if (region_y > base_y)
+	calc_float_line(&base_slice, closure, region_y - 1, lines[0]);
+    calc_float_line(&base_slice, closure, region_y, lines[1]);
+
+    for (row = region_y; row < region_y + region_height; ++row)
+    {
+	float *above = row > base_y ? lines[0] : lines[1];
+	float *below;
+	unsigned char *p = q;
+	int col;
 
-	for (row = region_y; row < region_y + region_height; ++row)
+	if (row + 1 < base_y + base_height)
 	{
-	    unsigned char *p = q;
+	    calc_float_line(&base_slice, closure, row + 1, lines[2]);
+	    below = lines[2];
+	}
+	else
+	    below = lines[1];
 
-	    calc_lines(&short_slice, closure, row, row + 1, line2);
-	    calc_lines(&long_slice, closure, row + 1, row + 2, line3);
+	col = 0;
+	while (col < region_width)
+	{
+	    int run_start, run_length;
 
-	    for (col = 0; col < region_width; ++col)
+	    /* Find the next run of pixels which need samples. */
+	    while (col < region_width)
 	    {
-		int i;
+		int bx = region_x + col - base_x;
+
+		if (needs_samples(lines[1], above, below, bx, base_width))
+		    break;
 
-		for (i = 0; i < invocation->output_bpp; ++i)
-		    p[i] = (line1[col*invocation->output_bpp+i]
-			    + line1[(col+1)*invocation->output_bpp+i]
-			    + 2*line2[col*invocation->output_bpp+i]
-			    + line3[col*invocation->output_bpp+i]
-			    + line3[(col+1)*invocation->output_bpp+i]) / 6;
-		p += invocation->output_bpp;
+		store_pixel(invocation, p + col * invocation->output_bpp,
+			    &lines[1][bx * NUM_FLOATMAP_CHANNELS]);
+		++col;
 	    }
-	    memcpy(line1, line3, (region_width + 1) * invocation->output_bpp);
 
-	    q += invocation->row_stride;
+	    run_start = col;
+	    while (col < region_width)
+	    {
+		if (!needs_samples(lines[1], above, below, region_x + col - base_x, base_width))
+		    break;
+		++col;
+	    }
+	    run_length = col - run_start;
 
-	    invocation->rows_finished[row] = 1;
+	    if (run_length > 0)
+	    {
+		supersample_run(frame, closure, region_x + run_start, row, run_length, samples, sums);
+
+		for (i = 0; i < run_length; ++i)
+		    store_pixel(invocation, p + (run_start + i) * invocation->output_bpp,
+				&sums[i * NUM_FLOATMAP_CHANNELS]);
+	    }
 	}
 
-	free(line1);
-	free(line2);
-	free(line3);
+	/* Rotate the lines. */
+	{
+	    float *tmp = lines[0];
+
+	    lines[0] = lines[1];
+	    lines[1] = lines[2];
+	    lines[2] = tmp;
+	}
 
-	invocation_deinit_slice(&short_slice);
-	invocation_deinit_slice(&long_slice);
+	q += invocation->row_stride;
+
+	invocation->rows_finished[row] = 1;
     }
+
+    invocation_deinit_slice(&base_slice);
+
+    for (i = 0; i < 3; ++i)
+	g_free(lines[i]);
+    g_free(samples);
+    g_free(sums);
+}
+
+static void
+call_invocation (mathmap_frame_t *frame, image_t *closure,
+		 int region_x, int region_y, int region_width, int region_height,
+		 unsigned char *q)
+{
+    mathmap_invocation_t *invocation = frame->invocation;
+
+    if (invocation->supersampling)
+	call_invocation_supersampled(frame, closure, region_x, region_y, region_width, region_height, q);
     else
     {
 	mathmap_slice_t slice;
@@ -935,48 +1213,39 @@ call_invocation (mathmap_frame_t *frame, image_t *closure,
     }
 }
 
-#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+/* The rows of an invocation call are split into this many tasks per
+   requested thread, so that the workers can balance the load. */
+#define CALL_TASKS_PER_THREAD	8
+
 typedef struct
 {
-    thread_handle_t thread_handle;
+    thread_pool_job_t *job;
     mathmap_frame_t *frame;
     image_t *closure;
     int region_x, region_y;
     int region_height, region_width;
+    int rows_per_task;
     unsigned char *q;
-    gboolean is_done;
-} thread_data_t;
-
-typedef struct
-{
-    int num_threads;
-    thread_data_t datas[];
 } invocation_call_t;
 
 static void
-call_invocation_thread_func (gpointer _data)
+call_invocation_task_func (gpointer _call, int task_index)
 {
-    thread_data_t *data = (thread_data_t*)_data;
-
-#ifdef USE_PTHREADS
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-#endif
-
-    call_invocation(data->frame, data->closure, data->region_x, data->region_y,
-		    data->region_width, data->region_height, data->q);
+    invocation_call_t *call = (invocation_call_t*)_call;
+    int first_row = call->region_y + task_index * call->rows_per_task;
+    int num_rows = MIN(call->rows_per_task, call->region_y + call->region_height - first_row);
 
-    data->is_done = TRUE;
+    call_invocation(call->frame, call->closure, call->region_x, first_row, call->region_width, num_rows,
+		    call->q + (first_row - call->region_y) * call->frame->invocation->row_stride);
 }
 
-gpointer
-call_invocation_parallel (mathmap_frame_t *frame, image_t *closure,
-			  int region_x, int region_y, int region_width, int region_height,
-			  unsigned char *q, int num_threads)
+static invocation_call_t*
+make_invocation_call (mathmap_frame_t *frame, image_t *closure,
+		      int region_x, int region_y, int region_width, int region_height,
+		      unsigned char *q, int num_threads)
 {
     mathmap_invocation_t *invocation = frame->invocation;
     invocation_call_t *call;
-    int i;
     int first_row = region_y;
     int last_row = region_y + region_height;
 
@@ -984,23 +1253,42 @@ call_invocation_parallel (mathmap_frame_t *frame, image_t *closure,
 
     memset(invocation->rows_finished + first_row, 0, last_row - first_row);
 
-    call = g_malloc(sizeof(invocation_call_t) + sizeof(thread_data_t) * num_threads);
+    call = g_new0(invocation_call_t, 1);
 
-    call->num_threads = num_threads;
+    call->frame = frame;
+    call->closure = closure;
+    call->region_x = region_x;
+    call->region_y = region_y;
+    call->region_width = region_width;
+    call->region_height = region_height;
+    call->q = q;
 
-    for (i = 0; i < num_threads; ++i)
-    {
-	call->datas[i].frame = frame;
-	call->datas[i].closure = closure;
-	call->datas[i].region_x = region_x;
-	call->datas[i].region_width = region_width;
-	call->datas[i].region_y = first_row + (last_row - first_row) * i / num_threads;
-	call->datas[i].region_height = first_row + (last_row - first_row) * (i + 1) / num_threads - call->datas[i].region_y;
-	call->datas[i].q = q + (call->datas[i].region_y - region_y) * invocation->row_stride;
-	call->datas[i].is_done = FALSE;
-
-	call->datas[i].thread_handle = mathmap_thread_start(call_invocation_thread_func, &call->datas[i]);
-    }
+    if (num_threads <= 1)
+	call->rows_per_task = MAX(region_height, 1);
+    else
+	call->rows_per_task = MAX(region_height / (num_threads * CALL_TASKS_PER_THREAD), 1);
+
+    return call;
+}
+
+static int
+invocation_call_num_tasks (invocation_call_t *call)
+{
+    return (call->region_height + call->rows_per_task - 1) / call->rows_per_task;
+}
+
+/* The region is split into bands of rows which are rendered by the
+   shared thread pool.  num_threads only determines how fine the split
+   is. */
+gpointer
+call_invocation_parallel (mathmap_frame_t *frame, image_t *closure,
+			  int region_x, int region_y, int region_width, int region_height,
+			  unsigned char *q, int num_threads)
+{
+    invocation_call_t *call = make_invocation_call(frame, closure, region_x, region_y,
+						   region_width, region_height, q, num_threads);
+
+    call->job = thread_pool_submit(call_invocation_task_func, call, invocation_call_num_tasks(call));
 
     return call;
 }
@@ -1009,38 +1297,28 @@ void
 join_invocation_call (gpointer *_call)
 {
     invocation_call_t *call = (invocation_call_t*)_call;
-    int i;
 
-    for (i = 0; i < call->num_threads; ++i)
-	mathmap_thread_join(call->datas[i].thread_handle);
+    thread_pool_join(call->job);
 
     g_free(call);
 }
 
-#ifdef USE_PTHREADS
 void
 kill_invocation_call (gpointer *_call)
 {
     invocation_call_t *call = (invocation_call_t*)_call;
-    int i;
 
-    for (i = 0; i < call->num_threads; ++i)
-	mathmap_thread_kill(call->datas[i].thread_handle);
+    thread_pool_cancel(call->job);
 
     g_free(call);
 }
-#endif
 
 gboolean
 invocation_call_is_done (gpointer *_call)
 {
     invocation_call_t *call = (invocation_call_t*)_call;
-    int i;
 
-    for (i = 0; i < call->num_threads; ++i)
-	if (!call->datas[i].is_done)
-	    return FALSE;
-    return TRUE;
+    return thread_pool_job_is_done(call->job);
 }
 
 void
@@ -1048,12 +1326,20 @@ call_invocation_parallel_and_join (mathmap_frame_t *frame, image_t *closure,
 				   int region_x, int region_y, int region_width, int region_height,
 				   unsigned char *q, int num_threads)
 {
-    gpointer call = call_invocation_parallel(frame, closure, region_x, region_y,
-					     region_width, region_height, q, num_threads);
+    invocation_call_t *call = make_invocation_call(frame, closure, region_x, region_y,
+						   region_width, region_height, q, num_threads);
+
+    /* Don't bother the pool if we're supposed to render in only one
+       thread anyway. */
+    if (num_threads <= 1)
+	call_invocation_task_func(call, 0);
+    else
+	thread_pool_run(call_invocation_task_func, call, invocation_call_num_tasks(call));
 
-    join_invocation_call(call);
+    g_free(call);
 }
 
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
 #ifdef USE_PTHREAD
 static void
 sigusr2_handler (int signum)
@@ -1111,14 +1397,6 @@ mathmap_thread_kill (thread_handle_t thread)
     pthread_join(thread, NULL);
 }
 #endif
-#else
-void
-call_invocation_parallel_and_join (mathmap_frame_t *frame, image_t *closure,
-				   int region_x, int region_y, int region_width, int region_height,
-				   unsigned char *q, int num_threads)
-{
-    call_invocation(frame, closure, region_x, region_y, region_width, region_height, q);
-}
 #endif
 
 void
@@ -1128,6 +1406,8 @@ carry_over_uservals_from_template (mathmap_invocation_t *invocation, mathmap_inv
     userval_info_t *info;
     gboolean have_first_image = copy_first_image;
 
+    invocation_set_rand_seed(invocation, template->rand_seed);
+
     for (info = invocation->mathmap->main_filter->userval_infos; info != 0; info = info->next)
     {
 	userval_info_t *template_info = lookup_matching_userval(template->mathmap->main_filter->userval_infos, info);
@@ -24,17 +24,135 @@
 
 #include "mmpools.h"
 
+/* Blocks' data and big allocations are aligned to a cache line,
+   which is what floatmap data needs for vectorized loops.  Small
+   allocations are only aligned for doubles and SSE types. */
+#define BLOCK_ALIGNMENT		64
+#define SMALL_ALIGNMENT		16
+
+#define CHUNK_SIZE		4096
+#define MAX_SMALL_SIZE		(CHUNK_SIZE / 4)
+
+/* The first block of a pool is small, because most frame pools only
+   hold a handful of closures.  Subsequent blocks double in size. */
+#define MIN_BLOCK_SIZE		(8 * CHUNK_SIZE)
+#define MAX_BLOCK_SIZE		(256 * CHUNK_SIZE)
+
+#define BLOCK_HEADER_SIZE	((sizeof(mathmap_pools_block_t) + BLOCK_ALIGNMENT - 1) & ~(BLOCK_ALIGNMENT - 1))
+#define BLOCK_DATA(b)		((char*)(b) + BLOCK_HEADER_SIZE)
+
+/* A thread allocates from a few pools at once, for example from the
+   frame pools and the pools of a native filter cache entry, so it
+   keeps a chunk for each of the last few pools it used. */
+#define NUM_THREAD_CHUNKS	4
+
+typedef struct
+{
+    int generation;
+    char *ptr;
+    char *end;
+} thread_chunk_t;
+
+typedef struct
+{
+    thread_chunk_t chunks[NUM_THREAD_CHUNKS];
+    int next_victim;
+} thread_chunks_t;
+
+static GStaticPrivate thread_chunks_key = G_STATIC_PRIVATE_INIT;
+
+static volatile int last_generation = 0;
+
+static GStaticMutex stats_mutex = G_STATIC_MUTEX_INIT;
+static size_t num_bytes = 0;
+static size_t peak_num_bytes = 0;
+
+static thread_chunks_t*
+get_thread_chunks (void)
+{
+    thread_chunks_t *chunks = g_static_private_get(&thread_chunks_key);
+
+    if (chunks == NULL)
+    {
+	chunks = g_new0(thread_chunks_t, 1);
+	g_static_private_set(&thread_chunks_key, chunks, g_free);
+    }
+
+    return chunks;
+}
+
+static void
+update_stats (long delta)
+{
+    g_static_mutex_lock(&stats_mutex);
+    num_bytes += delta;
+    if (num_bytes > peak_num_bytes)
+	peak_num_bytes = num_bytes;
+    g_static_mutex_unlock(&stats_mutex);
+}
+
+/* Allocates a block and adds it to the pools' list. */
+static mathmap_pools_block_t*
+alloc_block (mathmap_pools_t *pools, size_t size)
+{
+    void *mem = g_malloc(BLOCK_HEADER_SIZE + size + BLOCK_ALIGNMENT - 1);
+    mathmap_pools_block_t *block = (mathmap_pools_block_t*)(((gsize)mem + BLOCK_ALIGNMENT - 1) & ~(gsize)(BLOCK_ALIGNMENT - 1));
+
+    block->mem = mem;
+    block->size = size;
+    block->used = 0;
+
+    do
+    {
+	block->next = pools->blocks;
+    } while (!g_atomic_pointer_compare_and_exchange((gpointer*)&pools->blocks, block->next, block));
+
+    update_stats(size);
+
+    return block;
+}
+
+static char*
+carve_chunk (mathmap_pools_t *pools)
+{
+    for (;;)
+    {
+	mathmap_pools_block_t *block = g_atomic_pointer_get((gpointer*)&pools->current_block);
+	mathmap_pools_block_t *new_block;
+
+	if (block != NULL)
+	{
+	    int offset = g_atomic_int_exchange_and_add(&block->used, CHUNK_SIZE);
+
+	    if (offset + CHUNK_SIZE <= block->size)
+		return BLOCK_DATA(block) + offset;
+	}
+
+	new_block = alloc_block(pools, block == NULL ? MIN_BLOCK_SIZE : MIN(block->size * 2, MAX_BLOCK_SIZE));
+	new_block->used = CHUNK_SIZE;
+
+	/* If another thread has installed a new block in the meantime
+	   we still use the first chunk of ours.  The rest of it is
+	   wasted, but that's rare. */
+	g_atomic_pointer_compare_and_exchange((gpointer*)&pools->current_block, block, new_block);
+	return BLOCK_DATA(new_block);
+    }
+}
+
 void
 mathmap_pools_init_global (mathmap_pools_t *pools)
 {
     pools->is_global = 1;
-    pools->chunks = NULL;
+    pools->generation = g_atomic_int_exchange_and_add(&last_generation, 1) + 1;
+    pools->blocks = NULL;
+    pools->current_block = NULL;
 }
 
 void
 mathmap_pools_init_local (mathmap_pools_t *pools)
 {
     pools->is_global = 0;
+    pools->is_dirty = 0;
     init_pools(&pools->pools);
 }
 
@@ -42,7 +160,12 @@ void
 mathmap_pools_reset (mathmap_pools_t *pools)
 {
     g_assert(!pools->is_global);
+    /* nothing to do if nothing was allocated since the last reset,
+       which is the common case for the pixel pools */
+    if (!pools->is_dirty)
+	return;
     reset_pools(&pools->pools);
+    pools->is_dirty = 0;
 }
 
 void
@@ -50,18 +173,20 @@ mathmap_pools_free (mathmap_pools_t *pools)
 {
     if (pools->is_global)
     {
-	mathmap_pools_chunk_t *chunk = pools->chunks;
-	int num_chunks = 0;
+	mathmap_pools_block_t *block = pools->blocks;
+	long size = 0;
 
-	while (chunk != NULL)
+	/* The threads' chunks for this pool are never used again
+	   because generations are unique. */
+	while (block != NULL)
 	{
-	    mathmap_pools_chunk_t *next = chunk->next;
-	    free(chunk);
-	    chunk = next;
-	    ++num_chunks;
+	    mathmap_pools_block_t *next = block->next;
+	    size += block->size;
+	    g_free(block->mem);
+	    block = next;
 	}
 
-	//g_print("%d chunks freed\n", num_chunks);
+	update_stats(-size);
     }
     else
 	free_pools(&pools->pools);
@@ -70,15 +195,58 @@ mathmap_pools_free (mathmap_pools_t *pools)
 void*
 _mathmap_pools_alloc (mathmap_pools_t *pools, size_t size)
 {
-    if (pools->is_global)
+    thread_chunks_t *chunks;
+    thread_chunk_t *chunk;
+    char *p;
+    int i;
+
+    if (!pools->is_global)
     {
-	mathmap_pools_chunk_t *chunk = malloc(sizeof(mathmap_pools_chunk_t) + size);
-	do
+	pools->is_dirty = 1;
+	return pools_alloc(&pools->pools, size);
+    }
+
+    if (size > MAX_SMALL_SIZE)
+    {
+	mathmap_pools_block_t *block = alloc_block(pools, size);
+
+	block->used = size;
+	return BLOCK_DATA(block);
+    }
+
+    size = (size + SMALL_ALIGNMENT - 1) & ~(size_t)(SMALL_ALIGNMENT - 1);
+
+    chunks = get_thread_chunks();
+    chunk = NULL;
+    for (i = 0; i < NUM_THREAD_CHUNKS; ++i)
+	if (chunks->chunks[i].generation == pools->generation)
+	{
+	    chunk = &chunks->chunks[i];
+	    break;
+	}
+
+    if (chunk == NULL || chunk->ptr + size > chunk->end)
+    {
+	if (chunk == NULL)
 	{
-	    chunk->next = pools->chunks;
-	} while (!g_atomic_pointer_compare_and_exchange((gpointer*)&pools->chunks, chunk->next, chunk));
-	return chunk->data;
+	    chunk = &chunks->chunks[chunks->next_victim];
+	    chunks->next_victim = (chunks->next_victim + 1) % NUM_THREAD_CHUNKS;
+	    chunk->generation = pools->generation;
+	}
+	chunk->ptr = carve_chunk(pools);
+	chunk->end = chunk->ptr + CHUNK_SIZE;
     }
 
-    return pools_alloc(&pools->pools, size);
+    p = chunk->ptr;
+    chunk->ptr += size;
+    return p;
+}
+
+void
+mathmap_pools_get_stats (size_t *_num_bytes, size_t *_peak_num_bytes)
+{
+    g_static_mutex_lock(&stats_mutex);
+    *_num_bytes = num_bytes;
+    *_peak_num_bytes = peak_num_bytes;
+    g_static_mutex_unlock(&stats_mutex);
 }
@@ -27,15 +27,25 @@
 
 /* TEMPLATE mmpools */
 
-typedef struct _mathmap_pools_chunk_t {
-    struct _mathmap_pools_chunk_t *next;
-    double data[];		/* double for alignment */
-} mathmap_pools_chunk_t;
+/* Global pools are arenas of blocks which are freed all at once.
+   Each thread carves chunks out of the current block and allocates
+   from its chunk without synchronization.  Allocations too big for a
+   chunk get a block of their own. */
+typedef struct _mathmap_pools_block_t {
+    struct _mathmap_pools_block_t *next;
+    void *mem;			/* what was actually malloc'ed */
+    size_t size;		/* of the data */
+    volatile int used;		/* bytes of the data carved into chunks */
+} mathmap_pools_block_t;
 
 typedef struct {
     int is_global;
+    int is_dirty;		/* only for local pools */
     pools_t pools;			 /* only for local pools */
-    mathmap_pools_chunk_t *chunks; /* only for global pools */
+    /* only for global pools: */
+    int generation;		/* unique, identifies the threads' chunks */
+    mathmap_pools_block_t * volatile blocks;
+    mathmap_pools_block_t * volatile current_block;
 } mathmap_pools_t;
 
 void mathmap_pools_init_global (mathmap_pools_t *pools);
@@ -52,9 +62,13 @@ mathmap_pools_alloc (mathmap_pools_t *pools, size_t size)
 {
     if (pools->is_global)
 	return _mathmap_pools_alloc(pools, size);
+    pools->is_dirty = 1;
     return pools_alloc(&pools->pools, size);
 }
 
 /* END */
 
+/* Number of bytes currently and at most held by all global pools. */
+void mathmap_pools_get_stats (size_t *num_bytes, size_t *peak_num_bytes);
+
 #endif
@@ -22,7 +22,70 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+#include <string.h>
+
 #include "../mathmap.h"
+#include "../thread_pool.h"
+
+/* The cache is shared by all invocations and keyed by a string which
+   describes the filter, its arguments and everything the rendering of
+   the input images depends on.  Input drawables are identified by
+   their source (the GIMP drawable or the image file) and, for GIMP
+   drawables, by the stamp of their content, rather than by their
+   image ids, which are different for every invocation, so that
+   changing an unrelated user value or rendering another frame reuses
+   the results.  Closures are identified by the compiled filter and
+   their arguments.  Images which are results of cached filters are
+   identified by the keys of their entries.  Other images can only be
+   identified by their ids.
+
+   An invocation holds a reference to the entries it has looked up
+   while it has frames, because the generated code keeps pointers to
+   their images, and releases them when its last frame is freed.
+   Unreferenced entries are evicted in least recently used order as
+   soon as the images in the cache take up more memory than
+   MATHMAP_NATIVE_FILTER_CACHE_SIZE megabytes.
+
+   If the task producing an entry is cancelled its image might be
+   incomplete, so the entry is abandoned: it is removed from the cache
+   and threads waiting for it look it up again.
+
+   The thread producing an entry owns the jobs it submits in the
+   thread pool until the image is set, so that threads waiting for the
+   entry can help with exactly that work, see thread_pool_wait(). */
+
+#define NATIVE_FILTER_CACHE_DEFAULT_SIZE	256
+
+static GStaticMutex cache_mutex = G_STATIC_MUTEX_INIT;
+
+static GHashTable *entries_by_key = NULL;
+static GHashTable *entries_by_image = NULL;
+
+/* Most recently used entry first. */
+static native_filter_cache_entry_t *lru_first = NULL;
+static native_filter_cache_entry_t *lru_last = NULL;
+
+static gsize cache_size = 0;
+static gsize cache_max_size;
+
+static unsigned long num_hits = 0;
+static unsigned long num_misses = 0;
+static unsigned long num_evictions = 0;
+
+static void
+init_cache (void)
+{
+    const char *env;
+
+    if (entries_by_key != NULL)
+	return;
+
+    entries_by_key = g_hash_table_new(g_str_hash, g_str_equal);
+    entries_by_image = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    env = g_getenv("MATHMAP_NATIVE_FILTER_CACHE_SIZE");
+    cache_max_size = (gsize)(env != NULL ? atoi(env) : NATIVE_FILTER_CACHE_DEFAULT_SIZE) * 1024 * 1024;
+}
 
 static filter_t*
 get_native_filter_for_func (mathmap_t *mathmap, native_filter_func_t func)
@@ -35,76 +98,252 @@ get_native_filter_for_func (mathmap_t *mathmap, native_filter_func_t func)
     g_assert_not_reached();
 }
 
-static gboolean
-uservals_match (filter_t *filter, userval_t *entry_args, userval_t *filter_args)
+static void append_userval_key (GString *key, mathmap_invocation_t *invocation,
+				userval_info_t *info, userval_t *val);
+
+static void
+append_image_key (GString *key, mathmap_invocation_t *invocation, image_t *image)
 {
-    int i;
+    native_filter_cache_entry_t *entry;
+    input_drawable_t *drawable;
+    filter_t *filter;
     userval_info_t *info;
+    int i;
 
-    for (i = 0, info = filter->userval_infos;
-	 i < filter->num_uservals;
-	 ++i, info = info->next)
+    switch (image->type)
     {
-	switch (info->type)
-	{
-	    case USERVAL_INT_CONST :
-		if (entry_args[i].v.int_const != filter_args[i].v.int_const)
-		    return FALSE;
-		break;
+	case IMAGE_DRAWABLE :
+	    drawable = image->v.drawable;
+	    switch (drawable->kind)
+	    {
+#ifndef OPENSTEP
+		case INPUT_DRAWABLE_GIMP :
+		    g_string_append_printf(key, "gimp:%d,%d,%d,%d,%" G_GINT64_MODIFIER "x",
+					   drawable->v.gimp.drawable->drawable_id,
+					   drawable->v.gimp.has_selection,
+					   drawable->v.gimp.x0, drawable->v.gimp.y0,
+					   get_gimp_input_drawable_content_stamp(drawable));
+		    break;
+#endif
 
-	    case USERVAL_FLOAT_CONST :
-		if (entry_args[i].v.float_const != filter_args[i].v.float_const)
-		    return FALSE;
-		break;
+		case INPUT_DRAWABLE_CMDLINE_IMAGE :
+		    g_string_append_printf(key, "file:%d:%s",
+					   (int)strlen(drawable->v.cmdline.image_filename),
+					   drawable->v.cmdline.image_filename);
+		    break;
 
-	    case USERVAL_BOOL_CONST :
-		if (entry_args[i].v.bool_const != filter_args[i].v.bool_const)
-		    return FALSE;
-		break;
+		default :
+		    /* The content of movies depends on the frame and
+		       the OpenStep data can change under our feet. */
+		    g_string_append_printf(key, "id:%d", image->id);
+		    return;
+	    }
+	    g_string_append_printf(key, ",%dx%d,%.9g,%.9g,%.9g,%.9g",
+				   image->pixel_width, image->pixel_height,
+				   drawable->scale_x, drawable->scale_y,
+				   drawable->middle_x, drawable->middle_y);
+	    break;
 
-	    case USERVAL_IMAGE :
-		if (GPOINTER_TO_INT(entry_args[i].v.image) != filter_args[i].v.image->id)
-		    return FALSE;
+	case IMAGE_FLOATMAP :
+	    entry = g_hash_table_lookup(entries_by_image, image);
+	    if (entry != NULL)
+		g_string_append_printf(key, "(%s)", entry->key);
+	    else
+		g_string_append_printf(key, "id:%d", image->id);
+	    break;
+
+	case IMAGE_RESIZE :
+	    g_string_append_printf(key, "resize:%.9g,%.9g[",
+				   image->v.resize.x_factor, image->v.resize.y_factor);
+	    append_image_key(key, invocation, image->v.resize.original);
+	    g_string_append_c(key, ']');
+	    break;
+
+	case IMAGE_CLOSURE :
+	    /* Closures are always rendered at the first frame, so only
+	       their filter and their arguments matter.  The filter
+	       names are only unique within a mathmap, and every
+	       compiled mathmap has an id of its own. */
+	    if (image->v.closure.funcs->filter_name != NULL)
+		filter = lookup_filter(invocation->mathmap->filters, image->v.closure.funcs->filter_name);
+	    else
+		filter = NULL;
+	    if (filter == NULL || filter->kind != FILTER_MATHMAP
+		|| filter->num_uservals != image->v.closure.num_args)
+	    {
+		g_string_append_printf(key, "id:%d", image->id);
 		break;
+	    }
+	    g_string_append_printf(key, "closure:%d:%s,%dx%d[",
+				   invocation->mathmap->id, filter->name,
+				   image->pixel_width, image->pixel_height);
+	    for (i = 0, info = filter->userval_infos;
+		 info != NULL;
+		 ++i, info = info->next)
+		append_userval_key(key, invocation, info, &image->v.closure.args[i]);
+	    g_string_append_c(key, ']');
+	    break;
 
-	    default :
-		g_assert_not_reached();
-	}
+	default :
+	    g_string_append_printf(key, "id:%d", image->id);
+	    break;
     }
-    g_assert(info == NULL);
+}
+
+static void
+append_userval_key (GString *key, mathmap_invocation_t *invocation, userval_info_t *info, userval_t *val)
+{
+    gchar *checksum;
+
+    g_string_append_c(key, '|');
+    switch (info->type)
+    {
+	case USERVAL_INT_CONST :
+	    g_string_append_printf(key, "%d", val->v.int_const);
+	    break;
+
+	case USERVAL_FLOAT_CONST :
+	    g_string_append_printf(key, "%.9g", val->v.float_const);
+	    break;
+
+	case USERVAL_BOOL_CONST :
+	    g_string_append_printf(key, "%.9g", val->v.bool_const);
+	    break;
+
+	case USERVAL_COLOR :
+	    g_string_append_printf(key, "%08x", (unsigned int)val->v.color.value);
+	    break;
+
+	case USERVAL_CURVE :
+	    checksum = g_compute_checksum_for_data(G_CHECKSUM_MD5, (const guchar*)val->v.curve->values,
+						   sizeof(float) * USER_CURVE_POINTS);
+	    g_string_append(key, checksum);
+	    g_free(checksum);
+	    break;
+
+	case USERVAL_GRADIENT :
+	    checksum = g_compute_checksum_for_data(G_CHECKSUM_MD5, (const guchar*)val->v.gradient->values,
+						   sizeof(color_t) * USER_GRADIENT_POINTS);
+	    g_string_append(key, checksum);
+	    g_free(checksum);
+	    break;
+
+	case USERVAL_IMAGE :
+	    append_image_key(key, invocation, val->v.image);
+	    break;
 
-    return TRUE;
+	default :
+	    g_assert_not_reached();
+    }
 }
 
-static userval_t*
-uservals_copy (filter_t *filter, userval_t *args, mathmap_pools_t *pools)
+static char*
+make_key (mathmap_invocation_t *invocation, filter_t *filter, userval_t *args)
 {
+    GString *key = g_string_new(filter->name);
     int i;
     userval_info_t *info;
-    userval_t *copy = mathmap_pools_alloc(pools, sizeof(userval_t) * filter->num_uservals);
+
+    /* Everything rendering the input images depends on. */
+    g_string_append_printf(key, "|%p,%d,%d,%d,%u,%dx%d,%dx%d,%d,%d,%08x,%08x",
+			   invocation->orig_val_func, invocation->antialiasing,
+			   invocation->sampling, invocation->mipmapping, invocation->rand_seed,
+			   invocation->img_width, invocation->img_height,
+			   invocation->render_width, invocation->render_height,
+			   invocation->edge_behaviour_x, invocation->edge_behaviour_y,
+			   (unsigned int)invocation->edge_color_x, (unsigned int)invocation->edge_color_y);
 
     for (i = 0, info = filter->userval_infos;
 	 i < filter->num_uservals;
 	 ++i, info = info->next)
-    {
-	switch (info->type)
-	{
-	    case USERVAL_INT_CONST :
-	    case USERVAL_FLOAT_CONST :
-	    case USERVAL_BOOL_CONST :
-		copy_userval(&copy[i], &args[i], info->type);
-		break;
+	append_userval_key(key, invocation, info, &args[i]);
+    g_assert(info == NULL);
 
-	    case USERVAL_IMAGE :
-		copy[i].v.image = GINT_TO_POINTER(args[i].v.image->id);
-		break;
+    return g_string_free(key, FALSE);
+}
+
+static void
+lru_unlink (native_filter_cache_entry_t *entry)
+{
+    if (entry->prev != NULL)
+	entry->prev->next = entry->next;
+    else
+	lru_first = entry->next;
+    if (entry->next != NULL)
+	entry->next->prev = entry->prev;
+    else
+	lru_last = entry->prev;
+}
+
+static void
+lru_push_front (native_filter_cache_entry_t *entry)
+{
+    entry->prev = NULL;
+    entry->next = lru_first;
+    if (lru_first != NULL)
+	lru_first->prev = entry;
+    else
+	lru_last = entry;
+    lru_first = entry;
+}
+
+static void
+destroy_entry (native_filter_cache_entry_t *entry)
+{
+    mathmap_pools_free(&entry->pools);
+    g_free(entry->key);
+    g_free(entry);
+}
+
+static void
+free_entry (native_filter_cache_entry_t *entry)
+{
+    g_assert(entry->ref_count == 0 && entry->image != NULL && !entry->abandoned);
+
+    lru_unlink(entry);
+    g_hash_table_remove(entries_by_key, entry->key);
+    g_hash_table_remove(entries_by_image, entry->image);
+    cache_size -= entry->size;
 
-	    default :
-		g_assert_not_reached();
+    destroy_entry(entry);
+}
+
+/* The entry stays alive until the last reference to it is released,
+   because its image, as far as it got, might still be used. */
+static void
+abandon_entry (native_filter_cache_entry_t *entry)
+{
+    g_assert(entry->image == NULL && !entry->abandoned);
+
+    lru_unlink(entry);
+    g_hash_table_remove(entries_by_key, entry->key);
+    entry->abandoned = TRUE;
+}
+
+static void
+evict_entries (void)
+{
+    native_filter_cache_entry_t *entry = lru_last;
+
+    while (entry != NULL && cache_size > cache_max_size)
+    {
+	native_filter_cache_entry_t *prev = entry->prev;
+
+	if (entry->ref_count == 0 && entry->image != NULL)
+	{
+	    free_entry(entry);
+	    ++num_evictions;
 	}
+	entry = prev;
     }
+}
+
+static gboolean
+entry_is_done (gpointer data)
+{
+    native_filter_cache_entry_t *entry = data;
 
-    return copy;
+    return entry->image != NULL || entry->abandoned;
 }
 
 native_filter_cache_entry_t*
@@ -113,34 +352,70 @@ invocation_lookup_native_filter_invocation (mathmap_invocation_t *invocation, us
 {
     filter_t *filter = get_native_filter_for_func(invocation->mathmap, filter_func);
     native_filter_cache_entry_t *entry;
+    gboolean is_new;
+    char *key;
+
+    g_static_mutex_lock(&cache_mutex);
+
+    init_cache();
 
-    g_mutex_lock(invocation->native_filter_cache_mutex);
+    key = make_key(invocation, filter, args);
 
-    for (entry = invocation->native_filter_cache; entry != NULL; entry = entry->next)
+    for (;;)
     {
-	if (entry->filter != filter)
-	    continue;
+	entry = g_hash_table_lookup(entries_by_key, key);
+
+	if (entry != NULL)
+	{
+	    ++num_hits;
+	    lru_unlink(entry);
+	    is_new = FALSE;
+	}
+	else
+	{
+	    entry = g_new0(native_filter_cache_entry_t, 1);
+	    entry->key = g_strdup(key);
+	    mathmap_pools_init_global(&entry->pools);
+	    g_hash_table_insert(entries_by_key, entry->key, entry);
+	    ++num_misses;
+	    is_new = TRUE;
+	}
+	lru_push_front(entry);
 
-	if (uservals_match(filter, entry->args, args))
+	if (invocation->native_filter_cache_refs == NULL)
+	    invocation->native_filter_cache_refs = g_hash_table_new(g_direct_hash, g_direct_equal);
+	if (g_hash_table_lookup(invocation->native_filter_cache_refs, entry) == NULL)
+	{
+	    g_hash_table_insert(invocation->native_filter_cache_refs, entry, entry);
+	    ++entry->ref_count;
+	}
+
+	if (is_new)
+	{
+	    entry->producer_old_owner = thread_pool_set_owner(entry);
 	    break;
-    }
+	}
 
-    if (entry)
-    {
-	while (entry->image == NULL)
-	    g_cond_wait(invocation->native_filter_cache_cond, invocation->native_filter_cache_mutex);
-    }
-    else
-    {
-	entry = mathmap_pools_alloc(&invocation->pools, sizeof(native_filter_cache_entry_t));
-	entry->filter = filter;
-	entry->args = uservals_copy(filter, args, &invocation->pools);
-	entry->image = NULL;
-	entry->next = invocation->native_filter_cache;
-	invocation->native_filter_cache = entry;
+	if (entry->image != NULL)
+	    break;
+
+	g_static_mutex_unlock(&cache_mutex);
+
+	/* The thread producing the image might be rendering its input
+	   in the thread pool, so we help with that instead of
+	   blocking, which would leave it to a single thread if all the
+	   workers were waiting here. */
+	thread_pool_wait(entry_is_done, entry, entry);
+
+	g_static_mutex_lock(&cache_mutex);
+
+	if (!entry->abandoned)
+	    break;
     }
 
-    g_mutex_unlock(invocation->native_filter_cache_mutex);
+    g_static_mutex_unlock(&cache_mutex);
+
+    g_free(key);
 
     return entry;
 }
@@ -148,9 +423,76 @@ invocation_lookup_native_filter_invocation (mathmap_invocation_t *invocation, us
 void
 native_filter_cache_entry_set_image (mathmap_invocation_t *invocation, native_filter_cache_entry_t *cache_entry, image_t *image)
 {
-    g_mutex_lock(invocation->native_filter_cache_mutex);
+    g_static_mutex_lock(&cache_mutex);
+
+    thread_pool_set_owner(cache_entry->producer_old_owner);
+
+    if (thread_pool_is_cancelled())
+    {
+	abandon_entry(cache_entry);
+
+	g_static_mutex_unlock(&cache_mutex);
+
+	thread_pool_notify();
+	return;
+    }
+
     g_assert(cache_entry->image == NULL);
     cache_entry->image = image;
-    g_cond_broadcast(invocation->native_filter_cache_cond);
-    g_mutex_unlock(invocation->native_filter_cache_mutex);
+
+    cache_entry->size = sizeof(image_t);
+    if (image->type == IMAGE_FLOATMAP)
+	cache_entry->size += sizeof(float) * floatmap_data_size(image);
+    cache_size += cache_entry->size;
+
+    g_hash_table_insert(entries_by_image, image, cache_entry);
+
+    evict_entries();
+
+    g_static_mutex_unlock(&cache_mutex);
+
+    thread_pool_notify();
+}
+
+static void
+release_entry (gpointer key, gpointer value, gpointer user_data)
+{
+    native_filter_cache_entry_t *entry = value;
+
+    g_assert(entry->ref_count > 0);
+    --entry->ref_count;
+
+    if (entry->abandoned && entry->ref_count == 0)
+	destroy_entry(entry);
+}
+
+void
+invocation_release_native_filter_cache_entries (mathmap_invocation_t *invocation)
+{
+    if (invocation->native_filter_cache_refs == NULL)
+	return;
+
+    g_static_mutex_lock(&cache_mutex);
+
+    g_hash_table_foreach(invocation->native_filter_cache_refs, release_entry, NULL);
+    g_hash_table_destroy(invocation->native_filter_cache_refs);
+    invocation->native_filter_cache_refs = NULL;
+
+    evict_entries();
+
+    g_static_mutex_unlock(&cache_mutex);
+}
+
+void
+native_filter_cache_get_stats (native_filter_cache_stats_t *stats)
+{
+    g_static_mutex_lock(&cache_mutex);
+
+    stats->num_hits = num_hits;
+    stats->num_misses = num_misses;
+    stats->num_evictions = num_evictions;
+    stats->num_entries = entries_by_key != NULL ? g_hash_table_size(entries_by_key) : 0;
+    stats->size = cache_size;
+
+    g_static_mutex_unlock(&cache_mutex);
 }
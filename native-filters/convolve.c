@@ -26,42 +26,354 @@
 #include <fftw3.h>
 #include <string.h>
 
+#include <glib.h>
+
 #include "../drawable.h"
 #include "../mmpools.h"
+#include "../thread_pool.h"
 
 #include "native-filters.h"
 
+/* FFTW plans are expensive to make, so we keep the ones used last.
+   The transforms work directly on the data of planar floatmaps and
+   transform all the channels we need in one go.
+
+   Measuring plans would block the preview for seconds, so we only use
+   plans the FFTW wisdom already knows about and estimate the others.
+   The wisdom is read from the user's cache directory, or from
+   MATHMAP_FFTW_WISDOM if it is set, and can be made with fftwf-wisdom.
+
+   Forward plans transform the first num_channels planes of a planar
+   floatmap into a buffer of complex coefficients with one block of
+   height * (width / 2 + 1) coefficients per channel.  Inverse plans
+   go the other way.  Planar floatmaps and fftwf_malloc() both align
+   the data, so the plans can use SIMD. */
+
+#define MAX_FFT_PLANS		16
+
+typedef struct _fft_plan_t
+{
+    gboolean inverse;
+    int width;
+    int height;
+    int row_stride;
+    int num_channels;
+    fftwf_plan plan;
+    int num_users;
+    struct _fft_plan_t *next;
+} fft_plan_t;
+
+/* fft_plans_mutex protects the plan list, which is ordered by last
+   use.  The FFTW planner isn't thread-safe, so all calls to it are
+   serialized by fft_planner_mutex.  That one is never held together
+   with fft_plans_mutex, so looking up a plan never waits for one to
+   be made. */
+static GStaticMutex fft_plans_mutex = G_STATIC_MUTEX_INIT;
+static GStaticMutex fft_planner_mutex = G_STATIC_MUTEX_INIT;
+static fft_plan_t *fft_plans = NULL;
+
+static char*
+get_fft_wisdom_filename (void)
+{
+    const char *env = g_getenv("MATHMAP_FFTW_WISDOM");
+
+    if (env != NULL)
+	return env[0] == '\0' ? NULL : g_strdup(env);
+
+    return g_build_filename(g_get_user_cache_dir(), "mathmap", "fftw-wisdom", NULL);
+}
+
+/* Must be called with fft_planner_mutex locked. */
+static void
+init_fft (void)
+{
+    static gboolean initialized = FALSE;
+    char *wisdom_filename;
+
+    if (initialized)
+	return;
+
+    fftwf_init_threads();
+    fftwf_plan_with_nthreads(thread_pool_num_workers());
+
+    wisdom_filename = get_fft_wisdom_filename();
+    if (wisdom_filename != NULL)
+    {
+	fftwf_import_wisdom_from_filename(wisdom_filename);
+	g_free(wisdom_filename);
+    }
+
+    initialized = TRUE;
+}
+
+/* Must be called with fft_planner_mutex locked. */
+static fftwf_plan
+make_fft_plan (gboolean inverse, int width, int height, int row_stride, int num_channels, unsigned int flags)
+{
+    int dims[2] = { height, width };
+    int embed[2] = { height, row_stride };
+    int channel_stride = row_stride * height;
+    int cn = height * (width / 2 + 1);
+    float *real;
+    fftwf_complex *freq;
+    fftwf_plan plan;
+
+    /* Planning might overwrite the arrays, so we plan with scratch
+       buffers and execute the plans on the real data with the new
+       array interface. */
+    real = fftwf_malloc(sizeof(float) * channel_stride * num_channels);
+    freq = fftwf_malloc(sizeof(fftwf_complex) * cn * num_channels);
+
+    if (inverse)
+	plan = fftwf_plan_many_dft_c2r(2, dims, num_channels,
+				       freq, NULL, 1, cn,
+				       real, embed, 1, channel_stride,
+				       flags);
+    else
+	plan = fftwf_plan_many_dft_r2c(2, dims, num_channels,
+				       real, embed, 1, channel_stride,
+				       freq, NULL, 1, cn,
+				       flags | FFTW_PRESERVE_INPUT);
+
+    fftwf_free(real);
+    fftwf_free(freq);
+
+    return plan;
+}
+
 static void
-copy (double *dest, float *src, int n)
+destroy_fft_plans (fft_plan_t *entries)
 {
-    int i;
+    g_static_mutex_lock(&fft_planner_mutex);
+
+    while (entries != NULL)
+    {
+	fft_plan_t *next = entries->next;
 
-    for (i = 0; i < n; ++i)
-	dest[i] = src[i * NUM_FLOATMAP_CHANNELS];
+	fftwf_destroy_plan(entries->plan);
+	g_free(entries);
+	entries = next;
+    }
+
+    g_static_mutex_unlock(&fft_planner_mutex);
 }
 
+/* Must be called with fft_plans_mutex locked.  Makes the plan the
+   most recently used one. */
+static fft_plan_t*
+lookup_fft_plan (gboolean inverse, int width, int height, int row_stride, int num_channels)
+{
+    fft_plan_t **p;
+
+    for (p = &fft_plans; *p != NULL; p = &(*p)->next)
+    {
+	fft_plan_t *entry = *p;
+
+	if (entry->inverse == inverse && entry->width == width && entry->height == height
+	    && entry->row_stride == row_stride && entry->num_channels == num_channels)
+	{
+	    *p = entry->next;
+	    entry->next = fft_plans;
+	    fft_plans = entry;
+
+	    ++entry->num_users;
+	    return entry;
+	}
+    }
+
+    return NULL;
+}
+
+/* The plan must be given back with release_fft_plan(). */
+static fft_plan_t*
+get_fft_plan (gboolean inverse, int width, int height, int row_stride, int num_channels)
+{
+    fft_plan_t *entry, *other;
+
+    g_static_mutex_lock(&fft_plans_mutex);
+    entry = lookup_fft_plan(inverse, width, height, row_stride, num_channels);
+    g_static_mutex_unlock(&fft_plans_mutex);
+
+    if (entry != NULL)
+	return entry;
+
+    entry = g_new(fft_plan_t, 1);
+    entry->inverse = inverse;
+    entry->width = width;
+    entry->height = height;
+    entry->row_stride = row_stride;
+    entry->num_channels = num_channels;
+    entry->num_users = 1;
+    entry->next = NULL;
+
+    g_static_mutex_lock(&fft_planner_mutex);
+    init_fft();
+    entry->plan = make_fft_plan(inverse, width, height, row_stride, num_channels, FFTW_WISDOM_ONLY);
+    if (entry->plan == NULL)
+	entry->plan = make_fft_plan(inverse, width, height, row_stride, num_channels, FFTW_ESTIMATE);
+    g_assert(entry->plan != NULL);
+    g_static_mutex_unlock(&fft_planner_mutex);
+
+    /* Another thread might have made the same plan in the
+       meantime. */
+    g_static_mutex_lock(&fft_plans_mutex);
+    other = lookup_fft_plan(inverse, width, height, row_stride, num_channels);
+    if (other == NULL)
+    {
+	entry->next = fft_plans;
+	fft_plans = entry;
+    }
+    g_static_mutex_unlock(&fft_plans_mutex);
+
+    if (other != NULL)
+    {
+	destroy_fft_plans(entry);
+	entry = other;
+    }
+
+    return entry;
+}
+
+/* Destroys the least recently used plans nobody is using if there are
+   more than MAX_FFT_PLANS. */
+static void
+release_fft_plan (fft_plan_t *entry)
+{
+    fft_plan_t **p;
+    fft_plan_t *evicted = NULL;
+    int num_plans = 0;
+
+    g_static_mutex_lock(&fft_plans_mutex);
+
+    g_assert(entry->num_users > 0);
+    --entry->num_users;
+
+    p = &fft_plans;
+    while (*p != NULL)
+    {
+	if (++num_plans > MAX_FFT_PLANS && (*p)->num_users == 0)
+	{
+	    fft_plan_t *victim = *p;
+
+	    *p = victim->next;
+	    victim->next = evicted;
+	    evicted = victim;
+	}
+	else
+	    p = &(*p)->next;
+    }
+
+    g_static_mutex_unlock(&fft_plans_mutex);
+
+    if (evicted != NULL)
+	destroy_fft_plans(evicted);
+}
+
+/* The image must be planar. */
+static fftwf_complex*
+fft_forward (image_t *image, int num_channels)
+{
+    int cn = image->pixel_height * (image->pixel_width / 2 + 1);
+    fftwf_complex *freq = fftwf_malloc(sizeof(fftwf_complex) * cn * num_channels);
+    fft_plan_t *plan;
+
+    g_assert(image->v.floatmap.layout == FLOATMAP_LAYOUT_PLANAR);
+
+    plan = get_fft_plan(FALSE, image->pixel_width, image->pixel_height,
+			image->v.floatmap.row_stride, num_channels);
+    fftwf_execute_dft_r2c(plan->plan, image->v.floatmap.data, freq);
+    release_fft_plan(plan);
+
+    return freq;
+}
+
+/* Destroys freq and normalizes the result.  out_image must be
+   planar. */
+static void
+fft_inverse (image_t *out_image, fftwf_complex *freq, int num_channels)
+{
+    float factor = 1.0 / (out_image->pixel_width * out_image->pixel_height);
+    fft_plan_t *plan;
+    int x, y, channel;
+
+    g_assert(out_image->v.floatmap.layout == FLOATMAP_LAYOUT_PLANAR);
+
+    plan = get_fft_plan(TRUE, out_image->pixel_width, out_image->pixel_height,
+			out_image->v.floatmap.row_stride, num_channels);
+    fftwf_execute_dft_c2r(plan->plan, freq, out_image->v.floatmap.data);
+    release_fft_plan(plan);
+
+    for (channel = 0; channel < num_channels; ++channel)
+	for (y = 0; y < out_image->pixel_height; ++y)
+	{
+	    float *row = &FLOATMAP_VALUE_XY(out_image, 0, y, channel);
+
+	    for (x = 0; x < out_image->pixel_width; ++x)
+		row[x] *= factor;
+	}
+}
+
+/* Pairwise summation, to keep the error small for big images. */
 static double
-copy_and_add (double *dest, float *src, int n)
+row_sum (const float *src, int n)
 {
     int half;
 
     if (n <= 0)
 	return 0.0;
     if (n == 1)
-	return dest[0] = src[0];
-    if (n == 2)
-    {
-	double d1, d2;
+	return src[0];
 
-	d1 = dest[0] = src[0];
-	d2 = dest[1] = src[NUM_FLOATMAP_CHANNELS];
+    half = n / 2;
+    return row_sum(src, half) + row_sum(src + half, n - half);
+}
 
-	return d1 + d2;
-    }
+static double
+channel_sum (image_t *image, int channel, int first_row, int num_rows)
+{
+    int half;
 
-    half = n / 2;
-    return copy_and_add(dest, src, half)
-	+ copy_and_add(dest + half, src + half * NUM_FLOATMAP_CHANNELS, n - half);
+    if (num_rows <= 0)
+	return 0.0;
+    if (num_rows == 1)
+	return row_sum(&FLOATMAP_VALUE_XY(image, 0, first_row, channel), image->pixel_width);
+
+    half = num_rows / 2;
+    return channel_sum(image, channel, first_row, half)
+	+ channel_sum(image, channel, first_row + half, num_rows - half);
+}
+
+/* Both images must be planar and of the same size. */
+static void
+copy_alpha_channel (image_t *out_image, image_t *in_image)
+{
+    memcpy(&FLOATMAP_VALUE_XY(out_image, 0, 0, 3), &FLOATMAP_VALUE_XY(in_image, 0, 0, 3),
+	   sizeof(float) * in_image->v.floatmap.channel_stride);
+}
+
+/* The FFTs need planar floatmaps of the same size. */
+static void
+get_planar_images (mathmap_invocation_t *invocation, image_t **in_image, image_t **filter_image,
+		   mathmap_pools_t *pools)
+{
+    if ((*in_image)->type != IMAGE_FLOATMAP)
+	*in_image = render_image_with_layout(invocation, *in_image,
+					     invocation->render_width, invocation->render_height,
+					     FLOATMAP_LAYOUT_PLANAR, pools, TRUE);
+    else
+	*in_image = floatmap_with_layout(*in_image, FLOATMAP_LAYOUT_PLANAR, pools);
+
+    if (filter_image == NULL)
+	return;
+
+    if ((*filter_image)->type != IMAGE_FLOATMAP
+	|| (*filter_image)->pixel_width != (*in_image)->pixel_width
+	|| (*filter_image)->pixel_height != (*in_image)->pixel_height)
+	*filter_image = render_image_with_layout(invocation, *filter_image,
+						 (*in_image)->pixel_width, (*in_image)->pixel_height,
+						 FLOATMAP_LAYOUT_PLANAR, pools, TRUE);
+    else
+	*filter_image = floatmap_with_layout(*filter_image, FLOATMAP_LAYOUT_PLANAR, pools);
 }
 
 CALLBACK_SYMBOL
@@ -73,100 +385,77 @@ native_filter_convolve (mathmap_invocation_t *invocation, userval_t *args, mathm
     image_t *filter_image = args[1].v.image;
     gboolean normalize = args[2].v.bool_const != 0.0;
     gboolean copy_alpha = args[3].v.bool_const != 0.0;
-    image_t *out_image;
-    double *fftw_in;
-    fftw_complex *image_out, *filter_out;
-    fftw_plan in_plan, filter_plan, inverse_plan;
+    image_t *out_image, *filter_in;
+    fftwf_complex *image_out, *filter_out;
     int i, n, nhalf, cn, channel, num_channels;
+    int width, height;
 
     cache_entry = invocation_lookup_native_filter_invocation(invocation, args, &native_filter_convolve);
     if (cache_entry->image != NULL)
 	return cache_entry->image;
 
-    if (in_image->type != IMAGE_FLOATMAP)
-	in_image = render_image(invocation, in_image,
-				invocation->render_width, invocation->render_height, pools, TRUE);
-    if (filter_image->type != IMAGE_FLOATMAP
-	|| filter_image->pixel_width != in_image->pixel_width
-	|| filter_image->pixel_height != in_image->pixel_height)
-	filter_image = render_image(invocation, filter_image,
-				    in_image->pixel_width, in_image->pixel_height, pools, TRUE);
+    get_planar_images(invocation, &in_image, &filter_image, pools);
 
-    out_image = floatmap_alloc(in_image->pixel_width, in_image->pixel_height, &invocation->pools);
+    width = in_image->pixel_width;
+    height = in_image->pixel_height;
 
-    n = in_image->pixel_height * in_image->pixel_width;
-    nhalf = in_image->pixel_width * (in_image->pixel_height / 2) + in_image->pixel_width / 2;
-    cn = in_image->pixel_height * (in_image->pixel_width / 2 + 1);
-
-    fftw_in = fftw_malloc(sizeof(double) * n);
-    image_out = fftw_malloc(sizeof(fftw_complex) * cn);
-    filter_out = fftw_malloc(sizeof(fftw_complex) * cn);
-
-    in_plan = fftw_plan_dft_r2c_2d(in_image->pixel_height, in_image->pixel_width,
-				    fftw_in, image_out,
-				    FFTW_ESTIMATE);
-    filter_plan = fftw_plan_dft_r2c_2d(in_image->pixel_height, in_image->pixel_width,
-					fftw_in, filter_out,
-					FFTW_ESTIMATE);
-    inverse_plan = fftw_plan_dft_c2r_2d(in_image->pixel_height, in_image->pixel_width,
-					 image_out, fftw_in,
-					 FFTW_ESTIMATE);
+    out_image = floatmap_alloc_with_layout(width, height, FLOATMAP_LAYOUT_PLANAR, &cache_entry->pools);
+
+    n = height * width;
+    nhalf = width * (height / 2) + width / 2;
+    cn = height * (width / 2 + 1);
 
     if (copy_alpha)
 	num_channels = 3;
     else
 	num_channels = 4;
+
+    // the kernel, with its center moved to the origin
+    filter_in = floatmap_alloc_with_layout(width, height, FLOATMAP_LAYOUT_PLANAR, pools);
     for (channel = 0; channel < num_channels; ++channel)
-    {
-	// FFT of input image
 	for (i = 0; i < n; ++i)
-	    fftw_in[i] = in_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + channel];
-	fftw_execute(in_plan);
-
-	// FFT of kernel image
-	if (normalize)
 	{
-	    double d1 = copy_and_add(fftw_in,
-				     filter_image->v.floatmap.data + channel + (n - nhalf) * NUM_FLOATMAP_CHANNELS,
-				     nhalf);
-	    double d2 = copy_and_add(fftw_in + nhalf,
-				     filter_image->v.floatmap.data + channel,
-				     n - nhalf);
-	    double factor = 1.0 / (d1 + d2);
-
-	    for (i = 0; i < n; ++i)
-		fftw_in[i] *= factor;
+	    int src = i + n - nhalf;
+
+	    if (src >= n)
+		src -= n;
+
+	    FLOATMAP_VALUE_XY(filter_in, i % width, i / width, channel)
+		= FLOATMAP_VALUE_XY(filter_image, src % width, src / width, channel);
 	}
-	else
+
+    if (normalize)
+	for (channel = 0; channel < num_channels; ++channel)
 	{
-	    copy(fftw_in, filter_image->v.floatmap.data + channel + (n - nhalf) * NUM_FLOATMAP_CHANNELS, nhalf);
-	    copy(fftw_in + nhalf, filter_image->v.floatmap.data + channel, n - nhalf);
+	    float factor = 1.0 / channel_sum(filter_in, channel, 0, height);
+	    int x, y;
+
+	    for (y = 0; y < height; ++y)
+	    {
+		float *row = &FLOATMAP_VALUE_XY(filter_in, 0, y, channel);
+
+		for (x = 0; x < width; ++x)
+		    row[x] *= factor;
+	    }
 	}
-	fftw_execute(filter_plan);
 
-	// multiply in frequency domain
-	for (i = 0; i < cn; ++i)
-	    image_out[i] *= filter_out[i];
+    // FFT of input image and kernel
+    image_out = fft_forward(in_image, num_channels);
+    filter_out = fft_forward(filter_in, num_channels);
 
-	// reverse FFT
-	fftw_execute(inverse_plan);
-	for (i = 0; i < n; ++i)
-	    out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + channel] = fftw_in[i] / n;
-    }
+    // multiply in frequency domain
+    for (i = 0; i < cn * num_channels; ++i)
+	image_out[i] *= filter_out[i];
+
+    // reverse FFT
+    fft_inverse(out_image, image_out, num_channels);
 
     // copy alpha channel
     if (copy_alpha)
-	for (i = 0; i < n; ++i)
-	    out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + 3]
-		= in_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + 3];
-
-    fftw_destroy_plan(in_plan);
-    fftw_destroy_plan(filter_plan);
-    fftw_destroy_plan(inverse_plan);
+	copy_alpha_channel(out_image, in_image);
 
-    fftw_free(fftw_in);
-    fftw_free(image_out);
-    fftw_free(filter_out);
+    fftwf_free(image_out);
+    fftwf_free(filter_out);
 
     native_filter_cache_entry_set_image(invocation, cache_entry, out_image);
 
@@ -182,84 +471,58 @@ native_filter_half_convolve (mathmap_invocation_t *invocation, userval_t *args,
     image_t *filter_image = args[1].v.image;
     gboolean copy_alpha = args[2].v.bool_const != 0.0;
     image_t *out_image;
-    double *fftw_in;
-    fftw_complex *image_out;
-    fftw_plan in_plan, inverse_plan;
-    int i, n, nhalf, cn, cw, channel, num_channels;
+    fftwf_complex *image_out;
+    int n, nhalf, cn, cw, channel, num_channels;
+    int x, y;
 
     cache_entry = invocation_lookup_native_filter_invocation(invocation, args, &native_filter_half_convolve);
     if (cache_entry->image != NULL)
 	return cache_entry->image;
 
-    if (in_image->type != IMAGE_FLOATMAP)
-	in_image = render_image(invocation, in_image,
-				invocation->render_width, invocation->render_height, pools, TRUE);
-    if (filter_image->type != IMAGE_FLOATMAP
-	|| filter_image->pixel_width != in_image->pixel_width
-	|| filter_image->pixel_height != in_image->pixel_height)
-	filter_image = render_image(invocation, filter_image,
-				    in_image->pixel_width, in_image->pixel_height, pools, TRUE);
+    get_planar_images(invocation, &in_image, &filter_image, pools);
 
-    out_image = floatmap_alloc(in_image->pixel_width, in_image->pixel_height, &invocation->pools);
+    out_image = floatmap_alloc_with_layout(in_image->pixel_width, in_image->pixel_height,
+					   FLOATMAP_LAYOUT_PLANAR, &cache_entry->pools);
 
     n = in_image->pixel_height * in_image->pixel_width;
     nhalf = in_image->pixel_width * (in_image->pixel_height / 2) + in_image->pixel_width / 2;
     cw = in_image->pixel_width / 2 + 1;
     cn = in_image->pixel_height * cw;
 
-    fftw_in = fftw_malloc(sizeof(double) * n);
-    image_out = fftw_malloc(sizeof(fftw_complex) * cn);
-
-    in_plan = fftw_plan_dft_r2c_2d(in_image->pixel_height, in_image->pixel_width,
-				    fftw_in, image_out,
-				    FFTW_ESTIMATE);
-    inverse_plan = fftw_plan_dft_c2r_2d(in_image->pixel_height, in_image->pixel_width,
-					 image_out, fftw_in,
-					 FFTW_ESTIMATE);
-
     if (copy_alpha)
 	num_channels = 3;
     else
 	num_channels = 4;
-    for (channel = 0; channel < num_channels; ++channel)
-    {
-	// FFT of input image
-	for (i = 0; i < n; ++i)
-	    fftw_in[i] = in_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + channel];
-	fftw_execute(in_plan);
 
-	// multiply in frequency domain
-	int x, y;
+    // FFT of input image
+    image_out = fft_forward(in_image, num_channels);
 
+    // multiply in frequency domain
+    for (channel = 0; channel < num_channels; ++channel)
 	for (y = 0; y < in_image->pixel_height; ++y)
+	{
+	    fftwf_complex *freq = image_out + channel * cn + y * cw;
+
 	    for (x = 0; x < cw; ++x)
 	    {
-		int out_idx = x + y * in_image->pixel_width;
-		int in_idx = out_idx + nhalf;
+		int in_idx = x + y * in_image->pixel_width + nhalf;
 
 		if (in_idx >= n)
 		    in_idx -= n;
 
-		image_out[x + y * cw] *= filter_image->v.floatmap.data[in_idx * NUM_FLOATMAP_CHANNELS + channel];
+		freq[x] *= FLOATMAP_VALUE_XY(filter_image, in_idx % in_image->pixel_width,
+					     in_idx / in_image->pixel_width, channel);
 	    }
+	}
 
-	// reverse FFT
-	fftw_execute(inverse_plan);
-	for (i = 0; i < n; ++i)
-	    out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + channel] = fftw_in[i] / n;
-    }
+    // reverse FFT
+    fft_inverse(out_image, image_out, num_channels);
 
     // copy alpha channel
     if (copy_alpha)
-	for (i = 0; i < n; ++i)
-	    out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + 3]
-		= in_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + 3];
-
-    fftw_destroy_plan(in_plan);
-    fftw_destroy_plan(inverse_plan);
+	copy_alpha_channel(out_image, in_image);
 
-    fftw_free(fftw_in);
-    fftw_free(image_out);
+    fftwf_free(image_out);
 
     native_filter_cache_entry_set_image(invocation, cache_entry, out_image);
 
@@ -274,55 +537,40 @@ native_filter_visualize_fft (mathmap_invocation_t *invocation, userval_t *args,
     image_t *in_image = args[0].v.image;
     gboolean ignore_alpha = args[1].v.bool_const != 0.0;
     image_t *out_image;
-    double *fftw_in;
-    fftw_complex *image_out;
-    fftw_plan in_plan;
-    int i, n, nhalf, cn, cw, channel, num_channels;
+    fftwf_complex *image_out;
+    int n, cn, cw, channel, num_channels;
+    int x, y;
     double sqrtn;
 
     cache_entry = invocation_lookup_native_filter_invocation(invocation, args, &native_filter_visualize_fft);
     if (cache_entry->image != NULL)
 	return cache_entry->image;
 
-    if (in_image->type != IMAGE_FLOATMAP)
-	in_image = render_image(invocation, in_image,
-				invocation->render_width, invocation->render_height, pools, TRUE);
+    get_planar_images(invocation, &in_image, NULL, pools);
 
-    out_image = floatmap_alloc(in_image->pixel_width, in_image->pixel_height, &invocation->pools);
+    out_image = floatmap_alloc_with_layout(in_image->pixel_width, in_image->pixel_height,
+					   FLOATMAP_LAYOUT_PLANAR, &cache_entry->pools);
 
     n = in_image->pixel_height * in_image->pixel_width;
-    nhalf = in_image->pixel_width * (in_image->pixel_height / 2) + in_image->pixel_width / 2;
     sqrtn = sqrt(n);
     cw = in_image->pixel_width / 2 + 1;
     cn = in_image->pixel_height * cw;
 
-    fftw_in = fftw_malloc(sizeof(double) * n);
-    image_out = fftw_malloc(sizeof(fftw_complex) * cn);
-
-    in_plan = fftw_plan_dft_r2c_2d(in_image->pixel_height, in_image->pixel_width,
-				    fftw_in, image_out,
-				    FFTW_ESTIMATE);
-
-    memset(out_image->v.floatmap.data, 0,
-	   sizeof(float) * in_image->pixel_width * in_image->pixel_height * NUM_FLOATMAP_CHANNELS);
+    memset(out_image->v.floatmap.data, 0, sizeof(float) * floatmap_data_size(out_image));
 
     if (ignore_alpha)
 	num_channels = 3;
     else
 	num_channels = 4;
-    for (channel = 0; channel < num_channels; ++channel)
-    {
-	// FFT of input image
-	for (i = 0; i < n; ++i)
-	    fftw_in[i] = in_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + channel];
-	fftw_execute(in_plan);
 
-	// multiply in frequency domain
-	int x, y;
+    // FFT of input image
+    image_out = fft_forward(in_image, num_channels);
 
+    for (channel = 0; channel < num_channels; ++channel)
 	for (y = 0; y < in_image->pixel_height; ++y)
 	{
 	    int out_y = y + in_image->pixel_height / 2;
+	    fftwf_complex *freq = image_out + channel * cn + y * cw;
 
 	    if (out_y >= in_image->pixel_height)
 		out_y -= in_image->pixel_height;
@@ -331,25 +579,20 @@ native_filter_visualize_fft (mathmap_invocation_t *invocation, userval_t *args,
 	    {
 		int out_x1 = cw - 1 - x;
 		int out_x2 = x + in_image->pixel_width - cw;
-		double val = cabs(image_out[x + y * cw]) / sqrtn;
+		float val = cabsf(freq[x]) / sqrtn;
 
-		out_image->v.floatmap.data[(out_x1 + out_y * in_image->pixel_width) * NUM_FLOATMAP_CHANNELS + channel]
-		    = val;
-		out_image->v.floatmap.data[(out_x2 + out_y * in_image->pixel_width) * NUM_FLOATMAP_CHANNELS + channel]
-		    = val;
+		FLOATMAP_VALUE_XY(out_image, out_x1, out_y, channel) = val;
+		FLOATMAP_VALUE_XY(out_image, out_x2, out_y, channel) = val;
 	    }
 	}
-    }
 
     // set alpha channel
     if (ignore_alpha)
-	for (i = 0; i < n; ++i)
-	    out_image->v.floatmap.data[i * NUM_FLOATMAP_CHANNELS + 3] = 1.0;
-
-    fftw_destroy_plan(in_plan);
+	for (y = 0; y < in_image->pixel_height; ++y)
+	    for (x = 0; x < in_image->pixel_width; ++x)
+		FLOATMAP_VALUE_XY(out_image, x, y, 3) = 1.0;
 
-    fftw_free(fftw_in);
-    fftw_free(image_out);
+    fftwf_free(image_out);
 
     native_filter_cache_entry_set_image(invocation, cache_entry, out_image);
 
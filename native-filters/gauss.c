@@ -32,6 +32,7 @@
 
 #include "../drawable.h"
 #include "../mmpools.h"
+#include "../thread_pool.h"
 
 #include "native-filters.h"
 
@@ -114,149 +115,183 @@ find_iir_constants (double *n_p, double *n_m, double *d_p, double *d_m, double *
     }
 }
 
-static void
-transfer_pixels (const double *src1, const double *src2, float *dest, int width)
-{
-    int b;
+/* Both passes of the blurs run the same line function over every
+   row or column of each channel of a planar floatmap.  A line
+   function filters num_lanes lines at once.  Element pos of lane l is
+   src[pos * src_stride + l] and goes to dest[pos * num_lanes + l].
 
-    for (b = 0; b < width; b++)
-	*dest++ = *src1++ + *src2++;
-}
+   Rows are filtered one lane at a time.  Columns are filtered in
+   blocks of GAUSS_BLOCK_COLUMNS lanes, which are contiguous in a
+   planar floatmap and fill exactly one cache line, so the column pass
+   neither strides through the image for every pixel nor has to
+   transpose it, and the lanes can be vectorized. */
 
-static image_t*
-gauss_iir (image_t *floatmap, float horizontal_std_dev, float vertical_std_dev, mathmap_pools_t *pools)
-{
-    image_t *out;
-    int width = floatmap->pixel_width;
-    int height = floatmap->pixel_height;
-    float *dest;
-    float *src, *sp_p, *sp_m;
-    double n_p[5], n_m[5];
-    double d_p[5], d_m[5];
-    double bd_p[5], bd_m[5];
-    double *val_p;
-    double *val_m;
-    double *vp, *vm;
-    int i, j;
-    int row, col;
-    int terms;
-    float initial_p;
-    float initial_m;
-    int channel;
+#define GAUSS_TASKS_PER_WORKER		8
+#define GAUSS_BLOCK_COLUMNS		(FLOATMAP_ROW_ALIGNMENT / sizeof(float))
 
-    out = floatmap_copy(floatmap, pools);
+typedef void (*gauss_line_func_t) (const float *src, int src_stride, int num_lanes, float *dest, int length,
+				   gpointer info, gpointer scratch);
 
-    val_p = g_malloc(MAX(width, height) * sizeof(double));
-    val_m = g_malloc(MAX(width, height) * sizeof(double));
+typedef struct
+{
+    image_t *image;
+    gboolean vertical;
+    int lines_per_task;
+    int num_lines;
+    gauss_line_func_t line_func;
+    gpointer info;
+    gsize scratch_size;
+} gauss_pass_t;
 
-    src = g_malloc(MAX(width, height) * sizeof(float));
-    dest = g_malloc(MAX(width, height) * sizeof(float));
+static void
+gauss_pass_task_func (gpointer _data, int task_index)
+{
+    gauss_pass_t *pass = (gauss_pass_t*)_data;
+    image_t *image = pass->image;
+    int width = image->pixel_width;
+    int height = image->pixel_height;
+    int row_stride = image->v.floatmap.row_stride;
+    int first = task_index * pass->lines_per_task;
+    int num_lines = MIN(pass->lines_per_task, pass->num_lines - first);
+    gpointer scratch = g_malloc(pass->scratch_size);
+    float *dest;
+    int i;
 
-    /*  First the vertical pass  */
-    find_iir_constants (n_p, n_m, d_p, d_m, bd_p, bd_m, vertical_std_dev);
+    if (!pass->vertical)
+    {
+	dest = g_new(float, width);
 
-    for (channel = 0; channel < NUM_FLOATMAP_CHANNELS; ++channel)
-	for (col = 0; col < width; col++)
+	/* Line i is row i % height of channel i / height. */
+	for (i = first; i < first + num_lines; ++i)
 	{
-	    memset (val_p, 0, height * sizeof (double));
-	    memset (val_m, 0, height * sizeof (double));
-
-	    floatmap_get_channel_column(src, out, col, channel);
+	    float *row = &FLOATMAP_VALUE_XY(image, 0, i % height, i / height);
 
-	    sp_p = src;
-	    sp_m = src + (height - 1);
-	    vp = val_p;
-	    vm = val_m + (height - 1);
+	    pass->line_func(row, 1, 1, dest, width, pass->info, scratch);
+	    memcpy(row, dest, sizeof(float) * width);
+	}
+    }
+    else
+    {
+	int blocks_per_channel = (width + GAUSS_BLOCK_COLUMNS - 1) / GAUSS_BLOCK_COLUMNS;
 
-	    /*  Set up the first vals  */
-	    initial_p = sp_p[0];
-	    initial_m = sp_m[0];
+	dest = g_new(float, height * GAUSS_BLOCK_COLUMNS);
 
-	    for (row = 0; row < height; row++)
-	    {
-		double *vpptr, *vmptr;
-		terms = (row < 4) ? row : 4;
-
-		vpptr = vp; vmptr = vm;
-		for (i = 0; i <= terms; i++)
-		{
-		    *vpptr += n_p[i] * sp_p[-i] - d_p[i] * vp[-i];
-		    *vmptr += n_m[i] * sp_m[i] - d_m[i] * vm[i];
-		}
-		for (j = i; j <= 4; j++)
-		{
-		    *vpptr += (n_p[j] - bd_p[j]) * initial_p;
-		    *vmptr += (n_m[j] - bd_m[j]) * initial_m;
-		}
-
-		sp_p++;
-		sp_m--;
-		vp++;
-		vm--;
-	    }
+	/* Line i is block i % blocks_per_channel of channel
+	   i / blocks_per_channel. */
+	for (i = first; i < first + num_lines; ++i)
+	{
+	    int first_column = (i % blocks_per_channel) * GAUSS_BLOCK_COLUMNS;
+	    int num_lanes = MIN(GAUSS_BLOCK_COLUMNS, width - first_column);
+	    float *block = &FLOATMAP_VALUE_XY(image, first_column, 0, i / blocks_per_channel);
+	    int row;
 
-	    transfer_pixels (val_p, val_m, dest, height);
+	    pass->line_func(block, row_stride, num_lanes, dest, height, pass->info, scratch);
 
-	    floatmap_set_channel_column(out, col, channel, dest);
+	    for (row = 0; row < height; ++row)
+		memcpy(block + row * row_stride, dest + row * num_lanes, sizeof(float) * num_lanes);
 	}
+    }
 
-    /*  Now the horizontal pass  */
-    find_iir_constants (n_p, n_m, d_p, d_m, bd_p, bd_m, horizontal_std_dev);
+    g_free(dest);
+    g_free(scratch);
+}
 
-    for (channel = 0; channel < NUM_FLOATMAP_CHANNELS; ++channel)
-	for (row = 0; row < height; row++)
-	{
-	    memset (val_p, 0, width * sizeof (double));
-	    memset (val_m, 0, width * sizeof (double));
+/* The image must be planar.  scratch_size must be enough for a line
+   function call with GAUSS_BLOCK_COLUMNS lanes. */
+static void
+gauss_pass (image_t *image, gboolean vertical, gauss_line_func_t line_func, gpointer info, gsize scratch_size)
+{
+    gauss_pass_t pass;
+
+    g_assert(image->v.floatmap.layout == FLOATMAP_LAYOUT_PLANAR);
+
+    pass.image = image;
+    pass.vertical = vertical;
+    if (vertical)
+    {
+	pass.num_lines = (image->pixel_width + GAUSS_BLOCK_COLUMNS - 1) / GAUSS_BLOCK_COLUMNS * NUM_FLOATMAP_CHANNELS;
+	pass.lines_per_task = 1;
+    }
+    else
+    {
+	pass.num_lines = image->pixel_height * NUM_FLOATMAP_CHANNELS;
+	pass.lines_per_task = MAX(pass.num_lines / (thread_pool_num_workers() * GAUSS_TASKS_PER_WORKER), 1);
+    }
+    pass.line_func = line_func;
+    pass.info = info;
+    pass.scratch_size = scratch_size;
 
-	    floatmap_get_channel_row(src, out, row, channel);
+    thread_pool_run(gauss_pass_task_func, &pass, (pass.num_lines + pass.lines_per_task - 1) / pass.lines_per_task);
+}
 
-	    sp_p = src;
-	    sp_m = src + (width - 1);
-	    vp = val_p;
-	    vm = val_m + (width - 1);
+typedef struct
+{
+    double n_p[5], n_m[5];
+    double d_p[5], d_m[5];
+    double bd_p[5], bd_m[5];
+} iir_constants_t;
+
+/* Runs the causal and the anti-causal filter over the lanes.  All
+   lanes are processed in the innermost loops, which the compiler can
+   vectorize.  The recursion is done in double precision because the
+   filter is not stable enough in single precision for large
+   deviations.  scratch must have room for 2 * length * num_lanes
+   doubles. */
+static void
+iir_line (const float *src, int src_stride, int num_lanes, float *dest, int length, gpointer info, gpointer scratch)
+{
+    iir_constants_t *k = (iir_constants_t*)info;
+    double *val_p = (double*)scratch;
+    double *val_m = val_p + length * num_lanes;
+    const float *initial_p = src;
+    const float *initial_m = src + (length - 1) * src_stride;
+    int pos, i, j, l;
 
-	    /*  Set up the first vals  */
-	    initial_p = sp_p[0];
-	    initial_m = sp_m[0];
+    memset(val_p, 0, 2 * length * num_lanes * sizeof(double));
 
-	    for (col = 0; col < width; col++)
+    for (pos = 0; pos < length; ++pos)
+    {
+	const float *sp_p = src + pos * src_stride;
+	const float *sp_m = src + (length - 1 - pos) * src_stride;
+	double *vp = val_p + pos * num_lanes;
+	double *vm = val_m + (length - 1 - pos) * num_lanes;
+	int terms = (pos < 4) ? pos : 4;
+
+	for (i = 0; i <= terms; i++)
+	    for (l = 0; l < num_lanes; ++l)
 	    {
-		double *vpptr, *vmptr;
-
-		terms = (col < 4) ? col : 4;
-
-		vpptr = vp;
-		vmptr = vm;
-
-		for (i = 0; i <= terms; i++)
-		{
-		    *vpptr += n_p[i] * sp_p[-i] - d_p[i] * vp[-i];
-		    *vmptr += n_m[i] * sp_m[i] - d_m[i] * vm[i];
-		}
-		for (j = i; j <= 4; j++)
-		{
-		    *vpptr += (n_p[j] - bd_p[j]) * initial_p;
-		    *vmptr += (n_m[j] - bd_m[j]) * initial_m;
-		}
-
-		sp_p++;
-		sp_m--;
-		vp++;
-		vm--;
+		vp[l] += k->n_p[i] * sp_p[l - i * src_stride]
+		    - k->d_p[i] * vp[l - i * num_lanes];
+		vm[l] += k->n_m[i] * sp_m[l + i * src_stride]
+		    - k->d_m[i] * vm[l + i * num_lanes];
 	    }
+	for (j = i; j <= 4; j++)
+	    for (l = 0; l < num_lanes; ++l)
+	    {
+		vp[l] += (k->n_p[j] - k->bd_p[j]) * initial_p[l];
+		vm[l] += (k->n_m[j] - k->bd_m[j]) * initial_m[l];
+	    }
+    }
 
-	    transfer_pixels (val_p, val_m, dest, width);
+    for (i = 0; i < length * num_lanes; i++)
+	dest[i] = val_p[i] + val_m[i];
+}
 
-	    floatmap_set_channel_row(out, row, channel, dest);
-	}
+static image_t*
+gauss_iir (image_t *floatmap, float horizontal_std_dev, float vertical_std_dev, mathmap_pools_t *pools)
+{
+    image_t *out;
+    iir_constants_t k;
 
-    /*  free up buffers  */
-    g_free (val_p);
-    g_free (val_m);
+    out = floatmap_copy_with_layout(floatmap, FLOATMAP_LAYOUT_PLANAR, pools);
 
-    g_free (src);
-    g_free (dest);
+    /*  First the vertical pass  */
+    find_iir_constants(k.n_p, k.n_m, k.d_p, k.d_m, k.bd_p, k.bd_m, vertical_std_dev);
+    gauss_pass(out, TRUE, iir_line, &k, 2 * out->pixel_height * GAUSS_BLOCK_COLUMNS * sizeof(double));
+
+    /*  Now the horizontal pass  */
+    find_iir_constants(k.n_p, k.n_m, k.d_p, k.d_m, k.bd_p, k.bd_m, horizontal_std_dev);
+    gauss_pass(out, FALSE, iir_line, &k, 2 * out->pixel_width * sizeof(double));
 
     return out;
 }
@@ -497,143 +532,82 @@ do_full_lre (const float *src, float *dest, int width, int length, int dist, con
     }
 }
 
-static image_t*
-gauss_rle (image_t *floatmap, float horizontal_std_dev, float vertical_std_dev, mathmap_pools_t *pools)
+typedef struct
 {
-    int width = floatmap->pixel_width;
-    int height = floatmap->pixel_height;
-    image_t *out;
-    float *dest;
-    float *src;
-    int row, col, b;
-    float total;
     float *curve;
     float *sum;
+    float total;
     int length;
+} rle_curve_t;
 
-    src  = g_new(float, MAX(width, height) * NUM_FLOATMAP_CHANNELS);
-    dest = g_new(float, MAX(width, height) * NUM_FLOATMAP_CHANNELS);
+/* scratch must have room for length + 2 * curve->length ints and as
+   many floats.  The lanes are filtered one after the other. */
+static void
+rle_line (const float *src, int src_stride, int num_lanes, float *dest, int length, gpointer info, gpointer scratch)
+{
+    rle_curve_t *curve = (rle_curve_t*)info;
+    int *rle = (int*)scratch + curve->length;
+    float *pix = (float*)((int*)scratch + length + 2 * curve->length) + curve->length;
+    int b;
 
-    out = floatmap_copy(floatmap, pools);
+    /*
+    if (has_alpha)
+	multiply_alpha (src, length, NUM_FLOATMAP_CHANNELS);
+    */
 
-    /*  First the vertical pass  */
-    if (vertical_std_dev > 0.0)
+    for (b = 0; b < num_lanes; b++)
     {
-	int *rle = NULL;
-	float *pix = NULL;
-
-	make_rle_curve (vertical_std_dev, &curve, &length, &sum, &total);
-
-	rle = g_new (int, height + 2 * length);
-	rle += length; /* rle[] extends from -length to height+length-1 */
-
-	pix = g_new (float, height + 2 * length);
-	pix += length; /* pix[] extends from -length to height+length-1 */
-
-	for (col = 0; col < width; col++)
-        {
-	    floatmap_get_column(src, out, col);
-
-	    /*
-	    if (has_alpha)
-		multiply_alpha (src, height, NUM_FLOATMAP_CHANNELS);
-	    */
-
-	    for (b = 0; b < NUM_FLOATMAP_CHANNELS; b++)
-            {
-		int same = run_length_encode (src + b, rle, pix, NUM_FLOATMAP_CHANNELS,
-					      height, length, TRUE);
-
-		if (same > (3 * height) / 4)
-		{
-		    /* encoded_rle is only fastest if there are a lot of
-		     * repeating pixels
-		     */
-		    do_encoded_lre (rle, pix, dest + b, height, length, NUM_FLOATMAP_CHANNELS,
-				    curve, total, sum);
-		}
-		else
-		{
-		    /* else a full but more simple algorithm is better */
-		    do_full_lre (pix, dest + b, height, length, NUM_FLOATMAP_CHANNELS,
-				 curve, total);
-		}
-            }
-
-	    /*
-	    if (has_alpha)
-		separate_alpha (dest, height, NUM_FLOATMAP_CHANNELS);
-	    */
-
-	    floatmap_set_column(out, col, dest);
-        }
+	int same = run_length_encode (src + b, rle, pix, src_stride,
+				      length, curve->length, TRUE);
 
-	g_free(rle - length);
-	g_free(pix - length);
-
-	free_rle_curve(curve, length, sum);
+	if (same > (3 * length) / 4)
+	{
+	    /* encoded_rle is only fastest if there are a lot of
+	     * repeating pixels
+	     */
+	    do_encoded_lre (rle, pix, dest + b, length, curve->length, num_lanes,
+			    curve->curve, curve->total, curve->sum);
+	}
+	else
+	{
+	    /* else a full but more simple algorithm is better */
+	    do_full_lre (pix, dest + b, length, curve->length, num_lanes,
+			 curve->curve, curve->total);
+	}
     }
 
-    /*  Now the horizontal pass  */
-    if (horizontal_std_dev > 0.0)
-    {
-	int *rle = NULL;
-	float *pix = NULL;
+    /*
+    if (has_alpha)
+	separate_alpha (dest, length, NUM_FLOATMAP_CHANNELS);
+    */
+}
 
-	make_rle_curve(horizontal_std_dev, &curve, &length, &sum, &total);
+static void
+rle_pass (image_t *image, gboolean vertical, float std_dev)
+{
+    rle_curve_t curve;
+    int length = vertical ? image->pixel_height : image->pixel_width;
 
-	rle = g_new (int, width+2*length);
-	rle += length; /* so rle[] extends from -width to width+length-1 */
+    make_rle_curve(std_dev, &curve.curve, &curve.length, &curve.sum, &curve.total);
 
-	pix = g_new (float, width+2*length);
-	pix += length; /* so pix[] extends from -width to width+length-1 */
+    gauss_pass(image, vertical, rle_line, &curve,
+	       (length + 2 * curve.length) * (sizeof(int) + sizeof(float)));
 
-	for (row = 0; row < height; row++)
-        {
-	    floatmap_get_row(src, out, row);
-
-	    /*
-	    if (has_alpha)
-		multiply_alpha (src, width, NUM_FLOATMAP_CHANNELS);
-	    */
-
-	    for (b = 0; b < NUM_FLOATMAP_CHANNELS; b++)
-            {
-		int same = run_length_encode (src + b, rle, pix, NUM_FLOATMAP_CHANNELS,
-					      width, length, TRUE);
-
-		if (same > (3 * width) / 4)
-		{
-		    /* encoded_rle is only fastest if there are a lot of
-		     * repeating pixels
-		     */
-		    do_encoded_lre (rle, pix, dest + b, width, length, NUM_FLOATMAP_CHANNELS,
-				    curve, total, sum);
-		}
-		else
-		{
-		    /* else a full but more simple algorithm is better */
-		    do_full_lre (pix, dest + b, width, length, NUM_FLOATMAP_CHANNELS,
-				 curve, total);
-		}
-            }
-
-	    /*
-	    if (has_alpha)
-		separate_alpha (dest, width, NUM_FLOATMAP_CHANNELS);
-	    */
-
-	    floatmap_set_row(out, row, dest);
-        }
+    free_rle_curve(curve.curve, curve.length, curve.sum);
+}
 
-	g_free (rle - length);
-	g_free (pix - length);
+static image_t*
+gauss_rle (image_t *floatmap, float horizontal_std_dev, float vertical_std_dev, mathmap_pools_t *pools)
+{
+    image_t *out = floatmap_copy_with_layout(floatmap, FLOATMAP_LAYOUT_PLANAR, pools);
 
-	free_rle_curve (curve, length, sum);
-    }
+    /*  First the vertical pass  */
+    if (vertical_std_dev > 0.0)
+	rle_pass(out, TRUE, vertical_std_dev);
 
-    g_free(src);
-    g_free(dest);
+    /*  Now the horizontal pass  */
+    if (horizontal_std_dev > 0.0)
+	rle_pass(out, FALSE, horizontal_std_dev);
 
     return out;
 }
@@ -652,17 +626,20 @@ native_filter_gaussian_blur (mathmap_invocation_t *invocation, userval_t *args,
     if (cache_entry->image != NULL)
 	return cache_entry->image;
 
+    /* We copy the floatmap anyway, so it's converted to the planar
+       layout we need along the way. */
     if (floatmap->type != IMAGE_FLOATMAP)
-	floatmap = render_image(invocation, floatmap,
-				invocation->render_width, invocation->render_height, pools, FALSE);
+	floatmap = render_image_with_layout(invocation, floatmap,
+					    invocation->render_width, invocation->render_height,
+					    FLOATMAP_LAYOUT_PLANAR, pools, FALSE);
 
     horizontal_std_dev = fabs(horizontal_std_dev * floatmap->v.floatmap.ax);
     vertical_std_dev = fabs(vertical_std_dev * floatmap->v.floatmap.ay);
 
     if (horizontal_std_dev < 0.5 || vertical_std_dev < 0.5)
-	result = gauss_rle(floatmap, horizontal_std_dev, vertical_std_dev, &invocation->pools);
+	result = gauss_rle(floatmap, horizontal_std_dev, vertical_std_dev, &cache_entry->pools);
     else
-	result = gauss_iir(floatmap, horizontal_std_dev, vertical_std_dev, &invocation->pools);
+	result = gauss_iir(floatmap, horizontal_std_dev, vertical_std_dev, &cache_entry->pools);
 
     native_filter_cache_entry_set_image(invocation, cache_entry, result);
 
@@ -79,15 +79,17 @@
 #define VECTOR_NTH(i,vec)     ((vec).v[(int)(i)])
 
 // solvers
-#define SOLVE_LINEAR_2(mm,mv) ({ gsl_vector *gv = MAKE_GSL_V2((mv)); gsl_matrix *gm = MAKE_GSL_M2X2((mm)); \
+#define SOLVE_LINEAR_2(mm,mv) SOLVE_LINEAR_2_INTO((mm),(mv),ALLOC_TUPLE(2))
+#define SOLVE_LINEAR_2_INTO(mm,mv,s) ({ gsl_vector *gv = MAKE_GSL_V2((mv)); gsl_matrix *gm = MAKE_GSL_M2X2((mm)); \
 	    			 gsl_vector *gr = gsl_vector_alloc(2); gsl_linalg_HH_solve(gm,gv,gr); \
-				 float *r = ALLOC_TUPLE(2); \
+				 float *r = (s); \
 				 r[0] = gsl_vector_get(gr, 0); \
 				 r[1] = gsl_vector_get(gr, 1); \
 				 FREE_GSL_VECTOR(gv); FREE_GSL_VECTOR(gr); FREE_MATRIX(gm); r; })
-#define SOLVE_LINEAR_3(mm,mv) ({ gsl_vector *gv = MAKE_GSL_V3((mv)); gsl_matrix *gm = MAKE_GSL_M3X3((mm)); \
+#define SOLVE_LINEAR_3(mm,mv) SOLVE_LINEAR_3_INTO((mm),(mv),ALLOC_TUPLE(3))
+#define SOLVE_LINEAR_3_INTO(mm,mv,s) ({ gsl_vector *gv = MAKE_GSL_V3((mv)); gsl_matrix *gm = MAKE_GSL_M3X3((mm)); \
 	    			 gsl_vector *gr = gsl_vector_alloc(3); gsl_linalg_HH_solve(gm,gv,gr); \
-				 float *r = ALLOC_TUPLE(3); \
+				 float *r = (s); \
 				 r[0] = gsl_vector_get(gr, 0); \
 				 r[1] = gsl_vector_get(gr, 1); \
 				 r[2] = gsl_vector_get(gr, 2); \
@@ -95,6 +97,8 @@
 /* FIXME: implement these! */
 #define SOLVE_POLY_2(a,b,c)   ALLOC_TUPLE(2)
 #define SOLVE_POLY_3(a,b,c,d) ALLOC_TUPLE(3)
+#define SOLVE_POLY_2_INTO(a,b,c,s)   (s)
+#define SOLVE_POLY_3_INTO(a,b,c,d,s) (s)
 
 // elliptics
 #define ELL_INT_K_COMP(k)     gsl_sf_ellint_Kcomp((k), GSL_PREC_SINGLE)
@@ -110,15 +114,60 @@
 #define ELL_INT_RF(x,y,z)     gsl_sf_ellint_RF((x), (y), (z), GSL_PREC_SINGLE)
 #define ELL_INT_RJ(x,y,z,p)   gsl_sf_ellint_RJ((x), (y), (z), (p), GSL_PREC_SINGLE)
 
-#define ELL_JAC(u,m)	      ({ double sn, cn, dn; \
+#define ELL_JAC(u,m)	      ELL_JAC_INTO((u),(m),ALLOC_TUPLE(3))
+#define ELL_JAC_INTO(u,m,s)   ({ double sn, cn, dn; \
 				 gsl_sf_elljac_e((u), (m), &sn, &cn, &dn); \
-				 float *r = ALLOC_TUPLE(3); \
+				 float *r = (s); \
 				 r[0] = sn; \
 				 r[1] = cn; \
 				 r[2] = dn; \
 				 r; })
 
-#define RAND(a,b)             (g_random_double_range((a), (b)))
+/* RAND is a counter-based generator: the n-th call for a pixel
+   returns a hash of n and a key made from the seed of the invocation
+   and the pixel's virtual coordinates and time.  It needs no locks
+   and its results don't depend on which thread renders the pixel.
+   The pixel code must declare rand_state, initialized with
+   MATHMAP_RAND_STATE_INIT. */
+typedef struct
+{
+    unsigned long long key;
+    unsigned int counter;
+} mathmap_rand_state_t;
+
+/* The SplitMix64 finalizer. */
+static inline unsigned long long
+mathmap_rand_mix (unsigned long long z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static inline unsigned long long
+mathmap_rand_pixel_key (unsigned int seed, float x, float y, float t)
+{
+    union { float f; unsigned int i; } ux, uy, ut;
+
+    ux.f = x;
+    uy.f = y;
+    ut.f = t;
+
+    return mathmap_rand_mix(mathmap_rand_mix(((unsigned long long)uy.i << 32) | ux.i)
+			    ^ (((unsigned long long)seed << 32) | ut.i));
+}
+
+static inline double
+mathmap_rand (mathmap_rand_state_t *state, double a, double b)
+{
+    unsigned long long r = mathmap_rand_mix(state->key + 0x9e3779b97f4a7c15ULL * ++state->counter);
+
+    return a + (b - a) * ((r >> 11) * (1.0 / 9007199254740992.0));
+}
+
+#define MATHMAP_RAND_STATE_INIT(seed,x,y,t)	{ mathmap_rand_pixel_key((seed), (x), (y), (t)), 0 }
+
+#define RAND(a,b)             (mathmap_rand(&rand_state, (a), (b)))
 #define CLAMP01(x)            (MAX(0,MIN(1,(x))))
 
 #define USERVAL_INT_ACCESS(x)        (ARG((x)).v.int_const)
@@ -167,7 +216,11 @@
 #define TUPLE_NTH(t,n)			((t)[(n)])
 #define OUTPUT_TUPLE(t)			((return_tuple = (t)), 0)
 
-#define TUPLE_FROM_COLOR(c)	({ float *tuple = ALLOC_TUPLE(4); \
+/* The _INTO variants of the macros producing tuples build them in
+   the storage s instead of allocating them.  The compiler uses them
+   for tuples which don't escape the pixel. */
+#define TUPLE_FROM_COLOR(c)	TUPLE_FROM_COLOR_INTO((c), ALLOC_TUPLE(4))
+#define TUPLE_FROM_COLOR_INTO(c,s)	({ float *tuple = (s); \
 	    			   TUPLE_SET(tuple, 0, RED_FLOAT((c))); \
 	    			   TUPLE_SET(tuple, 1, GREEN_FLOAT((c))); \
 	    			   TUPLE_SET(tuple, 2, BLUE_FLOAT((c))); \
@@ -184,13 +237,16 @@
 #define SET_TREE_VECTOR_NTH(n,tv,v)	(tree_vector_set(pools, (tv), (n), (v)))
 
 #define APPLY_CURVE(c,p)	((c)->values[(int)(CLAMP01((p)) * (USER_CURVE_POINTS - 1))])
-#define APPLY_GRADIENT(g,p)	({ color_t color = (g)->values[(int)(CLAMP01((p)) * (USER_CURVE_POINTS - 1))]; \
-	    			   TUPLE_FROM_COLOR(color); })
+#define APPLY_GRADIENT(g,p)	APPLY_GRADIENT_INTO((g), (p), ALLOC_TUPLE(4))
+#define APPLY_GRADIENT_INTO(g,p,s)	({ color_t color = (g)->values[(int)(CLAMP01((p)) * (USER_CURVE_POINTS - 1))]; \
+	    			   TUPLE_FROM_COLOR_INTO(color, (s)); })
 
 #define RESIZE_IMAGE(i,xf,yf)	(make_resize_image((i), (xf), (yf), pools))
 #define STRIP_RESIZE(i)		((i)->type == IMAGE_RESIZE ? (i)->v.resize.original : (i))
 
-#define ORIG_VAL(ix,iy,i,f)	({ float *result; \
+/* The storage s is not evaluated for closures. */
+#define ORIG_VAL(ix,iy,i,f)	ORIG_VAL_INTO((ix), (iy), (i), (f), ALLOC_TUPLE(4))
+#define ORIG_VAL_INTO(ix,iy,i,f,s)	({ float *result; \
 	    			   float x = (ix);			\
 				   float y = (iy);			\
 				   image_t *img = (i);			\
@@ -202,11 +258,29 @@
 				   if (img->type == IMAGE_CLOSURE)	\
 				       result = img->v.closure.func(invocation, img, (x), (y), (f), pools); \
 				   else if (img->type == IMAGE_FLOATMAP) \
-				       result = get_floatmap_pixel(invocation, img, (x), (y), (f)); \
-				   else {				\
-				       color_t color = get_orig_val_pixel_func(invocation, (x), (y), img, (f)); \
-				       result = TUPLE_FROM_COLOR(color); \
+				       result = get_floatmap_pixel(invocation, img, (x), (y), (f), (s)); \
+				   else					\
+				       result = get_orig_val_pixel_func(invocation, (x), (y), img, (f), (s)); \
+				   result; })
+
+/* The footprint fp is the distance between the lookups of
+   neighbouring pixels, in image coordinates. */
+#define ORIG_VAL_LOD(ix,iy,i,f,fp)	ORIG_VAL_LOD_INTO((ix), (iy), (i), (f), (fp), ALLOC_TUPLE(4))
+#define ORIG_VAL_LOD_INTO(ix,iy,i,f,fp,s)	({ float *result; \
+	    			   float x = (ix);			\
+				   float y = (iy);			\
+				   float footprint = (fp);		\
+				   image_t *img = (i);			\
+				   if (img->type == IMAGE_RESIZE) {	\
+				       x *= img->v.resize.x_factor;	\
+				       y *= img->v.resize.y_factor;	\
+				       footprint *= MAX(fabsf(img->v.resize.x_factor), fabsf(img->v.resize.y_factor)); \
+				       img = img->v.resize.original;	\
 				   }					\
+				   if (img->type == IMAGE_CLOSURE)	\
+				       result = img->v.closure.func(invocation, img, (x), (y), (f), pools); \
+				   else					\
+				       result = get_orig_val_lod_pixel(invocation, (x), (y), img, (f), footprint, (s)); \
 				   result; })
 
 #define RENDER(i,w,h)	      (render_image(invocation, (i), (w), (h), pools, 0))
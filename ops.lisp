@@ -167,6 +167,8 @@
        :arg-types '(gradient float) :foldable nil)
 (defop 'orig-val 4 "ORIG_VAL" :interpreter-c-name "ORIG_VAL_INTERPRETER" :type 'tuple
        :arg-types '(float float image float) :foldable nil)
+(defop 'orig-val-lod 5 "ORIG_VAL_LOD" :interpreter-c-name "ORIG_VAL_LOD_INTERPRETER" :type 'tuple
+       :arg-types '(float float image float float) :foldable nil)
 
 (defop 'resize-image 3 "RESIZE_IMAGE" :interpreter-c-name "RESIZE_IMAGE_INTERPRETER" :type 'image
        :arg-types '(image float float) :foldable nil)
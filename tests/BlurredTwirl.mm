@@ -0,0 +1,4 @@
+filter blurred_twirl (image in, float dev: 0-0.5 (0.01))
+  blurred = gaussian_blur(in, dev, dev);
+  blurred(ra+ra:[0,(r/R-1)*(t-0.5)*4*pi])
+end
@@ -0,0 +1,78 @@
+#!/usr/bin/perl
+
+# Compares two benchmark results files written by run_bench.sh and
+# reports every timing which got slower than the threshold (in
+# percent, default 10).  Exits with 1 if there were any regressions.
+#
+# Usage: compare_bench.pl BASELINE RESULTS [THRESHOLD]
+
+use strict;
+
+my @timings = ("parse_ms", "optimize_ms", "backend_ms", "frame_init_ms", "ns_per_pixel");
+
+# Timings below these are too noisy to compare.
+my %min_values = ("parse_ms" => 1, "optimize_ms" => 1, "backend_ms" => 10,
+		  "frame_init_ms" => 1, "ns_per_pixel" => 1);
+
+sub read_results {
+    my ($filename) = @_;
+    my %results = ();
+
+    open FILE, $filename or die "Cannot open $filename: $!\n";
+    while (<FILE>) {
+	next unless /^\{"script": "((?:[^"\\]|\\.)*)"/;
+	my $script = $1;
+	my %result = ();
+
+	while (/"(\w+)": ([0-9.]+)/g) {
+	    $result{$1} = $2;
+	}
+
+	my $key = "$script $result{width}x$result{height} $result{threads}";
+	$results{$key} = \%result;
+    }
+    close FILE;
+
+    return \%results;
+}
+
+die "Usage: compare_bench.pl BASELINE RESULTS [THRESHOLD]\n" if $#ARGV < 1;
+
+my $baseline = read_results($ARGV[0]);
+my $results = read_results($ARGV[1]);
+my $threshold = $#ARGV >= 2 ? $ARGV[2] : 10;
+my $num_regressions = 0;
+
+foreach my $key (sort keys %$results) {
+    my $new = $results->{$key};
+    my $old = $baseline->{$key};
+
+    if (!defined($old)) {
+	print "$key: not in baseline\n";
+	next;
+    }
+
+    foreach my $timing (@timings) {
+	next unless defined($old->{$timing}) && defined($new->{$timing});
+	next if $old->{$timing} < $min_values{$timing} && $new->{$timing} < $min_values{$timing};
+
+	my $change = $old->{$timing} > 0 ? ($new->{$timing} / $old->{$timing} - 1) * 100 : 100;
+
+	if ($change > $threshold) {
+	    printf "%s: %s regressed by %.1f%% (%.3f -> %.3f)\n",
+		   $key, $timing, $change, $old->{$timing}, $new->{$timing};
+	    ++$num_regressions;
+	} elsif ($change < -$threshold) {
+	    printf "%s: %s improved by %.1f%% (%.3f -> %.3f)\n",
+		   $key, $timing, -$change, $old->{$timing}, $new->{$timing};
+	}
+    }
+}
+
+if ($num_regressions > 0) {
+    print "$num_regressions regressions.\n";
+    exit 1;
+}
+
+print "No regressions.\n";
+exit 0;
@@ -0,0 +1,62 @@
+#!/bin/bash
+
+# Runs all the filters in examples/ for each combination of image
+# size and number of threads and appends the timings of each run as a
+# line of JSON to the results file.  If a baseline file is given the
+# results are compared against it afterwards.
+#
+# Usage: run_bench.sh [-o RESULTS] [-b BASELINE] [-s "SIZE ..."]
+#                     [-t "THREADS ..."] [-n RENDER-COUNT]
+
+RESULTS=bench_results.json
+BASELINE=
+SIZES="256x256 1024x1024"
+THREADS="1 `getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1`"
+RENDER_COUNT=3
+
+while getopts "o:b:s:t:n:" OPTION ; do
+    case $OPTION in
+	o) RESULTS="$OPTARG" ;;
+	b) BASELINE="$OPTARG" ;;
+	s) SIZES="$OPTARG" ;;
+	t) THREADS="$OPTARG" ;;
+	n) RENDER_COUNT="$OPTARG" ;;
+	*) exit 1 ;;
+    esac
+done
+
+rm -f "$RESULTS"
+
+FAILED=0
+
+run_bench () {
+    SCRIPT=$1
+    SIZE=$2
+    NUM_THREADS=$3
+
+    # Every input image of the filter gets the same image.
+    DEFINES=`grep -oE "image +[A-Za-z_][A-Za-z_0-9]*" "$SCRIPT" | sort -u | awk '{ print "-D" $2 "=marlene.png" }'`
+
+    echo "Benchmarking $SCRIPT at $SIZE with $NUM_THREADS threads"
+
+    if ! ../mathmap -f "$SCRIPT" $DEFINES -s "$SIZE" --threads="$NUM_THREADS" \
+	--bench-no-output --bench-render-count="$RENDER_COUNT" \
+	--bench-results="$RESULTS" /dev/null >/dev/null ; then
+	echo "Error: Script $SCRIPT failed."
+	FAILED=1
+    fi
+}
+
+while IFS= read -r SCRIPT ; do
+    for SIZE in $SIZES ; do
+	for NUM_THREADS in $THREADS ; do
+	    run_bench "$SCRIPT" "$SIZE" "$NUM_THREADS"
+	done
+    done
+done < <(find ../examples -name '*.mm' | sort)
+
+if [ -n "$BASELINE" ] ; then
+    perl -- compare_bench.pl "$BASELINE" "$RESULTS" || exit 1
+fi
+
+exit $FAILED
@@ -67,6 +67,107 @@ run_modify_test () {
     run_test "$1" "$2" "-Din=marlene.png $3"
 }
 
+# Renders SCRIPT once with a single thread and once with NUM_THREADS
+# threads and requires the two outputs to be identical, byte for byte.
+
+OUTFILE_THREADED=/tmp/mathtest_threaded_$$.png
+NUM_THREADS=`getconf _NPROCESSORS_ONLN 2>/dev/null`
+if [ -z "$NUM_THREADS" ] || [ "$NUM_THREADS" -lt 4 ] ; then
+    NUM_THREADS=4
+fi
+
+run_thread_test () {
+    SCRIPT=$1
+    INPUT_ARGS=$2
+
+    echo "Running $SCRIPT with 1 and $NUM_THREADS threads"
+
+    rm -f "$OUTFILE" "$OUTFILE_THREADED"
+    ../mathmap -f "$SCRIPT" --threads=1 $INPUT_ARGS "$OUTFILE" >&/dev/null
+    ../mathmap -f "$SCRIPT" --threads=$NUM_THREADS $INPUT_ARGS "$OUTFILE_THREADED" >&/dev/null
+    if [ ! -f "$OUTFILE" ] || [ ! -f "$OUTFILE_THREADED" ] ; then
+	echo "Error: MathMap did not produce an output image."
+	exit 1
+    fi
+
+    if ! cmp -s "$OUTFILE" "$OUTFILE_THREADED" ; then
+	test_failed "$1"
+    fi
+}
+
+# Renders SCRIPT with INPUT_ARGS and with INPUT_ARGS VARIANT_ARGS and
+# requires the variant to be different from the plain render but to
+# differ in at most THRESHOLD pixels from REFERENCE, which must exist.
+# If REFERENCE is empty, the plain render is used instead.
+
+OUTFILE_VARIANT=/tmp/mathtest_variant_$$.png
+
+run_variant_test () {
+    SCRIPT=$1
+    REFERENCE=$2
+    INPUT_ARGS=$3
+    VARIANT_ARGS=$4
+    THRESHOLD=$5
+
+    echo "Running $SCRIPT with $VARIANT_ARGS"
+
+    rm -f "$OUTFILE" "$OUTFILE_VARIANT"
+    ../mathmap -i -f "$SCRIPT" $INPUT_ARGS "$OUTFILE" >&/dev/null
+    ../mathmap -i -f "$SCRIPT" $INPUT_ARGS $VARIANT_ARGS "$OUTFILE_VARIANT" >&/dev/null
+    if [ ! -f "$OUTFILE" ] || [ ! -f "$OUTFILE_VARIANT" ] ; then
+	echo "Error: MathMap did not produce an output image."
+	exit 1
+    fi
+
+    if [ -z "$REFERENCE" ] ; then
+	REFERENCE="$OUTFILE"
+    elif [ ! -f "$REFERENCE" ] ; then
+	echo "Error: Reference file $REFERENCE doesn't exist."
+	exit 1
+    fi
+
+    if cmp -s "$OUTFILE" "$OUTFILE_VARIANT" ; then
+	echo "$VARIANT_ARGS has no effect."
+	test_failed "$1"
+	return
+    fi
+
+    if [ $PDIFF_BROKEN -eq 0 ] ; then
+	if perceptualdiff "$OUTFILE_VARIANT" "$REFERENCE" -fov 85 -threshold $THRESHOLD ; then
+	    true
+	else
+	    test_failed "$1"
+	fi
+    else
+	if perceptualdiff "$OUTFILE_VARIANT" "$REFERENCE" -fov 85 -threshold $THRESHOLD ; then
+	    test_failed "$1"
+	fi
+    fi
+}
+
+# Renders SCRIPT once with all optimization passes and once without
+# PASS and requires the two outputs to be identical, byte for byte.
+
+run_pass_test () {
+    SCRIPT=$1
+    PASS=$2
+    INPUT_ARGS=$3
+
+    echo "Running $SCRIPT with and without $PASS"
+
+    rm -f "$OUTFILE" "$OUTFILE_THREADED"
+    ../mathmap -f "$SCRIPT" $INPUT_ARGS "$OUTFILE" >&/dev/null
+    ../mathmap -f "$SCRIPT" --disable-pass=$PASS $INPUT_ARGS "$OUTFILE_THREADED" >&/dev/null
+    if [ ! -f "$OUTFILE" ] || [ ! -f "$OUTFILE_THREADED" ] ; then
+	echo "Error: MathMap did not produce an output image."
+	exit 1
+    fi
+
+    if ! cmp -s "$OUTFILE" "$OUTFILE_THREADED" ; then
+	test_failed "$1"
+    fi
+}
+
 
 
 run_render_test Apply.mm apply.png
@@ -74,6 +175,12 @@ run_modify_test Circle.mm circle.png
 run_modify_test Closure.mm closure.png
 run_modify_test Twice.mm twice.png
 
+# The blurred image is a floatmap, so these sample floatmaps.  There
+# are no references for them, so they are compared to the bilinear
+# render.
+run_variant_test BlurredTwirl.mm "" "-Din=marlene.png" "--sampling=bicubic" 50
+run_variant_test BlurredTwirl.mm "" "-Din=marlene.png" "--sampling=lanczos" 50
+
 
 run_modify_test "../examples/Blur/Mosaic.mm" blur_mosaic.png
 run_modify_test "../examples/Blur/Radial Mosaic.mm" blur_radial_mosaic.png
@@ -81,6 +188,11 @@ run_modify_test "../examples/Blur/Radial Mosaic Bertl Edition.mm" blur_radial_mo
 run_modify_test "../examples/Blur/Gaussian Blur.mm" blur_gaussian_blur.png "-Ddev=0.1"
 run_modify_test "../examples/Blur/Spin-Zoom.mm" blur_spin_zoom.png
 run_modify_test "../examples/Blur/Zoom-Twist.mm" blur_zoom_twist.png
+run_thread_test "../examples/Blur/Random Blur.mm" "-Din=marlene.png"
+run_thread_test "../examples/Blur/Random Blur.mm" "-Din=marlene.png --rand-seed=12345"
+# The arguments of the rand calls are loop invariant, so this fails if
+# LICM hoists them out of the loop.
+run_pass_test "../examples/Blur/Random Blur.mm" licm "-Din=marlene.png --rand-seed=12345"
 
 # Colors->Alpha to Gray
 # Colors->Auto BW
@@ -123,6 +235,8 @@ run_modify_test "../examples/Distorts/Sphere.mm" distorts_sphere.png
 run_modify_test "../examples/Distorts/Square.mm" distorts_square.png
 run_modify_test "../examples/Distorts/Stereographic Projection.mm" distorts_stereographic_projection.png
 run_modify_test "../examples/Distorts/Twirl.mm" distorts_twirl.png
+run_variant_test "../examples/Distorts/Twirl.mm" distorts_twirl.png "-Din=marlene.png" "--sampling=bicubic" 50
+run_variant_test "../examples/Distorts/Twirl.mm" distorts_twirl.png "-Din=marlene.png" "--sampling=lanczos" 50
 run_modify_test "../examples/Distorts/Wave.mm" distorts_wave.png
 
 # Edge Detect->Gauss Blur Edge Detect
@@ -133,14 +247,19 @@ run_modify_test "../examples/Geometry/Scale.mm" geometry_scale.png "-Dsx=1.5 -Ds
 run_modify_test "../examples/Geometry/Shear.mm" geometry_shear.png "-Dax=0.5 -Day=-1.5"
 run_modify_test "../examples/Geometry/Translate.mm" geometry_translate.png "-Ddx=0.5 -Ddy=-0.7"
 run_modify_test "../examples/Geometry/Zoom.mm" geometry_zoom.png "-Dfactor=1.2"
+# Mipmapping only changes the minified parts, which at a factor of 6
+# are about 43x43 pixels.
+run_variant_test "../examples/Geometry/Zoom.mm" "" "-Din=marlene.png -Dfactor=6" "--mipmap" 2000
 
 run_render_test "../examples/Kernels/Gauss.mm" kernels_gauss.png "-Dphi=0.2"
 run_render_test "../examples/Kernels/Gauss Normalized.mm" kernels_gauss_normalized.png "-Dphi=0.35"
 
 # Map->Displace
 run_modify_test "../examples/Map/Droste.mm" map_droste.png
+run_variant_test "../examples/Map/Droste.mm" map_droste.png "-Din=marlene.png" "--mipmap" 2000
 run_modify_test "../examples/Map/IFS Functional.mm" map_ifs_functional.png
 run_modify_test "../examples/Map/IFS Iterative.mm" map_ifs_iterative.png
+run_pass_test "../examples/Map/IFS Iterative.mm" licm "-Din=marlene.png"
 # Map->Make Seamless
 run_modify_test "../examples/Map/Mugl.mm" map_mugl.png
 # Map->Radial Displace
@@ -159,6 +278,7 @@ run_modify_test "../examples/Render/Darts Board.mm" render_darts_board.png
 run_render_test "../examples/Render/Disco.mm" render_disco.png
 run_modify_test "../examples/Render/Domain Coloring.mm" render_domain_coloring.png
 run_render_test "../examples/Render/Fancy Mandelbrot.mm" mandelbrot.png
+run_pass_test "../examples/Render/Fancy Mandelbrot.mm" licm "-s 256x256"
 run_render_test "../examples/Render/Fractal Noise.mm" render_fractal_noise.png
 run_render_test "../examples/Render/Gray.mm" render_gray.png "-Dvalue=0.2"
 run_render_test "../examples/Render/Grid.mm" render_grid.png
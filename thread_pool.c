@@ -0,0 +1,629 @@
+/*
+ * thread_pool.c
+ *
+ * MathMap
+ *
+ * Copyright (C) 2009 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <glib.h>
+
+#include "mathmap.h"
+#include "thread_pool.h"
+
+struct _thread_pool_job_t
+{
+    thread_pool_task_func_t func;
+    gpointer data;
+    gpointer owner;
+    /* the job of the task which submitted this one, if any */
+    struct _thread_pool_job_t *parent;
+    int num_tasks;
+    volatile gint num_unfinished;
+    volatile gint is_cancelled;
+};
+
+#if defined(USE_PTHREADS) || defined(USE_GTHREADS)
+/* A range of consecutive tasks of one job, from first (inclusive) to
+   last (exclusive). */
+typedef struct _task_range_t
+{
+    thread_pool_job_t *job;
+    int first;
+    int last;
+    struct _task_range_t *next;
+    struct _task_range_t *prev;
+} task_range_t;
+
+/* The owner of a deque takes tasks from the head, thieves take ranges
+   from the tail. */
+typedef struct
+{
+    GMutex *mutex;
+    task_range_t *head;
+    task_range_t *tail;
+} task_deque_t;
+
+typedef struct
+{
+    int num_workers;
+    task_deque_t *deques;
+
+    /* Incremented when tasks are submitted and decremented when a task
+       is taken from a deque. */
+    volatile gint num_queued;
+    /* Round-robin counter for distributing submitted ranges. */
+    volatile gint next_deque;
+
+    /* mutex protects waiting on the two conditions and
+       num_submitted.  work_cond is signalled when new tasks are
+       submitted and by thread_pool_notify(), done_cond when a job is
+       finished. */
+    GMutex *mutex;
+    GCond *work_cond;
+    GCond *done_cond;
+    /* Incremented every time a job is submitted. */
+    guint num_submitted;
+
+    /* The value is the worker index plus one for worker threads and
+       NULL for all other threads. */
+    GPrivate *worker_index;
+    /* The current owner of every thread, see thread_pool_set_owner(). */
+    GPrivate *owner;
+    /* The job of the task every thread is executing, if any. */
+    GPrivate *current_job;
+} thread_pool_t;
+
+/* Submitted jobs are split into this many ranges per worker so that
+   there is something to steal even if the job is never joined by a
+   helping thread. */
+#define RANGES_PER_WORKER	2
+
+static thread_pool_t *the_pool = NULL;
+static int requested_num_workers = 0;
+
+static void
+deque_push_tail (task_deque_t *deque, task_range_t *range)
+{
+    range->next = NULL;
+    range->prev = deque->tail;
+    if (deque->tail != NULL)
+	deque->tail->next = range;
+    else
+	deque->head = range;
+    deque->tail = range;
+}
+
+static void
+deque_remove (task_deque_t *deque, task_range_t *range)
+{
+    if (range->prev != NULL)
+	range->prev->next = range->next;
+    else
+	deque->head = range->next;
+    if (range->next != NULL)
+	range->next->prev = range->prev;
+    else
+	deque->tail = range->prev;
+}
+
+/* Which tasks a thread may take.  If job is not NULL only tasks of
+   that job, if any_owner is FALSE only tasks of jobs owned by
+   owner. */
+typedef struct
+{
+    thread_pool_job_t *job;
+    gboolean any_owner;
+    gpointer owner;
+} task_filter_t;
+
+static gboolean
+range_matches (task_range_t *range, const task_filter_t *filter)
+{
+    return (filter->job == NULL || range->job == filter->job)
+	&& (filter->any_owner || range->job->owner == filter->owner);
+}
+
+/* Takes one task matching the filter from the head of the deque. */
+static gboolean
+deque_take_head (task_deque_t *deque, const task_filter_t *filter,
+		 thread_pool_job_t **task_job, int *task_index)
+{
+    task_range_t *range;
+    gboolean found = FALSE;
+
+    g_mutex_lock(deque->mutex);
+
+    for (range = deque->head; range != NULL; range = range->next)
+	if (range_matches(range, filter))
+	    break;
+
+    if (range != NULL)
+    {
+	*task_job = range->job;
+	*task_index = range->first++;
+
+	if (range->first == range->last)
+	{
+	    deque_remove(deque, range);
+	    g_free(range);
+	}
+
+	found = TRUE;
+    }
+
+    g_mutex_unlock(deque->mutex);
+
+    return found;
+}
+
+/* Steals the upper half of the last range matching the filter in the
+   victim deque.  The range is removed from the victim. */
+static task_range_t*
+deque_steal_tail (task_deque_t *deque, const task_filter_t *filter)
+{
+    task_range_t *range;
+
+    g_mutex_lock(deque->mutex);
+
+    for (range = deque->tail; range != NULL; range = range->prev)
+	if (range_matches(range, filter))
+	    break;
+
+    if (range != NULL)
+    {
+	int num = range->last - range->first;
+
+	if (num > 1)
+	{
+	    task_range_t *stolen = g_new(task_range_t, 1);
+
+	    stolen->job = range->job;
+	    stolen->last = range->last;
+	    stolen->first = range->last = range->first + num / 2;
+
+	    range = stolen;
+	}
+	else
+	    deque_remove(deque, range);
+    }
+
+    g_mutex_unlock(deque->mutex);
+
+    return range;
+}
+
+static int
+current_worker_index (thread_pool_t *pool)
+{
+    return GPOINTER_TO_INT(g_private_get(pool->worker_index)) - 1;
+}
+
+/* Finds a task to execute.  Workers look at their own deque first.
+   If that is empty a range is stolen from another deque, of which the
+   first task is returned and the rest is put into the worker's own
+   deque.  Threads which are not workers only take single tasks. */
+static gboolean
+grab_task (thread_pool_t *pool, const task_filter_t *filter, thread_pool_job_t **task_job, int *task_index)
+{
+    int self = current_worker_index(pool);
+    int start = self >= 0 ? self + 1 : 0;
+    int i;
+
+    if (g_atomic_int_get(&pool->num_queued) <= 0)
+	return FALSE;
+
+    if (self >= 0 && deque_take_head(&pool->deques[self], filter, task_job, task_index))
+    {
+	g_atomic_int_add(&pool->num_queued, -1);
+	return TRUE;
+    }
+
+    for (i = 0; i < pool->num_workers; ++i)
+    {
+	int victim = (start + i) % pool->num_workers;
+	task_range_t *range;
+
+	if (victim == self)
+	    continue;
+
+	if (self < 0)
+	{
+	    if (deque_take_head(&pool->deques[victim], filter, task_job, task_index))
+	    {
+		g_atomic_int_add(&pool->num_queued, -1);
+		return TRUE;
+	    }
+	    continue;
+	}
+
+	range = deque_steal_tail(&pool->deques[victim], filter);
+	if (range == NULL)
+	    continue;
+
+	*task_job = range->job;
+	*task_index = range->first++;
+
+	if (range->first < range->last)
+	{
+	    g_mutex_lock(pool->deques[self].mutex);
+	    deque_push_tail(&pool->deques[self], range);
+	    g_mutex_unlock(pool->deques[self].mutex);
+	}
+	else
+	    g_free(range);
+
+	g_atomic_int_add(&pool->num_queued, -1);
+	return TRUE;
+    }
+
+    return FALSE;
+}
+
+static gboolean
+job_is_cancelled (thread_pool_job_t *job)
+{
+    for (; job != NULL; job = job->parent)
+	if (g_atomic_int_get(&job->is_cancelled))
+	    return TRUE;
+    return FALSE;
+}
+
+static void
+execute_task (thread_pool_t *pool, thread_pool_job_t *job, int task_index)
+{
+    if (!job_is_cancelled(job))
+    {
+	gpointer old_owner = g_private_get(pool->owner);
+	gpointer old_job = g_private_get(pool->current_job);
+
+	g_private_set(pool->owner, job->owner);
+	g_private_set(pool->current_job, job);
+	job->func(job->data, task_index);
+	g_private_set(pool->current_job, old_job);
+	g_private_set(pool->owner, old_owner);
+    }
+
+    if (g_atomic_int_dec_and_test(&job->num_unfinished))
+    {
+	g_mutex_lock(pool->mutex);
+	g_cond_broadcast(pool->done_cond);
+	g_mutex_unlock(pool->mutex);
+    }
+}
+
+typedef struct
+{
+    thread_pool_t *pool;
+    int index;
+} worker_data_t;
+
+static void
+worker_func (gpointer _data)
+{
+    worker_data_t *data = (worker_data_t*)_data;
+    thread_pool_t *pool = data->pool;
+
+    task_filter_t filter = { NULL, TRUE, NULL };
+
+    g_private_set(pool->worker_index, GINT_TO_POINTER(data->index + 1));
+    g_free(data);
+
+    for (;;)
+    {
+	thread_pool_job_t *job;
+	int task_index;
+
+	if (grab_task(pool, &filter, &job, &task_index))
+	{
+	    execute_task(pool, job, task_index);
+	    continue;
+	}
+
+	g_mutex_lock(pool->mutex);
+	while (g_atomic_int_get(&pool->num_queued) <= 0)
+	    g_cond_wait(pool->work_cond, pool->mutex);
+	g_mutex_unlock(pool->mutex);
+    }
+}
+
+static thread_pool_t*
+get_pool (void)
+{
+    static GStaticMutex init_mutex = G_STATIC_MUTEX_INIT;
+    thread_pool_t *pool;
+    int i;
+
+    if (the_pool != NULL)
+	return the_pool;
+
+    if (!g_thread_supported())
+	g_thread_init(NULL);
+
+    g_static_mutex_lock(&init_mutex);
+
+    if (the_pool != NULL)
+    {
+	g_static_mutex_unlock(&init_mutex);
+	return the_pool;
+    }
+
+    pool = g_new0(thread_pool_t, 1);
+
+    if (requested_num_workers > 0)
+	pool->num_workers = requested_num_workers;
+    else
+	pool->num_workers = MAX(get_num_cpus(), 1);
+    pool->deques = g_new0(task_deque_t, pool->num_workers);
+    for (i = 0; i < pool->num_workers; ++i)
+	pool->deques[i].mutex = g_mutex_new();
+
+    pool->mutex = g_mutex_new();
+    pool->work_cond = g_cond_new();
+    pool->done_cond = g_cond_new();
+    pool->worker_index = g_private_new(NULL);
+    pool->owner = g_private_new(NULL);
+    pool->current_job = g_private_new(NULL);
+
+    for (i = 0; i < pool->num_workers; ++i)
+    {
+	worker_data_t *data = g_new(worker_data_t, 1);
+
+	data->pool = pool;
+	data->index = i;
+
+	mathmap_thread_start(worker_func, data);
+    }
+
+    the_pool = pool;
+
+    g_static_mutex_unlock(&init_mutex);
+
+    return pool;
+}
+
+void
+thread_pool_set_num_workers (int num_workers)
+{
+    g_assert(the_pool == NULL);
+
+    requested_num_workers = num_workers;
+}
+
+int
+thread_pool_num_workers (void)
+{
+    return get_pool()->num_workers;
+}
+
+thread_pool_job_t*
+thread_pool_submit (thread_pool_task_func_t func, gpointer data, int num_tasks)
+{
+    thread_pool_t *pool = get_pool();
+    thread_pool_job_t *job = g_new0(thread_pool_job_t, 1);
+    int num_ranges, i;
+
+    job->func = func;
+    job->data = data;
+    job->owner = g_private_get(pool->owner);
+    job->parent = g_private_get(pool->current_job);
+    job->num_tasks = num_tasks;
+    job->num_unfinished = num_tasks;
+    job->is_cancelled = FALSE;
+
+    if (num_tasks <= 0)
+	return job;
+
+    num_ranges = MIN(num_tasks, pool->num_workers * RANGES_PER_WORKER);
+
+    for (i = 0; i < num_ranges; ++i)
+    {
+	task_range_t *range = g_new(task_range_t, 1);
+	task_deque_t *deque;
+
+	range->job = job;
+	range->first = num_tasks * i / num_ranges;
+	range->last = num_tasks * (i + 1) / num_ranges;
+
+	deque = &pool->deques[(guint)g_atomic_int_exchange_and_add(&pool->next_deque, 1) % pool->num_workers];
+
+	g_mutex_lock(deque->mutex);
+	deque_push_tail(deque, range);
+	g_mutex_unlock(deque->mutex);
+    }
+
+    g_mutex_lock(pool->mutex);
+    g_atomic_int_add(&pool->num_queued, num_tasks);
+    ++pool->num_submitted;
+    g_cond_broadcast(pool->work_cond);
+    g_mutex_unlock(pool->mutex);
+
+    return job;
+}
+
+gboolean
+thread_pool_job_is_done (thread_pool_job_t *job)
+{
+    return g_atomic_int_get(&job->num_unfinished) == 0;
+}
+
+void
+thread_pool_join (thread_pool_job_t *job)
+{
+    thread_pool_t *pool = get_pool();
+    task_filter_t filter = { job, TRUE, NULL };
+
+    while (g_atomic_int_get(&job->num_unfinished) > 0)
+    {
+	thread_pool_job_t *task_job;
+	int task_index;
+
+	if (grab_task(pool, &filter, &task_job, &task_index))
+	{
+	    execute_task(pool, task_job, task_index);
+	    continue;
+	}
+
+	/* All the remaining tasks are being executed by other
+	   threads. */
+	g_mutex_lock(pool->mutex);
+	while (g_atomic_int_get(&job->num_unfinished) > 0)
+	    g_cond_wait(pool->done_cond, pool->mutex);
+	g_mutex_unlock(pool->mutex);
+    }
+
+    g_free(job);
+}
+
+gboolean
+thread_pool_is_cancelled (void)
+{
+    return job_is_cancelled(g_private_get(get_pool()->current_job));
+}
+
+gpointer
+thread_pool_set_owner (gpointer owner)
+{
+    thread_pool_t *pool = get_pool();
+    gpointer old_owner = g_private_get(pool->owner);
+
+    g_private_set(pool->owner, owner);
+
+    return old_owner;
+}
+
+void
+thread_pool_wait (thread_pool_done_func_t is_done, gpointer data, gpointer owner)
+{
+    thread_pool_t *pool = get_pool();
+    task_filter_t filter = { NULL, FALSE, owner };
+
+    for (;;)
+    {
+	thread_pool_job_t *job;
+	int task_index;
+	guint num_submitted;
+
+	g_mutex_lock(pool->mutex);
+	num_submitted = pool->num_submitted;
+	g_mutex_unlock(pool->mutex);
+
+	if (is_done(data))
+	    break;
+
+	if (grab_task(pool, &filter, &job, &task_index))
+	{
+	    execute_task(pool, job, task_index);
+	    continue;
+	}
+
+	/* There was nothing to help with.  We wait until the condition
+	   might have changed or new tasks have been submitted. */
+	g_mutex_lock(pool->mutex);
+	if (!is_done(data) && pool->num_submitted == num_submitted)
+	    g_cond_wait(pool->work_cond, pool->mutex);
+	g_mutex_unlock(pool->mutex);
+    }
+}
+
+void
+thread_pool_notify (void)
+{
+    thread_pool_t *pool = get_pool();
+
+    g_mutex_lock(pool->mutex);
+    g_cond_broadcast(pool->work_cond);
+    g_mutex_unlock(pool->mutex);
+}
+#else
+thread_pool_job_t*
+thread_pool_submit (thread_pool_task_func_t func, gpointer data, int num_tasks)
+{
+    thread_pool_job_t *job = g_new0(thread_pool_job_t, 1);
+    int i;
+
+    job->func = func;
+    job->data = data;
+    job->num_tasks = num_tasks;
+
+    for (i = 0; i < num_tasks; ++i)
+	func(data, i);
+
+    return job;
+}
+
+void
+thread_pool_set_num_workers (int num_workers)
+{
+}
+
+int
+thread_pool_num_workers (void)
+{
+    return 1;
+}
+
+gboolean
+thread_pool_job_is_done (thread_pool_job_t *job)
+{
+    return TRUE;
+}
+
+void
+thread_pool_join (thread_pool_job_t *job)
+{
+    g_free(job);
+}
+
+gboolean
+thread_pool_is_cancelled (void)
+{
+    return FALSE;
+}
+
+gpointer
+thread_pool_set_owner (gpointer owner)
+{
+    return NULL;
+}
+
+void
+thread_pool_wait (thread_pool_done_func_t is_done, gpointer data, gpointer owner)
+{
+    /* Without threads every task is done by the time it's submitted,
+       so there can't be anything to wait for. */
+    g_assert(is_done(data));
+}
+
+void
+thread_pool_notify (void)
+{
+}
+#endif
+
+void
+thread_pool_cancel (thread_pool_job_t *job)
+{
+    g_atomic_int_set(&job->is_cancelled, TRUE);
+    thread_pool_join(job);
+}
+
+void
+thread_pool_run (thread_pool_task_func_t func, gpointer data, int num_tasks)
+{
+    thread_pool_join(thread_pool_submit(func, data, num_tasks));
+}
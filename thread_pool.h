@@ -0,0 +1,86 @@
+/*
+ * thread_pool.h
+ *
+ * MathMap
+ *
+ * Copyright (C) 2009 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <glib.h>
+
+/* A job consists of num_tasks tasks, numbered 0 to num_tasks - 1,
+   which are all executed by calling func(data, task_index).  The
+   tasks of a job are distributed over the deques of the workers of
+   the process-wide pool, which are created the first time a job is
+   submitted and live until the process exits.  Idle workers steal
+   tasks from the other deques, so the tasks should be small and
+   independent of each other.
+
+   A thread joining a job helps executing its remaining tasks instead
+   of just blocking, which makes it safe to submit and join jobs from
+   within tasks.  Such nested jobs must be joined before the task
+   submitting them returns, and are cancelled together with its
+   job. */
+
+typedef void (*thread_pool_task_func_t) (gpointer data, int task_index);
+
+typedef struct _thread_pool_job_t thread_pool_job_t;
+
+/* Must be called before the first job is submitted.  The default is
+   the number of CPUs. */
+void thread_pool_set_num_workers (int num_workers);
+int thread_pool_num_workers (void);
+
+thread_pool_job_t* thread_pool_submit (thread_pool_task_func_t func, gpointer data, int num_tasks);
+gboolean thread_pool_job_is_done (thread_pool_job_t *job);
+/* Waits until all tasks of the job are done and frees it. */
+void thread_pool_join (thread_pool_job_t *job);
+/* Skips all tasks of the job and of the jobs nested in it which
+   haven't been started yet, waits for the running ones and frees the
+   job. */
+void thread_pool_cancel (thread_pool_job_t *job);
+/* Whether the job of the task the calling thread is executing, or a
+   job it is nested in, has been cancelled.  Whatever such a task
+   computes might be incomplete. */
+gboolean thread_pool_is_cancelled (void);
+
+void thread_pool_run (thread_pool_task_func_t func, gpointer data, int num_tasks);
+
+/* Every thread has an owner, an opaque pointer, which is NULL unless
+   set.  Jobs belong to the owner of the thread submitting them, and
+   while a thread executes a task its owner is that of the task's
+   job.  Sets the owner of the calling thread and returns the old
+   one. */
+gpointer thread_pool_set_owner (gpointer owner);
+
+typedef gboolean (*thread_pool_done_func_t) (gpointer data);
+
+/* Waits until is_done(data) returns TRUE, helping with the tasks of
+   the jobs belonging to owner in the meantime.  A thread waiting for
+   something which another thread produces should make that thread
+   the owner of the work it submits, so that the waiting thread helps
+   only with that work.  Executing any other task could make it wait
+   for something which it is producing itself, further up its stack.
+   Whoever makes is_done return TRUE must call thread_pool_notify()
+   afterwards. */
+void thread_pool_wait (thread_pool_done_func_t is_done, gpointer data, gpointer owner);
+void thread_pool_notify (void);
+
+#endif